@@ -0,0 +1,389 @@
+// Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License.
+// You are free to do whatever you want with this software. See LICENSE.txt.
+
+#ifndef __drfifo_await_h__
+#define __drfifo_await_h__
+
+// C++20 coroutine awaitables over drfifo::ring:
+//
+//   drfifo::async_ring<4096> fifo;
+//   std::size_t bytes = co_await fifo.get(buffer, sizeof(buffer));
+//   co_await fifo.put(message, message_bytes);
+//
+// A get suspends while the ring is empty and a put while its data don't
+// fit. Each suspended operation is a node in a lock-free list of waiters
+// for its side; the node is the awaiter itself, which lives in the
+// coroutine frame, so an await allocates nothing. Whoever makes progress
+// on one side - a put, or a get - drains the other side's list and
+// completes the waiting operations on their behalf, resuming each
+// coroutine whose operation succeeded. No thread ever blocks.
+//
+// Coroutines are resumed inline, on the thread whose put or get let them
+// proceed, so thousands of them may share a few threads without an
+// executor; post from the resumed coroutine if that matters. A coroutine
+// must not be destroyed while suspended in one of these awaits, and the
+// ring must outlive its waiters.
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+
+#include "drfifo_ring.h"
+
+namespace drfifo {
+
+// ----------------------------------------------------------------------------
+/**
+ * A ring of @a Capacity bytes whose puts and gets may be awaited.
+ *
+ * Gets return at most one packet in packet framing, as ring::get() does
+ * with the partial policy; puts are whole or wait for room, as
+ * ring::put_packet(). Keep the default locked policy whenever puts and
+ * gets can run on different threads: a put completes waiting gets itself,
+ * and resumes their coroutines, on the putting thread, and a get does the
+ * same for waiting puts, so neither side stays on one thread. spsc will do
+ * only when every coroutine using the ring runs on the same thread, or is
+ * always resumed through one executor.
+ */
+template <std::size_t Capacity,
+		  class Framing = packet_framing,
+		  class Concurrency = locked>
+class async_ring
+{
+public:
+	typedef ring<Capacity, Framing, partial, Concurrency> ring_type;
+
+	/**
+	 * Largest put that can ever complete; bigger ones complete at once
+	 * with 0.
+	 */
+	static const std::size_t max_put_bytes = Capacity - Framing::header_bytes;
+
+private:
+	// ------------------------------------------------------------------------
+	/**
+	 * A suspended operation: a node in a waiter list.
+	 */
+	struct waiter
+	{
+		waiter*                 next;
+		std::coroutine_handle<> handle;
+		async_ring*             owner;
+		bool                  (*attempt)(waiter*);     // Tries the operation; true when done.
+	};   // struct waiter
+
+	// ------------------------------------------------------------------------
+	/**
+	 * The suspended operations on one side, and a count of the times the
+	 * other side made progress that they might use.
+	 */
+	struct queue
+	{
+		std::atomic<waiter*>     waiters;    // Newest first.
+		std::atomic<std::size_t> wakeups;
+	};   // struct queue
+
+public:
+	// ------------------------------------------------------------------------
+	/**
+	 * Awaitable returned by get(). co_await yields the bytes gotten.
+	 */
+	class get_awaiter : private waiter
+	{
+		friend class async_ring;
+
+	public:
+		bool await_ready()
+		{
+			return attempt_get(this);
+		}   // await_ready()
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			this->handle = handle;
+			return !this->owner->park(this->owner->getters_, this);
+		}   // await_suspend()
+
+		std::size_t await_resume() const
+		{
+			return result_;
+		}   // await_resume()
+
+	private:
+		get_awaiter(async_ring* owner, void* data, std::size_t bytes) : data_(data), bytes_(bytes), result_(0)
+		{
+			this->next    = nullptr;
+			this->owner   = owner;
+			this->attempt = &attempt_get;
+		}
+
+		static bool attempt_get(waiter* node)
+		{
+			get_awaiter* self = static_cast<get_awaiter*>(node);
+
+			if (0 == self->bytes_)
+			{
+				return true;
+			}
+
+			self->result_ = self->owner->ring_.get(self->data_, self->bytes_);
+
+			if (0 == self->result_)
+			{
+				return false;
+			}
+
+			self->owner->notify(self->owner->putters_);
+			return true;
+		}   // attempt_get()
+
+		void*       data_;
+		std::size_t bytes_;
+		std::size_t result_;
+	};   // class get_awaiter
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Awaitable returned by put(). co_await yields the bytes put: all of
+	 * them, or 0 if they could never fit.
+	 */
+	class put_awaiter : private waiter
+	{
+		friend class async_ring;
+
+	public:
+		bool await_ready()
+		{
+			return attempt_put(this);
+		}   // await_ready()
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			this->handle = handle;
+			return !this->owner->park(this->owner->putters_, this);
+		}   // await_suspend()
+
+		std::size_t await_resume() const
+		{
+			return result_;
+		}   // await_resume()
+
+	private:
+		put_awaiter(async_ring* owner, const void* data, std::size_t bytes) : data_(data), bytes_(bytes), result_(0)
+		{
+			this->next    = nullptr;
+			this->owner   = owner;
+			this->attempt = &attempt_put;
+		}
+
+		static bool attempt_put(waiter* node)
+		{
+			put_awaiter* self = static_cast<put_awaiter*>(node);
+
+			if ((0 == self->bytes_) || (self->bytes_ > max_put_bytes))
+			{
+				return true;
+			}
+
+			self->result_ = self->owner->ring_.put_packet(self->data_, self->bytes_);
+
+			if (0 == self->result_)
+			{
+				return false;
+			}
+
+			self->owner->notify(self->owner->getters_);
+			return true;
+		}   // attempt_put()
+
+		const void* data_;
+		std::size_t bytes_;
+		std::size_t result_;
+	};   // class put_awaiter
+
+	async_ring()
+	{
+		getters_.waiters.store(nullptr);
+		getters_.wakeups.store(0);
+		putters_.waiters.store(nullptr);
+		putters_.wakeups.store(0);
+	}
+
+	async_ring(const async_ring&) = delete;
+	async_ring& operator=(const async_ring&) = delete;
+
+	// ------------------------------------------------------------------------
+	/**
+	 * @return an awaitable that gets up to @a bytes bytes into @a data,
+	 * suspending while the ring is empty.
+	 */
+	get_awaiter get(void* data, std::size_t bytes)
+	{
+		return get_awaiter(this, data, bytes);
+	}   // get()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * @return an awaitable that puts all @a bytes bytes from @a data,
+	 * suspending until they fit.
+	 */
+	put_awaiter put(const void* data, std::size_t bytes)
+	{
+		return put_awaiter(this, data, bytes);
+	}   // put()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Gets without waiting, for callers that aren't coroutines; waiting
+	 * puts are still woken.
+	 *
+	 * @return the bytes gotten, which may be 0.
+	 */
+	std::size_t try_get(void* data, std::size_t bytes)
+	{
+		const std::size_t result = ring_.get(data, bytes);
+
+		if (result > 0)
+		{
+			notify(putters_);
+		}
+
+		return result;
+	}   // try_get()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Puts without waiting, for callers that aren't coroutines; waiting
+	 * gets are still woken.
+	 *
+	 * @return @a bytes, or 0 if they didn't fit.
+	 */
+	std::size_t try_put(const void* data, std::size_t bytes)
+	{
+		const std::size_t result = ring_.put_packet(data, bytes);
+
+		if (result > 0)
+		{
+			notify(getters_);
+		}
+
+		return result;
+	}   // try_put()
+
+	std::size_t bytes_to_put() const { return ring_.bytes_to_put(); }
+	std::size_t bytes_to_get() const { return ring_.bytes_to_get(); }
+
+private:
+	// ------------------------------------------------------------------------
+	/**
+	 * Pushes the chain from @a first to @a last onto @a q.
+	 */
+	static void push(queue& q, waiter* first, waiter* last)
+	{
+		waiter* head = q.waiters.load(std::memory_order_relaxed);
+
+		do
+		{
+			last->next = head;
+		} while (!q.waiters.compare_exchange_weak(head, first, std::memory_order_acq_rel, std::memory_order_relaxed));
+	}   // push()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Adds @a self to @a q, then tries it again in case the other side made
+	 * progress - and found nobody to wake - since it last failed.
+	 *
+	 * @return true if @a self completed after all, so must not suspend.
+	 */
+	bool park(queue& q, waiter* self)
+	{
+		push(q, self, self);
+		return wake(q, self);
+	}   // park()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Tells the waiters in @a q that the other side made progress.
+	 */
+	void notify(queue& q)
+	{
+		q.wakeups.fetch_add(1);
+		wake(q, nullptr);
+	}   // notify()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Takes every waiter off @a q and completes their operations, oldest
+	 * first, resuming each one that succeeds. At the first that fails the
+	 * rest go back on the list, since they would fail too; if a notify()
+	 * came in meanwhile and found the list empty, they are tried again.
+	 *
+	 * @param self - waiter calling from its own await_suspend(), which is
+	 * not resumed here if it completes; nullptr otherwise.
+	 *
+	 * @return true if @a self completed.
+	 */
+	bool wake(queue& q, waiter* self)
+	{
+		bool self_done = false;
+
+		for (;;)
+		{
+			waiter* node = q.waiters.exchange(nullptr, std::memory_order_acq_rel);
+			waiter* oldest = nullptr;
+			bool    retry = false;
+
+			while (nullptr != node)         // The list is newest first; reverse it.
+			{
+				waiter* next = node->next;
+				node->next = oldest;
+				oldest = node;
+				node = next;
+			}
+
+			while (nullptr != oldest)
+			{
+				waiter*           next = oldest->next;
+				const std::size_t wakeups = q.wakeups.load();
+
+				if (!oldest->attempt(oldest))
+				{
+					waiter* last = oldest;
+
+					while (nullptr != last->next)
+					{
+						last = last->next;
+					}
+
+					push(q, oldest, last);
+					retry = (q.wakeups.load() != wakeups);
+					break;
+				}
+
+				if (oldest == self)
+				{
+					self_done = true;
+				}
+				else
+				{
+					oldest->handle.resume();    // May run until its next await; don't touch it after.
+				}
+
+				oldest = next;
+			}
+
+			if (!retry)
+			{
+				return self_done;
+			}
+		}
+	}   // wake()
+
+	ring_type ring_;
+	queue     getters_;   // Suspended gets, woken by puts.
+	queue     putters_;   // Suspended puts, woken by gets.
+};   // class async_ring
+
+}   // namespace drfifo
+
+#endif
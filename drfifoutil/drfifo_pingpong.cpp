@@ -0,0 +1,164 @@
+// Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License.
+// You are free to do whatever you want with this software. See LICENSE.txt.
+
+// drfifo_pingpong.cpp : Measures the round-trip latency of the busy-poll
+// consumer of drfifo_poll.h, in-process and without the device.
+//
+// Like the headers it tests, this needs C++11, so it is not part of the
+// drfifoutil project, which still builds with Visual Studio 2008. Build it
+// on its own:
+//
+//   cl /EHsc /O2 drfifo_pingpong.cpp                  (Visual Studio 2015 or later)
+//   g++ -std=c++11 -O2 -pthread drfifo_pingpong.cpp -o drfifo_pingpong
+//
+// Usage: drfifo_pingpong [packet_bytes [count [ping_cpu echo_cpu]]]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "drfifo_ring.h"
+#include "drfifo_poll.h"
+
+using namespace std;
+
+#define PROGRAM_NAME  "drfifo_pingpong"
+
+/**
+ * Rings used for the round trips, one each way.
+ */
+typedef drfifo::ring<4096, drfifo::packet_framing, drfifo::partial, drfifo::spsc> pingpong_ring_t;
+
+/**
+ * Clock used to time the round trips.
+ */
+typedef std::chrono::steady_clock pingpong_clock_t;
+
+// ----------------------------------------------------------------------------
+/**
+ * Prints the statistics of a busy-poll consumer.
+ */
+void print_poll_stats(const char* name, const drfifo::poll_stats& stats, bool pinned)
+{
+	cout << name << ": " << stats.polls << " polls, " << stats.hits << " hits ("
+		 << ((0 == stats.polls) ? 0.0 : (100.0 * stats.hits / stats.polls)) << "%), "
+		 << stats.yields << " yields, " << stats.parks << " parks"
+		 << (pinned ? ", pinned." : ", not pinned.") << endl;
+}   // print_poll_stats()
+
+// ----------------------------------------------------------------------------
+/**
+ * Main program. This thread puts a packet on one ring and polls another for
+ * its echo, which a second thread, polling the first ring, puts straight
+ * back. Pin the two to different cores of one socket for the best case,
+ * which should be well under a microsecond at the median; the first tenth
+ * of the round trips warm up and aren't counted.
+ *
+ * Arguments: optional packet size in bytes (default 64), then optional
+ * number of round trips (default 100000), then optional processors to pin
+ * this thread and the echoing one to (default neither).
+ */
+int main(int argc, char* argv[])
+{
+	const unsigned long packet_bytes = (argc > 1) ? strtoul(argv[1], NULL, 0) : 64;
+	const unsigned long count = (argc > 2) ? strtoul(argv[2], NULL, 0) : 100000;
+	const int           ping_cpu = (argc > 4) ? (int) strtol(argv[3], NULL, 0) : -1;
+	const int           echo_cpu = (argc > 4) ? (int) strtol(argv[4], NULL, 0) : -1;
+	const unsigned long warmup = count / 10;
+
+	if ((0 == packet_bytes) || (packet_bytes > (pingpong_ring_t::capacity / 2)) || (0 == count))
+	{
+		cerr << "Usage: " << PROGRAM_NAME << " [packet_bytes [count [ping_cpu echo_cpu]]]" << endl;
+		cerr << PROGRAM_NAME << ": packet size must be 1 to " << (pingpong_ring_t::capacity / 2)
+			 << ", and count non-zero." << endl;
+		return 1;
+	}
+
+	pingpong_ring_t    ping;    // Not new'd: before C++17 that ignores their cache line alignment.
+	pingpong_ring_t    pong;
+	std::atomic<bool>  stop(false);
+	drfifo::poll_stats echo_stats = drfifo::poll_stats();
+	bool               echo_pinned = false;
+
+	std::thread echo([&]()
+	{
+		drfifo::poller<pingpong_ring_t> poller(ping, drfifo::poll_options().pin_to(echo_cpu));
+		std::vector<uint8_t> buffer(packet_bytes);
+		std::size_t bytes;
+
+		while (0 != (bytes = poller.get(&buffer[0], packet_bytes, &stop)))
+		{
+			while (0 == pong.put_packet(&buffer[0], bytes))
+			{
+				drfifo::cpu_relax();
+			}
+		}
+
+		echo_stats = poller.stats();
+		echo_pinned = poller.pinned();
+	});
+
+	drfifo::poller<pingpong_ring_t> poller(pong, drfifo::poll_options().pin_to(ping_cpu));
+	std::vector<uint8_t> out(packet_bytes);
+	std::vector<uint8_t> in(packet_bytes);
+	std::vector<pingpong_clock_t::duration> trip;
+	pingpong_clock_t::time_point start;
+	pingpong_clock_t::time_point end;
+	pingpong_clock_t::time_point first;
+	int result = 0;
+	trip.reserve(count);
+
+	for (unsigned long i = 0; i < (warmup + count); i++)
+	{
+		out[0] = (uint8_t) i;
+		start = pingpong_clock_t::now();
+		ping.put_packet(&out[0], packet_bytes);    // Only one is ever in flight, so it fits.
+		poller.get(&in[0], packet_bytes);
+		end = pingpong_clock_t::now();
+
+		if (in[0] != out[0])
+		{
+			cerr << PROGRAM_NAME << ": echo of round trip " << i << " is not what was sent." << endl;
+			result = 1;
+			break;
+		}
+
+		if (i == warmup)
+		{
+			poller.clear_stats();
+			first = start;
+		}
+
+		if (i >= warmup)
+		{
+			trip.push_back(end - start);
+		}
+	}
+
+	stop = true;
+	echo.join();
+
+	if (trip.empty())
+	{
+		return result;
+	}
+
+	typedef std::chrono::duration<double, std::micro> us_t;
+	const double tick_us = us_t(pingpong_clock_t::duration(1)).count();
+	const double mean_us = us_t(end - first).count() / trip.size();
+	std::sort(trip.begin(), trip.end());
+	cout << trip.size() << " round trips of " << packet_bytes << " bytes: median "
+		 << us_t(trip[trip.size() / 2]).count() << "us, p99 "
+		 << us_t(trip[(trip.size() * 99) / 100]).count() << "us, max "
+		 << us_t(trip.back()).count() << "us, mean " << mean_us
+		 << "us (clock period " << tick_us << "us)." << endl;
+	print_poll_stats("ping", poller.stats(), poller.pinned());
+	print_poll_stats("echo", echo_stats, echo_pinned);
+	return result;
+}   // main()
@@ -0,0 +1,257 @@
+// Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License.
+// You are free to do whatever you want with this software. See LICENSE.txt.
+
+#ifndef __drfifo_poll_h__
+#define __drfifo_poll_h__
+
+// A busy-polling consumer of drfifo::ring, for paths that would rather burn
+// a core than pay for a wakeup:
+//
+//   drfifo::ring<65536, drfifo::packet_framing, drfifo::partial, drfifo::spsc> ring;
+//   drfifo::poller<decltype(ring)> poller(ring, drfifo::poll_options().pin_to(3));
+//   std::size_t bytes = poller.get(buffer, sizeof(buffer));
+//
+// A get looks at the producer's count until there is something to get. It
+// spins with a pause hint between looks for spin_polls looks, then yields
+// the processor between looks for yield_polls more, then parks - sleeps
+// park_time between looks - so that a consumer left idle gives the core
+// back. Every get starts over with the spin. A get that finds data but
+// can't take them - a packet too big for its buffer with the all_or_nothing
+// policy, say - returns at once instead of waiting on data already there.
+// With spsc a look is one load of a cache line that only the producer
+// writes, so spinning costs the producer nothing until there's something
+// to see. Give each poller a core of its
+// own: two sharing one only take turns, each spinning out its time slice.
+//
+// The statistics count the looks and how many found data, and the yields
+// and parks, so that the spin can be sized: a hit rate near 1 means the
+// consumer is behind, one near 0 that it is burning the core in vain.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#endif
+
+namespace drfifo {
+
+// ----------------------------------------------------------------------------
+/**
+ * Tells the processor that the caller is spinning: on x86 a pause, which
+ * spares the sibling hyperthread and the memory order machinery.
+ */
+inline void cpu_relax()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	_mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}   // cpu_relax()
+
+// ----------------------------------------------------------------------------
+/**
+ * Pins the calling thread to processor @a cpu.
+ *
+ * @return true on success; false if @a cpu doesn't exist or the platform
+ * can't pin.
+ */
+inline bool pin_thread(unsigned cpu)
+{
+#if defined(_WIN32)
+	return (cpu < (sizeof(DWORD_PTR) * 8)) &&
+		   (0 != SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu));
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void) cpu;
+	return false;
+#endif
+}   // pin_thread()
+
+// ----------------------------------------------------------------------------
+/**
+ * How a poller waits; see the top of this file.
+ */
+struct poll_options
+{
+	int                       cpu;           // Processor to pin to, or -1 for none.
+	std::uint64_t             spin_polls;    // Looks with a pause between...
+	std::uint64_t             yield_polls;   // ...then with a yield between...
+	std::chrono::microseconds park_time;     // ...then with this long a sleep between.
+
+	poll_options() : cpu(-1), spin_polls(1 << 20), yield_polls(1 << 10), park_time(100) {}
+
+	poll_options& pin_to(int value)                             { cpu = value; return *this; }
+	poll_options& spin(std::uint64_t value)                     { spin_polls = value; return *this; }
+	poll_options& yield(std::uint64_t value)                    { yield_polls = value; return *this; }
+	poll_options& park(std::chrono::microseconds value)         { park_time = value; return *this; }
+};   // struct poll_options
+
+/**
+ * Statistics of a poller.
+ */
+struct poll_stats
+{
+	std::uint64_t polls;    // Looks at the producer's count.
+	std::uint64_t hits;     // ... of which found data.
+	std::uint64_t yields;   // Looks after which the processor was yielded.
+	std::uint64_t parks;    // Looks after which the poller slept.
+};   // struct poll_stats
+
+// ----------------------------------------------------------------------------
+/**
+ * Busy-polling consumer of a @a Ring - a drfifo::ring, or anything with its
+ * get() and bytes_to_get(). Construct it on the consuming thread, which is
+ * pinned if the options say so; like the consuming side of an spsc ring, a
+ * poller belongs to one thread.
+ */
+template <class Ring>
+class poller
+{
+public:
+	explicit poller(Ring& ring, const poll_options& options = poll_options()) :
+		ring_(ring), options_(options), stats_(), pinned_(false)
+	{
+		if (options_.cpu >= 0)
+		{
+			pinned_ = pin_thread((unsigned) options_.cpu);
+		}
+	}
+
+	poller(const poller&) = delete;
+	poller& operator=(const poller&) = delete;
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Gets up to @a bytes bytes into @a data as Ring::get() does, polling
+	 * until there is something to get or @a stop, if given, is set.
+	 *
+	 * @return the bytes gotten; 0 if stopped, or if Ring::get() found data
+	 * but got none: an empty packet, or one bigger than @a bytes with the
+	 * all_or_nothing policy, which stays in the ring for a bigger get.
+	 */
+	std::size_t get(void* data, std::size_t bytes, const std::atomic<bool>* stop = nullptr)
+	{
+		std::size_t result = 0;
+		poll(stop, [&]() { return 0 != (result = ring_.get(data, bytes)); });
+		return result;
+	}   // get()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Gets a value put by Ring::put_value(), polling until there is one or
+	 * @a stop, if given, is set.
+	 *
+	 * @return true if @a value was filled in; false if stopped, or if the
+	 * next packet is not a T, as get() reports.
+	 */
+	template <class T>
+	bool get_value(T& value, const std::atomic<bool>* stop = nullptr)
+	{
+		return poll(stop, [&]() { return ring_.get_value(value); });
+	}   // get_value()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * @return true if the constructor pinned the thread as asked.
+	 */
+	bool pinned() const
+	{
+		return pinned_;
+	}   // pinned()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * @return the statistics so far.
+	 */
+	const poll_stats& stats() const
+	{
+		return stats_;
+	}   // stats()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Zeroes the statistics, after a warm-up say.
+	 */
+	void clear_stats()
+	{
+		stats_ = poll_stats();
+	}   // clear_stats()
+
+private:
+	// ------------------------------------------------------------------------
+	/**
+	 * Looks at the ring until it has data, backing off as the options say,
+	 * then tries @a attempt once; or until @a stop is set.
+	 *
+	 * @return true if @a attempt succeeded.
+	 */
+	template <class Attempt>
+	bool poll(const std::atomic<bool>* stop, Attempt attempt)
+	{
+		std::uint64_t idle = 0;
+
+		for (;;)
+		{
+			stats_.polls++;
+
+			if (0 != ring_.bytes_to_get())
+			{
+				stats_.hits++;
+
+				// Data this get can't take - a packet too big for the
+				// caller, say - may never go away, so waiting for more
+				// could spin or park forever.
+				return attempt();
+			}
+
+			if ((nullptr != stop) && stop->load(std::memory_order_relaxed))
+			{
+				return false;
+			}
+
+			if (idle < options_.spin_polls)
+			{
+				cpu_relax();
+			}
+			else if (idle < (options_.spin_polls + options_.yield_polls))
+			{
+				stats_.yields++;
+				std::this_thread::yield();
+			}
+			else
+			{
+				stats_.parks++;
+				std::this_thread::sleep_for(options_.park_time);
+			}
+
+			idle++;
+		}
+	}   // poll()
+
+	Ring&        ring_;
+	poll_options options_;
+	poll_stats   stats_;
+	bool         pinned_;
+};   // class poller
+
+}   // namespace drfifo
+
+#endif
@@ -0,0 +1,487 @@
+// Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License.
+// You are free to do whatever you want with this software. See LICENSE.txt.
+
+#ifndef __drfifo_ring_h__
+#define __drfifo_ring_h__
+
+// A header-only C++ (C++11 or later) version of the ring in driver/fifo.c,
+// with the modes of operation chosen at compile time:
+//
+//   drfifo::ring<4096, drfifo::packet_framing, drfifo::all_or_nothing, drfifo::spsc> ring;
+//
+// Put and get behave as fifo_put() and fifo_get() do for the same modes, and
+// packets use the same length-word header as an uncompressed, unchecked
+// driver FIFO. The capacity is a power of two so that indexing is a mask,
+// and each policy is a type, so the hot path has neither the flag tests nor
+// the division of fifo.c. Compression and CRC framing stay in the driver.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <type_traits>
+
+namespace drfifo {
+
+// ----------------------------------------------------------------------------
+// Framing policies: how writes are delimited in the ring.
+
+/**
+ * Bytes are a stream: a get may return parts of several puts, or part of one.
+ */
+struct stream_framing
+{
+	static const bool        packetized = false;
+	static const std::size_t header_bytes = 0;
+};   // struct stream_framing
+
+/**
+ * Each put is a packet preceded by a length word; a get returns at most one
+ * packet, dropping whatever doesn't fit in the caller's buffer.
+ */
+struct packet_framing
+{
+	static const bool        packetized = true;
+	static const std::size_t header_bytes = sizeof(std::size_t);
+};   // struct packet_framing
+
+// ----------------------------------------------------------------------------
+// Overflow policies: what a put or get does when not everything fits.
+
+/**
+ * Transfers as much as fits; a packet that doesn't fit is truncated.
+ */
+struct partial
+{
+	static const bool whole = false;
+};   // struct partial
+
+/**
+ * Transfers everything or nothing.
+ */
+struct all_or_nothing
+{
+	static const bool whole = true;
+};   // struct all_or_nothing
+
+// ----------------------------------------------------------------------------
+// Concurrency policies: how the put and get counts are shared.
+
+/**
+ * No synchronization; for a ring used by one thread at a time.
+ */
+struct single_thread
+{
+	typedef std::size_t count_type;
+	struct lock_type {};
+	struct guard_type { explicit guard_type(lock_type&) {} };
+	static const std::size_t alignment = sizeof(std::size_t);
+
+	static std::size_t own(const count_type& count)            { return count; }
+	static std::size_t other(const count_type& count)          { return count; }
+	static void publish(count_type& count, std::size_t value)  { count = value; }
+};   // struct single_thread
+
+/**
+ * Lock-free for one producer thread and one consumer thread. Each side owns
+ * one count and publishes it with release ordering once its data are in
+ * place; the counts sit on separate cache lines.
+ */
+struct spsc
+{
+	typedef std::atomic<std::size_t> count_type;
+	struct lock_type {};
+	struct guard_type { explicit guard_type(lock_type&) {} };
+	static const std::size_t alignment = 64;
+
+	static std::size_t own(const count_type& count)            { return count.load(std::memory_order_relaxed); }
+	static std::size_t other(const count_type& count)          { return count.load(std::memory_order_acquire); }
+	static void publish(count_type& count, std::size_t value)  { count.store(value, std::memory_order_release); }
+};   // struct spsc
+
+/**
+ * Every operation holds a mutex; for any number of producers and consumers.
+ */
+struct locked
+{
+	typedef std::size_t count_type;
+	typedef std::mutex lock_type;
+	typedef std::lock_guard<std::mutex> guard_type;
+	static const std::size_t alignment = sizeof(std::size_t);
+
+	static std::size_t own(const count_type& count)            { return count; }
+	static std::size_t other(const count_type& count)          { return count; }
+	static void publish(count_type& count, std::size_t value)  { count = value; }
+};   // struct locked
+
+// ----------------------------------------------------------------------------
+/**
+ * A mutex that profiles itself as the driver's FIFO lock does (see
+ * drfifo_lock.h): acquisitions, how many found it held, time spent waiting
+ * and holding, and a histogram of hold times with the driver's buckets.
+ * The statistics are kept under the mutex itself.
+ */
+class profiled_mutex
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	static const std::size_t buckets = 8;   // Under 250ns * 4^n; the last, the rest.
+
+	struct stats_type
+	{
+		std::uint64_t acquisitions;
+		std::uint64_t contended;             // ... of which had to wait.
+		clock::duration wait;
+		clock::duration wait_max;
+		clock::duration hold;
+		clock::duration hold_max;
+		std::uint64_t hold_histogram[buckets];
+	};   // struct stats_type
+
+	profiled_mutex() : stats_() {}
+
+	profiled_mutex(const profiled_mutex&) = delete;
+	profiled_mutex& operator=(const profiled_mutex&) = delete;
+
+	void lock()
+	{
+		clock::time_point now;
+
+		if (mutex_.try_lock())
+		{
+			now = clock::now();
+		}
+		else
+		{
+			const clock::time_point start = clock::now();
+			mutex_.lock();
+			now = clock::now();
+			stats_.contended++;
+			stats_.wait += now - start;
+			stats_.wait_max = (std::max)(stats_.wait_max, now - start);
+		}
+
+		stats_.acquisitions++;
+		held_since_ = now;
+	}   // lock()
+
+	void unlock()
+	{
+		const clock::duration hold = clock::now() - held_since_;
+		const std::int64_t    hold_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(hold).count();
+		std::int64_t          bound = 250;
+		std::size_t           bucket = 0;
+
+		while ((bucket < (buckets - 1)) && (hold_ns >= bound))
+		{
+			bucket++;
+			bound *= 4;
+		}
+
+		stats_.hold += hold;
+		stats_.hold_max = (std::max)(stats_.hold_max, hold);
+		stats_.hold_histogram[bucket]++;
+		mutex_.unlock();
+	}   // unlock()
+
+	/**
+	 * @return a copy of the statistics so far.
+	 */
+	stats_type stats() const
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		return stats_;
+	}   // stats()
+
+private:
+	mutable std::mutex mutex_;
+	clock::time_point  held_since_;
+	stats_type         stats_;
+};   // class profiled_mutex
+
+/**
+ * As locked, with the mutex profiled; read its statistics through
+ * ring::lock().stats() to judge what sharing the ring costs.
+ */
+struct profiled
+{
+	typedef std::size_t count_type;
+	typedef profiled_mutex lock_type;
+	typedef std::lock_guard<profiled_mutex> guard_type;
+	static const std::size_t alignment = sizeof(std::size_t);
+
+	static std::size_t own(const count_type& count)            { return count; }
+	static std::size_t other(const count_type& count)          { return count; }
+	static void publish(count_type& count, std::size_t value)  { count = value; }
+};   // struct profiled
+
+// ----------------------------------------------------------------------------
+/**
+ * A FIFO ring buffer of @a Capacity bytes, which must be a power of two.
+ *
+ * As in fifo.c, put and get counts run freely and wrap at the word size, so
+ * their difference is always the number of bytes held; in packet framing
+ * each packet costs an extra header_bytes.
+ */
+template <std::size_t Capacity,
+		  class Framing = stream_framing,
+		  class Overflow = partial,
+		  class Concurrency = single_thread>
+class ring
+{
+	static_assert((Capacity >= 2) && (0 == (Capacity & (Capacity - 1))), "ring capacity must be a power of two");
+	static_assert(Capacity > Framing::header_bytes, "ring capacity must exceed the packet header");
+
+public:
+	static const std::size_t capacity = Capacity;
+	static const std::size_t header_bytes = Framing::header_bytes;
+
+	ring() : put_count_(0), get_count_(0) {}
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Empties the ring. With spsc, neither side may be using it meanwhile.
+	 */
+	void reset()
+	{
+		typename Concurrency::guard_type guard(lock_);
+		Concurrency::publish(put_count_, 0);
+		Concurrency::publish(get_count_, 0);
+	}   // reset()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Puts @a bytes bytes from @a data into the ring, following the framing
+	 * and overflow policies.
+	 *
+	 * @return the number of bytes put, which may be 0.
+	 */
+	std::size_t put(const void* data, std::size_t bytes)
+	{
+		return put_common(data, bytes, Overflow::whole);
+	}   // put()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Puts all @a bytes bytes from @a data or nothing, regardless of the
+	 * overflow policy, as fifo_put_packet() does.
+	 *
+	 * @return @a bytes, or 0 if they didn't fit.
+	 */
+	std::size_t put_packet(const void* data, std::size_t bytes)
+	{
+		return put_common(data, bytes, true);
+	}   // put_packet()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Gets up to @a bytes bytes into @a data, following the framing and
+	 * overflow policies. In packet framing this is at most one packet, and
+	 * the rest of a packet longer than @a bytes is dropped.
+	 *
+	 * @return the number of bytes gotten, which may be 0.
+	 */
+	std::size_t get(void* data, std::size_t bytes)
+	{
+		return get_common(data, bytes, Overflow::whole);
+	}   // get()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Puts a copy of @a value, whole or not at all.
+	 */
+	template <class T>
+	bool put_value(const T& value)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "ring values must be trivially copyable");
+		return sizeof(T) == put_common(&value, sizeof(T), true);
+	}   // put_value()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Gets a value put by put_value(), whole or not at all.
+	 *
+	 * @return true if @a value was filled in.
+	 */
+	template <class T>
+	bool get_value(T& value)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "ring values must be trivially copyable");
+		return sizeof(T) == get_common(&value, sizeof(T), true);
+	}   // get_value()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * @return the number of bytes that may be put, less any packet header.
+	 */
+	std::size_t bytes_to_put() const
+	{
+		typename Concurrency::guard_type guard(lock_);
+		return room(Concurrency::own(put_count_) - Concurrency::other(get_count_));
+	}   // bytes_to_put()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * @return the number of bytes that may be gotten, less one packet
+	 * header. In packet framing the next get may return fewer.
+	 */
+	std::size_t bytes_to_get() const
+	{
+		typename Concurrency::guard_type guard(lock_);
+		return held(Concurrency::other(put_count_) - Concurrency::own(get_count_));
+	}   // bytes_to_get()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * @return the lock of the ring, whose statistics may be read with the
+	 * profiled policy.
+	 */
+	const typename Concurrency::lock_type& lock() const
+	{
+		return lock_;
+	}   // lock()
+
+private:
+	static const std::size_t mask = Capacity - 1;
+
+	// ------------------------------------------------------------------------
+	/**
+	 * @return the payload room left when @a used bytes are held.
+	 */
+	static std::size_t room(std::size_t used)
+	{
+		const std::size_t free_bytes = Capacity - used;
+		return (free_bytes <= header_bytes) ? 0 : (free_bytes - header_bytes);
+	}   // room()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * @return the payload that may be gotten when @a used bytes are held.
+	 */
+	static std::size_t held(std::size_t used)
+	{
+		return (used <= header_bytes) ? 0 : (used - header_bytes);
+	}   // held()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Copies @a bytes bytes into the ring at count @a at, wrapping as needed.
+	 */
+	void raw_put(std::size_t at, const void* data, std::size_t bytes)
+	{
+		const std::size_t index = at & mask;
+		const std::size_t first = ((Capacity - index) < bytes) ? (Capacity - index) : bytes;
+
+		std::memcpy(&data_[index], data, first);
+		std::memcpy(&data_[0], static_cast<const unsigned char*>(data) + first, bytes - first);
+	}   // raw_put()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Copies @a bytes bytes out of the ring from count @a at, wrapping as
+	 * needed.
+	 */
+	void raw_get(std::size_t at, void* data, std::size_t bytes) const
+	{
+		const std::size_t index = at & mask;
+		const std::size_t first = ((Capacity - index) < bytes) ? (Capacity - index) : bytes;
+
+		std::memcpy(data, &data_[index], first);
+		std::memcpy(static_cast<unsigned char*>(data) + first, &data_[0], bytes - first);
+	}   // raw_get()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Puts @a bytes bytes; see put() and put_packet().
+	 */
+	std::size_t put_common(const void* data, std::size_t bytes, bool whole)
+	{
+		typename Concurrency::guard_type guard(lock_);
+		std::size_t       put_count = Concurrency::own(put_count_);
+		const std::size_t available = room(put_count - Concurrency::other(get_count_));
+
+		if (0 == available)
+		{
+			return 0;
+		}
+
+		if (bytes > available)
+		{
+			if (whole)
+			{
+				return 0;
+			}
+
+			bytes = available;
+		}
+
+		if (Framing::packetized)
+		{
+			raw_put(put_count, &bytes, header_bytes);
+			put_count += header_bytes;
+		}
+
+		raw_put(put_count, data, bytes);
+		Concurrency::publish(put_count_, put_count + bytes);
+		return bytes;
+	}   // put_common()
+
+	// ------------------------------------------------------------------------
+	/**
+	 * Gets up to @a bytes bytes; see get().
+	 */
+	std::size_t get_common(void* data, std::size_t bytes, bool whole)
+	{
+		typename Concurrency::guard_type guard(lock_);
+		std::size_t       get_count = Concurrency::own(get_count_);
+		const std::size_t available = held(Concurrency::other(put_count_) - get_count);
+
+		if (0 == available)
+		{
+			return 0;
+		}
+
+		if (bytes > available)
+		{
+			if (whole)
+			{
+				return 0;
+			}
+
+			bytes = available;
+		}
+
+		if (!Framing::packetized)
+		{
+			raw_get(get_count, data, bytes);
+			Concurrency::publish(get_count_, get_count + bytes);
+			return bytes;
+		}
+
+		std::size_t packet_bytes = 0;
+		raw_get(get_count, &packet_bytes, header_bytes);
+		get_count += header_bytes;
+
+		if (packet_bytes < bytes)
+		{
+			bytes = packet_bytes;
+		}
+
+		raw_get(get_count, data, bytes);
+		Concurrency::publish(get_count_, get_count + packet_bytes);    // Skip any rest of the packet.
+		return bytes;
+	}   // get_common()
+
+	alignas(Concurrency::alignment) typename Concurrency::count_type put_count_;
+	alignas(Concurrency::alignment) typename Concurrency::count_type get_count_;
+	mutable typename Concurrency::lock_type lock_;
+	alignas(64) unsigned char data_[Capacity];     // Cache-line aligned, as pool memory is.
+};   // class ring
+
+}   // namespace drfifo
+
+#endif
@@ -6,8 +6,10 @@
 
 #include "stdafx.h"
 
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "tstuff.h"
 #include "../driver/drfifo_ioctl.h"
@@ -31,7 +33,21 @@ void usage(void)
 	tcerr << endl;
 	tcerr << M_T("Usage: ") << T_PROGRAM_NAME << M_T(" <device-service-name> <command> [args...]") << endl;
 	tcerr << endl;
-	tcerr << M_T("Commands are 'status', 'read', 'write', 'reset' and 'flush'.") << endl;
+	tcerr << M_T("Commands are 'status', 'read', 'write', 'reset', 'flush' and") << endl;
+	tcerr << M_T("'persist <off|none|periodic|batch> [period_ms]' and") << endl;
+	tcerr << M_T("'spill <on|off> [segment_bytes [memory_bytes]]' and") << endl;
+	tcerr << M_T("'sink <on|off> [batch_bytes [flush_ms [rotate_bytes]]]' and") << endl;
+	tcerr << M_T("'codec <on|off> [threshold]' and 'crc <on|off>' and") << endl;
+	tcerr << M_T("'record <record_bytes|off>' and 'align <align_bytes|off>' and") << endl;
+	tcerr << M_T("'wait [count [timeout_ms [topic_mask]]]' and") << endl;
+	tcerr << M_T("'watermark <low_bytes> [high_bytes [max_delay_ms]]' and") << endl;
+	tcerr << M_T("'broadcast <on|off> [evict]' and 'topics <on|off>' and") << endl;
+	tcerr << M_T("'batch [count [packet_bytes]]' and 'retain <on|off>' and 'seek <sequence>' and") << endl;
+	tcerr << M_T("'trace [clear]' and 'indirect <on|off> [buffers [buffer_bytes [threshold]]]' and") << endl;
+	tcerr << M_T("'fragment <on|off> [fragment_bytes]' and 'message [bytes [read_bytes]]' and") << endl;
+	tcerr << M_T("'deadline <ttl_us|off>' and 'capture <file> [count [timeout_ms]]' and") << endl;
+	tcerr << M_T("'replay <file> [speed|0]' and") << endl;
+	tcerr << M_T("'bench [packet_bytes [count]]'.") << endl;
 	tcerr << endl;
 }   // usage()
 
@@ -68,6 +84,97 @@ tstring error_message(DWORD error_number)
 	return result;
 }   // error_message()
 
+// ----------------------------------------------------------------------------
+/**
+ * Issues a device control, reporting any failure to stderr.
+ *
+ * @param device - file handle for the open device.
+ * @param command - DRFIFO_IOCTL_xxx command.
+ * @param input - input argument structure, or NULL.
+ * @param input_bytes - size of @a input.
+ * @param output - output argument structure, or NULL.
+ * @param output_bytes - size of @a output.
+ *
+ * @return true on success, false otherwise.
+ */
+bool device_control(HANDLE device, DWORD command, void* input, DWORD input_bytes, void* output, DWORD output_bytes)
+{
+	DWORD bytes_read = 0;
+	BOOL result = DeviceIoControl(device, command, input, input_bytes, output, output_bytes, &bytes_read, NULL);
+
+	if (!result)
+	{
+		DWORD error = ::GetLastError();
+		tcerr << T_PROGRAM_NAME << M_T(": DeviceIoControl() failed with error ") << error
+			  << M_T(": ") << error_message(error) << endl;
+	}
+
+	return result ? true : false;
+}   // device_control()
+
+// ----------------------------------------------------------------------------
+/**
+ * Prints the FIFO lock profile in @a status, one line per call site that
+ * took the lock and one of its hold-time histogram. With @a since, counts
+ * are those since that earlier status; the maxima are since the driver was
+ * loaded either way. Prints nothing if the driver wasn't built to profile
+ * the lock.
+ *
+ * @param status - status holding the profile.
+ * @param since - earlier status to subtract, or NULL.
+ */
+void print_lock_profile(const drfifo_ioctl_status_t& status, const drfifo_ioctl_status_t* since)
+{
+	static const _TCHAR* const site_name[DRFIFO_LOCK_SITES] =
+	{
+		M_T("put   "), M_T("get   "), M_T("status"), M_T("reset "), M_T("flush "), M_T("other ")
+	};
+	static const _TCHAR* const bucket_name[DRFIFO_LOCK_BUCKETS] =
+	{
+		M_T("<250ns"), M_T("<1us"), M_T("<4us"), M_T("<16us"), M_T("<64us"), M_T("<256us"), M_T("<1ms"), M_T(">=1ms")
+	};
+	const double us_per_tick = (status.ticks_per_second > 0) ? (1e6 / (double) status.ticks_per_second) : 0.0;
+
+	for (int site = 0; site < DRFIFO_LOCK_SITES; site++)
+	{
+		drfifo_ioctl_lock_site_t lock = status.lock[site];
+
+		if (NULL != since)
+		{
+			const drfifo_ioctl_lock_site_t& before = since->lock[site];
+			lock.acquisitions -= before.acquisitions;
+			lock.contended    -= before.contended;
+			lock.spin_ticks   -= before.spin_ticks;
+			lock.hold_ticks   -= before.hold_ticks;
+
+			for (int bucket = 0; bucket < DRFIFO_LOCK_BUCKETS; bucket++)
+			{
+				lock.hold_histogram[bucket] -= before.hold_histogram[bucket];
+			}
+		}
+
+		if (0 == lock.acquisitions)
+		{
+			continue;
+		}
+
+		tcout << M_T("lock ") << site_name[site] << M_T(" = ") << lock.acquisitions << M_T(" acquisitions, ")
+			  << lock.contended << M_T(" contended (") << (100.0 * lock.contended / lock.acquisitions)
+			  << M_T("%); spin ") << ((lock.contended > 0) ? (lock.spin_ticks * us_per_tick / lock.contended) : 0.0)
+			  << M_T("us mean, ") << (lock.spin_max_ticks * us_per_tick) << M_T("us max; hold ")
+			  << (lock.hold_ticks * us_per_tick / lock.acquisitions) << M_T("us mean, ")
+			  << (lock.hold_max_ticks * us_per_tick) << M_T("us max") << endl;
+		tcout << M_T("      holds  =");
+
+		for (int bucket = 0; bucket < DRFIFO_LOCK_BUCKETS; bucket++)
+		{
+			tcout << M_T(" ") << bucket_name[bucket] << M_T(":") << lock.hold_histogram[bucket];
+		}
+
+		tcout << endl;
+	}
+}   // print_lock_profile()
+
 // ----------------------------------------------------------------------------
 /**
  * Handles a status command by issuing a DRFIFO_IOCTL_STATUS device control.
@@ -101,6 +208,95 @@ void handle_status(HANDLE device)
 		const size_t bytes_in_fifo = status.put_count - status.get_count;
 		tcout << M_T("bytes available for put = ") << (status.size - bytes_in_fifo) << endl;
 		tcout << M_T("bytes available for get = ") << bytes_in_fifo << endl;
+
+		if (status.record_bytes > 0)
+		{
+			tcout << M_T("records   = ") << status.record_count << M_T(" of ") << status.record_capacity
+				  << M_T(" (") << status.record_bytes << M_T(" bytes each)") << endl;
+		}
+
+		if (status.align_bytes > 0)
+		{
+			tcout << M_T("align     = ") << status.align_bytes << M_T(" bytes") << endl;
+		}
+
+		if (status.page_bytes > 0)
+		{
+			tcout << M_T("sparse    = ") << status.committed_bytes << M_T(" of ") << status.size
+				  << M_T(" bytes committed in ") << status.page_bytes << M_T("-byte pages (")
+				  << status.commits << M_T(" commits, ") << status.decommits << M_T(" decommits)") << endl;
+		}
+
+		if ((status.readable_signals > 0) || (status.writable_signals > 0) || (status.timer_signals > 0))
+		{
+			tcout << M_T("wakeups   = ") << status.readable_signals << M_T(" readable, ") << status.timer_signals
+				  << M_T(" by timer, ") << status.writable_signals << M_T(" writable") << endl;
+		}
+
+		if ((status.readers > 0) || (status.evictions > 0))
+		{
+			tcout << M_T("readers   = ") << status.readers << M_T(" (") << status.evictions << M_T(" evictions, ")
+				  << status.reader_evictions << M_T(" of this handle)") << endl;
+		}
+
+		if (status.filtered > 0)
+		{
+			tcout << M_T("filtered  = ") << status.filtered << M_T(" packets of unsubscribed topics") << endl;
+		}
+
+		if (status.staged_bytes > 0)
+		{
+			tcout << M_T("staged    = ") << status.staged_bytes << M_T(" bytes in an open transaction") << endl;
+		}
+
+		tcout << M_T("sequence  = ") << status.get_sequence << M_T(" (retained from ") << status.retained_sequence
+			  << M_T(", next put ") << status.put_sequence << M_T(")") << endl;
+
+		if (status.indirect_buffers > 0)
+		{
+			tcout << M_T("indirect  = ") << status.indirect_free << M_T(" of ") << status.indirect_buffers
+				  << M_T(" buffers free (") << status.indirect_exhausted << M_T(" writes refused, ")
+				  << status.indirect_stale << M_T(" stale)") << endl;
+		}
+
+		if (status.fragment_bytes > 0)
+		{
+			tcout << M_T("fragments = ") << status.fragment_bytes << M_T(" bytes")
+				  << (status.fragmenting ? M_T(", a message part way written") : M_T("")) << endl;
+		}
+
+		if ((status.ttl_ticks > 0) || (status.expired > 0))
+		{
+			tcout << M_T("deadline  = ") << ((status.ttl_ticks * 1000000) / status.ticks_per_second)
+				  << M_T(" us (") << status.expired << M_T(" packets expired unread)") << endl;
+		}
+
+		if (status.sink_writes > 0)
+		{
+			tcout << M_T("sink      = ") << status.sink_bytes << M_T(" bytes in ") << status.sink_writes
+				  << M_T(" writes (") << status.sink_errors << M_T(" failed and retried), file ")
+				  << status.sink_file << endl;
+		}
+
+		if ((status.bad_packets > 0) || (status.resyncs > 0))
+		{
+			tcout << M_T("bad packets = ") << status.bad_packets << M_T(", resyncs = ") << status.resyncs
+				  << M_T(" (") << status.resync_bytes << M_T(" bytes skipped)") << endl;
+		}
+
+		if (status.codec_packets > 0)
+		{
+			const double ticks = (status.ticks_per_second > 0) ? (double) status.ticks_per_second : 1.0;
+			tcout << M_T("codec packets = ") << status.codec_packets
+				  << M_T(" (") << status.codec_compressed << M_T(" compressed)") << endl;
+			tcout << M_T("codec ratio   = ")
+				  << ((status.codec_stored_bytes > 0) ? ((double) status.codec_raw_bytes / status.codec_stored_bytes) : 1.0)
+				  << M_T(" (") << status.codec_raw_bytes << M_T(" -> ") << status.codec_stored_bytes << M_T(" bytes)") << endl;
+			tcout << M_T("codec cpu     = ") << (status.codec_compress_ticks / ticks * 1e6) << M_T("us compressing, ")
+				  << (status.codec_expand_ticks / ticks * 1e6) << M_T("us expanding") << endl;
+		}
+
+		print_lock_profile(status, NULL);
 	}
 }   // handle_status()
 
@@ -153,6 +349,1242 @@ void handle_read(HANDLE device, int num_args, _TCHAR* arg[])
 	}
 }   // handle_write()
 
+// ----------------------------------------------------------------------------
+/**
+ * Handles a persist command by issuing a DRFIFO_IOCTL_PERSIST device control.
+ *
+ * Arguments are the durability level ('off', 'none', 'periodic' or 'batch')
+ * and, optionally, the sync period in milliseconds.
+ *
+ * @param device - file handle for the open device.
+ */
+void handle_persist(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_persist_t persist;
+	memset(&persist, 0, sizeof(persist));
+
+	if (num_args < 1)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": persist requires a durability level: off, none, periodic or batch.") << endl;
+		return;
+	}
+
+	tstring level(arg[0]);
+
+	if (level == M_T("off"))			persist.durability = DRFIFO_DURABILITY_OFF;
+	else if (level == M_T("none"))		persist.durability = DRFIFO_DURABILITY_NONE;
+	else if (level == M_T("periodic"))	persist.durability = DRFIFO_DURABILITY_PERIODIC;
+	else if (level == M_T("batch"))		persist.durability = DRFIFO_DURABILITY_BATCH;
+	else
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": unknown durability level \"") << level << M_T("\".") << endl;
+		return;
+	}
+
+	if (num_args > 1)
+	{
+		persist.period_ms = _tcstoul(arg[1], NULL, 0);
+	}
+
+	if (device_control(device, DRFIFO_IOCTL_PERSIST, &persist, sizeof(persist), NULL, 0))
+	{
+		tcout << M_T("persistence set to ") << level << M_T(".") << endl;
+	}
+}   // handle_persist()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a spill command by issuing a DRFIFO_IOCTL_SPILL device control.
+ *
+ * Arguments are 'on' or 'off' and, optionally, the segment file size and the
+ * in-memory limit, both in bytes.
+ *
+ * @param device - file handle for the open device.
+ */
+void handle_spill(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_spill_t spill;
+	memset(&spill, 0, sizeof(spill));
+
+	if ((num_args < 1) || ((tstring(arg[0]) != M_T("on")) && (tstring(arg[0]) != M_T("off"))))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": spill requires 'on' or 'off'.") << endl;
+		return;
+	}
+
+	spill.enabled = (tstring(arg[0]) == M_T("on"));
+
+	if (num_args > 1)
+	{
+		spill.segment_bytes = _tcstoul(arg[1], NULL, 0);
+	}
+
+	if (num_args > 2)
+	{
+		spill.memory_bytes = _tcstoul(arg[2], NULL, 0);
+	}
+
+	if (device_control(device, DRFIFO_IOCTL_SPILL, &spill, sizeof(spill), NULL, 0))
+	{
+		tcout << M_T("spill turned ") << arg[0] << M_T(".") << endl;
+	}
+}   // handle_spill()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a sink command by issuing a DRFIFO_IOCTL_SINK device control.
+ *
+ * Arguments are 'on' or 'off' and, optionally, the batch size in bytes, the
+ * flush period in milliseconds and the file size at which to rotate.
+ *
+ * @param device - file handle for the open device.
+ */
+void handle_sink(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_sink_t sink;
+	memset(&sink, 0, sizeof(sink));
+
+	if ((num_args < 1) || ((tstring(arg[0]) != M_T("on")) && (tstring(arg[0]) != M_T("off"))))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": sink requires 'on' or 'off'.") << endl;
+		return;
+	}
+
+	sink.enabled = (tstring(arg[0]) == M_T("on"));
+
+	if (num_args > 1)
+	{
+		sink.batch_bytes = _tcstoul(arg[1], NULL, 0);
+	}
+
+	if (num_args > 2)
+	{
+		sink.flush_ms = _tcstoul(arg[2], NULL, 0);
+	}
+
+	if (num_args > 3)
+	{
+		sink.rotate_bytes = _tcstoul(arg[3], NULL, 0);
+	}
+
+	if (device_control(device, DRFIFO_IOCTL_SINK, &sink, sizeof(sink), NULL, 0))
+	{
+		tcout << M_T("sink turned ") << arg[0] << M_T(".") << endl;
+	}
+}   // handle_sink()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a codec command by issuing a DRFIFO_IOCTL_CODEC device control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - 'on' or 'off', optionally followed by the threshold in bytes.
+ */
+void handle_codec(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_codec_t codec;
+	memset(&codec, 0, sizeof(codec));
+
+	if ((num_args < 1) || ((tstring(arg[0]) != M_T("on")) && (tstring(arg[0]) != M_T("off"))))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": codec requires 'on' or 'off'.") << endl;
+		return;
+	}
+
+	codec.enabled = (tstring(arg[0]) == M_T("on"));
+
+	if (num_args > 1)
+	{
+		codec.threshold = _tcstoul(arg[1], NULL, 0);
+	}
+
+	if (device_control(device, DRFIFO_IOCTL_CODEC, &codec, sizeof(codec), NULL, 0))
+	{
+		tcout << M_T("codec turned ") << arg[0] << M_T(".") << endl;
+	}
+}   // handle_codec()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles an indirect command by issuing a DRFIFO_IOCTL_INDIRECT device
+ * control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - 'on' or 'off', optionally followed by the number of buffers,
+ * their size and the threshold in bytes.
+ */
+void handle_indirect(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_indirect_t indirect;
+	memset(&indirect, 0, sizeof(indirect));
+
+	if ((num_args < 1) || ((tstring(arg[0]) != M_T("on")) && (tstring(arg[0]) != M_T("off"))))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": indirect requires 'on' or 'off'.") << endl;
+		return;
+	}
+
+	indirect.enabled = (tstring(arg[0]) == M_T("on"));
+
+	if (num_args > 1)
+	{
+		indirect.buffers = _tcstoul(arg[1], NULL, 0);
+	}
+
+	if (num_args > 2)
+	{
+		indirect.buffer_bytes = _tcstoul(arg[2], NULL, 0);
+	}
+
+	if (num_args > 3)
+	{
+		indirect.threshold = _tcstoul(arg[3], NULL, 0);
+	}
+
+	if (device_control(device, DRFIFO_IOCTL_INDIRECT, &indirect, sizeof(indirect), NULL, 0))
+	{
+		tcout << M_T("indirect turned ") << arg[0] << M_T(".") << endl;
+	}
+}   // handle_indirect()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a fragment command by issuing a DRFIFO_IOCTL_FRAGMENT device
+ * control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - 'on' or 'off', optionally followed by the fragment size in
+ * bytes.
+ */
+void handle_fragment(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_fragment_t fragment;
+	memset(&fragment, 0, sizeof(fragment));
+
+	if ((num_args < 1) || ((tstring(arg[0]) != M_T("on")) && (tstring(arg[0]) != M_T("off"))))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": fragment requires 'on' or 'off'.") << endl;
+		return;
+	}
+
+	fragment.enabled = (tstring(arg[0]) == M_T("on"));
+
+	if (num_args > 1)
+	{
+		fragment.fragment_bytes = _tcstoul(arg[1], NULL, 0);
+	}
+
+	if (device_control(device, DRFIFO_IOCTL_FRAGMENT, &fragment, sizeof(fragment), NULL, 0))
+	{
+		tcout << M_T("fragmentation turned ") << arg[0] << M_T(".") << endl;
+	}
+}   // handle_fragment()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a message command: sends one message, bigger than the FIFO if
+ * need be, through the device with fragmentation on, reading it back in
+ * pieces as the writes make progress, and checks that it arrives intact.
+ * Short writes are carried on from where they stopped; reads that fail with
+ * ERROR_MORE_DATA are carried on until one succeeds.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - optional message size in bytes (default 65536), then
+ * optional read size in bytes (default 4096).
+ */
+void handle_message(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	const DWORD message_bytes = (num_args > 0) ? _tcstoul(arg[0], NULL, 0) : 0x10000;
+	const DWORD read_bytes = (num_args > 1) ? _tcstoul(arg[1], NULL, 0) : 0x1000;
+
+	if ((0 == message_bytes) || (0 == read_bytes))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": message and read sizes must be non-zero.") << endl;
+		return;
+	}
+
+	std::vector<uint8_t> out(message_bytes);
+	std::vector<uint8_t> in(message_bytes + read_bytes);
+
+	for (DWORD i = 0; i < message_bytes; i++)
+	{
+		out[i] = (uint8_t) ((i * 7) + (i >> 8));
+	}
+
+	DWORD written = 0;
+	DWORD got = 0;
+	DWORD writes = 0;
+	DWORD reads = 0;
+	bool  more = true;
+
+	while (more)
+	{
+		DWORD bytes = 0;
+		DWORD progress = 0;
+
+		if (written < message_bytes)
+		{
+			if (!WriteFile(device, &out[written], message_bytes - written, &bytes, 0) &&
+				(ERROR_NO_SYSTEM_RESOURCES != ::GetLastError()))      // No room yet is fine.
+			{
+				DWORD error = ::GetLastError();
+				tcerr << T_PROGRAM_NAME << M_T(": WriteFile() failed with error ") << error
+					  << M_T(": ") << error_message(error) << endl;
+				return;
+			}
+
+			written += bytes;
+			progress += bytes;
+			writes++;
+		}
+
+		if (got + read_bytes > in.size())
+		{
+			tcerr << T_PROGRAM_NAME << M_T(": read ") << got << M_T(" bytes, more than was written.") << endl;
+			return;
+		}
+
+		bytes = 0;
+		more = !ReadFile(device, &in[got], read_bytes, &bytes, 0);
+
+		if (more && (ERROR_MORE_DATA != ::GetLastError()))
+		{
+			DWORD error = ::GetLastError();
+			tcerr << T_PROGRAM_NAME << M_T(": ReadFile() failed with error ") << error
+				  << M_T(": ") << error_message(error) << endl;
+			return;
+		}
+
+		more = more || (0 == bytes);        // Nothing there yet.
+		got += bytes;
+		progress += bytes;
+		reads++;
+
+		if (0 == progress)
+		{
+			tcerr << T_PROGRAM_NAME << M_T(": stuck after writing ") << written << M_T(" and reading ") << got
+				  << M_T(" bytes; is fragmentation on?") << endl;
+			return;
+		}
+	}
+
+	if ((got != message_bytes) || (0 != memcmp(&in[0], &out[0], message_bytes)))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": read back ") << got << M_T(" bytes, or not what was written.") << endl;
+		return;
+	}
+
+	tcout << M_T("sent a ") << message_bytes << M_T("-byte message in ") << writes << M_T(" writes and ")
+		  << reads << M_T(" reads.") << endl;
+}   // handle_message()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a crc command by issuing a DRFIFO_IOCTL_CRC device control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - 'on' or 'off'.
+ */
+void handle_crc(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_crc_t crc;
+	memset(&crc, 0, sizeof(crc));
+
+	if ((num_args < 1) || ((tstring(arg[0]) != M_T("on")) && (tstring(arg[0]) != M_T("off"))))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": crc requires 'on' or 'off'.") << endl;
+		return;
+	}
+
+	crc.enabled = (tstring(arg[0]) == M_T("on"));
+
+	if (device_control(device, DRFIFO_IOCTL_CRC, &crc, sizeof(crc), NULL, 0))
+	{
+		tcout << M_T("crc turned ") << arg[0] << M_T(".") << endl;
+	}
+}   // handle_crc()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a broadcast command by issuing a DRFIFO_IOCTL_BROADCAST device
+ * control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - 'on' or 'off', then optional 'evict' to evict slow readers.
+ */
+void handle_broadcast(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_broadcast_t broadcast;
+	memset(&broadcast, 0, sizeof(broadcast));
+
+	if ((num_args < 1) || ((tstring(arg[0]) != M_T("on")) && (tstring(arg[0]) != M_T("off"))))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": broadcast requires 'on' or 'off'.") << endl;
+		return;
+	}
+
+	broadcast.enabled = (tstring(arg[0]) == M_T("on"));
+	broadcast.evict = (num_args > 1) && (tstring(arg[1]) == M_T("evict"));
+
+	if (device_control(device, DRFIFO_IOCTL_BROADCAST, &broadcast, sizeof(broadcast), NULL, 0))
+	{
+		tcout << M_T("broadcast turned ") << arg[0] << (broadcast.evict ? M_T(", evicting slow readers.") : M_T(".")) << endl;
+	}
+}   // handle_broadcast()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a topics command by issuing a DRFIFO_IOCTL_TOPICS device control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - 'on' or 'off'.
+ */
+void handle_topics(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_topics_t topics;
+	memset(&topics, 0, sizeof(topics));
+
+	if ((num_args < 1) || ((tstring(arg[0]) != M_T("on")) && (tstring(arg[0]) != M_T("off"))))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": topics requires 'on' or 'off'.") << endl;
+		return;
+	}
+
+	topics.enabled = (tstring(arg[0]) == M_T("on"));
+
+	if (device_control(device, DRFIFO_IOCTL_TOPICS, &topics, sizeof(topics), NULL, 0))
+	{
+		tcout << M_T("topics turned ") << arg[0] << M_T("; the first byte of each packet is its topic.") << endl;
+	}
+}   // handle_topics()
+
+// ----------------------------------------------------------------------------
+/**
+ * Sends a DRFIFO_IOCTL_TRANSACTION device control with @a action.
+ *
+ * @return true on success.
+ */
+bool transaction(HANDLE device, ulong_t action)
+{
+	drfifo_ioctl_transaction_t transaction;
+	memset(&transaction, 0, sizeof(transaction));
+	transaction.action = action;
+	return device_control(device, DRFIFO_IOCTL_TRANSACTION, &transaction, sizeof(transaction), NULL, 0);
+}   // transaction()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a batch command by writing packets inside a transaction, so that
+ * readers see all of them or none. The batch is aborted if any write fails.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - optional number of packets (default 10), then optional packet
+ * size in bytes (default 64).
+ */
+void handle_batch(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	const DWORD count = (num_args > 0) ? _tcstoul(arg[0], NULL, 0) : 10;
+	const DWORD packet_bytes = (num_args > 1) ? _tcstoul(arg[1], NULL, 0) : 64;
+
+	if (0 == packet_bytes)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": batch packet size must be non-zero.") << endl;
+		return;
+	}
+
+	std::vector<uint8_t> out(packet_bytes);
+
+	if (!transaction(device, DRFIFO_TRANSACTION_BEGIN))
+	{
+		return;
+	}
+
+	for (DWORD i = 0; i < count; i++)
+	{
+		DWORD bytes = 0;
+		memset(&out[0], (int) (i & 0xFF), packet_bytes);
+
+		if (!WriteFile(device, &out[0], packet_bytes, &bytes, 0) || (bytes != packet_bytes))
+		{
+			DWORD error = ::GetLastError();
+			tcerr << T_PROGRAM_NAME << M_T(": WriteFile() of packet ") << i << M_T(" failed with error ") << error
+				  << M_T(": ") << error_message(error) << M_T("; aborting the batch.") << endl;
+			transaction(device, DRFIFO_TRANSACTION_ABORT);
+			return;
+		}
+	}
+
+	if (transaction(device, DRFIFO_TRANSACTION_COMMIT))
+	{
+		tcout << M_T("committed ") << count << M_T(" packets of ") << packet_bytes << M_T(" bytes.") << endl;
+	}
+}   // handle_batch()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a retain command by issuing a DRFIFO_IOCTL_RETAIN device control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - 'on' or 'off'.
+ */
+void handle_retain(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_retain_t retain;
+	memset(&retain, 0, sizeof(retain));
+
+	if ((num_args < 1) || ((tstring(arg[0]) != M_T("on")) && (tstring(arg[0]) != M_T("off"))))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": retain requires 'on' or 'off'.") << endl;
+		return;
+	}
+
+	retain.enabled = (tstring(arg[0]) == M_T("on"));
+
+	if (device_control(device, DRFIFO_IOCTL_RETAIN, &retain, sizeof(retain), NULL, 0))
+	{
+		tcout << M_T("retention turned ") << arg[0] << M_T(".") << endl;
+	}
+}   // handle_retain()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a seek command by issuing a DRFIFO_IOCTL_SEEK device control, then
+ * reading one packet from the new position. With broadcast off this moves
+ * the position shared by every handle; with it on, the position only lives
+ * as long as this handle does.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - sequence number, as shown by the status command.
+ */
+void handle_seek(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_seek_t seek;
+	memset(&seek, 0, sizeof(seek));
+
+	if (num_args < 1)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": seek requires a sequence number.") << endl;
+		return;
+	}
+
+	seek.sequence = _tcstoui64(arg[0], NULL, 0);
+
+	if (device_control(device, DRFIFO_IOCTL_SEEK, &seek, sizeof(seek), NULL, 0))
+	{
+		tcout << M_T("sought to ") << seek.sequence << M_T(".") << endl;
+		handle_read(device, 0, NULL);
+	}
+}   // handle_seek()
+
+// ----------------------------------------------------------------------------
+/**
+ * @return the name of trace operation @a op.
+ */
+const _TCHAR* trace_op_name(uint16_t op)
+{
+	switch (op)
+	{
+	case FIFO_TRACE_RAW_PUT:	return M_T("raw_put");
+	case FIFO_TRACE_RAW_GET:	return M_T("raw_get");
+	case FIFO_TRACE_CORRUPT:	return M_T("corrupt");
+	case FIFO_TRACE_IRP_CREATE:	return M_T("create");
+	case FIFO_TRACE_IRP_CLOSE:	return M_T("close");
+	case FIFO_TRACE_IRP_READ:	return M_T("read");
+	case FIFO_TRACE_IRP_WRITE:	return M_T("write");
+	case FIFO_TRACE_IRP_IOCTL:	return M_T("ioctl");
+	case FIFO_TRACE_IRP_OTHER:	return M_T("other");
+	case FIFO_TRACE_READ_FAILED:	return M_T("read_failed");
+	case FIFO_TRACE_WRITE_FAILED:	return M_T("write_failed");
+	case FIFO_TRACE_IOCTL_FAILED:	return M_T("ioctl_failed");
+	}
+
+	return M_T("?");
+}   // trace_op_name()
+
+// ----------------------------------------------------------------------------
+/**
+ * @return true if trace event @a a was recorded before @a b.
+ */
+bool trace_event_before(const fifo_trace_event_t& a, const fifo_trace_event_t& b)
+{
+	return (a.ticks != b.ticks) ? (a.ticks < b.ticks) : (a.sequence < b.sequence);
+}   // trace_event_before()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a trace command by issuing a DRFIFO_IOCTL_TRACE device control and
+ * decoding the events, merged across processors in time order.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - optional 'clear' to empty the trace rings after reading.
+ */
+void handle_trace(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	const DWORD max_events = 64 * FIFO_TRACE_EVENTS;
+	std::vector<uint8_t> buffer(sizeof(drfifo_ioctl_trace_t) + (max_events * sizeof(fifo_trace_event_t)));
+	drfifo_ioctl_trace_t* trace = (drfifo_ioctl_trace_t*) &buffer[0];
+	trace->clear = (num_args > 0) && (tstring(arg[0]) == M_T("clear"));
+
+	if (!device_control(device, DRFIFO_IOCTL_TRACE, trace, sizeof(*trace), trace, (DWORD) buffer.size()))
+	{
+		return;
+	}
+
+	if (FIFO_TRACE_OFF == trace->level)
+	{
+		tcout << M_T("tracing is compiled out of the driver; rebuild it with FIFO_TRACE_LEVEL set.") << endl;
+		return;
+	}
+
+	fifo_trace_event_t* first = (fifo_trace_event_t*) &trace[1];
+	std::vector<fifo_trace_event_t> events(first, first + trace->count);
+	std::sort(events.begin(), events.end(), trace_event_before);
+	tcout << M_T("trace level ") << trace->level << M_T(", ") << trace->count << M_T(" events")
+		  << (trace->clear ? M_T(", cleared") : M_T("")) << M_T(".") << endl;
+
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		const fifo_trace_event_t& event = events[i];
+		const uint64_t microseconds = ((event.ticks - events[0].ticks) * 1000000) / trace->ticks_per_second;
+		const bool failed = (FIFO_TRACE_READ_FAILED == event.op) || (FIFO_TRACE_WRITE_FAILED == event.op) ||
+							(FIFO_TRACE_IOCTL_FAILED == event.op);
+		tcout << microseconds << M_T("us cpu") << event.cpu << M_T(" #") << event.sequence << M_T(" ")
+			  << trace_op_name(event.op);
+
+		if (failed)
+		{
+			tcout << M_T(" status=0x") << std::hex << event.bytes << std::dec;
+		}
+		else
+		{
+			tcout << M_T(" bytes=") << event.bytes;
+		}
+
+		tcout << M_T(" index=") << event.index << endl;
+	}
+}   // handle_trace()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a deadline command by issuing a DRFIFO_IOCTL_DEADLINE device
+ * control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - time to live of each packet in microseconds, or 'off'.
+ */
+void handle_deadline(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_deadline_t deadline;
+	memset(&deadline, 0, sizeof(deadline));
+
+	if (num_args < 1)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": deadline requires a time to live in microseconds or 'off'.") << endl;
+		return;
+	}
+
+	if (tstring(arg[0]) != M_T("off"))
+	{
+		deadline.ttl_us = _tcstoul(arg[0], NULL, 0);
+
+		if (0 == deadline.ttl_us)
+		{
+			tcerr << T_PROGRAM_NAME << M_T(": time to live must be non-zero; use 'off' to turn deadlines off.") << endl;
+			return;
+		}
+	}
+
+	if (device_control(device, DRFIFO_IOCTL_DEADLINE, &deadline, sizeof(deadline), NULL, 0))
+	{
+		if (0 == deadline.ttl_us)
+		{
+			tcout << M_T("deadlines turned off.") << endl;
+		}
+		else
+		{
+			tcout << M_T("packets now expire ") << deadline.ttl_us << M_T(" us after they are written.") << endl;
+		}
+	}
+}   // handle_deadline()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a record command by issuing a DRFIFO_IOCTL_RECORD device control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - record size in bytes, or 'off'.
+ */
+void handle_record(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_record_t record;
+	memset(&record, 0, sizeof(record));
+
+	if (num_args < 1)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": record requires a record size or 'off'.") << endl;
+		return;
+	}
+
+	if (tstring(arg[0]) != M_T("off"))
+	{
+		record.record_bytes = _tcstoul(arg[0], NULL, 0);
+
+		if (0 == record.record_bytes)
+		{
+			tcerr << T_PROGRAM_NAME << M_T(": record size must be non-zero; use 'off' to turn record mode off.") << endl;
+			return;
+		}
+	}
+
+	if (device_control(device, DRFIFO_IOCTL_RECORD, &record, sizeof(record), NULL, 0))
+	{
+		if (0 == record.record_bytes)
+		{
+			tcout << M_T("record mode turned off.") << endl;
+		}
+		else
+		{
+			tcout << M_T("record mode on with ") << record.record_bytes << M_T("-byte records.") << endl;
+		}
+	}
+}   // handle_record()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles an align command by issuing a DRFIFO_IOCTL_ALIGN device control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - boundary for packet data in bytes, or 'off'.
+ */
+void handle_align(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_align_t align;
+	memset(&align, 0, sizeof(align));
+
+	if (num_args < 1)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": align requires an alignment or 'off'.") << endl;
+		return;
+	}
+
+	if (tstring(arg[0]) != M_T("off"))
+	{
+		align.align_bytes = _tcstoul(arg[0], NULL, 0);
+
+		if (0 == align.align_bytes)
+		{
+			tcerr << T_PROGRAM_NAME << M_T(": alignment must be non-zero; use 'off' to turn alignment off.") << endl;
+			return;
+		}
+	}
+
+	if (device_control(device, DRFIFO_IOCTL_ALIGN, &align, sizeof(align), NULL, 0))
+	{
+		if (align.align_bytes <= 1)
+		{
+			tcout << M_T("packet alignment turned off.") << endl;
+		}
+		else
+		{
+			tcout << M_T("packet data aligned to ") << align.align_bytes << M_T(" bytes.") << endl;
+		}
+	}
+}   // handle_align()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a watermark command by issuing a DRFIFO_IOCTL_WATERMARK device
+ * control.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - low watermark in bytes, then optional high watermark in
+ * bytes (default 1), then optional max delay in milliseconds (default none).
+ */
+void handle_watermark(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	drfifo_ioctl_watermark_t watermark;
+	memset(&watermark, 0, sizeof(watermark));
+
+	if (num_args < 1)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": watermark requires a low watermark in bytes.") << endl;
+		return;
+	}
+
+	watermark.low_bytes = _tcstoul(arg[0], NULL, 0);
+	watermark.high_bytes = (num_args > 1) ? _tcstoul(arg[1], NULL, 0) : 0;
+	watermark.max_delay_ms = (num_args > 2) ? _tcstoul(arg[2], NULL, 0) : 0;
+
+	if (device_control(device, DRFIFO_IOCTL_WATERMARK, &watermark, sizeof(watermark), NULL, 0))
+	{
+		tcout << M_T("watermarks set: low ") << watermark.low_bytes << M_T(" bytes, high ") << watermark.high_bytes
+			  << M_T(" bytes, max delay ") << watermark.max_delay_ms << M_T("ms.") << endl;
+	}
+}   // handle_watermark()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a wait command: registers a readable event with
+ * DRFIFO_IOCTL_EVENTS and reads packets as they arrive, waiting on the
+ * event whenever the FIFO is empty - as an event loop would, alongside its
+ * sockets and timers.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - optional number of packets to read (default 1), then
+ * optional timeout for each wait in milliseconds (default forever), then
+ * optional mask of topics to read (default all).
+ */
+void handle_wait(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	const DWORD count = (num_args > 0) ? _tcstoul(arg[0], NULL, 0) : 1;
+	const DWORD timeout_ms = (num_args > 1) ? _tcstoul(arg[1], NULL, 0) : INFINITE;
+	HANDLE readable = CreateEvent(NULL, FALSE, FALSE, NULL);    // Auto-reset.
+
+	if (NULL == readable)
+	{
+		DWORD error = ::GetLastError();
+		tcerr << T_PROGRAM_NAME << M_T(": CreateEvent() failed with error ") << error
+			  << M_T(": ") << error_message(error) << endl;
+		return;
+	}
+
+	drfifo_ioctl_events_t events;
+	memset(&events, 0, sizeof(events));
+	events.readable = readable;
+
+	if (num_args > 2)
+	{
+		drfifo_ioctl_subscribe_t subscribe;
+		memset(&subscribe, 0, sizeof(subscribe));
+		subscribe.topics = _tcstoul(arg[2], NULL, 0);
+		device_control(device, DRFIFO_IOCTL_SUBSCRIBE, &subscribe, sizeof(subscribe), NULL, 0);
+	}
+
+	if (device_control(device, DRFIFO_IOCTL_EVENTS, &events, sizeof(events), NULL, 0))
+	{
+		std::vector<uint8_t> data(0x10000);
+		DWORD got = 0;
+		DWORD wakeups = 0;
+
+		while (got < count)
+		{
+			DWORD bytes = 0;
+
+			if (!ReadFile(device, &data[0], (DWORD) data.size(), &bytes, 0))
+			{
+				DWORD error = ::GetLastError();
+				tcerr << T_PROGRAM_NAME << M_T(": ReadFile() failed with error ") << error
+					  << M_T(": ") << error_message(error) << endl;
+				break;
+			}
+
+			if (bytes > 0)
+			{
+				got++;
+				tcout << M_T("packet ") << got << M_T(": ") << bytes << M_T(" bytes.") << endl;
+				continue;
+			}
+
+			// Empty: the next write into the empty FIFO signals the event.
+			if (WAIT_OBJECT_0 != WaitForSingleObject(readable, timeout_ms))
+			{
+				tcerr << T_PROGRAM_NAME << M_T(": timed out waiting for data.") << endl;
+				break;
+			}
+
+			wakeups++;
+		}
+
+		tcout << got << M_T(" packets read after ") << wakeups << M_T(" waits.") << endl;
+		memset(&events, 0, sizeof(events));
+		device_control(device, DRFIFO_IOCTL_EVENTS, &events, sizeof(events), NULL, 0);
+	}
+
+	CloseHandle(readable);
+}   // handle_wait()
+
+// ----------------------------------------------------------------------------
+/**
+ * Capture files, as written by 'capture' and read by 'replay': a
+ * capture_header_t, then for each packet a capture_record_t followed by
+ * the packet's data. Packed, so that each record adds only 12 bytes.
+ */
+#define CAPTURE_MAGIC     0x43524644    // "DFRC", little-endian.
+#define CAPTURE_VERSION   1
+#define CAPTURE_MAX_NAP_MS 8            // Longest sleep between polls of an idle device.
+
+#pragma pack(push, 4)
+
+typedef struct capture_header_s
+{
+	uint32_t magic;              // CAPTURE_MAGIC.
+	uint32_t version;            // CAPTURE_VERSION.
+	uint64_t ticks_per_second;   // Frequency of the capturing machine's ticks.
+} capture_header_t;
+
+typedef struct capture_record_s
+{
+	uint64_t ticks;              // When the packet was read, counted from the first packet.
+	uint32_t bytes;              // Size of the packet's data, which follow.
+} capture_record_t;
+
+#pragma pack(pop)
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a capture command: reads packets from the device and records
+ * each, with the time it was read, in a capture file for 'replay'. With
+ * broadcast on, the handle is a reader of its own, so the capture sees all
+ * the traffic without taking it from the other readers; otherwise it drains
+ * the FIFO. Polls rather than waiting on the readable event: the event is a
+ * single slot for the whole device, which capture would take from whoever
+ * registered it, and in broadcast mode it follows the other readers too.
+ * The naps while idle are short, so the times are those at which packets
+ * became readable to within CAPTURE_MAX_NAP_MS.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - capture file name, then optional number of packets to
+ * capture (default 0, for no limit), then optional time to wait for the
+ * next packet in milliseconds, after which the capture ends (default
+ * 10000).
+ */
+void handle_capture(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	if (num_args < 1)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": capture requires a file name.") << endl;
+		return;
+	}
+
+	const DWORD count = (num_args > 1) ? _tcstoul(arg[1], NULL, 0) : 0;
+	const DWORD timeout_ms = (num_args > 2) ? _tcstoul(arg[2], NULL, 0) : 10000;
+	FILE* file = _tfopen(arg[0], M_T("wb"));
+
+	if (NULL == file)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": could not create capture file \"") << arg[0] << M_T("\".") << endl;
+		return;
+	}
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	capture_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic            = CAPTURE_MAGIC;
+	header.version          = CAPTURE_VERSION;
+	header.ticks_per_second = (uint64_t) frequency.QuadPart;
+	fwrite(&header, sizeof(header), 1, file);
+
+	std::vector<uint8_t> data(0x10000);
+	LARGE_INTEGER first;
+	DWORD         got = 0;
+	uint64_t      total_bytes = 0;
+	DWORD         idle_since = GetTickCount();
+	DWORD         nap_ms = 1;
+
+	first.QuadPart = 0;
+
+	while ((0 == count) || (got < count))
+	{
+		DWORD bytes = 0;
+
+		if (!ReadFile(device, &data[0], (DWORD) data.size(), &bytes, 0))
+		{
+			DWORD error = ::GetLastError();
+			tcerr << T_PROGRAM_NAME << M_T(": ReadFile() failed with error ") << error
+				  << M_T(": ") << error_message(error) << endl;
+			break;
+		}
+
+		if (bytes > 0)
+		{
+			LARGE_INTEGER    now;
+			capture_record_t record;
+			QueryPerformanceCounter(&now);
+
+			if (0 == got)
+			{
+				first = now;
+			}
+
+			record.ticks = (uint64_t) (now.QuadPart - first.QuadPart);
+			record.bytes = bytes;
+
+			if ((1 != fwrite(&record, sizeof(record), 1, file)) || (1 != fwrite(&data[0], bytes, 1, file)))
+			{
+				tcerr << T_PROGRAM_NAME << M_T(": could not write capture file \"") << arg[0] << M_T("\".") << endl;
+				break;
+			}
+
+			got++;
+			total_bytes += bytes;
+			idle_since = GetTickCount();
+			nap_ms = 1;
+			continue;
+		}
+
+		// Nothing for this handle: poll again after a nap that grows while idle.
+		if ((GetTickCount() - idle_since) >= timeout_ms)
+		{
+			tcerr << T_PROGRAM_NAME << M_T(": capture idle for ") << timeout_ms << M_T(" ms; stopping.") << endl;
+			break;
+		}
+
+		Sleep(nap_ms);
+		nap_ms = (nap_ms < CAPTURE_MAX_NAP_MS) ? (2 * nap_ms) : CAPTURE_MAX_NAP_MS;
+	}
+
+	tcout << M_T("captured ") << got << M_T(" packets, ") << total_bytes << M_T(" bytes, to \"")
+		  << arg[0] << M_T("\".") << endl;
+	fclose(file);
+}   // handle_capture()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a replay command: writes the packets of a capture file made by
+ * 'capture' to the device, paced as they were captured, then reports the
+ * throughput achieved, how late the writes were against the schedule and
+ * how long each took. A write refused for want of room is retried until it
+ * succeeds, so a slow reader shows up as lateness rather than loss.
+ *
+ * Pacing sleeps until a millisecond or two before each packet is due and
+ * spins on the performance counter for the rest, since Sleep() alone is
+ * only as good as the timer resolution.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - capture file name, then optional speed: 1 for the original
+ * speed (the default), N for N times faster, or 0 for as fast as possible.
+ */
+void handle_replay(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	if (num_args < 1)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": replay requires a file name.") << endl;
+		return;
+	}
+
+	const double speed = (num_args > 1) ? _tcstod(arg[1], NULL) : 1.0;
+	FILE* file = _tfopen(arg[0], M_T("rb"));
+
+	if (NULL == file)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": could not open capture file \"") << arg[0] << M_T("\".") << endl;
+		return;
+	}
+
+	capture_header_t header;
+
+	if ((1 != fread(&header, sizeof(header), 1, file)) || (CAPTURE_MAGIC != header.magic) ||
+		(CAPTURE_VERSION != header.version) || (0 == header.ticks_per_second))
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": \"") << arg[0] << M_T("\" is not a capture file.") << endl;
+		fclose(file);
+		return;
+	}
+
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER start;
+	LARGE_INTEGER stop;
+	QueryPerformanceFrequency(&frequency);
+
+	// Capture ticks to ours, sped up.
+	const double scale = (speed > 0.0) ? ((double) frequency.QuadPart / (double) header.ticks_per_second / speed) : 0.0;
+	const LONGLONG ticks_per_ms = frequency.QuadPart / 1000;
+
+	std::vector<uint8_t>  data;
+	std::vector<LONGLONG> write_ticks;      // How long each write took, retries included.
+	LONGLONG              late_total = 0;
+	LONGLONG              late_max = 0;
+	uint64_t              total_bytes = 0;
+	uint64_t              retries = 0;
+	capture_record_t      record;
+
+	QueryPerformanceCounter(&start);
+
+	while (1 == fread(&record, sizeof(record), 1, file))
+	{
+		data.resize((record.bytes > 0) ? record.bytes : 1);
+
+		if ((record.bytes > 0) && (1 != fread(&data[0], record.bytes, 1, file)))
+		{
+			tcerr << T_PROGRAM_NAME << M_T(": capture file \"") << arg[0] << M_T("\" is truncated.") << endl;
+			break;
+		}
+
+		const LONGLONG due = start.QuadPart + (LONGLONG) ((double) record.ticks * scale);
+		LARGE_INTEGER  now;
+		QueryPerformanceCounter(&now);
+
+		if (due - now.QuadPart > 2 * ticks_per_ms)
+		{
+			Sleep((DWORD) ((due - now.QuadPart) / ticks_per_ms) - 1);
+		}
+
+		do
+		{
+			QueryPerformanceCounter(&now);
+		} while (now.QuadPart < due);
+
+		const LONGLONG late = now.QuadPart - due;
+		late_total += late;
+		late_max = (std::max)(late_max, late);
+
+		DWORD bytes = 0;
+
+		while (!WriteFile(device, &data[0], record.bytes, &bytes, 0))
+		{
+			DWORD error = ::GetLastError();
+
+			if (ERROR_NO_SYSTEM_RESOURCES != error)     // Anything but no room yet.
+			{
+				tcerr << T_PROGRAM_NAME << M_T(": WriteFile() failed with error ") << error
+					  << M_T(": ") << error_message(error) << endl;
+				fclose(file);
+				return;
+			}
+
+			retries++;
+			YieldProcessor();
+		}
+
+		QueryPerformanceCounter(&stop);
+		write_ticks.push_back(stop.QuadPart - now.QuadPart);
+		total_bytes += record.bytes;
+	}
+
+	QueryPerformanceCounter(&stop);
+	fclose(file);
+
+	const size_t packets = write_ticks.size();
+
+	if (0 == packets)
+	{
+		tcout << M_T("no packets replayed.") << endl;
+		return;
+	}
+
+	const double seconds = (double) (stop.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+	const double us_per_tick = 1e6 / (double) frequency.QuadPart;
+	std::sort(write_ticks.begin(), write_ticks.end());
+
+	tcout << M_T("replayed ") << packets << M_T(" packets, ") << total_bytes << M_T(" bytes, in ") << seconds
+		  << M_T("s: ") << ((double) packets / seconds) << M_T(" packets/s, ")
+		  << ((double) total_bytes / seconds / (1024.0 * 1024.0)) << M_T(" MB/s.") << endl;
+	tcout << M_T("write latency: median ") << (write_ticks[packets / 2] * us_per_tick)
+		  << M_T("us, 99th percentile ") << (write_ticks[(packets * 99) / 100] * us_per_tick)
+		  << M_T("us, max ") << (write_ticks[packets - 1] * us_per_tick) << M_T("us; ")
+		  << retries << M_T(" retries for want of room.") << endl;
+
+	if (speed > 0.0)
+	{
+		tcout << M_T("pacing: writes started ") << ((double) late_total / packets * us_per_tick)
+			  << M_T("us late on average, ") << (late_max * us_per_tick) << M_T("us at worst.") << endl;
+	}
+}   // handle_replay()
+
+// ----------------------------------------------------------------------------
+/**
+ * Handles a bench command: times round trips of a packet through the
+ * device, writing it and reading it straight back, so that the cost of a
+ * FIFO mode (crc, codec) can be compared by running it with the mode on and
+ * off. If the driver profiles its lock, the lock activity during the run is
+ * printed too, so that a lock change can be judged the same way.
+ *
+ * @param device - file handle for the open device.
+ * @param num_args - number of arguments in @a arg.
+ * @param arg - optional packet size in bytes (default 1024), then optional
+ * number of round trips (default 10000).
+ */
+void handle_bench(HANDLE device, int num_args, _TCHAR* arg[])
+{
+	const DWORD packet_bytes = (num_args > 0) ? _tcstoul(arg[0], NULL, 0) : 1024;
+	const DWORD count = (num_args > 1) ? _tcstoul(arg[1], NULL, 0) : 10000;
+
+	if (0 == packet_bytes)
+	{
+		tcerr << T_PROGRAM_NAME << M_T(": bench packet size must be non-zero.") << endl;
+		return;
+	}
+
+	// Something log-like, so that a codec sees realistic data.
+	std::vector<uint8_t> out(packet_bytes);
+	std::vector<uint8_t> in(packet_bytes);
+	static const char line[] = "2019-01-01 00:00:00 INFO drfifo: request completed ok status=0\n";
+
+	for (DWORD i = 0; i < packet_bytes; i++)
+	{
+		out[i] = (uint8_t) line[i % (sizeof(line) - 1)];
+	}
+
+	drfifo_ioctl_status_t before;
+	drfifo_ioctl_status_t after;
+	memset(&before, 0, sizeof(before));
+	memset(&after, 0, sizeof(after));
+	const bool have_before = device_control(device, DRFIFO_IOCTL_STATUS, NULL, 0, &before, sizeof(before));
+
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER start;
+	LARGE_INTEGER stop;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	DWORD done = 0;
+
+	for (done = 0; done < count; done++)
+	{
+		DWORD bytes = 0;
+
+		if (!WriteFile(device, &out[0], packet_bytes, &bytes, 0) || (bytes != packet_bytes))
+		{
+			DWORD error = ::GetLastError();
+			tcerr << T_PROGRAM_NAME << M_T(": WriteFile() failed with error ") << error
+				  << M_T(": ") << error_message(error) << endl;
+			break;
+		}
+
+		if (!ReadFile(device, &in[0], packet_bytes, &bytes, 0) || (bytes != packet_bytes) ||
+			(0 != memcmp(&in[0], &out[0], packet_bytes)))
+		{
+			tcerr << T_PROGRAM_NAME << M_T(": read back ") << bytes << M_T(" bytes, or not what was written.") << endl;
+			break;
+		}
+	}
+
+	QueryPerformanceCounter(&stop);
+	const double seconds = (double) (stop.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+
+	if (done > 0)
+	{
+		tcout << done << M_T(" round trips of ") << packet_bytes << M_T(" bytes in ") << seconds << M_T("s: ")
+			  << (seconds * 1e6 / done) << M_T("us each, ")
+			  << ((double) done * packet_bytes / seconds / (1024.0 * 1024.0)) << M_T(" MB/s.") << endl;
+	}
+
+	if (have_before && device_control(device, DRFIFO_IOCTL_STATUS, NULL, 0, &after, sizeof(after)))
+	{
+		print_lock_profile(after, &before);
+	}
+}   // handle_bench()
+
 // ----------------------------------------------------------------------------
 /**
  * Main program.
@@ -205,6 +1637,28 @@ int _tmain(int argc, _TCHAR* argv[])
 	if (command == M_T("status"))		handle_status(device);
 	else if (command == M_T("write"))	handle_write(device, argc - 3, &argv[3]);
 	else if (command == M_T("read"))	handle_read(device, argc - 3, &argv[3]);
+	else if (command == M_T("persist"))	handle_persist(device, argc - 3, &argv[3]);
+	else if (command == M_T("spill"))	handle_spill(device, argc - 3, &argv[3]);
+	else if (command == M_T("sink"))	handle_sink(device, argc - 3, &argv[3]);
+	else if (command == M_T("codec"))	handle_codec(device, argc - 3, &argv[3]);
+	else if (command == M_T("indirect"))	handle_indirect(device, argc - 3, &argv[3]);
+	else if (command == M_T("fragment"))	handle_fragment(device, argc - 3, &argv[3]);
+	else if (command == M_T("message"))	handle_message(device, argc - 3, &argv[3]);
+	else if (command == M_T("deadline"))	handle_deadline(device, argc - 3, &argv[3]);
+	else if (command == M_T("crc"))		handle_crc(device, argc - 3, &argv[3]);
+	else if (command == M_T("record"))	handle_record(device, argc - 3, &argv[3]);
+	else if (command == M_T("align"))	handle_align(device, argc - 3, &argv[3]);
+	else if (command == M_T("wait"))	handle_wait(device, argc - 3, &argv[3]);
+	else if (command == M_T("watermark"))	handle_watermark(device, argc - 3, &argv[3]);
+	else if (command == M_T("broadcast"))	handle_broadcast(device, argc - 3, &argv[3]);
+	else if (command == M_T("topics"))	handle_topics(device, argc - 3, &argv[3]);
+	else if (command == M_T("batch"))	handle_batch(device, argc - 3, &argv[3]);
+	else if (command == M_T("retain"))	handle_retain(device, argc - 3, &argv[3]);
+	else if (command == M_T("seek"))	handle_seek(device, argc - 3, &argv[3]);
+	else if (command == M_T("trace"))	handle_trace(device, argc - 3, &argv[3]);
+	else if (command == M_T("capture"))	handle_capture(device, argc - 3, &argv[3]);
+	else if (command == M_T("replay"))	handle_replay(device, argc - 3, &argv[3]);
+	else if (command == M_T("bench"))	handle_bench(device, argc - 3, &argv[3]);
 	else
 	{
 		tcerr << T_PROGRAM_NAME << ": unsupported command \"" << command << "\"." << endl;
@@ -10,23 +10,10 @@
 #include "drfifo.h"
 #include "drfifo_stdint.h"
 #include "drfifo_ioctl.h"
+#include "drfifo_persist.h"
+#include "drfifo_spill.h"
 #include "fifo.h"
-
-//#ifdef UNICODE
-#define M_T(_s) L ## _s
-//#else
-//#define M_T(_s) _s
-//#endif
-
-/**
- * The name of this driver.
- */
-#define DRIVER_NAME   "drfifo"
-
-/**
- * The name of this driver, possibly in wide char.
- */
-#define T_DRIVER_NAME   M_T("drfifo")
+#include "fifo_trace.h"
 
 /**
  * The name of our device.
@@ -60,16 +47,6 @@ const WCHAR DRFIFO_DEVICE_LINK[]  = M_T("\\??\\") T_DRIVER_NAME;
 static const GUID guid_drfifo =      // {28329D26-B481-41dd-8F6D-77F68CBF2883}
 { 0x28329d26, 0xb481, 0x41dd, { 0x8f, 0x6d, 0x77, 0xf6, 0x8c, 0xbf, 0x28, 0x83 } };
 
-/**
- * Structure holding private data for a device that's handled by our driver.
- */
-typedef struct drfifo_dev_s
-{
-    KSPIN_LOCK   lock;          /**< General lock, used mostly to protect the FIFO. */
-    fifo_t*      fifo;          /**< FIFO object. */
-    PIO_WORKITEM work_item;     /**< Work item for writing to file. */
-} drfifo_dev_t;
-
 /**
  * Global pointer to our singleton device object.
  *
@@ -80,15 +57,21 @@ PDEVICE_OBJECT g_dev = NULL;
 /* ------------------------------------------------------------------------- */
 /**
  * Provides a protected FIFO put operation for the @a drfifo device
- * (extension).
+ * (extension). The packet is put whole or not at all; with compression on,
+ * whether it fits depends on its compressed size. During a transaction the
+ * packet is staged if @a file began it, and refused otherwise. With
+ * fragmentation on, as much of it as fits is put; see
+ * DRFIFO_IOCTL_FRAGMENT.
  *
  * @param drfifo - device of interest.
+ * @param file - handle being written.
  * @param data - pointer to data to be put into the FIFO.
  * @param size - number of bytes to put into the FIFO.
  *
- * @return the actual number of bytes written to the FIFO.
+ * @return the actual number of bytes written to the FIFO; 0 if there was no
+ * room, or another handle has a transaction or message open.
  */
-static ssize_t drfifo_put(drfifo_dev_t* drfifo, const void* data, size_t size)
+static ssize_t drfifo_put(drfifo_dev_t* drfifo, PFILE_OBJECT file, const void* data, size_t size)
 {
     ssize_t bytes_put = 0;
 
@@ -96,9 +79,26 @@ static ssize_t drfifo_put(drfifo_dev_t* drfifo, const void* data, size_t size)
     {
         KIRQL level;
 //      DbgPrint(DRIVER_NAME ": drfifo_put() calling fifo_put(size=%d).", size);
-        KeAcquireSpinLock(&drfifo->lock, &level);
-        bytes_put = fifo_put(drfifo->fifo, data, size);
-        KeReleaseSpinLock(&drfifo->lock, level);
+        drfifo_lock(drfifo, &level, DRFIFO_LOCK_PUT);
+        if ((NULL != drfifo->staging) && (file == drfifo->staging))
+        {
+            bytes_put = drfifo_event_stage(drfifo, data, size);
+        }
+        else if ((drfifo->fragment_bytes > 0) && !fifo_is_staging(drfifo->fifo))
+        {
+            bytes_put = drfifo_event_put_fragments(drfifo, file, data, size);
+        }
+        else
+        {
+            bytes_put = drfifo_event_put(drfifo, data, size);
+        }
+
+        if (0 == bytes_put)
+        {
+            drfifo_event_refused(drfifo);
+        }
+
+        drfifo_unlock(drfifo, level);
 //      DbgPrint(DRIVER_NAME ": drfifo_put() bytes_put=%d.", size);
     }
 
@@ -111,12 +111,13 @@ static ssize_t drfifo_put(drfifo_dev_t* drfifo, const void* data, size_t size)
  * (extension).
  *
  * @param drfifo - device of interest.
+ * @param reader - the reading handle's position and topics.
  * @param data - pointer to buffer to hold data from the FIFO.
  * @param size - maximum number of bytes to get from the FIFO.
  *
  * @return the actual number of bytes read from the FIFO.
  */
-static ssize_t drfifo_get(drfifo_dev_t* drfifo, void* data, size_t size)
+static ssize_t drfifo_get(drfifo_dev_t* drfifo, fifo_reader_t* reader, void* data, size_t size)
 {
     ssize_t bytes_gotten = 0;
 
@@ -124,15 +125,158 @@ static ssize_t drfifo_get(drfifo_dev_t* drfifo, void* data, size_t size)
     {
         KIRQL level;
 //      DbgPrint(DRIVER_NAME ": drfifo_get() calling fifo_get(size=%d).", size);
-        KeAcquireSpinLock(&drfifo->lock, &level);
-        bytes_gotten = fifo_get(drfifo->fifo, data, size);
-        KeReleaseSpinLock(&drfifo->lock, level);
+        drfifo_lock(drfifo, &level, DRFIFO_LOCK_GET);
+        if (!fifo_is_topic_tagged(drfifo->fifo))
+        {
+            bytes_gotten = fifo_reader_get(drfifo->fifo, reader, data, size);
+        }
+        else if ((NULL != reader) && (size > 1))
+        {
+            uint8_t* tagged = (uint8_t*) data;
+            bytes_gotten = fifo_reader_get(drfifo->fifo, reader, &tagged[1], size - 1);
+
+            if (bytes_gotten > 0)
+            {
+                tagged[0] = (uint8_t) reader->topic;
+                bytes_gotten++;
+            }
+        }
+
+        if (bytes_gotten > 0)
+        {
+            drfifo_event_room(drfifo);
+        }
+
+        drfifo_unlock(drfifo, level);
 //      DbgPrint(DRIVER_NAME ": drfifo_get() bytes_gotten=%d.", bytes_gotten);
     }
 
     return bytes_gotten;
 }   /* drfifo_get() */
 
+/* ------------------------------------------------------------------------- */
+/**
+ * Handles DRFIFO_IOCTL_CODEC: attaches a new packet codec to the FIFO, or
+ * detaches the current one. Must be called at PASSIVE_LEVEL.
+ *
+ * @param drfifo - device of interest.
+ * @param config - requested compression settings.
+ *
+ * @return STATUS_SUCCESS on success, something else otherwise.
+ */
+static NTSTATUS drfifo_codec_config(drfifo_dev_t* drfifo, const drfifo_ioctl_codec_t* config)
+{
+    fifo_codec_t* codec = NULL;
+    KIRQL         level;
+    int8_t        previous;
+
+    if (NULL == drfifo->fifo)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (config->enabled)
+    {
+        codec = fifo_codec_new(drfifo->fifo->size, config->threshold ? config->threshold : DRFIFO_CODEC_THRESHOLD);
+
+        if (NULL == codec)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    previous = fifo_is_compressed(drfifo->fifo);
+    codec = fifo_codec(drfifo->fifo, codec);
+    drfifo_unlock(drfifo, level);
+
+    if (previous != (0 != config->enabled))
+    {
+        drfifo_spill_discard(drfifo);   // Spilled writes were framed for the old mode.
+    }
+
+    fifo_codec_del(&codec);     // The one that was replaced, if any.
+    return STATUS_SUCCESS;
+}   /* drfifo_codec_config() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Handles DRFIFO_IOCTL_INDIRECT: attaches a new slab of buffers for large
+ * packets to the FIFO, or detaches the current one. Must be called at
+ * PASSIVE_LEVEL.
+ *
+ * @param drfifo - device of interest.
+ * @param config - requested indirect settings.
+ *
+ * @return STATUS_SUCCESS on success, something else otherwise.
+ */
+static NTSTATUS drfifo_indirect_config(drfifo_dev_t* drfifo, const drfifo_ioctl_indirect_t* config)
+{
+    fifo_slab_t* slab = NULL;
+    KIRQL        level;
+
+    if (NULL == drfifo->fifo)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (config->enabled)
+    {
+        slab = fifo_slab_new(config->buffers ? config->buffers : DRFIFO_INDIRECT_BUFFERS,
+                             config->buffer_bytes ? config->buffer_bytes : DRFIFO_INDIRECT_BUFFER_BYTES,
+                             config->threshold ? config->threshold : DRFIFO_INDIRECT_THRESHOLD);
+
+        if (NULL == slab)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    slab = fifo_indirect(drfifo->fifo, slab);
+    drfifo_event_room(drfifo);
+    drfifo_unlock(drfifo, level);
+
+    fifo_slab_del(&slab);       // The one that was replaced, if any.
+    return STATUS_SUCCESS;
+}   /* drfifo_indirect_config() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Handles DRFIFO_IOCTL_FRAGMENT: sets the fragment size for writes, or
+ * turns fragmentation off, ending any message part way written.
+ *
+ * @param drfifo - device of interest.
+ * @param config - requested fragmentation settings.
+ *
+ * @return STATUS_SUCCESS on success, something else otherwise.
+ */
+static NTSTATUS drfifo_fragment_config(drfifo_dev_t* drfifo, const drfifo_ioctl_fragment_t* config)
+{
+    KIRQL level;
+
+    if (NULL == drfifo->fifo)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+
+    if (config->enabled)
+    {
+        drfifo->fragment_bytes = config->fragment_bytes ? config->fragment_bytes : DRFIFO_FRAGMENT_BYTES;
+    }
+    else
+    {
+        drfifo->fragment_bytes = 0;
+        fifo_put_fragments(drfifo->fifo, drfifo->fragment_topic, NULL, 0, 0, 0);
+        drfifo->fragmenting = NULL;
+    }
+
+    drfifo_unlock(drfifo, level);
+    return STATUS_SUCCESS;
+}   /* drfifo_fragment_config() */
+
 /* ------------------------------------------------------------------------- */
 /**
  * Sets IRP major function @a irp_num to be handled by @a handler.
@@ -187,6 +331,24 @@ static NTSTATUS irp_complete_event(PIRP irp, ULONG info_bytes, NTSTATUS status)
     return status;
 }   /* irp_complete_event() */
 
+/* ------------------------------------------------------------------------- */
+/**
+ * Completes @a irp with no data and failure @a status, recording an
+ * error-level trace event @a op first.
+ *
+ * @param irp - request to complete.
+ * @param op - FIFO_TRACE_xxx_FAILED operation to record.
+ * @param status - failure status.
+ * @param index - index field of the trace event; see @a op.
+ *
+ * @return @a status.
+ */
+static NTSTATUS irp_complete_failed(PIRP irp, uint32_t op, NTSTATUS status, size_t index)
+{
+    FIFO_TRACE(FIFO_TRACE_ERRORS, op, (ULONG) status, index);
+    return irp_complete_event(irp, 0, status);
+}   /* irp_complete_failed() */
+
 /* ------------------------------------------------------------------------- */
 /**
  * Default handler for an IRP. Does nothing; returns STATUS_SUCCESS.
@@ -201,7 +363,7 @@ NTSTATUS drfifo_handle_irp_default(IN PDEVICE_OBJECT dev, IN PIRP irp)
     PIO_STACK_LOCATION irp_stack;
 //  PAGED_CODE();
     irp_stack = IoGetCurrentIrpStackLocation(irp);
-    DbgPrint(DRIVER_NAME ": drfifo_handle_irp_default(0x%08X).", irp_stack->MajorFunction);
+    FIFO_TRACE(FIFO_TRACE_IRPS, FIFO_TRACE_IRP_OTHER, 0, irp_stack->MajorFunction);
     return irp_complete_event(irp, 0, STATUS_SUCCESS);
 }   /* drfifo_handle_irp_default() */
 
@@ -216,8 +378,21 @@ NTSTATUS drfifo_handle_irp_default(IN PDEVICE_OBJECT dev, IN PIRP irp)
  */
 NTSTATUS drfifo_handle_irp_create(IN PDEVICE_OBJECT dev, IN PIRP irp)
 {
+    PIO_STACK_LOCATION irp_stack = IoGetCurrentIrpStackLocation(irp);
+    fifo_reader_t*     reader;
 //  PAGED_CODE();
-    DbgPrint(DRIVER_NAME ": drfifo_handle_irp_create().");
+    FIFO_TRACE(FIFO_TRACE_IRPS, FIFO_TRACE_IRP_CREATE, 0, 0);
+
+    // Each handle's position for broadcast mode; it joins on its first read.
+    reader = (fifo_reader_t*) ExAllocatePoolWithTag(NonPagedPool, sizeof(fifo_reader_t), DRFIFO_POOL_TAG);
+
+    if (NULL == reader)
+    {
+        return irp_complete_event(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+    }
+
+    RtlZeroMemory(reader, sizeof(fifo_reader_t));
+    irp_stack->FileObject->FsContext = reader;
     return irp_complete_event(irp, 0, STATUS_SUCCESS);
 }   /* drfifo_handle_irp_create() */
 
@@ -236,31 +411,45 @@ NTSTATUS drfifo_handle_irp_read(IN PDEVICE_OBJECT dev, IN PIRP irp)
     PVOID              ibuf = NULL;
     ULONG              ibuf_len = 0;
     ULONG              info_bytes = 0;
+    NTSTATUS           status = STATUS_SUCCESS;
     drfifo_dev_t*      drfifo = (drfifo_dev_t*) dev->DeviceExtension;
+    fifo_reader_t*     reader;
 
 //  PAGED_CODE();
-    DbgPrint(DRIVER_NAME ": drfifo_handle_irp_read().");
-
     irp_stack = IoGetCurrentIrpStackLocation(irp);
+    reader   = (fifo_reader_t*) irp_stack->FileObject->FsContext;
     ibuf     = irp->AssociatedIrp.SystemBuffer;
     ibuf_len = irp_stack->Parameters.DeviceIoControl.OutputBufferLength;
-    DbgPrint(DRIVER_NAME ": drfifo_handle_irp_read(ibuf=0x%08lX,ibuf_len=%d).", (long) ibuf, ibuf_len);
+
+    if ((ibuf_len > 0) && drfifo->sink.enabled)
+    {
+        return irp_complete_failed(irp, FIFO_TRACE_READ_FAILED, STATUS_DEVICE_BUSY, ibuf_len);     // The sink is reading.
+    }
 
     if (ibuf_len > 0)
     {
         __try {
 //          ProbeForWrite(ibuf, ibuf_len, 1);   // Not necessary for DO_BUFFERED_IO.
-            DbgPrint(DRIVER_NAME ": drfifo_handle_irp_read() getting %d bytes.", ibuf_len);
-            info_bytes = drfifo_get(drfifo, ibuf, ibuf_len);
-            DbgPrint(DRIVER_NAME ": drfifo_handle_irp_read() info_bytes=%d.", info_bytes);
+            info_bytes = drfifo_get(drfifo, reader, ibuf, ibuf_len);
         }
         __except(1) {
-            DbgPrint(DRIVER_NAME ": drfifo_handle_irp_read() SEGFAULT.");
-            return irp_complete_event(irp, 0, STATUS_INVALID_ADDRESS);
+            return irp_complete_failed(irp, FIFO_TRACE_READ_FAILED, STATUS_INVALID_ADDRESS, ibuf_len);
+        }
+
+        if ((NULL != reader) && reader->more)
+        {
+            status = STATUS_BUFFER_OVERFLOW;    // The message goes on; data are still returned.
+        }
+
+        if (info_bytes > 0)
+        {
+            drfifo_spill_kick(drfifo);      // Room for spilled packets, maybe.
+            drfifo_persist_dirty(drfifo);
         }
     }
 
-    return irp_complete_event(irp, info_bytes, STATUS_SUCCESS);
+    FIFO_TRACE(FIFO_TRACE_IRPS, FIFO_TRACE_IRP_READ, info_bytes, ibuf_len);
+    return irp_complete_event(irp, info_bytes, status);
 }   /* drfifo_handle_irp_read() */
 
 /* ------------------------------------------------------------------------- */
@@ -278,37 +467,85 @@ NTSTATUS drfifo_handle_irp_write(IN PDEVICE_OBJECT dev, IN PIRP irp)
     PVOID              obuf = NULL;
     ULONG              obuf_len = 0;
     ULONG              info_bytes = 0;
+    size_t             record_bytes = 0;
     drfifo_dev_t*      drfifo = (drfifo_dev_t*) dev->DeviceExtension;
 
 //  PAGED_CODE();
-    DbgPrint(DRIVER_NAME ": drfifo_handle_irp_write().");
-
     irp_stack = IoGetCurrentIrpStackLocation(irp);
     obuf     = irp->AssociatedIrp.SystemBuffer;
     obuf_len = irp_stack->Parameters.DeviceIoControl.OutputBufferLength;
-    DbgPrint(DRIVER_NAME ": drfifo_handle_irp_write(obuf=0x%08lX,obuf_len=%d).", (unsigned long) obuf, obuf_len);
 
-    if (obuf_len > 0)
+    record_bytes = fifo_record_bytes(drfifo->fifo);
+
+    if ((record_bytes > 0) && (0 != (obuf_len % record_bytes)))
+    {
+        return irp_complete_failed(irp, FIFO_TRACE_WRITE_FAILED, STATUS_INVALID_PARAMETER, obuf_len);  // Not whole records.
+    }
+
+    if (fifo_is_topic_tagged(drfifo->fifo) && (obuf_len > 0) && (((const uint8_t*) obuf)[0] >= DRFIFO_TOPICS))
+    {
+        return irp_complete_failed(irp, FIFO_TRACE_WRITE_FAILED, STATUS_INVALID_PARAMETER, obuf_len);  // Topic out of range.
+    }
+
+    if ((obuf_len > 0) && drfifo_spill_active(drfifo) && (irp_stack->FileObject != drfifo->staging) &&
+        (irp_stack->FileObject != drfifo->fragmenting))
     {
-        if (obuf_len > fifo_bytes_to_put(drfifo->fifo))
+        NTSTATUS status = STATUS_SUCCESS;
+
+        __try {
+            status = drfifo_spill_put(drfifo, obuf, obuf_len);
+        }
+        __except(1) {
+            return irp_complete_failed(irp, FIFO_TRACE_WRITE_FAILED, STATUS_INVALID_ADDRESS, obuf_len);
+        }
+
+        if (!NT_SUCCESS(status))
         {
-            DbgPrint(DRIVER_NAME ": drfifo_handle_irp_write() no room in FIFO.");
-            return irp_complete_event(irp, 0, STATUS_INSUFFICIENT_RESOURCES);
+            return irp_complete_failed(irp, FIFO_TRACE_WRITE_FAILED, status, obuf_len);    // Could not put or spill.
         }
 
+        info_bytes = obuf_len;
+    }
+    else if (obuf_len > 0)
+    {
         __try {
 //          ProbeForRead(obuf, obuf_len, 1);     // Not necessary - and fails! - for DO_BUFFERED_IO.
 //          DbgPrint(DRIVER_NAME ": drfifo_handle_irp_write() putting %d bytes; %d available.",
 //                   obuf_len, fifo_bytes_to_put(drfifo->fifo));
-            info_bytes = drfifo_put(drfifo, obuf, obuf_len);
+            info_bytes = drfifo_put(drfifo, irp_stack->FileObject, obuf, obuf_len);
 //          DbgPrint(DRIVER_NAME ": drfifo_handle_irp_write() info_bytes=%d.", info_bytes);
         }
         __except(1) {
-            DbgPrint(DRIVER_NAME ": drfifo_handle_irp_write() SEGFAULT.");
-            return irp_complete_event(irp, 0, STATUS_INVALID_ADDRESS);
+            return irp_complete_failed(irp, FIFO_TRACE_WRITE_FAILED, STATUS_INVALID_ADDRESS, obuf_len);
+        }
+
+        if (0 == info_bytes)
+        {
+            PFILE_OBJECT staging = drfifo->staging;
+
+            if ((NULL != staging) && (irp_stack->FileObject != staging))
+            {
+                // Another handle has a transaction open.
+                return irp_complete_failed(irp, FIFO_TRACE_WRITE_FAILED, STATUS_DEVICE_BUSY, obuf_len);
+            }
+
+            if (fifo_is_fragmenting(drfifo->fifo) && (irp_stack->FileObject != drfifo->fragmenting))
+            {
+                // Another handle is part way through a message.
+                return irp_complete_failed(irp, FIFO_TRACE_WRITE_FAILED, STATUS_DEVICE_BUSY, obuf_len);
+            }
+
+            return irp_complete_failed(irp, FIFO_TRACE_WRITE_FAILED, STATUS_INSUFFICIENT_RESOURCES, obuf_len);  // No room.
         }
     }
 
+    if (info_bytes > 0)
+    {
+        drfifo_sink_kick(drfifo);       // A batch's worth, maybe.
+        drfifo_persist_dirty(drfifo);
+    }
+
+    FIFO_TRACE(FIFO_TRACE_IRPS, FIFO_TRACE_IRP_WRITE, info_bytes, obuf_len);
     return irp_complete_event(irp, info_bytes, STATUS_SUCCESS);
 }   /* drfifo_handle_irp_write() */
 
@@ -335,16 +572,13 @@ NTSTATUS drfifo_handle_irp_ioctl(IN PDEVICE_OBJECT dev, IN PIRP irp)
     KIRQL              level;
 
 //  PAGED_CODE();
-    DbgPrint(DRIVER_NAME ": drfifo_handle_irp_ioctl().");
-
     // Get a pointer to the current location in the Irp. This is where
     // the function codes and parameters are located.
     irp_stack = IoGetCurrentIrpStackLocation(irp);
 
     if (IRP_MJ_DEVICE_CONTROL != irp_stack->MajorFunction)
     {
-        DbgPrint(DRIVER_NAME ": ioctl(): invalid major function %d; should be IRP_MJ_DEVICE_CONTROL (%d).",
-                 (int) irp_stack->MajorFunction, (int) IRP_MJ_DEVICE_CONTROL);
+        FIFO_TRACE(FIFO_TRACE_IRPS, FIFO_TRACE_IRP_OTHER, 0, irp_stack->MajorFunction);
         return irp_complete_event(irp, 0, STATUS_INVALID_DEVICE_REQUEST);
     }
 
@@ -358,79 +592,569 @@ NTSTATUS drfifo_handle_irp_ioctl(IN PDEVICE_OBJECT dev, IN PIRP irp)
 
     if (IRP_MJ_DEVICE_CONTROL != irp_stack->MajorFunction)
     {
-        DbgPrint(DRIVER_NAME ": ioctl(): invalid major function %d; should be IRP_MJ_DEVICE_CONTROL (%d).",
-                 (int) irp_stack->MajorFunction, (int) IRP_MJ_DEVICE_CONTROL);
+        FIFO_TRACE(FIFO_TRACE_IRPS, FIFO_TRACE_IRP_OTHER, 0, irp_stack->MajorFunction);
         return irp_complete_event(irp, 0, STATUS_INVALID_DEVICE_REQUEST);
     }
 
-    DbgPrint(DRIVER_NAME ": ioctl(command=0x%08lX).", command);
-
     switch (command)
     {
     case DRFIFO_IOCTL_RESET:
         if (NULL == drfifo->fifo)
         {
-            DbgPrint(DRIVER_NAME ": ioctl(RESET) drfifo->fifo == NULL.");
             result = STATUS_DEVICE_NOT_READY;   // This is meant for removable disk drives (CDROMs), but I'll take it.
         }
         else
         {
-            DbgPrint(DRIVER_NAME ": ioctl(RESET) setting get_count %d and put_count %d to 0.",
-                     drfifo->fifo->get_count, drfifo->fifo->put_count);
-            KeAcquireSpinLock(&drfifo->lock, &level);
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_RESET);
             fifo_reset(drfifo->fifo);
-            KeReleaseSpinLock(&drfifo->lock, level);
+            drfifo_event_room(drfifo);
+            drfifo_unlock(drfifo, level);
         }
         break;
 
     case DRFIFO_IOCTL_FLUSH:
         if (NULL == drfifo->fifo)
         {
-            DbgPrint(DRIVER_NAME ": ioctl(FLUSH) drfifo->fifo == NULL.");
             result = STATUS_DEVICE_NOT_READY;
         }
         else
         {
-            DbgPrint(DRIVER_NAME ": ioctl(FLUSH) setting get_count %d to put_count %d.",
-                     drfifo->fifo->get_count, drfifo->fifo->put_count);
-            KeAcquireSpinLock(&drfifo->lock, &level);
-            drfifo->fifo->get_count = drfifo->fifo->put_count;
-            KeReleaseSpinLock(&drfifo->lock, level);
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_FLUSH);
+            fifo_flush(drfifo->fifo);
+            drfifo_event_room(drfifo);
+            drfifo_unlock(drfifo, level);
         }
         break;
 
     case DRFIFO_IOCTL_STATUS:
         if (obuf_len < sizeof(drfifo_ioctl_status_t))
         {
-            DbgPrint(DRIVER_NAME ": ioctl(STATUS) output buffer length too small (%d < %d).",
-                     obuf_len, sizeof(drfifo_ioctl_status_t));
             result = STATUS_INVALID_DEVICE_REQUEST;   // STATUS_INFO_LENGTH_MISMATCH isn't quite right.
         }
         else if (NULL == drfifo->fifo)
         {
-            DbgPrint(DRIVER_NAME ": ioctl(STATUS) drfifo->fifo == NULL.");
             result = STATUS_DEVICE_NOT_READY;
         }
         else
         {
             drfifo_ioctl_status_t* status = (drfifo_ioctl_status_t*) obuf;
-            DbgPrint(DRIVER_NAME ": ioctl(STATUS) getting status.");
-            KeAcquireSpinLock(&drfifo->lock, &level);
+            fifo_codec_stats_t     stats;
+            fifo_stats_t           damage;
+            fifo_slab_stats_t      slab;
+            LARGE_INTEGER          frequency;
+            size_t                 record_bytes;
+            size_t                 record_count;
+            size_t                 record_capacity;
+            uint64_t               readable_signals;
+            uint64_t               writable_signals;
+            uint64_t               timer_signals;
+            fifo_reader_t*         reader = (fifo_reader_t*) irp_stack->FileObject->FsContext;
+            size_t                 readers;
+            uint64_t               reader_evictions;
+            size_t                 staged_bytes;
+            uint64_t               put_sequence;
+            uint64_t               get_sequence;
+            uint64_t               retained_sequence;
+            KeQueryPerformanceCounter(&frequency);
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_STATUS);
             status->size  = drfifo->fifo->size;
             status->flags = drfifo->fifo->flags;
             status->put_count = drfifo->fifo->put_count;
             status->get_count = drfifo->fifo->get_count;
-            KeReleaseSpinLock(&drfifo->lock, level);
+            fifo_codec_stats(drfifo->fifo, &stats);
+            fifo_stats(drfifo->fifo, &damage);
+            record_bytes    = fifo_record_bytes(drfifo->fifo);
+            record_count    = fifo_records_to_get(drfifo->fifo);
+            record_capacity = fifo_records_capacity(drfifo->fifo);
+            readable_signals = drfifo->event.readable_signals;
+            writable_signals = drfifo->event.writable_signals;
+            timer_signals    = drfifo->event.timer_signals;
+            readers          = fifo_readers(drfifo->fifo);
+            reader_evictions = (NULL == reader) ? 0 : reader->evictions;
+            staged_bytes     = fifo_staged_bytes(drfifo->fifo);
+            put_sequence     = fifo_put_sequence(drfifo->fifo);
+            get_sequence     = fifo_reader_sequence(drfifo->fifo, reader);
+            retained_sequence = fifo_retained_sequence(drfifo->fifo);
+            fifo_slab_stats(drfifo->fifo->slab, &slab);
+            status->fragment_bytes = drfifo->fragment_bytes;
+            status->fragmenting    = fifo_is_fragmenting(drfifo->fifo);
+            status->ttl_ticks      = fifo_ttl_ticks(drfifo->fifo);
+            status->sink_bytes     = drfifo->sink.bytes;
+            status->sink_writes    = drfifo->sink.writes;
+            status->sink_errors    = drfifo->sink.errors;
+            status->sink_file      = drfifo->sink.file_number;
+            status->align_bytes    = fifo_align_bytes(drfifo->fifo);
+            status->page_bytes     = drfifo->fifo->page_bytes;
+            status->committed_bytes = fifo_bytes_committed(drfifo->fifo);
+            RtlCopyMemory(status->lock, drfifo->lock_profile.site, sizeof(status->lock));
+            drfifo_unlock(drfifo, level);
+            status->ticks_per_second     = (uint64_t) frequency.QuadPart;
+            status->codec_packets        = stats.packets;
+            status->codec_compressed     = stats.compressed;
+            status->codec_raw_bytes      = stats.raw_bytes;
+            status->codec_stored_bytes   = stats.stored_bytes;
+            status->codec_compress_ticks = stats.compress_ticks;
+            status->codec_expand_ticks   = stats.expand_ticks;
+            status->bad_packets          = damage.bad_packets;
+            status->resyncs              = damage.resyncs;
+            status->resync_bytes         = damage.resync_bytes;
+            status->record_bytes         = record_bytes;
+            status->record_count         = record_count;
+            status->record_capacity      = record_capacity;
+            status->readable_signals     = readable_signals;
+            status->writable_signals     = writable_signals;
+            status->timer_signals        = timer_signals;
+            status->readers              = readers;
+            status->evictions            = damage.evictions;
+            status->reader_evictions     = reader_evictions;
+            status->filtered             = damage.filtered;
+            status->staged_bytes         = staged_bytes;
+            status->put_sequence         = put_sequence;
+            status->get_sequence         = get_sequence;
+            status->retained_sequence    = retained_sequence;
+            status->indirect_buffers     = slab.buffers;
+            status->indirect_free        = slab.free;
+            status->indirect_exhausted   = slab.exhausted;
+            status->indirect_stale       = slab.stale;
+            status->expired              = damage.expired;
+            status->commits              = damage.commits;
+            status->decommits            = damage.decommits;
             info_bytes = sizeof(drfifo_ioctl_status_t);
         }
 
         break;
 
+    case DRFIFO_IOCTL_SPILL:
+        if (ibuf_len < sizeof(drfifo_ioctl_spill_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else
+        {
+            const drfifo_ioctl_spill_t* spill = (const drfifo_ioctl_spill_t*) ibuf;
+            result = drfifo_spill_config(drfifo, spill);
+        }
+        break;
+
+    case DRFIFO_IOCTL_SINK:
+        if (ibuf_len < sizeof(drfifo_ioctl_sink_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else
+        {
+            const drfifo_ioctl_sink_t* sink = (const drfifo_ioctl_sink_t*) ibuf;
+            result = drfifo_sink_config(drfifo, sink);
+        }
+        break;
+
+    case DRFIFO_IOCTL_ALIGN:
+        if (ibuf_len < sizeof(drfifo_ioctl_align_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else if (NULL == drfifo->fifo)
+        {
+            result = STATUS_DEVICE_NOT_READY;
+        }
+        else
+        {
+            const drfifo_ioctl_align_t* align = (const drfifo_ioctl_align_t*) ibuf;
+            size_t                      previous;
+            size_t                      current;
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+            previous = fifo_align(drfifo->fifo, align->align_bytes);
+            current  = fifo_align_bytes(drfifo->fifo);
+
+            if (previous != current)
+            {
+                drfifo_event_room(drfifo);
+            }
+
+            drfifo_unlock(drfifo, level);
+
+            if (current != ((1 == align->align_bytes) ? 0 : align->align_bytes))
+            {
+                result = STATUS_INVALID_PARAMETER;
+            }
+            else if (previous != current)
+            {
+                drfifo_spill_discard(drfifo);   // Spilled writes were framed for the old layout.
+            }
+        }
+        break;
+
+    case DRFIFO_IOCTL_PERSIST:
+        if (ibuf_len < sizeof(drfifo_ioctl_persist_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else
+        {
+            const drfifo_ioctl_persist_t* persist = (const drfifo_ioctl_persist_t*) ibuf;
+            result = drfifo_persist_config(drfifo, persist);
+        }
+        break;
+
+    case DRFIFO_IOCTL_CODEC:
+        if (ibuf_len < sizeof(drfifo_ioctl_codec_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else
+        {
+            const drfifo_ioctl_codec_t* codec = (const drfifo_ioctl_codec_t*) ibuf;
+            result = drfifo_codec_config(drfifo, codec);
+        }
+        break;
+
+    case DRFIFO_IOCTL_INDIRECT:
+        if (ibuf_len < sizeof(drfifo_ioctl_indirect_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else
+        {
+            const drfifo_ioctl_indirect_t* indirect = (const drfifo_ioctl_indirect_t*) ibuf;
+            result = drfifo_indirect_config(drfifo, indirect);
+        }
+        break;
+
+    case DRFIFO_IOCTL_FRAGMENT:
+        if (ibuf_len < sizeof(drfifo_ioctl_fragment_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else
+        {
+            const drfifo_ioctl_fragment_t* fragment = (const drfifo_ioctl_fragment_t*) ibuf;
+            result = drfifo_fragment_config(drfifo, fragment);
+        }
+        break;
+
+    case DRFIFO_IOCTL_CRC:
+        if (ibuf_len < sizeof(drfifo_ioctl_crc_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else if (NULL == drfifo->fifo)
+        {
+            result = STATUS_DEVICE_NOT_READY;
+        }
+        else
+        {
+            const drfifo_ioctl_crc_t* crc = (const drfifo_ioctl_crc_t*) ibuf;
+            int8_t                    previous;
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+            previous = fifo_crc_checked(drfifo->fifo, (int8_t) (0 != crc->enabled));
+            drfifo_unlock(drfifo, level);
+
+            if (previous != (0 != crc->enabled))
+            {
+                drfifo_spill_discard(drfifo);   // Spilled writes were framed for the old mode.
+            }
+        }
+        break;
+
+    case DRFIFO_IOCTL_RECORD:
+        if (ibuf_len < sizeof(drfifo_ioctl_record_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else if (NULL == drfifo->fifo)
+        {
+            result = STATUS_DEVICE_NOT_READY;
+        }
+        else if (((const drfifo_ioctl_record_t*) ibuf)->record_bytes > drfifo->fifo->size)
+        {
+            result = STATUS_INVALID_PARAMETER;
+        }
+        else
+        {
+            const drfifo_ioctl_record_t* record = (const drfifo_ioctl_record_t*) ibuf;
+            size_t                       previous;
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+            previous = fifo_record(drfifo->fifo, record->record_bytes);
+            drfifo_unlock(drfifo, level);
+
+            if (previous != record->record_bytes)
+            {
+                drfifo_spill_discard(drfifo);   // Spilled writes were framed for the old mode.
+            }
+        }
+        break;
+
+    case DRFIFO_IOCTL_EVENTS:
+        if (ibuf_len < sizeof(drfifo_ioctl_events_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else
+        {
+            const drfifo_ioctl_events_t* events = (const drfifo_ioctl_events_t*) ibuf;
+            result = drfifo_event_config(drfifo, events, irp->RequestorMode);
+        }
+        break;
+
+    case DRFIFO_IOCTL_WATERMARK:
+        if (ibuf_len < sizeof(drfifo_ioctl_watermark_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else
+        {
+            const drfifo_ioctl_watermark_t* watermark = (const drfifo_ioctl_watermark_t*) ibuf;
+            result = drfifo_event_watermark(drfifo, watermark);
+        }
+        break;
+
+    case DRFIFO_IOCTL_BROADCAST:
+        if (ibuf_len < sizeof(drfifo_ioctl_broadcast_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else if (NULL == drfifo->fifo)
+        {
+            result = STATUS_DEVICE_NOT_READY;
+        }
+        else if (((const drfifo_ioctl_broadcast_t*) ibuf)->enabled && drfifo->sink.enabled)
+        {
+            result = STATUS_DEVICE_BUSY;
+        }
+        else
+        {
+            const drfifo_ioctl_broadcast_t* broadcast = (const drfifo_ioctl_broadcast_t*) ibuf;
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+            fifo_broadcast(drfifo->fifo, (int8_t) (0 != broadcast->enabled), (int8_t) (0 != broadcast->evict));
+            drfifo_unlock(drfifo, level);
+        }
+        break;
+
+    case DRFIFO_IOCTL_TOPICS:
+        if (ibuf_len < sizeof(drfifo_ioctl_topics_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else if (NULL == drfifo->fifo)
+        {
+            result = STATUS_DEVICE_NOT_READY;
+        }
+        else
+        {
+            const drfifo_ioctl_topics_t* topics = (const drfifo_ioctl_topics_t*) ibuf;
+            int8_t                       previous;
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+            previous = fifo_topic_tagged(drfifo->fifo, (int8_t) (0 != topics->enabled));
+            drfifo_event_room(drfifo);
+            drfifo_unlock(drfifo, level);
+
+            if (previous != (0 != topics->enabled))
+            {
+                drfifo_spill_discard(drfifo);   // Spilled writes were framed for the old mode.
+            }
+        }
+        break;
+
+    case DRFIFO_IOCTL_DEADLINE:
+        if (ibuf_len < sizeof(drfifo_ioctl_deadline_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else if (NULL == drfifo->fifo)
+        {
+            result = STATUS_DEVICE_NOT_READY;
+        }
+        else
+        {
+            const drfifo_ioctl_deadline_t* deadline = (const drfifo_ioctl_deadline_t*) ibuf;
+            LARGE_INTEGER                  frequency;
+            uint64_t                       ttl_ticks;
+            uint64_t                       previous;
+            KeQueryPerformanceCounter(&frequency);
+            ttl_ticks = ((uint64_t) deadline->ttl_us * (uint64_t) frequency.QuadPart) / 1000000;
+            ttl_ticks += (0 == ttl_ticks) && (0 != deadline->ttl_us);      // Never round a deadline away.
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+            previous = fifo_ttl(drfifo->fifo, ttl_ticks);
+            drfifo_event_room(drfifo);
+            drfifo_unlock(drfifo, level);
+
+            if ((0 != previous) != (0 != ttl_ticks))
+            {
+                drfifo_spill_discard(drfifo);   // Spilled writes were framed for the old mode.
+            }
+        }
+        break;
+
+    case DRFIFO_IOCTL_SUBSCRIBE:
+        if (ibuf_len < sizeof(drfifo_ioctl_subscribe_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else if (NULL == irp_stack->FileObject->FsContext)
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else
+        {
+            const drfifo_ioctl_subscribe_t* subscribe = (const drfifo_ioctl_subscribe_t*) ibuf;
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+            ((fifo_reader_t*) irp_stack->FileObject->FsContext)->topics = (uint32_t) subscribe->topics;
+            drfifo_unlock(drfifo, level);
+        }
+        break;
+
+    case DRFIFO_IOCTL_RETAIN:
+        if (ibuf_len < sizeof(drfifo_ioctl_retain_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else if (NULL == drfifo->fifo)
+        {
+            result = STATUS_DEVICE_NOT_READY;
+        }
+        else if (((const drfifo_ioctl_retain_t*) ibuf)->enabled && drfifo->sink.enabled)
+        {
+            result = STATUS_DEVICE_BUSY;
+        }
+        else
+        {
+            const drfifo_ioctl_retain_t* retain = (const drfifo_ioctl_retain_t*) ibuf;
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+            fifo_retain(drfifo->fifo, (int8_t) (0 != retain->enabled));
+            drfifo_unlock(drfifo, level);
+        }
+        break;
+
+    case DRFIFO_IOCTL_SEEK:
+        if (ibuf_len < sizeof(drfifo_ioctl_seek_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else if (NULL == drfifo->fifo)
+        {
+            result = STATUS_DEVICE_NOT_READY;
+        }
+        else
+        {
+            const drfifo_ioctl_seek_t* seek = (const drfifo_ioctl_seek_t*) ibuf;
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+
+            if (!fifo_reader_seek(drfifo->fifo, (fifo_reader_t*) irp_stack->FileObject->FsContext, seek->sequence))
+            {
+                result = STATUS_INVALID_PARAMETER;
+            }
+
+            drfifo_event_room(drfifo);      // A seek forward frees room.
+            drfifo_unlock(drfifo, level);
+        }
+        break;
+
+    case DRFIFO_IOCTL_TRACE:
+        if (obuf_len < sizeof(drfifo_ioctl_trace_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else
+        {
+            drfifo_ioctl_trace_t* trace = (drfifo_ioctl_trace_t*) obuf;
+            const int8_t          clear = (ibuf_len >= sizeof(ulong_t)) && (0 != trace->clear);    // Input shares obuf.
+            LARGE_INTEGER         frequency;
+
+            KeQueryPerformanceCounter(&frequency);
+            trace->level = FIFO_TRACE_LEVEL;
+            trace->count = (ulong_t) fifo_trace_read((fifo_trace_event_t*) &trace[1],
+                                                     (obuf_len - sizeof(*trace)) / sizeof(fifo_trace_event_t), clear);
+            trace->clear = clear;
+            trace->ticks_per_second = (uint64_t) frequency.QuadPart;
+            info_bytes = sizeof(*trace) + (trace->count * sizeof(fifo_trace_event_t));
+        }
+        break;
+
+    case DRFIFO_IOCTL_TRANSACTION:
+        if (ibuf_len < sizeof(drfifo_ioctl_transaction_t))
+        {
+            result = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        else if (NULL == drfifo->fifo)
+        {
+            result = STATUS_DEVICE_NOT_READY;
+        }
+        else
+        {
+            const drfifo_ioctl_transaction_t* transaction = (const drfifo_ioctl_transaction_t*) ibuf;
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+
+            if (DRFIFO_TRANSACTION_BEGIN == transaction->action)
+            {
+                if ((NULL != drfifo->staging) || !fifo_begin(drfifo->fifo))
+                {
+                    result = STATUS_DEVICE_BUSY;
+                }
+                else
+                {
+                    drfifo->staging = irp_stack->FileObject;
+                }
+            }
+            else if ((DRFIFO_TRANSACTION_COMMIT != transaction->action) &&
+                     (DRFIFO_TRANSACTION_ABORT != transaction->action))
+            {
+                result = STATUS_INVALID_PARAMETER;
+            }
+            else if (irp_stack->FileObject != drfifo->staging)
+            {
+                result = STATUS_INVALID_DEVICE_STATE;       // Not this handle's transaction.
+            }
+            else
+            {
+                if (DRFIFO_TRANSACTION_COMMIT == transaction->action)
+                {
+                    drfifo_event_commit(drfifo);
+                }
+                else
+                {
+                    fifo_abort(drfifo->fifo);
+                    drfifo_event_room(drfifo);
+                }
+
+                drfifo->staging = NULL;
+            }
+
+            drfifo_unlock(drfifo, level);
+
+            if (NT_SUCCESS(result) && (DRFIFO_TRANSACTION_BEGIN != transaction->action))
+            {
+                drfifo_spill_kick(drfifo);      // Writes spilled while it was open may go in now.
+            }
+        }
+        break;
+
     default:
-        DbgPrint(DRIVER_NAME ": ioctl() invalid command 0x%08lX.", command);
         result = STATUS_INVALID_DEVICE_REQUEST;
     }   // switch on command
 
+    if (NT_SUCCESS(result) && ((DRFIFO_IOCTL_RESET == command) || (DRFIFO_IOCTL_FLUSH == command)))
+    {
+        drfifo_spill_discard(drfifo);
+    }
+
+    if (NT_SUCCESS(result) &&
+        ((DRFIFO_IOCTL_RESET == command) || (DRFIFO_IOCTL_FLUSH == command) ||
+         (DRFIFO_IOCTL_CODEC == command) || (DRFIFO_IOCTL_CRC == command) ||
+         (DRFIFO_IOCTL_RECORD == command) || (DRFIFO_IOCTL_TOPICS == command) ||
+         (DRFIFO_IOCTL_TRANSACTION == command) || (DRFIFO_IOCTL_RETAIN == command) ||
+         (DRFIFO_IOCTL_SEEK == command) || (DRFIFO_IOCTL_INDIRECT == command) ||
+         (DRFIFO_IOCTL_FRAGMENT == command) || (DRFIFO_IOCTL_DEADLINE == command) ||
+         (DRFIFO_IOCTL_ALIGN == command)))
+    {
+        drfifo_persist_dirty(drfifo);
+    }
+
+    if (!NT_SUCCESS(result))
+    {
+        FIFO_TRACE(FIFO_TRACE_ERRORS, FIFO_TRACE_IOCTL_FAILED, (ULONG) result, command);
+    }
+
+    FIFO_TRACE(FIFO_TRACE_IRPS, FIFO_TRACE_IRP_IOCTL, info_bytes, command);
     return irp_complete_event(irp, info_bytes, result);
 }   /* drfifo_handle_irp_ioctl() */
 
@@ -445,8 +1169,36 @@ NTSTATUS drfifo_handle_irp_ioctl(IN PDEVICE_OBJECT dev, IN PIRP irp)
  */
 NTSTATUS drfifo_handle_irp_close(IN PDEVICE_OBJECT dev, IN PIRP irp)
 {
+    PIO_STACK_LOCATION irp_stack = IoGetCurrentIrpStackLocation(irp);
+    drfifo_dev_t*      drfifo = (drfifo_dev_t*) dev->DeviceExtension;
+    fifo_reader_t*     reader = (fifo_reader_t*) irp_stack->FileObject->FsContext;
+    KIRQL              level;
 //  PAGED_CODE();
-    DbgPrint(DRIVER_NAME ": drfifo_handle_irp_close()\r\n");
+    FIFO_TRACE(FIFO_TRACE_IRPS, FIFO_TRACE_IRP_CLOSE, 0, 0);
+
+    if (NULL != reader)
+    {
+        drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+        fifo_reader_remove(drfifo->fifo, reader);     // Frees whatever only it held.
+
+        if (irp_stack->FileObject == drfifo->staging)
+        {
+            fifo_abort(drfifo->fifo);                 // Never committed.
+            drfifo->staging = NULL;
+        }
+
+        if (fifo_is_fragmenting(drfifo->fifo) && (irp_stack->FileObject == drfifo->fragmenting))
+        {
+            fifo_put_fragments(drfifo->fifo, drfifo->fragment_topic, NULL, 0, 0, 0);   // Never finished.
+            drfifo->fragmenting = NULL;
+        }
+
+        drfifo_event_room(drfifo);
+        drfifo_unlock(drfifo, level);
+        irp_stack->FileObject->FsContext = NULL;
+        ExFreePoolWithTag(reader, DRFIFO_POOL_TAG);
+    }
+
     return irp_complete_event(irp, 0, STATUS_SUCCESS);
 }   /* drfifo_handle_irp_close() */
 
@@ -485,14 +1237,20 @@ NTSTATUS drfifo_driver_unload(IN PDRIVER_OBJECT drv)
         }
         else
         {
-            KeAcquireSpinLock(&drfifo->lock, &level);
+            drfifo_sink_exit(drfifo);
+            drfifo_spill_exit(drfifo);
+            drfifo_persist_exit(drfifo);
+            KeCancelTimer(&drfifo->decommit_timer);
+            drfifo_event_exit(drfifo);      // Flushes queued DPCs, the decommit one too.
+            drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
             fifo_del(&drfifo->fifo);
-            KeReleaseSpinLock(&drfifo->lock, level);
+            drfifo_unlock(drfifo, level);
         }
 
         IoDeleteDevice(g_dev);
     }
 
+    fifo_trace_exit();
     return STATUS_SUCCESS;
 }   /* drfifo_driver_unload() */
 
@@ -567,6 +1325,85 @@ VOID append_time_to_file(PDEVICE_OBJECT DeviceObject,
     }
 }   /* append_time_to_file() */
 
+/* ------------------------------------------------------------------------- */
+/**
+ * Reads the optional DWORD values Size, PageBytes and IdleMs from the
+ * Parameters key under the driver's @a registry_path, setting the FIFO
+ * size in @a size and the sparse settings in @a drfifo. Missing values - or
+ * a missing key - leave the defaults: a dense FIFO of DRFIFO_DEFAULT_SIZE.
+ */
+static void drfifo_registry_config(drfifo_dev_t* drfifo, PUNICODE_STRING registry_path, size_t* size)
+{
+    RTL_QUERY_REGISTRY_TABLE table[5];
+    ULONG                    size_value = DRFIFO_DEFAULT_SIZE;
+    ULONG                    page_bytes = 0;
+    ULONG                    idle_ms = DRFIFO_IDLE_MS;
+    ULONG                    flags = RTL_QUERY_REGISTRY_DIRECT;
+
+#if defined(RTL_QUERY_REGISTRY_TYPECHECK)
+    flags |= RTL_QUERY_REGISTRY_TYPECHECK | (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT);
+#endif
+
+    RtlZeroMemory(table, sizeof(table));
+    table[0].Flags        = RTL_QUERY_REGISTRY_SUBKEY;
+    table[0].Name         = L"Parameters";
+    table[1].Flags        = flags;
+    table[1].Name         = L"Size";
+    table[1].EntryContext = &size_value;
+    table[1].DefaultType  = REG_NONE;
+    table[2].Flags        = flags;
+    table[2].Name         = L"PageBytes";
+    table[2].EntryContext = &page_bytes;
+    table[2].DefaultType  = REG_NONE;
+    table[3].Flags        = flags;
+    table[3].Name         = L"IdleMs";
+    table[3].EntryContext = &idle_ms;
+    table[3].DefaultType  = REG_NONE;
+    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, registry_path->Buffer, table, NULL, NULL);
+
+    *size = size_value ? size_value : DRFIFO_DEFAULT_SIZE;
+    drfifo->page_bytes = page_bytes;
+    drfifo->idle_ms    = idle_ms;
+}   /* drfifo_registry_config() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Creates the device's FIFO of @a size bytes: sparse, with pages of
+ * drfifo->page_bytes freed after lying drained for drfifo->idle_ms, if the
+ * registry set PageBytes; otherwise dense.
+ *
+ * @return the new FIFO, or NULL if out of memory.
+ */
+fifo_t* drfifo_fifo_new(drfifo_dev_t* drfifo, size_t size)
+{
+    LARGE_INTEGER frequency;
+
+    if (0 == drfifo->page_bytes)
+    {
+        return fifo_new(size);
+    }
+
+    KeQueryPerformanceCounter(&frequency);
+    return fifo_new_sparse(size, drfifo->page_bytes,
+                           ((uint64_t) drfifo->idle_ms * (uint64_t) frequency.QuadPart) / 1000);
+}   /* drfifo_fifo_new() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Decommit timer DPC: frees the pages of a sparse FIFO that have lain
+ * drained for its idle time. Gets do this themselves as they finish pages;
+ * the timer catches the pages left when traffic stops.
+ */
+KDEFERRED_ROUTINE drfifo_decommit_dpc;
+VOID drfifo_decommit_dpc(PKDPC dpc, PVOID context, PVOID arg1, PVOID arg2)
+{
+    drfifo_dev_t* drfifo = (drfifo_dev_t*) context;
+
+    drfifo_lock_at_dpc(drfifo, DRFIFO_LOCK_OTHER);
+    fifo_decommit(drfifo->fifo);
+    drfifo_unlock_from_dpc(drfifo);
+}   /* drfifo_decommit_dpc() */
+
 /* ------------------------------------------------------------------------- */
 /**
  * Entry point for driver.
@@ -584,9 +1421,15 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT drv, IN PUNICODE_STRING registry_path)
     UNICODE_STRING device_link_unicode;
     NTSTATUS result = 0;
     drfifo_dev_t* drfifo = NULL;
+    size_t size = DRFIFO_DEFAULT_SIZE;
 
     DbgPrint(DRIVER_NAME ": Loading driver.\r\n");
 
+    if (!fifo_trace_init())
+    {
+        DbgPrint("%s: Could not allocate the trace rings; tracing is off.\r\n", DRIVER_NAME);
+    }
+
     drv->DriverUnload = drfifo_driver_unload;
 
     irp_handler_set_default(drv, drfifo_handle_irp_default);
@@ -662,10 +1505,40 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT drv, IN PUNICODE_STRING registry_path)
     }
 
     KeInitializeSpinLock(&drfifo->lock);
-    drfifo->fifo = fifo_new(0x0800);
-    fifo_packetized(drfifo->fifo, 1);
+    KeInitializeTimer(&drfifo->decommit_timer);
+    KeInitializeDpc(&drfifo->decommit_dpc, drfifo_decommit_dpc, drfifo);
+    drfifo_persist_init(drfifo, g_dev);
+    drfifo_spill_init(drfifo, g_dev);
+    drfifo_sink_init(drfifo, g_dev);
+    drfifo_event_init(drfifo);
+    drfifo_registry_config(drfifo, registry_path, &size);
+    drfifo->fifo = drfifo_persist_load(drfifo);
+
+    if (NULL == drfifo->fifo)
+    {
+        drfifo->fifo = drfifo_fifo_new(drfifo, size);
+        fifo_packetized(drfifo->fifo, 1);
+
+        if (NULL == drfifo->fifo)
+        {
+            DbgPrint("%s: Could not allocate a %u-byte FIFO.\r\n", DRIVER_NAME, (unsigned) size);
+        }
+    }
+    else if (fifo_is_compressed(drfifo->fifo))
+    {
+        // The image holds compressed packets; a codec is needed to read them.
+        fifo_codec(drfifo->fifo, fifo_codec_new(drfifo->fifo->size, DRFIFO_CODEC_THRESHOLD));
+    }
+
 //  fifo_all_or_nothing_set(drfifo->fifo, 1);
 
+    if ((NULL != drfifo->fifo) && (drfifo->fifo->page_bytes > 0) && (drfifo->idle_ms > 0))
+    {
+        LARGE_INTEGER due;
+        due.QuadPart = -10 * 1000 * (LONGLONG) drfifo->idle_ms;
+        KeSetTimerEx(&drfifo->decommit_timer, due, (LONG) drfifo->idle_ms, &drfifo->decommit_dpc);
+    }
+
     {
         drfifo->work_item = IoAllocateWorkItem(g_dev);
 
@@ -6,6 +6,95 @@
 
 #include <ntddk.h>
 
+#include "drfifo_stdint.h"
+#include "drfifo_event.h"
+#include "drfifo_lock.h"
+#include "drfifo_persist.h"
+#include "drfifo_spill.h"
+#include "drfifo_sink.h"
+#include "fifo.h"
+
+//#ifdef UNICODE
+#define M_T(_s) L ## _s
+//#else
+//#define M_T(_s) _s
+//#endif
+
+/**
+ * The name of this driver.
+ */
+#define DRIVER_NAME   "drfifo"
+
+/**
+ * The name of this driver, possibly in wide char.
+ */
+#define T_DRIVER_NAME   M_T("drfifo")
+
+/**
+ * Tag for pool allocations made by this driver; shows as "drfo" in pool
+ * dumps.
+ */
+#define DRFIFO_POOL_TAG   'ofrd'
+
+/**
+ * Size of the FIFO created when the driver loads without an image, unless
+ * the Size value of the service's Parameters key gives another.
+ */
+#define DRFIFO_DEFAULT_SIZE   0x0800
+
+/**
+ * How long, in milliseconds, a page of a sparse FIFO stays drained before
+ * it is freed, unless the IdleMs value of the Parameters key gives another.
+ * The FIFO is sparse only if the PageBytes value is set; see
+ * drfifo_fifo_new().
+ */
+#define DRFIFO_IDLE_MS   1000
+
+/**
+ * Compression threshold used when none is given, or when a compressed FIFO
+ * is restored from its image.
+ */
+#define DRFIFO_CODEC_THRESHOLD   64
+
+/**
+ * Indirect pool settings used when none are given; see
+ * DRFIFO_IOCTL_INDIRECT.
+ */
+#define DRFIFO_INDIRECT_BUFFERS        16
+#define DRFIFO_INDIRECT_BUFFER_BYTES   0x40000
+#define DRFIFO_INDIRECT_THRESHOLD      512
+
+/**
+ * Fragment size used when none is given; see DRFIFO_IOCTL_FRAGMENT. A
+ * quarter of the default FIFO, so several fragments are in flight at once.
+ */
+#define DRFIFO_FRAGMENT_BYTES   0x0200
+
+/**
+ * Structure holding private data for a device that's handled by our driver.
+ */
+typedef struct drfifo_dev_s
+{
+    KSPIN_LOCK   lock;          /**< General lock, used mostly to protect the FIFO. */
+    drfifo_lock_profile_t lock_profile;     /**< Profile of lock, when DRFIFO_LOCK_PROFILE is set. */
+    fifo_t*      fifo;          /**< FIFO object. */
+    PIO_WORKITEM work_item;     /**< Work item for writing to file. */
+    drfifo_persist_t persist;   /**< Image file state. */
+    drfifo_spill_t   spill;     /**< Spill-to-disk state. */
+    drfifo_sink_t    sink;      /**< Drain-to-file state. */
+    drfifo_event_t   event;     /**< Readiness events. */
+    PFILE_OBJECT     staging;   /**< Handle with an open transaction, or NULL; see DRFIFO_IOCTL_TRANSACTION. */
+    PFILE_OBJECT     fragmenting;   /**< Handle part way through a message, while fifo_is_fragmenting(). */
+    size_t           fragment_bytes;   /**< Largest fragment written; 0 when fragmentation is off. */
+    uint32_t         fragment_topic;   /**< Topic of the message part way written. */
+    size_t           page_bytes;    /**< Page size of a sparse FIFO, from the registry; 0 for a dense one. */
+    ulong_t          idle_ms;       /**< Time a sparse FIFO's page stays drained before it is freed. */
+    KTIMER           decommit_timer;    /**< Frees a sparse FIFO's idle pages once traffic stops. */
+    KDPC             decommit_dpc;      /**< Runs drfifo_decommit_dpc() for decommit_timer. */
+} drfifo_dev_t;
+
+fifo_t* drfifo_fifo_new(drfifo_dev_t* drfifo, size_t size);   // Sparse if the registry says so.
+
 DRIVER_INITIALIZE DriverEntry;
 DRIVER_UNLOAD     drfifo_unload;
 
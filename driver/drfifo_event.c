@@ -0,0 +1,458 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#include <ntddk.h>
+
+#include "drfifo.h"
+#include "drfifo_stdint.h"
+#include "drfifo_ioctl.h"
+#include "drfifo_event.h"
+#include "fifo.h"
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Max-delay timer DPC: signals the readable event for data that have
+ * waited below the low watermark since the timer was armed.
+ */
+KDEFERRED_ROUTINE drfifo_event_timer;
+VOID drfifo_event_timer(PKDPC dpc, PVOID context, PVOID arg1, PVOID arg2)
+{
+    drfifo_dev_t* drfifo = (drfifo_dev_t*) context;
+
+    drfifo_lock_at_dpc(drfifo, DRFIFO_LOCK_OTHER);
+
+    if (drfifo->event.timer_armed)
+    {
+        drfifo->event.timer_armed = 0;
+
+        if ((NULL != drfifo->event.readable) && (NULL != drfifo->fifo) &&
+            (drfifo->fifo->put_count != drfifo->fifo->get_count))
+        {
+            drfifo->event.timer_signals++;
+            KeSetEvent(drfifo->event.readable, IO_NO_INCREMENT, FALSE);
+        }
+    }
+
+    drfifo_unlock_from_dpc(drfifo);
+}   /* drfifo_event_timer() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Signals the readable event if @a bytes to get have reached the low
+ * watermark; otherwise starts the max-delay timer, if there is one, for any
+ * data below it. Called with the FIFO lock held.
+ */
+static void drfifo_event_check_readable(drfifo_dev_t* drfifo, size_t bytes)
+{
+    drfifo_event_t* event = &drfifo->event;
+
+    if (bytes >= event->low_watermark)
+    {
+        event->readable_signals++;
+        KeSetEvent(event->readable, IO_NO_INCREMENT, FALSE);
+
+        if (event->timer_armed)
+        {
+            event->timer_armed = 0;
+            KeCancelTimer(&event->timer);
+        }
+    }
+    else if ((0 != event->max_delay.QuadPart) && !event->timer_armed &&
+             (drfifo->fifo->put_count != drfifo->fifo->get_count))
+    {
+        event->timer_armed = 1;
+        KeSetTimer(&event->timer, event->max_delay, &event->dpc);
+    }
+}   /* drfifo_event_check_readable() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Picks the position whose bytes to get decide whether a put signals the
+ * readable event: the FIFO's own, or in broadcast mode the active reader
+ * with the most to get that is still below the low watermark - the next to
+ * reach it. A fast reader that has caught up waits on the event while
+ * slower ones still have data, so the shared get position, the slowest
+ * reader's, won't do. Called with the FIFO lock held.
+ *
+ * @return 1 with the position in @a waiter - NULL for the FIFO's own - or 0
+ * if no event is registered or every position is at or above the low
+ * watermark already, so that a put needn't check.
+ */
+static int drfifo_event_waiter(drfifo_dev_t* drfifo, fifo_reader_t** waiter)
+{
+    const size_t   low = drfifo->event.low_watermark;
+    fifo_reader_t* reader;
+    size_t         most = 0;
+    int            found = 0;
+
+    *waiter = NULL;
+
+    if (NULL == drfifo->event.readable)
+    {
+        return 0;
+    }
+
+    if (!fifo_is_broadcast(drfifo->fifo) || (NULL == drfifo->fifo->readers))
+    {
+        return (fifo_bytes_to_get(drfifo->fifo) < low);
+    }
+
+    for (reader = drfifo->fifo->readers; NULL != reader; reader = reader->next)
+    {
+        const size_t bytes = fifo_reader_bytes_to_get(drfifo->fifo, reader);
+
+        if ((bytes < low) && (!found || (bytes >= most)))
+        {
+            found   = 1;
+            most    = bytes;
+            *waiter = reader;
+        }
+    }
+
+    return found;
+}   /* drfifo_event_waiter() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Initializes the readiness event state of @a drfifo; no events are
+ * registered until DRFIFO_IOCTL_EVENTS, and both watermarks start at 1 byte
+ * with no max-delay timer.
+ */
+void drfifo_event_init(drfifo_dev_t* drfifo)
+{
+    RtlZeroMemory(&drfifo->event, sizeof(drfifo->event));
+    drfifo->event.low_watermark  = 1;
+    drfifo->event.high_watermark = 1;
+    KeInitializeTimer(&drfifo->event.timer);
+    KeInitializeDpc(&drfifo->event.dpc, drfifo_event_timer, drfifo);
+}   /* drfifo_event_init() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Stops the max-delay timer and releases the registered events when the
+ * driver unloads.
+ */
+void drfifo_event_exit(drfifo_dev_t* drfifo)
+{
+    drfifo_ioctl_events_t none;
+
+    KeCancelTimer(&drfifo->event.timer);
+    KeFlushQueuedDpcs();
+    RtlZeroMemory(&none, sizeof(none));
+    drfifo_event_config(drfifo, &none, KernelMode);
+}   /* drfifo_event_exit() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Handles DRFIFO_IOCTL_EVENTS: references the caller's event objects and
+ * swaps them in for any registered before, which are released. An event
+ * whose condition already holds is signalled at once, so a waiter that
+ * registers late doesn't miss the transition. Must be called at
+ * PASSIVE_LEVEL in the context of the process that owns the handles.
+ *
+ * @param drfifo - device of interest.
+ * @param config - event handles; NULL handles unregister.
+ * @param mode - requestor mode, for checking the handles.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_DEVICE_NOT_READY when
+ * registering with no FIFO, something else otherwise.
+ */
+NTSTATUS drfifo_event_config(drfifo_dev_t* drfifo, const drfifo_ioctl_events_t* config, KPROCESSOR_MODE mode)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PKEVENT  readable = NULL;
+    PKEVENT  writable = NULL;
+    PKEVENT  old_readable;
+    PKEVENT  old_writable;
+    KIRQL    level;
+
+    if ((NULL == drfifo->fifo) && ((NULL != config->readable) || (NULL != config->writable)))
+    {
+        return STATUS_DEVICE_NOT_READY;         // Unregistering is fine, as at unload.
+    }
+
+    if (NULL != config->readable)
+    {
+        status = ObReferenceObjectByHandle(config->readable, EVENT_MODIFY_STATE, *ExEventObjectType, mode,
+                                           (PVOID*) &readable, NULL);
+    }
+
+    if (NT_SUCCESS(status) && (NULL != config->writable))
+    {
+        status = ObReferenceObjectByHandle(config->writable, EVENT_MODIFY_STATE, *ExEventObjectType, mode,
+                                           (PVOID*) &writable, NULL);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        if (NULL != readable)
+        {
+            ObDereferenceObject(readable);
+        }
+
+        return status;
+    }
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    old_readable = drfifo->event.readable;
+    old_writable = drfifo->event.writable;
+    drfifo->event.readable = readable;
+    drfifo->event.writable = writable;
+    drfifo->event.refused  = 0;
+
+    if ((NULL != readable) && (NULL != drfifo->fifo))
+    {
+        drfifo_event_check_readable(drfifo, fifo_bytes_to_get(drfifo->fifo));
+    }
+
+    if ((NULL != writable) && (NULL != drfifo->fifo) &&
+        (fifo_bytes_to_put(drfifo->fifo) >= drfifo->event.high_watermark))
+    {
+        KeSetEvent(writable, IO_NO_INCREMENT, FALSE);
+    }
+
+    drfifo_unlock(drfifo, level);
+
+    if (NULL != old_readable)
+    {
+        ObDereferenceObject(old_readable);
+    }
+
+    if (NULL != old_writable)
+    {
+        ObDereferenceObject(old_writable);
+    }
+
+    return STATUS_SUCCESS;
+}   /* drfifo_event_config() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Handles DRFIFO_IOCTL_WATERMARK: sets the thresholds for the readiness
+ * events, then checks them against the FIFO as it stands, so that data
+ * already waiting are not stranded below a raised low watermark.
+ *
+ * @param drfifo - device of interest.
+ * @param config - watermarks and max delay.
+ *
+ * @return STATUS_SUCCESS on success, something else otherwise.
+ */
+NTSTATUS drfifo_event_watermark(drfifo_dev_t* drfifo, const drfifo_ioctl_watermark_t* config)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    size_t   low  = (0 == config->low_bytes)  ? 1 : config->low_bytes;
+    size_t   high = (0 == config->high_bytes) ? 1 : config->high_bytes;
+    KIRQL    level;
+
+    if (NULL == drfifo->fifo)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+
+    if ((low > fifo_bytes_capacity(drfifo->fifo)) || (high > fifo_bytes_capacity(drfifo->fifo)))
+    {
+        status = STATUS_INVALID_PARAMETER;      // Neither could ever be reached.
+    }
+    else
+    {
+        drfifo->event.low_watermark  = low;
+        drfifo->event.high_watermark = high;
+        drfifo->event.max_delay.QuadPart = -10 * 1000 * (LONGLONG) config->max_delay_ms;   // Relative.
+
+        if (drfifo->event.timer_armed)
+        {
+            drfifo->event.timer_armed = 0;
+            KeCancelTimer(&drfifo->event.timer);
+        }
+
+        if (NULL != drfifo->event.readable)
+        {
+            drfifo_event_check_readable(drfifo, fifo_bytes_to_get(drfifo->fifo));
+        }
+
+        drfifo_event_room(drfifo);
+    }
+
+    drfifo_unlock(drfifo, level);
+    return status;
+}   /* drfifo_event_watermark() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Puts a whole packet into the FIFO, as fifo_put_packet(). With topics on,
+ * the first byte of @a data is the packet's topic (see
+ * DRFIFO_IOCTL_TOPICS).
+ *
+ * @return the number of bytes put, topic byte included; 0 if there was no
+ * room.
+ */
+static ssize_t drfifo_event_put_packet(drfifo_dev_t* drfifo, const void* data, size_t bytes)
+{
+    ssize_t bytes_put;
+
+    if (!fifo_is_topic_tagged(drfifo->fifo))
+    {
+        bytes_put = fifo_put_packet(drfifo->fifo, data, bytes);
+    }
+    else if (bytes < 2)
+    {
+        bytes_put = 0;      // No packet after the topic.
+    }
+    else
+    {
+        const uint8_t* tagged = (const uint8_t*) data;
+        bytes_put = fifo_put_topic(drfifo->fifo, tagged[0], &tagged[1], bytes - 1);
+        bytes_put += (bytes_put > 0);
+    }
+
+    return bytes_put;
+}   /* drfifo_event_put_packet() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Puts a whole packet into the FIFO, as fifo_put_packet(), and signals the
+ * readable event if the bytes to get rose to the low watermark, or starts
+ * the max-delay timer if they are still below it. With topics on, the first
+ * byte of @a data is the packet's topic (see DRFIFO_IOCTL_TOPICS). While a
+ * transaction is open nothing but drfifo_event_stage() may put, so this
+ * finds no room. Called with the FIFO lock held.
+ *
+ * @return the number of bytes put, topic byte included; 0 if there was no
+ * room.
+ */
+ssize_t drfifo_event_put(drfifo_dev_t* drfifo, const void* data, size_t bytes)
+{
+    fifo_reader_t* waiter;
+    const int      waiting = drfifo_event_waiter(drfifo, &waiter);
+    ssize_t        bytes_put = 0;
+
+    if (!fifo_is_staging(drfifo->fifo))
+    {
+        bytes_put = drfifo_event_put_packet(drfifo, data, bytes);
+    }
+
+    if ((bytes_put > 0) && waiting)
+    {
+        drfifo_event_check_readable(drfifo, fifo_reader_bytes_to_get(drfifo->fifo, waiter));
+    }
+
+    return bytes_put;
+}   /* drfifo_event_put() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Puts as much of a message as fits into the FIFO, as fragments of
+ * drfifo->fragment_bytes (see DRFIFO_IOCTL_FRAGMENT), signalling the
+ * readable event as drfifo_event_put() does. A write by @a file while it is
+ * part way through a message carries on with the message; any other write
+ * starts one, its first byte being the topic when topics are on. Called with
+ * the FIFO lock held.
+ *
+ * @return the number of bytes put, topic byte included; 0 if there was no
+ * room, or another handle is part way through a message.
+ */
+ssize_t drfifo_event_put_fragments(drfifo_dev_t* drfifo, PFILE_OBJECT file, const void* data, size_t bytes)
+{
+    const uint8_t* src = (const uint8_t*) data;
+    fifo_reader_t* waiter;
+    const int      waiting = drfifo_event_waiter(drfifo, &waiter);
+    size_t         skip = 0;
+    ssize_t        bytes_put = 0;
+
+    if (fifo_is_fragmenting(drfifo->fifo))
+    {
+        if (file != drfifo->fragmenting)
+        {
+            return 0;
+        }
+    }
+    else if (!fifo_is_topic_tagged(drfifo->fifo))
+    {
+        drfifo->fragment_topic = 0;
+    }
+    else if (bytes < 2)
+    {
+        return 0;       // No message after the topic.
+    }
+    else
+    {
+        drfifo->fragment_topic = src[0];
+        skip = 1;
+    }
+
+    bytes_put = fifo_put_fragments(drfifo->fifo, drfifo->fragment_topic, &src[skip], bytes - skip,
+                                   drfifo->fragment_bytes, 0);
+    bytes_put += (bytes_put > 0) ? skip : 0;
+    drfifo->fragmenting = fifo_is_fragmenting(drfifo->fifo) ? file : NULL;
+
+    if ((bytes_put > 0) && waiting)
+    {
+        drfifo_event_check_readable(drfifo, fifo_reader_bytes_to_get(drfifo->fifo, waiter));
+    }
+
+    return bytes_put;
+}   /* drfifo_event_put_fragments() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Stages a whole packet in the open transaction, as drfifo_event_put() puts
+ * one, but unseen by readers and so signalling nothing. Called with the
+ * FIFO lock held.
+ *
+ * @return the number of bytes staged; 0 if there was no room or no
+ * transaction is open.
+ */
+ssize_t drfifo_event_stage(drfifo_dev_t* drfifo, const void* data, size_t bytes)
+{
+    return fifo_is_staging(drfifo->fifo) ? drfifo_event_put_packet(drfifo, data, bytes) : 0;
+}   /* drfifo_event_stage() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Commits the open transaction with fifo_commit(), signalling the readable
+ * event as drfifo_event_put() would have for the whole batch. Called with
+ * the FIFO lock held.
+ *
+ * @return the number of bytes published.
+ */
+size_t drfifo_event_commit(drfifo_dev_t* drfifo)
+{
+    fifo_reader_t* waiter;
+    const int      waiting = drfifo_event_waiter(drfifo, &waiter);
+    const size_t   bytes = fifo_commit(drfifo->fifo);
+
+    if ((bytes > 0) && waiting)
+    {
+        drfifo_event_check_readable(drfifo, fifo_reader_bytes_to_get(drfifo->fifo, waiter));
+    }
+
+    return bytes;
+}   /* drfifo_event_commit() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Notes that a writer was turned away for lack of room, so that the next
+ * get signals the writable event. Called with the FIFO lock held.
+ */
+void drfifo_event_refused(drfifo_dev_t* drfifo)
+{
+    drfifo->event.refused = (NULL != drfifo->event.writable);
+}   /* drfifo_event_refused() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Signals the writable event if a writer was turned away since it was last
+ * signalled and the bytes to put have reached the high watermark. Called
+ * with the FIFO lock held after anything that makes room.
+ */
+void drfifo_event_room(drfifo_dev_t* drfifo)
+{
+    if (drfifo->event.refused && (fifo_bytes_to_put(drfifo->fifo) >= drfifo->event.high_watermark))
+    {
+        drfifo->event.refused = 0;
+        drfifo->event.writable_signals++;
+        KeSetEvent(drfifo->event.writable, IO_NO_INCREMENT, FALSE);
+    }
+}   /* drfifo_event_room() */
@@ -0,0 +1,50 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#ifndef __drfifo_event_h__
+#define __drfifo_event_h__
+
+#include <ntddk.h>
+
+#include "drfifo_ioctl.h"
+#include "fifo.h"
+
+struct drfifo_dev_s;
+
+/**
+ * Readiness events registered with DRFIFO_IOCTL_EVENTS. They are signalled
+ * on transitions only - occupancy rising to the low watermark, and a refused
+ * writer finding the high watermark's worth of room - so a busy FIFO costs
+ * no more than one KeSetEvent() per transition. The timer bounds how long
+ * data below the low watermark wait for a reader. All fields but the timer
+ * and DPC are protected by the FIFO lock.
+ */
+typedef struct drfifo_event_s
+{
+    PKEVENT       readable;           /**< Signalled when a put raises occupancy to low_watermark, or NULL. */
+    PKEVENT       writable;           /**< Signalled when a get leaves high_watermark free after a refusal, or NULL. */
+    int           refused;            /**< Set when a write found no room; cleared when writable is signalled. */
+    size_t        low_watermark;      /**< Bytes to get at which readable is signalled; at least 1. */
+    size_t        high_watermark;     /**< Bytes to put at which writable is signalled; at least 1. */
+    LARGE_INTEGER max_delay;          /**< Relative due time for the timer; 0 for no timer. */
+    KTIMER        timer;              /**< Signals readable when data wait below the low watermark too long. */
+    KDPC          dpc;                /**< Runs drfifo_event_timer() for the timer. */
+    int           timer_armed;        /**< Set while the timer is pending for data already put. */
+    uint64_t      readable_signals;   /**< Times readable was signalled by a put. */
+    uint64_t      writable_signals;   /**< Times writable was signalled. */
+    uint64_t      timer_signals;      /**< Times readable was signalled by the timer. */
+} drfifo_event_t;
+
+void     drfifo_event_init(struct drfifo_dev_s* drfifo);
+void     drfifo_event_exit(struct drfifo_dev_s* drfifo);
+NTSTATUS drfifo_event_config(struct drfifo_dev_s* drfifo, const drfifo_ioctl_events_t* config, KPROCESSOR_MODE mode);
+NTSTATUS drfifo_event_watermark(struct drfifo_dev_s* drfifo, const drfifo_ioctl_watermark_t* config);
+ssize_t  drfifo_event_put(struct drfifo_dev_s* drfifo, const void* data, size_t bytes);    // FIFO lock held.
+ssize_t  drfifo_event_stage(struct drfifo_dev_s* drfifo, const void* data, size_t bytes);  // FIFO lock held.
+ssize_t  drfifo_event_put_fragments(struct drfifo_dev_s* drfifo, PFILE_OBJECT file,
+                                    const void* data, size_t bytes);                       // FIFO lock held.
+size_t   drfifo_event_commit(struct drfifo_dev_s* drfifo);                                 // FIFO lock held.
+void     drfifo_event_refused(struct drfifo_dev_s* drfifo);                                // FIFO lock held.
+void     drfifo_event_room(struct drfifo_dev_s* drfifo);                                   // FIFO lock held.
+
+#endif
@@ -11,6 +11,7 @@
 #endif
 
 #include "drfifo_stdint.h"
+#include "fifo_trace.h"
 
 /**
  * Device-specific ID for this device. It is included in ioctl() command
@@ -38,6 +39,266 @@
  */
 #define DRFIFO_IOCTL_STATUS     ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x03, METHOD_BUFFERED, FILE_READ_ACCESS))
 
+/**
+ * Configures persistence of the FIFO to its backing image file. See
+ * structure drfifo_ioctl_persist_t.
+ *
+ * While persistence is on, the FIFO header and data buffer are mirrored into
+ * the image file and the FIFO is restored from it when the driver loads, so
+ * a reader resumes at the last committed get_count. Turning persistence off
+ * deletes the image file. The image, and the buffer its data are staged in,
+ * cover the whole ring, so persisting a sparse FIFO costs its full size.
+ */
+#define DRFIFO_IOCTL_PERSIST    ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x04, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Configures spilling of writes that don't fit in the FIFO to on-disk
+ * segment files. See structure drfifo_ioctl_spill_t.
+ *
+ * While anything is spilled, every write goes to the spill so that order is
+ * kept; a background worker moves spilled packets back into the FIFO as
+ * readers make room. Flushing or resetting the FIFO discards the spill.
+ */
+#define DRFIFO_IOCTL_SPILL      ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x05, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Turns packet compression on or off, or changes its threshold. See
+ * structure drfifo_ioctl_codec_t.
+ *
+ * Turning compression on or off resets the FIFO, since it changes the way
+ * packets are stored; changing the threshold does not. Compression ratio and
+ * CPU cost are reported by DRFIFO_IOCTL_STATUS.
+ */
+#define DRFIFO_IOCTL_CODEC      ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x06, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Turns CRC32C checking of each packet on or off. See structure
+ * drfifo_ioctl_crc_t.
+ *
+ * While on, a packet whose data are damaged is dropped on its own and the
+ * reader searches past a damaged header rather than resetting the FIFO.
+ * Drops are counted in DRFIFO_IOCTL_STATUS. Changing the setting resets the
+ * FIFO.
+ */
+#define DRFIFO_IOCTL_CRC        ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x07, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Turns record mode on or off. See structure drfifo_ioctl_record_t.
+ *
+ * In record mode every write and read moves whole fixed-size records with
+ * no packet header; a write must be a multiple of the record size and a read
+ * returns as many whole records as fit in its buffer. Packet framing,
+ * compression and CRC checking are not used while record mode is on.
+ * Changing the record size resets the FIFO and discards any spill.
+ */
+#define DRFIFO_IOCTL_RECORD     ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x08, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Registers event objects to be signalled when the FIFO becomes readable or
+ * writable, so that an event loop can wait on the FIFO alongside sockets
+ * (WSAEventSelect()) and timers with WaitForMultipleObjects(). See
+ * structure drfifo_ioctl_events_t.
+ *
+ * Events are signalled on transitions only: readable when a write makes an
+ * empty FIFO non-empty, writable when a read makes room after a write was
+ * refused. Use auto-reset events, and read (or write) until the FIFO is
+ * empty (or full) before waiting again. An event whose condition already
+ * holds when it is registered is signalled at once. NULL handles unregister.
+ * DRFIFO_IOCTL_WATERMARK moves the thresholds for both transitions.
+ */
+#define DRFIFO_IOCTL_EVENTS     ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x09, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Sets the watermarks that coalesce the readiness events of
+ * DRFIFO_IOCTL_EVENTS. See structure drfifo_ioctl_watermark_t.
+ *
+ * The readable event is signalled when a write raises the bytes to get to
+ * the low watermark, or when max_delay_ms passes with data below it; the
+ * writable event when a read leaves the high watermark's worth of bytes to
+ * put after a write was refused. A producer sending many small packets then
+ * wakes its consumer once per batch rather than once per packet. Signal
+ * counts are reported by DRFIFO_IOCTL_STATUS.
+ */
+#define DRFIFO_IOCTL_WATERMARK  ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x0A, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Turns broadcast mode on or off. See structure drfifo_ioctl_broadcast_t.
+ *
+ * In broadcast mode every handle that reads the FIFO is a separate reader
+ * with its own position, and sees every write made after its first read -
+ * or, for the first reader, every write kept since broadcast was turned on.
+ * One write thus serves any number of readers, and its space is reclaimed
+ * once the slowest reader has read it. Handles that only write never become
+ * readers. Optionally a write that would not fit evicts the slowest readers
+ * instead; an evicted reader skips to the oldest data kept, and its
+ * evictions are counted in DRFIFO_IOCTL_STATUS.
+ */
+#define DRFIFO_IOCTL_BROADCAST  ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x0B, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Turns topic tags on or off. See structure drfifo_ioctl_topics_t.
+ *
+ * With topics on, the first byte of every write is its topic, 0 through
+ * DRFIFO_TOPICS - 1, and the rest is the packet; every read likewise
+ * returns the packet's topic followed by the packet. The topic is kept in
+ * the packet header, and each handle reads only the topics it subscribed
+ * to with DRFIFO_IOCTL_SUBSCRIBE. Packets of other topics are skipped in
+ * place without being copied - for that handle alone in broadcast mode,
+ * and for every handle otherwise. Changing the setting resets the FIFO.
+ */
+#define DRFIFO_IOCTL_TOPICS     ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x0C, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Sets the topics read through this handle. See structure
+ * drfifo_ioctl_subscribe_t and DRFIFO_IOCTL_TOPICS.
+ */
+#define DRFIFO_IOCTL_SUBSCRIBE  ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x0D, METHOD_BUFFERED, FILE_READ_ACCESS))
+
+/**
+ * Number of topics for DRFIFO_IOCTL_TOPICS.
+ */
+#define DRFIFO_TOPICS   32
+
+/**
+ * Begins, commits or aborts a transaction. See structure
+ * drfifo_ioctl_transaction_t.
+ *
+ * Between begin and commit, every write through the handle that began the
+ * transaction is staged in the FIFO, taking up room but unseen by readers;
+ * commit publishes them all at once, so a reader sees the whole batch or
+ * none of it. A write that doesn't fit fails as usual and is never spilled,
+ * so the writer can abort, which gives the room back. Writes through other
+ * handles are refused (or spilled) until the transaction ends, and closing
+ * the handle aborts it.
+ */
+#define DRFIFO_IOCTL_TRANSACTION  ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x0E, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Actions for drfifo_ioctl_transaction_t.action.
+ */
+#define DRFIFO_TRANSACTION_BEGIN    1   /**< Stage this handle's writes from now on. */
+#define DRFIFO_TRANSACTION_COMMIT   2   /**< Publish everything staged. */
+#define DRFIFO_TRANSACTION_ABORT    3   /**< Throw away everything staged. */
+
+/**
+ * Turns retention on or off. See structure drfifo_ioctl_retain_t.
+ *
+ * With retention on, data read stay in the FIFO until writes need the room,
+ * so a consumer that crashed after reading them can seek back with
+ * DRFIFO_IOCTL_SEEK and read them again. Every byte written has a 64-bit
+ * sequence number; DRFIFO_IOCTL_STATUS reports the handle's next one, which
+ * a consumer checkpoints as it finishes each packet, and the oldest one
+ * still retained. Retention never refuses a write.
+ */
+#define DRFIFO_IOCTL_RETAIN     ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x0F, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Moves this handle's read position to a sequence number. See structure
+ * drfifo_ioctl_seek_t and DRFIFO_IOCTL_RETAIN. The sequence must start a
+ * packet and still be in the FIFO; otherwise the request fails with
+ * STATUS_INVALID_PARAMETER. Without broadcast mode there is one read
+ * position, shared by every handle.
+ */
+#define DRFIFO_IOCTL_SEEK       ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x10, METHOD_BUFFERED, FILE_READ_ACCESS))
+
+/**
+ * Reads the driver's trace events. See structure drfifo_ioctl_trace_t.
+ *
+ * Tracing is chosen at compile time with FIFO_TRACE_LEVEL (see
+ * fifo_trace.h); at FIFO_TRACE_OFF, the default for free builds, it costs
+ * nothing and this returns no events. Otherwise each processor records
+ * binary events into its own ring of FIFO_TRACE_EVENTS, and this returns
+ * the newest of them that fit after the header, shared evenly among the
+ * processors. Each processor's events come oldest first; merge them by
+ * ticks. Pass the header as input too, with clear set, to empty the rings.
+ */
+#define DRFIFO_IOCTL_TRACE      ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x11, METHOD_BUFFERED, FILE_READ_ACCESS))
+
+/**
+ * Turns indirect mode on or off, or changes its pool. See structure
+ * drfifo_ioctl_indirect_t.
+ *
+ * In indirect mode each packet of at least the threshold is copied into a
+ * buffer from a preallocated pool, and only a small descriptor goes through
+ * the FIFO, so large packets need not fit in it and don't hold up small ones
+ * queued behind them. A write that finds no buffer free fails as if the
+ * FIFO were full. Packets written while broadcasting, retaining or in a
+ * transaction are stored in the FIFO as usual, and packets held in buffers
+ * are not saved in the image file. Any change resets the FIFO; pool usage
+ * is reported by DRFIFO_IOCTL_STATUS.
+ */
+#define DRFIFO_IOCTL_INDIRECT   ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x12, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Turns fragmentation of large writes on or off. See structure
+ * drfifo_ioctl_fragment_t.
+ *
+ * With fragmentation on, a write is put as fragments of at most
+ * fragment_bytes, so a message may be bigger than the FIFO. As many
+ * fragments as fit are put and the write completes with the bytes taken;
+ * the handle then writes the rest, as room appears, and until the message
+ * is complete writes from other handles fail with STATUS_DEVICE_BUSY.
+ * Closing the handle part way ends the message early. With topics on, only
+ * the first write of a message starts with its topic.
+ *
+ * A read returns as many whole fragments of a message as are in the FIFO
+ * and fit; if the message goes on, the read completes with
+ * STATUS_BUFFER_OVERFLOW - ReadFile() fails with ERROR_MORE_DATA, as for a
+ * message-mode pipe - and the next read carries on with it. A message
+ * ended early finishes with an empty read. Read buffers should be at least
+ * fragment_bytes, since a bigger fragment is truncated like any packet.
+ * Writes are spilled whole, as before, while spilling is on.
+ */
+#define DRFIFO_IOCTL_FRAGMENT   ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x13, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Sets the time to live of packets written from now on, or turns deadlines
+ * off. See structure drfifo_ioctl_deadline_t.
+ *
+ * Each packet's header carries the time by which it must be read. Reads
+ * skip packets past their deadlines without copying them, and count them
+ * in the status' expired, so a reader that falls behind a real-time feed
+ * catches up with live data rather than working through stale data.
+ * Fragments of a message never expire. Turning deadlines on or off resets
+ * the FIFO, since it changes the way that data are stored; changing only
+ * the time to live does not. A persisted FIFO keeps its time to live, and
+ * each packet the time it had left when last synced: time spent unloaded
+ * doesn't count.
+ */
+#define DRFIFO_IOCTL_DEADLINE   ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x14, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Turns the sink on or off. See structure drfifo_ioctl_sink_t.
+ *
+ * While the sink is on, the driver itself reads the FIFO and appends every
+ * packet to numbered log files, \DosDevices\C:\drfifo.N.sink, so that
+ * logging a feed costs no reader and no copy through user mode. Each record
+ * is a uint32_t size followed by the data, as a read returns them. Packets
+ * are written in large unbuffered batches, and their room in the FIFO goes
+ * back to writers only once they are on disk. Until a file is closed it may
+ * end in padding, read as a record of size 0. Handles can't read while the
+ * sink is on, and broadcast and retention modes can't be turned on. A
+ * failed write is retried from the flush timer after a wait that doubles
+ * with each failure; after 8 in a row the sink gives up what it holds and
+ * turns itself off.
+ */
+#define DRFIFO_IOCTL_SINK       ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x15, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
+/**
+ * Sets the alignment of packets in the FIFO. See structure
+ * drfifo_ioctl_align_t.
+ *
+ * When aligned, each packet is stored in one piece, never wrapping around
+ * the end of the ring, and its data start at a multiple of the alignment -
+ * 8, say, or a cache line of 64 - so that a consumer in the driver can use
+ * them where they lie. This costs up to the alignment plus a header per
+ * packet, and the end of the ring for a packet that would wrap. The
+ * alignment must be a power of two that divides the FIFO's size; it is
+ * used only in packet mode. Changing it resets the FIFO and discards any
+ * spill.
+ */
+#define DRFIFO_IOCTL_ALIGN      ((ulong_t) CTL_CODE(FILE_DEVICE_DRFIFO, 0x16, METHOD_BUFFERED, FILE_WRITE_ACCESS))
+
 /* #define IOCTL_TRANSFER_TYPE( _iocontrol)   (_iocontrol & 0x3) */
 
 /**
@@ -48,6 +309,221 @@ typedef struct drfifo_ioctl_reset_s
     size_t new_size;     /**< New size for the FIFO, in bytes. 0 means no new size. */
 } drfifo_ioctl_reset_t;
 
+/**
+ * Durability levels for drfifo_ioctl_persist_t.durability.
+ */
+#define DRFIFO_DURABILITY_OFF       0   /**< Not persisted; any image file is deleted. */
+#define DRFIFO_DURABILITY_NONE      1   /**< Image written only when the driver unloads. */
+#define DRFIFO_DURABILITY_PERIODIC  2   /**< Image written and flushed every period_ms. */
+#define DRFIFO_DURABILITY_BATCH     3   /**< Image written and flushed by a worker as soon as reads and writes change it. */
+
+/**
+ * Argument structure for DRFIFO_IOCTL_PERSIST.
+ */
+typedef struct drfifo_ioctl_persist_s
+{
+    ulong_t durability;   /**< One of DRFIFO_DURABILITY_xxx. */
+    ulong_t period_ms;    /**< Sync period for DRFIFO_DURABILITY_PERIODIC; 0 means 1000. */
+} drfifo_ioctl_persist_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_SPILL.
+ */
+typedef struct drfifo_ioctl_spill_s
+{
+    ulong_t enabled;         /**< Non-zero to spill writes that don't fit in the FIFO. */
+    ulong_t segment_bytes;   /**< Segment file size at which a new segment is started; 0 means 1MB. */
+    ulong_t memory_bytes;    /**< Most bytes held in memory waiting for the worker; 0 means 256KB. */
+} drfifo_ioctl_spill_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_SINK.
+ */
+typedef struct drfifo_ioctl_sink_s
+{
+    ulong_t enabled;        /**< Non-zero to drain the FIFO into the sink files. */
+    ulong_t batch_bytes;    /**< Bytes gathered for each write; 0 means 256KB. */
+    ulong_t flush_ms;       /**< Longest data wait for a batch to fill before being written anyway; 0 means 100. */
+    ulong_t rotate_bytes;   /**< File size at which a new file is started; 0 means 64MB. */
+} drfifo_ioctl_sink_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_CODEC.
+ */
+typedef struct drfifo_ioctl_codec_s
+{
+    ulong_t enabled;     /**< Non-zero to compress packets. */
+    ulong_t threshold;   /**< Packets smaller than this are stored raw; 0 means 64. */
+} drfifo_ioctl_codec_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_CRC.
+ */
+typedef struct drfifo_ioctl_crc_s
+{
+    ulong_t enabled;     /**< Non-zero to check each packet with a CRC32C. */
+} drfifo_ioctl_crc_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_RECORD.
+ */
+typedef struct drfifo_ioctl_record_s
+{
+    ulong_t record_bytes;   /**< Size of each record; 0 turns record mode off. */
+} drfifo_ioctl_record_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_EVENTS.
+ */
+typedef struct drfifo_ioctl_events_s
+{
+    HANDLE readable;     /**< Event signalled when the FIFO becomes non-empty, or NULL. */
+    HANDLE writable;     /**< Event signalled when a refused writer may find room, or NULL. */
+} drfifo_ioctl_events_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_WATERMARK.
+ */
+typedef struct drfifo_ioctl_watermark_s
+{
+    ulong_t low_bytes;      /**< Bytes to get at which readers are woken; 0 means 1. */
+    ulong_t high_bytes;     /**< Bytes to put at which refused writers are woken; 0 means 1. */
+    ulong_t max_delay_ms;   /**< Longest data wait below low_bytes before readers are woken; 0 means forever. */
+} drfifo_ioctl_watermark_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_BROADCAST.
+ */
+typedef struct drfifo_ioctl_broadcast_s
+{
+    ulong_t enabled;     /**< Non-zero to give each reading handle its own position. */
+    ulong_t evict;       /**< Non-zero to evict the slowest readers rather than refuse a write. */
+} drfifo_ioctl_broadcast_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_TOPICS.
+ */
+typedef struct drfifo_ioctl_topics_s
+{
+    ulong_t enabled;     /**< Non-zero to tag each packet with the topic in its first byte. */
+} drfifo_ioctl_topics_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_SUBSCRIBE.
+ */
+typedef struct drfifo_ioctl_subscribe_s
+{
+    ulong_t topics;      /**< Topics to read, bit n for topic n; 0 for all. */
+} drfifo_ioctl_subscribe_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_TRANSACTION.
+ */
+typedef struct drfifo_ioctl_transaction_s
+{
+    ulong_t action;      /**< One of DRFIFO_TRANSACTION_xxx. */
+} drfifo_ioctl_transaction_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_RETAIN.
+ */
+typedef struct drfifo_ioctl_retain_s
+{
+    ulong_t enabled;     /**< Non-zero to keep data read until writes need the room. */
+} drfifo_ioctl_retain_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_SEEK.
+ */
+typedef struct drfifo_ioctl_seek_s
+{
+    uint64_t sequence;   /**< Sequence number of the next byte to read. */
+} drfifo_ioctl_seek_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_TRACE. On output it is followed by
+ * count fifo_trace_event_t records.
+ */
+typedef struct drfifo_ioctl_trace_s
+{
+    ulong_t  clear;             /**< In: non-zero to empty the rings after reading. Out: whether they were. */
+    ulong_t  level;             /**< FIFO_TRACE_LEVEL the driver was built with. */
+    ulong_t  count;             /**< Events following this header. */
+    ulong_t  reserved;
+    uint64_t ticks_per_second;  /**< Frequency of the events' ticks. */
+} drfifo_ioctl_trace_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_INDIRECT.
+ */
+typedef struct drfifo_ioctl_indirect_s
+{
+    ulong_t enabled;        /**< Non-zero to carry large packets in pool buffers. */
+    ulong_t buffers;        /**< Buffers in the pool; 0 means 16. */
+    ulong_t buffer_bytes;   /**< Size of each buffer, the largest such packet; 0 means 256KB. */
+    ulong_t threshold;      /**< Packets smaller than this are stored in the FIFO; 0 means 512. */
+} drfifo_ioctl_indirect_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_FRAGMENT.
+ */
+typedef struct drfifo_ioctl_fragment_s
+{
+    ulong_t enabled;          /**< Non-zero to fragment writes rather than refuse those that don't fit. */
+    ulong_t fragment_bytes;   /**< Largest fragment; 0 means 512. */
+} drfifo_ioctl_fragment_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_DEADLINE.
+ */
+typedef struct drfifo_ioctl_deadline_s
+{
+    ulong_t ttl_us;      /**< Time to live of each packet written, in microseconds; 0 for no deadlines. */
+} drfifo_ioctl_deadline_t;
+
+/**
+ * Argument structure for DRFIFO_IOCTL_ALIGN.
+ */
+typedef struct drfifo_ioctl_align_s
+{
+    ulong_t align_bytes;   /**< Boundary for packet data; 0 turns alignment off. */
+} drfifo_ioctl_align_t;
+
+/**
+ * Call sites of the FIFO lock, as indexes into drfifo_ioctl_status_t's
+ * lock array.
+ */
+#define DRFIFO_LOCK_PUT       0   /**< Writes. */
+#define DRFIFO_LOCK_GET       1   /**< Reads. */
+#define DRFIFO_LOCK_STATUS    2   /**< DRFIFO_IOCTL_STATUS. */
+#define DRFIFO_LOCK_RESET     3   /**< DRFIFO_IOCTL_RESET. */
+#define DRFIFO_LOCK_FLUSH     4   /**< DRFIFO_IOCTL_FLUSH. */
+#define DRFIFO_LOCK_OTHER     5   /**< Everything else: configuration, events, spilling and persistence. */
+#define DRFIFO_LOCK_SITES     6
+
+/**
+ * Buckets of the lock hold-time histogram. Bucket n counts holds shorter
+ * than 250ns * 4^n that didn't fit in bucket n - 1; the last counts the
+ * rest, 1ms and up.
+ */
+#define DRFIFO_LOCK_BUCKETS   8
+
+/**
+ * Lock profile of one call site, in drfifo_ioctl_status_t. All zero unless
+ * the driver was built with DRFIFO_LOCK_PROFILE; see drfifo_lock.h. Counted
+ * since the driver was loaded.
+ */
+typedef struct drfifo_ioctl_lock_site_s
+{
+    uint64_t acquisitions;      /**< Times the site took the lock. */
+    uint64_t contended;         /**< ... of which found it held and had to spin. */
+    uint64_t spin_ticks;        /**< Time spent spinning. */
+    uint64_t spin_max_ticks;    /**< Longest spin. */
+    uint64_t hold_ticks;        /**< Time spent holding the lock. */
+    uint64_t hold_max_ticks;    /**< Longest hold. */
+    uint64_t hold_histogram[DRFIFO_LOCK_BUCKETS];   /**< Holds by duration; see DRFIFO_LOCK_BUCKETS. */
+} drfifo_ioctl_lock_site_t;
+
 /**
  * Argument structure for DRFIFO_IOCTL_STATUS.
  */
@@ -57,6 +533,48 @@ typedef struct drfifo_ioctl_status_s
     size_t flags;       /**< Flags for FIFO (currently not defined). */
     size_t put_count;   /**< Number of bytes so far written to the FIFO. */
     size_t get_count;   /**< Number of bytes so far read from the FIFO. */
+    uint64_t ticks_per_second;      /**< Frequency of the xxx_ticks counters. */
+    uint64_t codec_packets;         /**< Packets put since compression was last configured. */
+    uint64_t codec_compressed;      /**< ... of which were stored compressed. */
+    uint64_t codec_raw_bytes;       /**< Payload bytes put; divide by codec_stored_bytes for the ratio. */
+    uint64_t codec_stored_bytes;    /**< Payload bytes stored in the FIFO. */
+    uint64_t codec_compress_ticks;  /**< Time spent compressing. */
+    uint64_t codec_expand_ticks;    /**< Time spent expanding. */
+    uint64_t bad_packets;           /**< Packets dropped because their data failed the CRC check. */
+    uint64_t resyncs;               /**< Times the reader searched past a damaged header. */
+    uint64_t resync_bytes;          /**< Bytes skipped while searching. */
+    uint64_t record_bytes;          /**< Record size in record mode, else 0. */
+    uint64_t record_count;          /**< Records held in the FIFO. */
+    uint64_t record_capacity;       /**< Records the empty FIFO holds. */
+    uint64_t readable_signals;      /**< Times a write signalled the readable event. */
+    uint64_t writable_signals;      /**< Times a read signalled the writable event. */
+    uint64_t timer_signals;         /**< Times the max-delay timer signalled the readable event. */
+    uint64_t readers;               /**< Active readers in broadcast mode. */
+    uint64_t evictions;             /**< Readers evicted for falling behind. */
+    uint64_t reader_evictions;      /**< ... of which were the handle asking for status. */
+    uint64_t filtered;              /**< Packets skipped by handles not subscribed to their topics. */
+    uint64_t staged_bytes;          /**< Bytes staged by an open transaction, headers included. */
+    uint64_t put_sequence;          /**< Sequence number of the next byte written. */
+    uint64_t get_sequence;          /**< Sequence number of the next byte read through this handle. */
+    uint64_t retained_sequence;     /**< Oldest sequence number that may be sought. */
+    uint64_t indirect_buffers;      /**< Buffers in the indirect pool; 0 when indirect mode is off. */
+    uint64_t indirect_free;         /**< ... of which are free. */
+    uint64_t indirect_exhausted;    /**< Writes refused because no buffer was free. */
+    uint64_t indirect_stale;        /**< Packets dropped because their buffer had been reclaimed. */
+    uint64_t fragment_bytes;        /**< Largest fragment written; 0 when fragmentation is off. */
+    uint64_t fragmenting;           /**< Non-zero while a handle is part way through writing a message. */
+    uint64_t ttl_ticks;             /**< Time to live of each packet written; 0 when deadlines are off. */
+    uint64_t expired;               /**< Packets skipped unread because they were past their deadlines. */
+    uint64_t sink_bytes;            /**< Record bytes written by the sink since the driver loaded. */
+    uint64_t sink_writes;           /**< ... in this many batches. */
+    uint64_t sink_errors;           /**< Batch writes that failed, to be retried unless the sink gave up. */
+    uint64_t sink_file;             /**< Number of the sink file being written, or next to be. */
+    uint64_t align_bytes;           /**< Boundary to which packet data are aligned, else 0. */
+    uint64_t page_bytes;            /**< Page size of a sparse FIFO, else 0; see the PageBytes registry value. */
+    uint64_t committed_bytes;       /**< Bytes of the data buffer allocated; less than size while sparse pages are free. */
+    uint64_t commits;               /**< Sparse pages allocated as writes reached them. */
+    uint64_t decommits;             /**< Sparse pages freed after lying drained and idle. */
+    drfifo_ioctl_lock_site_t lock[DRFIFO_LOCK_SITES];   /**< FIFO lock profile by call site (DRFIFO_LOCK_xxx). */
 } drfifo_ioctl_status_t;
 
 /**
@@ -67,6 +585,25 @@ typedef union drfifo_ioctl_arg_u
 {
     drfifo_ioctl_reset_t  reset;
     drfifo_ioctl_status_t status;
+    drfifo_ioctl_persist_t persist;
+    drfifo_ioctl_spill_t  spill;
+    drfifo_ioctl_codec_t  codec;
+    drfifo_ioctl_crc_t    crc;
+    drfifo_ioctl_record_t record;
+    drfifo_ioctl_events_t events;
+    drfifo_ioctl_watermark_t watermark;
+    drfifo_ioctl_broadcast_t broadcast;
+    drfifo_ioctl_topics_t    topics;
+    drfifo_ioctl_subscribe_t subscribe;
+    drfifo_ioctl_transaction_t transaction;
+    drfifo_ioctl_retain_t    retain;
+    drfifo_ioctl_seek_t      seek;
+    drfifo_ioctl_trace_t     trace;
+    drfifo_ioctl_indirect_t  indirect;
+    drfifo_ioctl_fragment_t  fragment;
+    drfifo_ioctl_deadline_t  deadline;
+    drfifo_ioctl_sink_t      sink;
+    drfifo_ioctl_align_t     align;
 } drfifo_ioctl_arg_t;
 
 #endif
@@ -0,0 +1,118 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#include <ntddk.h>
+
+#include "drfifo.h"
+#include "drfifo_stdint.h"
+#include "drfifo_ioctl.h"
+#include "drfifo_lock.h"
+
+#if DRFIFO_LOCK_PROFILE
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Takes the lock of @a drfifo at DISPATCH_LEVEL on behalf of call site
+ * @a site, timing the spin if another processor holds it.
+ */
+static void drfifo_lock_profiled(drfifo_dev_t* drfifo, uint32_t site)
+{
+    drfifo_ioctl_lock_site_t* stats = &drfifo->lock_profile.site[site];
+    uint64_t                  now;
+
+    if (KeTryToAcquireSpinLockAtDpcLevel(&drfifo->lock))
+    {
+        now = (uint64_t) KeQueryPerformanceCounter(NULL).QuadPart;
+    }
+    else
+    {
+        const uint64_t start = (uint64_t) KeQueryPerformanceCounter(NULL).QuadPart;
+        uint64_t       spin;
+
+        KeAcquireSpinLockAtDpcLevel(&drfifo->lock);
+        now = (uint64_t) KeQueryPerformanceCounter(NULL).QuadPart;
+        spin = now - start;
+        stats->contended++;
+        stats->spin_ticks += spin;
+        stats->spin_max_ticks = (spin > stats->spin_max_ticks) ? spin : stats->spin_max_ticks;
+    }
+
+    stats->acquisitions++;
+    drfifo->lock_profile.held_site  = site;
+    drfifo->lock_profile.held_since = now;
+}   /* drfifo_lock_profiled() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Records how long the current holder of the lock of @a drfifo held it,
+ * just before it lets go.
+ */
+static void drfifo_lock_held(drfifo_dev_t* drfifo)
+{
+    drfifo_ioctl_lock_site_t* stats = &drfifo->lock_profile.site[drfifo->lock_profile.held_site];
+    LARGE_INTEGER             frequency;
+    const uint64_t            hold = (uint64_t) KeQueryPerformanceCounter(&frequency).QuadPart -
+                                     drfifo->lock_profile.held_since;
+    uint64_t                  hold_ns = 1000000000;     // A second or more; the last bucket anyway.
+    uint64_t                  bound = 250;
+    size_t                    bucket = 0;
+
+    if (hold < (uint64_t) frequency.QuadPart)
+    {
+        hold_ns = (hold * 1000000000) / (uint64_t) frequency.QuadPart;
+    }
+
+    while ((bucket < (DRFIFO_LOCK_BUCKETS - 1)) && (hold_ns >= bound))
+    {
+        bucket++;
+        bound *= 4;
+    }
+
+    stats->hold_ticks += hold;
+    stats->hold_max_ticks = (hold > stats->hold_max_ticks) ? hold : stats->hold_max_ticks;
+    stats->hold_histogram[bucket]++;
+}   /* drfifo_lock_held() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Profiled KeAcquireSpinLock() of the lock of @a drfifo, for call site
+ * @a site (DRFIFO_LOCK_xxx).
+ */
+void drfifo_lock(drfifo_dev_t* drfifo, KIRQL* level, uint32_t site)
+{
+    KeRaiseIrql(DISPATCH_LEVEL, level);
+    drfifo_lock_profiled(drfifo, site);
+}   /* drfifo_lock() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Profiled KeReleaseSpinLock() of the lock of @a drfifo.
+ */
+void drfifo_unlock(drfifo_dev_t* drfifo, KIRQL level)
+{
+    drfifo_lock_held(drfifo);
+    KeReleaseSpinLockFromDpcLevel(&drfifo->lock);
+    KeLowerIrql(level);
+}   /* drfifo_unlock() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Profiled KeAcquireSpinLockAtDpcLevel() of the lock of @a drfifo, for call
+ * site @a site (DRFIFO_LOCK_xxx).
+ */
+void drfifo_lock_at_dpc(drfifo_dev_t* drfifo, uint32_t site)
+{
+    drfifo_lock_profiled(drfifo, site);
+}   /* drfifo_lock_at_dpc() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Profiled KeReleaseSpinLockFromDpcLevel() of the lock of @a drfifo.
+ */
+void drfifo_unlock_from_dpc(drfifo_dev_t* drfifo)
+{
+    drfifo_lock_held(drfifo);
+    KeReleaseSpinLockFromDpcLevel(&drfifo->lock);
+}   /* drfifo_unlock_from_dpc() */
+
+#endif
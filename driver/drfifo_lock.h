@@ -0,0 +1,50 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#ifndef __drfifo_lock_h__
+#define __drfifo_lock_h__
+
+#include <ntddk.h>
+
+#include "drfifo_ioctl.h"
+
+struct drfifo_dev_s;
+
+/**
+ * Set to 1 to profile the FIFO lock: acquisitions, contention, spin time and
+ * hold times per call site, as reported by DRFIFO_IOCTL_STATUS. Checked
+ * builds profile by default; define it in SOURCES' C_DEFINES for a free
+ * build. Compiled out, the wrappers below are the plain spin lock calls.
+ */
+#ifndef DRFIFO_LOCK_PROFILE
+#if DBG
+#define DRFIFO_LOCK_PROFILE   1
+#else
+#define DRFIFO_LOCK_PROFILE   0
+#endif
+#endif
+
+/**
+ * Lock profile of a device. Protected by the lock it profiles, so it costs
+ * no interlocked operations of its own.
+ */
+typedef struct drfifo_lock_profile_s
+{
+    uint32_t                 held_site;     /**< DRFIFO_LOCK_xxx of the current holder. */
+    uint64_t                 held_since;    /**< Performance counter when it took the lock. */
+    drfifo_ioctl_lock_site_t site[DRFIFO_LOCK_SITES];
+} drfifo_lock_profile_t;
+
+#if DRFIFO_LOCK_PROFILE
+void drfifo_lock(struct drfifo_dev_s* drfifo, KIRQL* level, uint32_t site);
+void drfifo_unlock(struct drfifo_dev_s* drfifo, KIRQL level);
+void drfifo_lock_at_dpc(struct drfifo_dev_s* drfifo, uint32_t site);
+void drfifo_unlock_from_dpc(struct drfifo_dev_s* drfifo);
+#else
+#define drfifo_lock(_drfifo,_level,_site)   KeAcquireSpinLock(&(_drfifo)->lock, _level)
+#define drfifo_unlock(_drfifo,_level)       KeReleaseSpinLock(&(_drfifo)->lock, _level)
+#define drfifo_lock_at_dpc(_drfifo,_site)   KeAcquireSpinLockAtDpcLevel(&(_drfifo)->lock)
+#define drfifo_unlock_from_dpc(_drfifo)     KeReleaseSpinLockFromDpcLevel(&(_drfifo)->lock)
+#endif
+
+#endif
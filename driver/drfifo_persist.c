@@ -0,0 +1,586 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#include <ntifs.h>
+#include <wdm.h>
+
+#include "drfifo.h"
+#include "drfifo_stdint.h"
+#include "drfifo_ioctl.h"
+#include "drfifo_persist.h"
+#include "fifo.h"
+
+/**
+ * Image file used to persist the FIFO.
+ */
+#define DRFIFO_IMAGE_PATH   M_T("\\DosDevices\\C:\\drfifo.fifo")
+
+/**
+ * Default sync period for DRFIFO_DURABILITY_PERIODIC, in milliseconds.
+ */
+#define DRFIFO_PERSIST_PERIOD_MS   1000
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Opens the FIFO image file.
+ *
+ * @param handle - receives the file handle.
+ * @param disposition - ZwCreateFile() disposition, FILE_OPEN or
+ * FILE_OVERWRITE_IF.
+ *
+ * @return the result of ZwCreateFile().
+ */
+static NTSTATUS drfifo_image_open(HANDLE* handle, ULONG disposition)
+{
+    UNICODE_STRING    uname;
+    OBJECT_ATTRIBUTES attr;
+    IO_STATUS_BLOCK   io_status;
+
+    RtlInitUnicodeString(&uname, DRFIFO_IMAGE_PATH);
+    InitializeObjectAttributes(&attr, &uname, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    return ZwCreateFile(handle,
+                        GENERIC_READ | GENERIC_WRITE | DELETE,
+                        &attr,
+                        &io_status,
+                        NULL,
+                        FILE_ATTRIBUTE_NORMAL,
+                        0,
+                        disposition,
+                        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+                        NULL,
+                        0);
+}   /* drfifo_image_open() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Reads or writes @a bytes at @a offset in the image @a file.
+ *
+ * @return the result of ZwReadFile() or ZwWriteFile().
+ */
+static NTSTATUS drfifo_image_io(HANDLE file, int write, void* data, size_t bytes, uint64_t offset)
+{
+    IO_STATUS_BLOCK io_status;
+    LARGE_INTEGER   position;
+
+    position.QuadPart = (LONGLONG) offset;
+
+    if (write)
+    {
+        return ZwWriteFile(file, NULL, NULL, NULL, &io_status, data, (ULONG) bytes, &position, NULL);
+    }
+
+    return ZwReadFile(file, NULL, NULL, NULL, &io_status, data, (ULONG) bytes, &position, NULL);
+}   /* drfifo_image_io() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Writes @a image to the front of the image file, flushing it if @a flush
+ * is set.
+ */
+static NTSTATUS drfifo_image_commit(HANDLE file, fifo_image_t* image, int flush)
+{
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS        status = drfifo_image_io(file, 1, image, sizeof(*image), 0);
+
+    if (NT_SUCCESS(status) && flush)
+    {
+        status = ZwFlushBuffersFile(file, &io_status);
+    }
+
+    return status;
+}   /* drfifo_image_commit() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Sizes the image @a file to hold the header and the whole ring of @a size
+ * bytes, so that restoring it never reads past the end.
+ */
+static NTSTATUS drfifo_image_size(HANDLE file, size_t size)
+{
+    IO_STATUS_BLOCK              io_status;
+    FILE_END_OF_FILE_INFORMATION eof;
+
+    eof.EndOfFile.QuadPart = sizeof(fifo_image_t) + size;
+    return ZwSetInformationFile(file, &io_status, &eof, sizeof(eof), FileEndOfFileInformation);
+}   /* drfifo_image_size() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Commits the FIFO's current state to the image file; the caller must hold
+ * persist.mutex. Must be called at PASSIVE_LEVEL.
+ *
+ * Only ring bytes put since the last sync are written; the header that
+ * makes them visible goes last, so a crash at any point leaves an image
+ * whose put_count covers only data that reached the disk. If the new data
+ * land on bytes that the image still counts as unread (because a reader
+ * freed them since the last sync) the reader's progress is committed first,
+ * so the image never claims overwritten data.
+ *
+ * @param drfifo - device whose FIFO is to be synced.
+ * @param flush - whether to flush file system buffers so that the image
+ * survives a crash.
+ *
+ * @return STATUS_SUCCESS on success, something else otherwise.
+ */
+static NTSTATUS drfifo_persist_sync_locked(drfifo_dev_t* drfifo, int flush)
+{
+    drfifo_persist_t* persist = &drfifo->persist;
+    NTSTATUS          status  = STATUS_SUCCESS;
+    IO_STATUS_BLOCK   io_status;
+    fifo_image_t      image;
+    KIRQL             level;
+    size_t            size  = 0;
+    size_t            start = 0;
+    size_t            bytes = 0;
+    size_t            index = 0;
+    size_t            first = 0;
+
+    if ((NULL == persist->file) || (NULL == drfifo->fifo))
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    fifo_image_header(drfifo->fifo, &image);
+    size  = drfifo->fifo->size;
+    start = persist->synced_put_count;
+
+    // After a reset or flush, or once a reader overtakes the last sync,
+    // nothing before the image's get_count is worth writing.
+    if ((drfifo->fifo->put_count - start) > (drfifo->fifo->put_count - (size_t) image.get_count))
+    {
+        start = (size_t) image.get_count;
+    }
+
+    bytes = drfifo->fifo->put_count - start;
+    index = start % size;
+    first = ((size - index) < bytes) ? (size - index) : bytes;
+
+    if (bytes <= persist->staging_size)
+    {
+        fifo_image_data(drfifo->fifo, index, persist->staging, bytes);     // Sparse FIFOs have no fifo->data.
+    }
+
+    drfifo_unlock(drfifo, level);
+
+    if (bytes > persist->staging_size)
+    {
+        DbgPrint(DRIVER_NAME ": drfifo_persist_sync() staging buffer too small (%u < %u).",
+                 (unsigned) persist->staging_size, (unsigned) bytes);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    image.durability = persist->durability;
+    image.period_ms  = persist->period_ms;
+
+    if ((bytes > 0) && ((size_t) (image.put_count - persist->synced_get_count) > size))
+    {
+        fifo_image_t interim = image;
+        interim.put_count = start;
+        status = drfifo_image_commit(persist->file, &interim, flush);
+    }
+
+    if (NT_SUCCESS(status) && (first > 0))
+    {
+        status = drfifo_image_io(persist->file, 1, persist->staging, first, sizeof(image) + index);
+    }
+
+    if (NT_SUCCESS(status) && (bytes > first))
+    {
+        status = drfifo_image_io(persist->file, 1, &persist->staging[first], bytes - first, sizeof(image));
+    }
+
+    if (NT_SUCCESS(status) && flush && (bytes > 0))
+    {
+        status = ZwFlushBuffersFile(persist->file, &io_status);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = drfifo_image_commit(persist->file, &image, flush);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        persist->synced_put_count = (size_t) image.put_count;
+        persist->synced_get_count = (size_t) image.get_count;
+    }
+    else
+    {
+        DbgPrint(DRIVER_NAME ": drfifo_persist_sync() failed with 0x%08X.", (unsigned) status);
+    }
+
+    return status;
+}   /* drfifo_persist_sync_locked() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Commits the FIFO's current state to the image file, if persistence is on.
+ * Must be called at PASSIVE_LEVEL.
+ *
+ * @param drfifo - device whose FIFO is to be synced.
+ * @param flush - whether to flush file system buffers.
+ *
+ * @return STATUS_SUCCESS on success, something else otherwise.
+ */
+NTSTATUS drfifo_persist_sync(drfifo_dev_t* drfifo, int flush)
+{
+    NTSTATUS status;
+
+    KeWaitForSingleObject(&drfifo->persist.mutex, Executive, KernelMode, FALSE, NULL);
+    status = drfifo_persist_sync_locked(drfifo, flush);
+    KeSetEvent(&drfifo->persist.mutex, IO_NO_INCREMENT, FALSE);
+    return status;
+}   /* drfifo_persist_sync() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Work item routine for periodic and batch syncs. Changes made while a
+ * sync runs mark the image dirty again but find the work queued, so they
+ * are picked up by another pass rather than another work item.
+ */
+IO_WORKITEM_ROUTINE drfifo_persist_work;
+VOID drfifo_persist_work(PDEVICE_OBJECT DeviceObject, PVOID Context)
+{
+    drfifo_dev_t*     drfifo = (drfifo_dev_t*) DeviceObject->DeviceExtension;
+    drfifo_persist_t* persist = &drfifo->persist;
+
+    do
+    {
+        InterlockedExchange(&persist->dirty, 0);
+        drfifo_persist_sync(drfifo, 1);
+        InterlockedExchange(&persist->work_queued, 0);
+    } while ((0 != persist->dirty) && (0 == InterlockedCompareExchange(&persist->work_queued, 1, 0)));
+}   /* drfifo_persist_work() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Notes a change to the FIFO that DRFIFO_DURABILITY_BATCH must commit, and
+ * queues a sync unless one is already queued or running, which will see
+ * the change. A burst of reads and writes so costs one sync and flush per
+ * pass of the worker instead of one per request. May be called at up to
+ * DISPATCH_LEVEL.
+ */
+void drfifo_persist_dirty(drfifo_dev_t* drfifo)
+{
+    drfifo_persist_t* persist = &drfifo->persist;
+
+    if (DRFIFO_DURABILITY_BATCH != persist->durability)
+    {
+        return;
+    }
+
+    InterlockedExchange(&persist->dirty, 1);
+
+    if ((NULL != persist->work_item) &&
+        (0 == InterlockedCompareExchange(&persist->work_queued, 1, 0)))
+    {
+        IoQueueWorkItem(persist->work_item, drfifo_persist_work, DelayedWorkQueue, NULL);
+    }
+}   /* drfifo_persist_dirty() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Timer DPC for periodic syncs. Syncing means file I/O, so the actual work
+ * is handed to drfifo_persist_work() unless it's still busy with the last
+ * period.
+ */
+KDEFERRED_ROUTINE drfifo_persist_dpc;
+VOID drfifo_persist_dpc(PKDPC dpc, PVOID context, PVOID arg1, PVOID arg2)
+{
+    drfifo_dev_t* drfifo = (drfifo_dev_t*) context;
+
+    if ((NULL != drfifo->persist.work_item) &&
+        (0 == InterlockedCompareExchange(&drfifo->persist.work_queued, 1, 0)))
+    {
+        IoQueueWorkItem(drfifo->persist.work_item, drfifo_persist_work, DelayedWorkQueue, NULL);
+    }
+}   /* drfifo_persist_dpc() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Stops the periodic sync timer and takes the work item over, waiting for
+ * any sync queued, as drfifo_sink_stop() does: a running worker clears
+ * work_queued before its last look for more work, so waiting for 0 alone
+ * could let it start again. Holding the flag at 1 keeps the timer and
+ * drfifo_persist_dirty() from queueing it until the caller clears it.
+ */
+static void drfifo_persist_stop_timer(drfifo_persist_t* persist)
+{
+    LARGE_INTEGER delay;
+
+    KeCancelTimer(&persist->timer);
+    KeFlushQueuedDpcs();
+    delay.QuadPart = -10 * 1000 * 10;     // 10ms, relative.
+
+    while (0 != InterlockedCompareExchange(&persist->work_queued, 1, 0))
+    {
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+    }
+}   /* drfifo_persist_stop_timer() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Starts the periodic sync timer if the durability level calls for it.
+ */
+static void drfifo_persist_start_timer(drfifo_persist_t* persist)
+{
+    LARGE_INTEGER due;
+
+    if (DRFIFO_DURABILITY_PERIODIC == persist->durability)
+    {
+        due.QuadPart = -10 * 1000 * (LONGLONG) persist->period_ms;
+        KeSetTimerEx(&persist->timer, due, (LONG) persist->period_ms, &persist->dpc);
+    }
+}   /* drfifo_persist_start_timer() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Allocates the staging buffer used to copy dirty ring bytes out of a FIFO
+ * of @a size bytes.
+ */
+static NTSTATUS drfifo_persist_alloc(drfifo_persist_t* persist, size_t size)
+{
+    persist->staging = (uint8_t*) ExAllocatePoolWithTag(NonPagedPool, size, DRFIFO_POOL_TAG);
+    persist->staging_size = (NULL == persist->staging) ? 0 : size;
+    return (NULL == persist->staging) ? STATUS_INSUFFICIENT_RESOURCES : STATUS_SUCCESS;
+}   /* drfifo_persist_alloc() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Closes the image file, deleting it if @a remove is set, and releases the
+ * staging buffer. The timer must already be stopped.
+ */
+static void drfifo_persist_close(drfifo_persist_t* persist, int remove)
+{
+    if (NULL != persist->file)
+    {
+        if (remove)
+        {
+            IO_STATUS_BLOCK              io_status;
+            FILE_DISPOSITION_INFORMATION disposition;
+            disposition.DeleteFile = TRUE;
+            ZwSetInformationFile(persist->file, &io_status, &disposition, sizeof(disposition),
+                                 FileDispositionInformation);
+        }
+
+        ZwClose(persist->file);
+        persist->file = NULL;
+    }
+
+    if (NULL != persist->staging)
+    {
+        ExFreePoolWithTag(persist->staging, DRFIFO_POOL_TAG);
+        persist->staging = NULL;
+        persist->staging_size = 0;
+    }
+
+    persist->durability = DRFIFO_DURABILITY_OFF;
+}   /* drfifo_persist_close() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Creates the device's FIFO from the image file left by a previous run, if
+ * there is a valid one, and resumes persisting at the image's durability
+ * level. Must be called at PASSIVE_LEVEL.
+ *
+ * @param drfifo - device whose FIFO is to be restored; drfifo->fifo must
+ * be NULL.
+ *
+ * @return the restored FIFO, or NULL if there was no usable image.
+ */
+fifo_t* drfifo_persist_load(drfifo_dev_t* drfifo)
+{
+    drfifo_persist_t* persist = &drfifo->persist;
+    HANDLE            file = NULL;
+    fifo_image_t      image;
+    fifo_t*           fifo = NULL;
+    NTSTATUS          status = drfifo_image_open(&file, FILE_OPEN);
+
+    if (!NT_SUCCESS(status))
+    {
+        return NULL;    // No image; nothing to restore.
+    }
+
+    memset(&image, 0, sizeof(image));
+    status = drfifo_image_io(file, 0, &image, sizeof(image), 0);
+
+    // The data go through the staging buffer, since a sparse FIFO has no
+    // single buffer to read them into.
+    if (NT_SUCCESS(status) &&
+        (image.durability >  DRFIFO_DURABILITY_OFF) &&
+        (image.durability <= DRFIFO_DURABILITY_BATCH) &&
+        (image.size > 0) && (image.size == (size_t) image.size) &&
+        NT_SUCCESS(drfifo_persist_alloc(persist, (size_t) image.size)))
+    {
+        fifo = drfifo_fifo_new(drfifo, (size_t) image.size);
+    }
+
+    if ((NULL != fifo) &&
+        NT_SUCCESS(drfifo_image_io(file, 0, persist->staging, fifo->size, image.header_bytes)) &&
+        fifo_image_restore(fifo, &image) &&
+        fifo_image_load(fifo, &image, persist->staging))
+    {
+        DbgPrint(DRIVER_NAME ": restored %u bytes from image (get_count=%u, put_count=%u).",
+                 (unsigned) (fifo->put_count - fifo->get_count), (unsigned) fifo->get_count,
+                 (unsigned) fifo->put_count);
+        persist->file             = file;
+        persist->durability       = image.durability;
+        persist->period_ms        = image.period_ms ? image.period_ms : DRFIFO_PERSIST_PERIOD_MS;
+        persist->synced_put_count = fifo->put_count;
+        persist->synced_get_count = fifo->get_count;
+
+        if (sizeof(fifo_image_t) != image.header_bytes)
+        {
+            // An older, shorter header: the data move. Commit an empty image
+            // in the new layout, so that a crash can lose the data but never
+            // leave them at the wrong offsets; the next sync writes them all.
+            fifo_image_t empty;
+            fifo_image_header(fifo, &empty);
+            empty.put_count  = empty.get_count;
+            empty.durability = persist->durability;
+            empty.period_ms  = persist->period_ms;
+            drfifo_image_size(file, fifo->size);
+            drfifo_image_commit(file, &empty, 1);
+            persist->synced_put_count = fifo->get_count;
+        }
+
+        drfifo_persist_start_timer(persist);
+        return fifo;
+    }
+
+    DbgPrint(DRIVER_NAME ": ignoring invalid image file.");
+    fifo_del(&fifo);
+    ZwClose(file);
+
+    if (NULL != persist->staging)
+    {
+        ExFreePoolWithTag(persist->staging, DRFIFO_POOL_TAG);
+        persist->staging = NULL;
+        persist->staging_size = 0;
+    }
+
+    return NULL;
+}   /* drfifo_persist_load() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Handles DRFIFO_IOCTL_PERSIST: turns persistence on or off, or changes its
+ * durability level. Turning it on writes a complete image right away. Must
+ * be called at PASSIVE_LEVEL.
+ *
+ * @param drfifo - device of interest.
+ * @param config - requested settings.
+ *
+ * @return STATUS_SUCCESS on success, something else otherwise.
+ */
+NTSTATUS drfifo_persist_config(drfifo_dev_t* drfifo, const drfifo_ioctl_persist_t* config)
+{
+    drfifo_persist_t* persist = &drfifo->persist;
+    NTSTATUS          status = STATUS_SUCCESS;
+
+    if (config->durability > DRFIFO_DURABILITY_BATCH)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (NULL == drfifo->fifo)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    drfifo_persist_stop_timer(persist);
+    KeWaitForSingleObject(&persist->mutex, Executive, KernelMode, FALSE, NULL);
+
+    if (DRFIFO_DURABILITY_OFF == config->durability)
+    {
+        drfifo_persist_close(persist, 1);
+    }
+    else
+    {
+        if (NULL == persist->file)
+        {
+            status = drfifo_persist_alloc(persist, drfifo->fifo->size);
+
+            if (NT_SUCCESS(status))
+            {
+                status = drfifo_image_open(&persist->file, FILE_OVERWRITE_IF);
+            }
+
+            if (NT_SUCCESS(status))
+            {
+                status = drfifo_image_size(persist->file, drfifo->fifo->size);
+            }
+
+            // Start from an empty image so the first sync writes all unread data.
+            persist->synced_put_count = drfifo->fifo->get_count;
+            persist->synced_get_count = drfifo->fifo->get_count;
+        }
+
+        persist->durability = config->durability;
+        persist->period_ms  = config->period_ms ? config->period_ms : DRFIFO_PERSIST_PERIOD_MS;
+
+        if (NT_SUCCESS(status))
+        {
+            status = drfifo_persist_sync_locked(drfifo, 1);
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            drfifo_persist_close(persist, 1);
+        }
+    }
+
+    KeSetEvent(&persist->mutex, IO_NO_INCREMENT, FALSE);
+    InterlockedExchange(&persist->work_queued, 0);      // Taken by drfifo_persist_stop_timer().
+
+    if (NULL != persist->file)
+    {
+        drfifo_persist_start_timer(persist);
+    }
+
+    return status;
+}   /* drfifo_persist_config() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Initializes the persistence state of @a drfifo, whose device object is
+ * @a dev. Persistence stays off until drfifo_persist_load() finds an image
+ * or DRFIFO_IOCTL_PERSIST turns it on.
+ */
+void drfifo_persist_init(drfifo_dev_t* drfifo, PDEVICE_OBJECT dev)
+{
+    drfifo_persist_t* persist = &drfifo->persist;
+
+    KeInitializeEvent(&persist->mutex, SynchronizationEvent, TRUE);
+    KeInitializeTimer(&persist->timer);
+    KeInitializeDpc(&persist->dpc, drfifo_persist_dpc, drfifo);
+    persist->work_item = IoAllocateWorkItem(dev);
+
+    if (NULL == persist->work_item)
+    {
+        DbgPrint("%s: Could not allocate work item for persisting the FIFO.\r\n", DRIVER_NAME);
+    }
+}   /* drfifo_persist_init() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Shuts down persistence for @a drfifo when the driver unloads. Whatever
+ * the durability level, a clean unload leaves a complete image behind. The
+ * work item stays taken over; it is freed.
+ */
+void drfifo_persist_exit(drfifo_dev_t* drfifo)
+{
+    drfifo_persist_t* persist = &drfifo->persist;
+
+    drfifo_persist_stop_timer(persist);
+    drfifo_persist_sync(drfifo, 1);
+    drfifo_persist_close(persist, 0);
+
+    if (NULL != persist->work_item)
+    {
+        IoFreeWorkItem(persist->work_item);
+        persist->work_item = NULL;
+    }
+}   /* drfifo_persist_exit() */
@@ -0,0 +1,42 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#ifndef __drfifo_persist_h__
+#define __drfifo_persist_h__
+
+#include <ntddk.h>
+
+#include "drfifo_ioctl.h"
+#include "fifo.h"
+
+struct drfifo_dev_s;
+
+/**
+ * State for mirroring the FIFO into its image file. See
+ * drfifo_persist_sync_locked() in drfifo_persist.c for the commit protocol.
+ */
+typedef struct drfifo_persist_s
+{
+    HANDLE       file;              /**< Image file; NULL when persistence is off. */
+    ulong_t      durability;        /**< DRFIFO_DURABILITY_xxx. */
+    ulong_t      period_ms;         /**< Sync period for DRFIFO_DURABILITY_PERIODIC. */
+    size_t       synced_put_count;  /**< put_count as last committed to the image. */
+    size_t       synced_get_count;  /**< get_count as last committed to the image. */
+    uint8_t*     staging;           /**< Dirty ring bytes, copied out under the FIFO lock. */
+    size_t       staging_size;      /**< Size of the staging buffer, in bytes. */
+    KEVENT       mutex;             /**< Serializes syncs while staying at PASSIVE_LEVEL. */
+    KTIMER       timer;             /**< Periodic sync timer. */
+    KDPC         dpc;               /**< Timer DPC; queues work_item. */
+    PIO_WORKITEM work_item;         /**< Performs periodic syncs at PASSIVE_LEVEL. */
+    LONG         work_queued;       /**< 1 while work_item is queued or running. */
+    LONG         dirty;             /**< Set by drfifo_persist_dirty() until a sync starts that commits it. */
+} drfifo_persist_t;
+
+void     drfifo_persist_init(struct drfifo_dev_s* drfifo, PDEVICE_OBJECT dev);
+void     drfifo_persist_exit(struct drfifo_dev_s* drfifo);
+fifo_t*  drfifo_persist_load(struct drfifo_dev_s* drfifo);
+NTSTATUS drfifo_persist_sync(struct drfifo_dev_s* drfifo, int flush);
+void     drfifo_persist_dirty(struct drfifo_dev_s* drfifo);     // Queues a batch sync; up to DISPATCH_LEVEL.
+NTSTATUS drfifo_persist_config(struct drfifo_dev_s* drfifo, const drfifo_ioctl_persist_t* config);
+
+#endif
@@ -0,0 +1,585 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#include <ntifs.h>
+#include <wdm.h>
+#include <ntstrsafe.h>
+
+#include "drfifo.h"
+#include "drfifo_stdint.h"
+#include "drfifo_ioctl.h"
+#include "drfifo_event.h"
+#include "drfifo_sink.h"
+#include "fifo.h"
+
+/**
+ * Format of sink file names; the argument is the file number.
+ */
+#define DRFIFO_SINK_PATH_FORMAT   M_T("\\DosDevices\\C:\\drfifo.%lu.sink")
+
+/**
+ * Unit of unbuffered writes. Offsets and sizes must be whole sectors, and
+ * every disk's sector size divides this.
+ */
+#define DRFIFO_SINK_SECTOR_BYTES   4096
+
+/**
+ * Default bytes gathered before a write is worth it.
+ */
+#define DRFIFO_SINK_BATCH_BYTES    (256 * 1024)
+
+/**
+ * Default period at which a partial batch is written anyway.
+ */
+#define DRFIFO_SINK_FLUSH_MS       100
+
+/**
+ * Default file size at which the sink moves on to a new file.
+ */
+#define DRFIFO_SINK_ROTATE_BYTES   (64 * 1024 * 1024)
+
+/**
+ * Failed writes in a row after which the sink gives up and turns itself
+ * off. Each failure doubles the flush periods waited before the retry, so
+ * this is about 2^8 periods of a disk that stays broken.
+ */
+#define DRFIFO_SINK_MAX_FAILURES   8
+
+/**
+ * Rounds @a _n up to whole sectors.
+ */
+#define DRFIFO_SINK_ROUND_UP(_n)   (((_n) + DRFIFO_SINK_SECTOR_BYTES - 1) & ~(size_t) (DRFIFO_SINK_SECTOR_BYTES - 1))
+
+static void drfifo_sink_queue(drfifo_dev_t* drfifo, int partial);
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Creates the next sink file, skipping numbers already taken so that the
+ * logs of an earlier run are never overwritten. Run by the worker only.
+ *
+ * The file is opened for unbuffered, write-through I/O: the batch goes
+ * straight from the sink's buffer to the disk, with no copy through the
+ * cache, and the write is complete only once the data are on the disk.
+ *
+ * @return the result of ZwCreateFile().
+ */
+static NTSTATUS drfifo_sink_open(drfifo_sink_t* sink)
+{
+    WCHAR             name[0x40];
+    UNICODE_STRING    uname;
+    OBJECT_ATTRIBUTES attr;
+    IO_STATUS_BLOCK   io_status;
+    NTSTATUS          status;
+
+    for (;;)
+    {
+        status = RtlStringCchPrintfW(name, sizeof(name) / sizeof(name[0]), DRFIFO_SINK_PATH_FORMAT, sink->file_number);
+
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        RtlInitUnicodeString(&uname, name);
+        InitializeObjectAttributes(&attr, &uname, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+        status = ZwCreateFile(&sink->file,
+                              GENERIC_WRITE | SYNCHRONIZE,
+                              &attr,
+                              &io_status,
+                              NULL,
+                              FILE_ATTRIBUTE_NORMAL,
+                              FILE_SHARE_READ,
+                              FILE_CREATE,
+                              FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT |
+                              FILE_NO_INTERMEDIATE_BUFFERING | FILE_WRITE_THROUGH,
+                              NULL,
+                              0);
+
+        if (STATUS_OBJECT_NAME_COLLISION != status)
+        {
+            break;
+        }
+
+        sink->file_number++;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        sink->file = NULL;
+    }
+
+    return status;
+}   /* drfifo_sink_open() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Closes the sink file, trimming the padding of its last sector, and moves
+ * on to the next file number. Anything in the batch not yet written is
+ * lost. Run by the worker only.
+ */
+static void drfifo_sink_close(drfifo_sink_t* sink)
+{
+    FILE_END_OF_FILE_INFORMATION eof;
+    IO_STATUS_BLOCK              io_status;
+
+    if (NULL != sink->file)
+    {
+        eof.EndOfFile.QuadPart = (LONGLONG) (sink->file_offset + sink->written_bytes);
+        ZwSetInformationFile(sink->file, &io_status, &eof, sizeof(eof), FileEndOfFileInformation);
+        ZwClose(sink->file);
+        sink->file = NULL;
+        sink->file_number++;
+    }
+
+    sink->file_offset   = 0;
+    sink->buffer_bytes  = 0;
+    sink->written_bytes = 0;
+}   /* drfifo_sink_close() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Writes the part of the batch not yet on disk, from the start of its
+ * sector - the last sector written is rewritten with what has been added to
+ * it - to the end of its last sector, zero-padded. Run by the worker only.
+ *
+ * @return the result of ZwWriteFile().
+ */
+static NTSTATUS drfifo_sink_write(drfifo_sink_t* sink)
+{
+    const size_t    start = sink->written_bytes & ~(size_t) (DRFIFO_SINK_SECTOR_BYTES - 1);
+    const size_t    end   = DRFIFO_SINK_ROUND_UP(sink->buffer_bytes);
+    IO_STATUS_BLOCK io_status;
+    LARGE_INTEGER   position;
+    NTSTATUS        status = STATUS_SUCCESS;
+
+    RtlZeroMemory(&sink->buffer[sink->buffer_bytes], end - sink->buffer_bytes);
+
+    if (NULL == sink->file)
+    {
+        status = drfifo_sink_open(sink);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        position.QuadPart = (LONGLONG) (sink->file_offset + start);
+        status = ZwWriteFile(sink->file, NULL, NULL, NULL, &io_status,
+                             &sink->buffer[start], (ULONG) (end - start), &position, NULL);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        sink->written_bytes = sink->buffer_bytes;
+    }
+    else
+    {
+        DbgPrint(DRIVER_NAME ": drfifo_sink_write() failed with 0x%08X.", (unsigned) status);
+    }
+
+    return status;
+}   /* drfifo_sink_write() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Gets packets from the FIFO into the batch, each as a record laid out as
+ * in a spill segment - a uint32_t size, then the data, which start with the
+ * topic if the FIFO is topic-tagged - until there's a batch's worth, or not
+ * room left for the largest packet. What is gotten stays held in the FIFO.
+ * Empty packets carry nothing worth a record and are dropped. Run by the
+ * worker only, with the FIFO lock held.
+ */
+static void drfifo_sink_gather(drfifo_dev_t* drfifo)
+{
+    drfifo_sink_t* sink = &drfifo->sink;
+    fifo_t*        fifo = drfifo->fifo;
+    const size_t   tagged = fifo_is_topic_tagged(fifo) ? 1 : 0;
+    const size_t   carried = sink->written_bytes % DRFIFO_SINK_SECTOR_BYTES;
+    uint8_t*       record;
+    uint32_t       bytes;
+    ssize_t        gotten;
+
+    if (!fifo_hold(fifo))
+    {
+        return;     // Broadcast or retention was turned on; see drfifo_sink_config().
+    }
+
+    while ((fifo_bytes_to_get(fifo) > 0) &&
+           ((sink->buffer_bytes - carried) < sink->batch_bytes) &&
+           ((sink->buffer_size - sink->buffer_bytes) >= sink->reserve_bytes))
+    {
+        record = &sink->buffer[sink->buffer_bytes];
+        gotten = fifo_reader_get(fifo, &sink->reader, &record[sizeof(bytes) + tagged],
+                                 sink->buffer_size - sink->buffer_bytes - sizeof(bytes) - tagged);
+
+        if (gotten <= 0)
+        {
+            break;      // Nothing left but packets that are skipped or empty; the next round goes on.
+        }
+
+        if (tagged)
+        {
+            record[sizeof(bytes)] = (uint8_t) sink->reader.topic;
+        }
+
+        bytes = (uint32_t) (gotten + tagged);
+        RtlCopyMemory(record, &bytes, sizeof(bytes));
+        sink->buffer_bytes += sizeof(bytes) + bytes;
+    }
+}   /* drfifo_sink_gather() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * One round of the sink: gathers a batch, writes it outside the FIFO lock,
+ * and only then releases its room in the FIFO to writers. A failed write
+ * keeps the data held and is retried from the flush timer, after a wait
+ * that doubles with each failure in a row; after DRFIFO_SINK_MAX_FAILURES
+ * the sink turns itself off. Once the sink is disabled nothing more is
+ * gathered; what is held is written, or given up if it can't be, and the
+ * file is closed. The caller must own the worker; see work_queued.
+ */
+static void drfifo_sink_drain(drfifo_dev_t* drfifo)
+{
+    drfifo_sink_t* sink = &drfifo->sink;
+    KIRQL          level;
+    NTSTATUS       status = STATUS_SUCCESS;
+    size_t         batch;
+    size_t         keep;
+    int            enabled;
+    int            gave_up = 0;
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    enabled = sink->enabled && (NULL != drfifo->fifo);
+
+    if (enabled)
+    {
+        drfifo_sink_gather(drfifo);
+    }
+
+    batch = sink->buffer_bytes - sink->written_bytes;
+    drfifo_unlock(drfifo, level);
+
+    if (batch > 0)
+    {
+        status = drfifo_sink_write(sink);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+        sink->errors++;
+        sink->failures++;
+
+        if (enabled && (sink->failures < DRFIFO_SINK_MAX_FAILURES))
+        {
+            sink->retry_periods = 1 << (sink->failures - 1);
+            drfifo_unlock(drfifo, level);
+            return;     // Still held; the flush timer tries again.
+        }
+
+        if (enabled)
+        {
+            sink->enabled = 0;
+            gave_up = 1;
+        }
+
+        enabled = 0;
+        drfifo_unlock(drfifo, level);
+
+        if (gave_up)
+        {
+            KeCancelTimer(&sink->timer);
+            DbgPrint(DRIVER_NAME ": drfifo_sink_drain() turning the sink off after %u failed writes.",
+                     (unsigned) DRFIFO_SINK_MAX_FAILURES);
+        }
+
+        DbgPrint(DRIVER_NAME ": drfifo_sink_drain() lost %u bytes.", (unsigned) batch);
+    }
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+
+    if (fifo_release(drfifo->fifo) > 0)
+    {
+        drfifo_event_room(drfifo);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        sink->failures = 0;
+        sink->retry_periods = 0;
+
+        if (batch > 0)
+        {
+            sink->bytes += batch;
+            sink->writes++;
+        }
+    }
+
+    drfifo_unlock(drfifo, level);
+
+    if (!enabled || ((sink->file_offset + sink->buffer_bytes) >= sink->rotate_bytes))
+    {
+        drfifo_sink_close(sink);
+    }
+    else
+    {
+        // Keep the partial last sector; the next write rewrites it.
+        keep = sink->buffer_bytes % DRFIFO_SINK_SECTOR_BYTES;
+        RtlMoveMemory(sink->buffer, &sink->buffer[sink->buffer_bytes - keep], keep);
+        sink->file_offset  += sink->buffer_bytes - keep;
+        sink->buffer_bytes  = keep;
+        sink->written_bytes = keep;
+    }
+}   /* drfifo_sink_drain() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Sink worker. Runs a round, then goes again if a full batch is already
+ * waiting.
+ */
+IO_WORKITEM_ROUTINE drfifo_sink_work;
+VOID drfifo_sink_work(PDEVICE_OBJECT DeviceObject, PVOID Context)
+{
+    drfifo_dev_t* drfifo = (drfifo_dev_t*) DeviceObject->DeviceExtension;
+
+    drfifo_sink_drain(drfifo);
+    InterlockedExchange(&drfifo->sink.work_queued, 0);
+    drfifo_sink_queue(drfifo, 0);
+}   /* drfifo_sink_work() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Timer DPC for periodic flushes: whatever has waited a period is written,
+ * however little.
+ */
+KDEFERRED_ROUTINE drfifo_sink_dpc;
+VOID drfifo_sink_dpc(PKDPC dpc, PVOID context, PVOID arg1, PVOID arg2)
+{
+    drfifo_sink_queue((drfifo_dev_t*) context, 1);
+}   /* drfifo_sink_dpc() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Queues the sink worker if there's something for it to do and it isn't
+ * already queued. May be called at IRQL <= DISPATCH_LEVEL without the FIFO
+ * lock.
+ *
+ * @param drfifo - device of interest.
+ * @param partial - non-zero if any data at all are reason enough to run,
+ * as for the flush timer; otherwise it takes a batch's worth. While writes
+ * are failing only the former counts.
+ */
+static void drfifo_sink_queue(drfifo_dev_t* drfifo, int partial)
+{
+    drfifo_sink_t* sink = &drfifo->sink;
+    KIRQL          level;
+    int            wanted;
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+
+    if (0 != sink->failures)
+    {
+        // A write is failing: only the timer retries it, once its wait is up.
+        wanted = partial && sink->enabled && (0 == sink->retry_periods);
+        sink->retry_periods -= (partial && (sink->retry_periods > 0));
+    }
+    else
+    {
+        wanted = sink->enabled && (NULL != drfifo->fifo) &&
+                 ((sink->buffer_bytes > sink->written_bytes) ||
+                  (fifo_bytes_to_get(drfifo->fifo) >= (partial ? 1 : sink->batch_bytes)));
+    }
+
+    drfifo_unlock(drfifo, level);
+
+    if (wanted && (NULL != sink->work_item) &&
+        (0 == InterlockedCompareExchange(&sink->work_queued, 1, 0)))
+    {
+        IoQueueWorkItem(sink->work_item, drfifo_sink_work, DelayedWorkQueue, NULL);
+    }
+}   /* drfifo_sink_queue() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Queues the sink worker if a batch's worth is waiting, such as after a
+ * write. Cheap when the sink is off.
+ */
+void drfifo_sink_kick(drfifo_dev_t* drfifo)
+{
+    if (drfifo->sink.enabled)
+    {
+        drfifo_sink_queue(drfifo, 0);
+    }
+}   /* drfifo_sink_kick() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Stops the flush timer, disables the sink and takes over the worker,
+ * waiting for any round in progress. The caller must give the worker back
+ * by clearing work_queued. Must be called at PASSIVE_LEVEL.
+ */
+static void drfifo_sink_stop(drfifo_dev_t* drfifo)
+{
+    drfifo_sink_t* sink = &drfifo->sink;
+    LARGE_INTEGER  delay;
+    KIRQL          level;
+
+    KeCancelTimer(&sink->timer);
+    KeFlushQueuedDpcs();
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    sink->enabled = 0;
+    drfifo_unlock(drfifo, level);
+    delay.QuadPart = -10 * 1000 * 10;     // 10ms, relative.
+
+    while (0 != InterlockedCompareExchange(&sink->work_queued, 1, 0))
+    {
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+    }
+}   /* drfifo_sink_stop() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Handles DRFIFO_IOCTL_SINK. Disabling writes out and releases whatever
+ * the sink holds and closes its file; reads work again once it returns.
+ * Must be called at PASSIVE_LEVEL.
+ *
+ * @param drfifo - device of interest.
+ * @param config - requested settings.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_INVALID_DEVICE_STATE if the
+ * FIFO is broadcasting or retaining, something else otherwise.
+ */
+NTSTATUS drfifo_sink_config(drfifo_dev_t* drfifo, const drfifo_ioctl_sink_t* config)
+{
+    drfifo_sink_t* sink = &drfifo->sink;
+    NTSTATUS       status = STATUS_SUCCESS;
+    LARGE_INTEGER  due;
+    KIRQL          level;
+    size_t         reserve;
+    size_t         batch;
+    size_t         size;
+
+    if (NULL == drfifo->fifo)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (NULL == sink->work_item)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (config->enabled && (fifo_is_broadcast(drfifo->fifo) || fifo_is_retaining(drfifo->fifo)))
+    {
+        return STATUS_INVALID_DEVICE_STATE;     // Each keeps its own tail; see fifo_hold().
+    }
+
+    drfifo_sink_stop(drfifo);
+
+    if (!config->enabled)
+    {
+        drfifo_sink_drain(drfifo);
+        InterlockedExchange(&sink->work_queued, 0);
+        return STATUS_SUCCESS;
+    }
+
+    // Room for the partial sector carried over, a batch, and then the
+    // largest packet a get can return, so that none is ever truncated -
+    // short of a compressed one that expands past the ring's capacity.
+    reserve = fifo_bytes_capacity(drfifo->fifo);
+    reserve = (fifo_slab_buffer_bytes(drfifo->fifo->slab) > reserve) ? fifo_slab_buffer_bytes(drfifo->fifo->slab) : reserve;
+    reserve += sizeof(uint32_t) + 1;
+    batch = config->batch_bytes ? config->batch_bytes : DRFIFO_SINK_BATCH_BYTES;
+    size = DRFIFO_SINK_ROUND_UP(DRFIFO_SINK_SECTOR_BYTES + batch + reserve);
+
+    if (sink->buffer_size < size)
+    {
+        // At least a page, so page-aligned, as unbuffered I/O needs.
+        uint8_t* buffer = (uint8_t*) ExAllocatePoolWithTag(NonPagedPool, size, DRFIFO_POOL_TAG);
+
+        if (NULL == buffer)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+        else
+        {
+            if (NULL != sink->buffer)
+            {
+                RtlCopyMemory(buffer, sink->buffer, sink->buffer_bytes);
+                ExFreePoolWithTag(sink->buffer, DRFIFO_POOL_TAG);
+            }
+
+            sink->buffer = buffer;
+            sink->buffer_size = size;
+        }
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        sink->flush_ms     = config->flush_ms     ? config->flush_ms     : DRFIFO_SINK_FLUSH_MS;
+        sink->rotate_bytes = config->rotate_bytes ? config->rotate_bytes : DRFIFO_SINK_ROTATE_BYTES;
+        drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+        sink->reserve_bytes = reserve;
+        sink->batch_bytes   = (ulong_t) batch;
+        sink->failures      = 0;
+        sink->retry_periods = 0;
+        sink->enabled       = 1;
+        drfifo_unlock(drfifo, level);
+        due.QuadPart = -10 * 1000 * (LONGLONG) sink->flush_ms;
+        KeSetTimerEx(&sink->timer, due, (LONG) sink->flush_ms, &sink->dpc);
+    }
+    else
+    {
+        drfifo_sink_drain(drfifo);      // Stay off, as if disabled.
+    }
+
+    InterlockedExchange(&sink->work_queued, 0);
+    drfifo_sink_kick(drfifo);
+    return status;
+}   /* drfifo_sink_config() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Initializes the sink state of @a drfifo, whose device object is @a dev.
+ * The sink stays off until DRFIFO_IOCTL_SINK turns it on.
+ */
+void drfifo_sink_init(drfifo_dev_t* drfifo, PDEVICE_OBJECT dev)
+{
+    drfifo_sink_t* sink = &drfifo->sink;
+
+    sink->batch_bytes  = DRFIFO_SINK_BATCH_BYTES;
+    sink->flush_ms     = DRFIFO_SINK_FLUSH_MS;
+    sink->rotate_bytes = DRFIFO_SINK_ROTATE_BYTES;
+    KeInitializeTimer(&sink->timer);
+    KeInitializeDpc(&sink->dpc, drfifo_sink_dpc, drfifo);
+    sink->work_item = IoAllocateWorkItem(dev);
+
+    if (NULL == sink->work_item)
+    {
+        DbgPrint("%s: Could not allocate work item for the sink.\r\n", DRIVER_NAME);
+    }
+}   /* drfifo_sink_init() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Shuts down the sink when the driver unloads, writing out whatever it
+ * holds and closing its file.
+ */
+void drfifo_sink_exit(drfifo_dev_t* drfifo)
+{
+    drfifo_sink_t* sink = &drfifo->sink;
+
+    drfifo_sink_stop(drfifo);
+    drfifo_sink_drain(drfifo);
+
+    if (NULL != sink->buffer)
+    {
+        ExFreePoolWithTag(sink->buffer, DRFIFO_POOL_TAG);
+        sink->buffer = NULL;
+        sink->buffer_size = 0;
+    }
+
+    if (NULL != sink->work_item)
+    {
+        IoFreeWorkItem(sink->work_item);
+        sink->work_item = NULL;
+    }
+}   /* drfifo_sink_exit() */
@@ -0,0 +1,55 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#ifndef __drfifo_sink_h__
+#define __drfifo_sink_h__
+
+#include <ntddk.h>
+
+#include "drfifo_ioctl.h"
+#include "fifo.h"
+
+struct drfifo_dev_s;
+
+/**
+ * State for draining the FIFO into log files from within the driver.
+ *
+ * The sink worker gathers packets into a sector-aligned batch and writes it
+ * with unbuffered I/O. What it has gathered stays held in the FIFO (see
+ * fifo_hold()) until the write completes, so writers see no room for it
+ * until it's on disk. Only the worker touches the files and the batch, so
+ * those fields need no locking; the fields marked "FIFO lock" are shared
+ * with the dispatch routines.
+ */
+typedef struct drfifo_sink_s
+{
+    ulong_t       enabled;         /**< Non-zero while the sink is the FIFO's reader. FIFO lock. */
+    ulong_t       batch_bytes;     /**< Bytes gathered before a write is worth it. FIFO lock. */
+    ulong_t       flush_ms;        /**< Period at which a partial batch is written anyway. */
+    ulong_t       rotate_bytes;    /**< File size at which the sink moves on to a new file. */
+    fifo_reader_t reader;          /**< The sink's topic, when the FIFO is topic-tagged. FIFO lock. */
+    HANDLE        file;            /**< File being appended to, or NULL. */
+    ulong_t       file_number;     /**< Number of the file being appended to. */
+    uint64_t      file_offset;     /**< Offset in file of buffer[0]; a multiple of the sector size. */
+    uint8_t*      buffer;          /**< Batch: records from file_offset on, page-aligned. */
+    size_t        buffer_size;     /**< Size of buffer, in bytes. */
+    size_t        buffer_bytes;    /**< Bytes of records in buffer. */
+    size_t        written_bytes;   /**< ...of which are already on disk. */
+    size_t        reserve_bytes;   /**< Room kept in buffer for the largest packet. */
+    uint64_t      bytes;           /**< Record bytes written since the sink was enabled. FIFO lock. */
+    uint64_t      writes;          /**< Batches written. FIFO lock. */
+    uint64_t      errors;          /**< Writes failed, to be retried. FIFO lock. */
+    ulong_t       failures;        /**< Writes failed in a row; while non-zero only the timer queues the worker. FIFO lock. */
+    ulong_t       retry_periods;   /**< Flush periods still to wait before retrying a failed write. FIFO lock. */
+    KTIMER        timer;           /**< Periodic flush timer. */
+    KDPC          dpc;             /**< Timer DPC; queues work_item. */
+    PIO_WORKITEM  work_item;       /**< Runs the sink worker at PASSIVE_LEVEL. */
+    LONG          work_queued;     /**< 1 while work_item is queued or running. */
+} drfifo_sink_t;
+
+void     drfifo_sink_init(struct drfifo_dev_s* drfifo, PDEVICE_OBJECT dev);
+void     drfifo_sink_exit(struct drfifo_dev_s* drfifo);
+NTSTATUS drfifo_sink_config(struct drfifo_dev_s* drfifo, const drfifo_ioctl_sink_t* config);
+void     drfifo_sink_kick(struct drfifo_dev_s* drfifo);
+
+#endif
@@ -0,0 +1,692 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#include <ntifs.h>
+#include <wdm.h>
+#include <ntstrsafe.h>
+
+#include "drfifo.h"
+#include "drfifo_stdint.h"
+#include "drfifo_ioctl.h"
+#include "drfifo_event.h"
+#include "drfifo_spill.h"
+#include "fifo.h"
+
+/**
+ * Format of spill segment file names; the argument is the segment number.
+ */
+#define DRFIFO_SPILL_PATH_FORMAT   M_T("\\DosDevices\\C:\\drfifo.%lu.spill")
+
+/**
+ * Default segment size at which the spill writer starts a new file.
+ */
+#define DRFIFO_SPILL_SEGMENT_BYTES   (1024 * 1024)
+
+/**
+ * Default limit on spilled bytes waiting in memory for the spill worker.
+ */
+#define DRFIFO_SPILL_MEMORY_BYTES    (256 * 1024)
+
+/**
+ * A spilled packet waiting in memory to be written to disk. The bytes and
+ * data fields are laid out exactly as the record is stored in a segment
+ * file, so the record is written with a single ZwWriteFile().
+ */
+typedef struct drfifo_spill_packet_s
+{
+    LIST_ENTRY link;       /**< Link in drfifo_spill_t.pending. */
+    uint32_t   bytes;      /**< Number of bytes in data. */
+    uint8_t    data[1];    /**< Packet data. */
+} drfifo_spill_packet_t;
+
+static void drfifo_spill_queue(drfifo_dev_t* drfifo, int drain);
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Opens spill segment number @a segment.
+ *
+ * Readers open segments with FILE_DELETE_ON_CLOSE; a segment is only closed
+ * by its reader once it's been drained and the writer has moved on, so the
+ * file goes away as soon as it's no longer needed.
+ *
+ * @param handle - receives the file handle.
+ * @param segment - segment number.
+ * @param write - non-zero to create the segment for appending, zero to
+ * open it for draining.
+ *
+ * @return the result of ZwCreateFile().
+ */
+static NTSTATUS drfifo_spill_open(HANDLE* handle, ulong_t segment, int write)
+{
+    WCHAR             name[0x40];
+    UNICODE_STRING    uname;
+    OBJECT_ATTRIBUTES attr;
+    IO_STATUS_BLOCK   io_status;
+    NTSTATUS          status;
+
+    status = RtlStringCchPrintfW(name, sizeof(name) / sizeof(name[0]), DRFIFO_SPILL_PATH_FORMAT, segment);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    RtlInitUnicodeString(&uname, name);
+    InitializeObjectAttributes(&attr, &uname, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    return ZwCreateFile(handle,
+                        write ? (GENERIC_WRITE | SYNCHRONIZE) : (GENERIC_READ | DELETE),
+                        &attr,
+                        &io_status,
+                        NULL,
+                        FILE_ATTRIBUTE_NORMAL,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        write ? FILE_OVERWRITE_IF : FILE_OPEN,
+                        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT |
+                        (write ? 0 : FILE_DELETE_ON_CLOSE),
+                        NULL,
+                        0);
+}   /* drfifo_spill_open() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Reads exactly @a bytes at @a offset in @a file.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_END_OF_FILE if the file holds
+ * fewer bytes, or the error from ZwReadFile().
+ */
+static NTSTATUS drfifo_spill_read(HANDLE file, void* data, size_t bytes, uint64_t offset)
+{
+    IO_STATUS_BLOCK io_status;
+    LARGE_INTEGER   position;
+    NTSTATUS        status;
+
+    position.QuadPart = (LONGLONG) offset;
+    status = ZwReadFile(file, NULL, NULL, NULL, &io_status, data, (ULONG) bytes, &position, NULL);
+
+    if (NT_SUCCESS(status) && (io_status.Information < bytes))
+    {
+        status = STATUS_END_OF_FILE;
+    }
+
+    return status;
+}   /* drfifo_spill_read() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Closes the spill files and deletes every segment. Run by the worker only.
+ */
+static void drfifo_spill_remove_segments(drfifo_spill_t* spill)
+{
+    HANDLE  file = NULL;
+    ulong_t segment;
+
+    if (NULL != spill->write_file)
+    {
+        ZwClose(spill->write_file);
+        spill->write_file = NULL;
+    }
+
+    if (NULL != spill->read_file)
+    {
+        ZwClose(spill->read_file);      // Deleted on close.
+        spill->read_file = NULL;
+    }
+
+    for (segment = spill->read_segment; segment != spill->write_segment + 1; segment++)
+    {
+        if (NT_SUCCESS(drfifo_spill_open(&file, segment, 0)))
+        {
+            ZwClose(file);              // Deleted on close.
+        }
+    }
+
+    spill->read_segment  = 0;
+    spill->read_offset   = 0;
+    spill->write_segment = 0;
+    spill->write_offset  = 0;
+    spill->next_bytes    = 0;
+}   /* drfifo_spill_remove_segments() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Appends the packets in @a batch to the write segment, moving on to a new
+ * segment whenever the current one reaches segment_bytes, and frees them.
+ * Run by the worker only.
+ *
+ * @return the number of packets that could not be written and are lost.
+ */
+static size_t drfifo_spill_append(drfifo_spill_t* spill, PLIST_ENTRY batch)
+{
+    IO_STATUS_BLOCK        io_status;
+    LARGE_INTEGER          position;
+    PLIST_ENTRY            entry;
+    drfifo_spill_packet_t* packet;
+    NTSTATUS               status = STATUS_SUCCESS;
+    size_t                 lost = 0;
+
+    while (!IsListEmpty(batch))
+    {
+        entry  = RemoveHeadList(batch);
+        packet = CONTAINING_RECORD(entry, drfifo_spill_packet_t, link);
+
+        if ((NULL != spill->write_file) && (spill->write_offset >= spill->segment_bytes))
+        {
+            ZwClose(spill->write_file);
+            spill->write_file = NULL;
+            spill->write_segment++;
+        }
+
+        if (NULL == spill->write_file)
+        {
+            spill->write_offset = 0;
+            status = drfifo_spill_open(&spill->write_file, spill->write_segment, 1);
+
+            if (!NT_SUCCESS(status))
+            {
+                spill->write_file = NULL;
+            }
+        }
+
+        if (NULL != spill->write_file)
+        {
+            position.QuadPart = (LONGLONG) spill->write_offset;
+            status = ZwWriteFile(spill->write_file, NULL, NULL, NULL, &io_status,
+                                 &packet->bytes, sizeof(packet->bytes) + packet->bytes, &position, NULL);
+        }
+
+        if (NT_SUCCESS(status))
+        {
+            spill->write_offset += sizeof(packet->bytes) + packet->bytes;
+        }
+        else
+        {
+            DbgPrint(DRIVER_NAME ": drfifo_spill_append() lost %u bytes (0x%08X).",
+                     packet->bytes, (unsigned) status);
+            lost++;
+        }
+
+        ExFreePoolWithTag(packet, DRFIFO_POOL_TAG);
+    }
+
+    return lost;
+}   /* drfifo_spill_append() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Reads the next spilled record into the spill buffer, moving on to the next
+ * segment when the current one is drained. Run by the worker only.
+ *
+ * @return STATUS_SUCCESS if a record was read, STATUS_END_OF_FILE if the
+ * spill files hold no more records, or another error.
+ */
+static NTSTATUS drfifo_spill_next_record(drfifo_spill_t* spill)
+{
+    NTSTATUS status;
+    uint32_t bytes = 0;
+
+    for (;;)
+    {
+        if (NULL == spill->read_file)
+        {
+            status = drfifo_spill_open(&spill->read_file, spill->read_segment, 0);
+
+            if (!NT_SUCCESS(status))
+            {
+                spill->read_file = NULL;
+                return status;
+            }
+
+            spill->read_offset = 0;
+        }
+
+        status = drfifo_spill_read(spill->read_file, &bytes, sizeof(bytes), spill->read_offset);
+
+        if ((STATUS_END_OF_FILE == status) && (spill->read_segment != spill->write_segment))
+        {
+            ZwClose(spill->read_file);      // Deleted on close.
+            spill->read_file = NULL;
+            spill->read_segment++;
+            continue;
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        spill->read_offset += sizeof(bytes);
+
+        if (bytes > spill->buffer_size)
+        {
+            DbgPrint(DRIVER_NAME ": drfifo_spill_next_record() dropping %u-byte record.", bytes);
+            spill->read_offset += bytes;
+            return STATUS_BUFFER_OVERFLOW;
+        }
+
+        status = drfifo_spill_read(spill->read_file, spill->buffer, bytes, spill->read_offset);
+
+        if (NT_SUCCESS(status))
+        {
+            spill->read_offset += bytes;
+            spill->next_bytes   = bytes;
+        }
+
+        return status;
+    }
+}   /* drfifo_spill_next_record() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Spill worker. Writes pending packets to disk, then moves spilled records
+ * back into the FIFO, oldest first, until the FIFO is full or the spill is
+ * empty.
+ */
+IO_WORKITEM_ROUTINE drfifo_spill_work;
+VOID drfifo_spill_work(PDEVICE_OBJECT DeviceObject, PVOID Context)
+{
+    drfifo_dev_t*   drfifo = (drfifo_dev_t*) DeviceObject->DeviceExtension;
+    drfifo_spill_t* spill = &drfifo->spill;
+    LIST_ENTRY      batch;
+    KIRQL           level;
+    ulong_t         generation;
+    ulong_t         discard;
+    size_t          lost;
+    NTSTATUS        status = STATUS_SUCCESS;
+    int             put = 0;
+    int             moved = 0;
+
+    InitializeListHead(&batch);
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    generation = spill->generation;
+    discard = spill->discard;
+    spill->discard = 0;
+
+    while (!IsListEmpty(&spill->pending))
+    {
+        InsertTailList(&batch, RemoveHeadList(&spill->pending));
+    }
+
+    spill->pending_bytes = 0;
+    drfifo_unlock(drfifo, level);
+
+    if (discard)
+    {
+        drfifo_spill_remove_segments(spill);
+    }
+
+    moved = !IsListEmpty(&batch);
+    lost = drfifo_spill_append(spill, &batch);
+
+    while (NT_SUCCESS(status) || (STATUS_BUFFER_OVERFLOW == status))
+    {
+        if (0 == spill->next_bytes)
+        {
+            status = drfifo_spill_next_record(spill);
+
+            if (STATUS_BUFFER_OVERFLOW == status)
+            {
+                lost++;
+                continue;
+            }
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+        }
+
+        put = 0;
+        drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+
+        if ((generation == spill->generation) && (drfifo_event_put(drfifo, spill->buffer, spill->next_bytes) > 0))
+        {
+            spill->backlog--;
+            put = 1;
+        }
+
+        drfifo_unlock(drfifo, level);
+
+        if (!put)
+        {
+            break;      // FIFO full, or discarded under us; a later kick resumes.
+        }
+
+        spill->next_bytes = 0;
+        moved = 1;
+    }
+
+    if (lost > 0)
+    {
+        drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+        spill->backlog = (lost > spill->backlog) ? 0 : (spill->backlog - lost);
+        drfifo_unlock(drfifo, level);
+    }
+
+    InterlockedExchange(&spill->work_queued, 0);
+
+    // Catch anything that arrived while running. If nothing moved this time
+    // around, only new arrivals are worth another run.
+    drfifo_spill_queue(drfifo, discard || moved || (lost > 0));
+}   /* drfifo_spill_work() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Queues the spill worker if there's something for it to do and it isn't
+ * already queued. May be called at IRQL <= DISPATCH_LEVEL without the FIFO
+ * lock.
+ *
+ * @param drfifo - device of interest.
+ * @param drain - non-zero if room in the FIFO for the next spilled record
+ * is reason enough to run.
+ */
+static void drfifo_spill_queue(drfifo_dev_t* drfifo, int drain)
+{
+    drfifo_spill_t* spill = &drfifo->spill;
+    KIRQL           level;
+    int             wanted;
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    wanted = spill->discard || !IsListEmpty(&spill->pending) ||
+             (drain && (spill->backlog > 0) && (fifo_bytes_to_put(drfifo->fifo) >= spill->next_bytes));
+    drfifo_unlock(drfifo, level);
+
+    if (wanted && (NULL != spill->work_item) &&
+        (0 == InterlockedCompareExchange(&spill->work_queued, 1, 0)))
+    {
+        IoQueueWorkItem(spill->work_item, drfifo_spill_work, DelayedWorkQueue, NULL);
+    }
+}   /* drfifo_spill_queue() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Queues the spill worker if it has work to do, such as after a read has
+ * made room in the FIFO.
+ */
+void drfifo_spill_kick(drfifo_dev_t* drfifo)
+{
+    drfifo_spill_queue(drfifo, 1);
+}   /* drfifo_spill_kick() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return non-zero if writes must go through drfifo_spill_put(): spilling
+ * is enabled, or spilled packets remain that later writes must not overtake.
+ */
+int drfifo_spill_active(const drfifo_dev_t* drfifo)
+{
+    return drfifo->spill.enabled || (drfifo->spill.backlog > 0);
+}   /* drfifo_spill_active() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Puts a whole packet into the FIFO, or spills it if the FIFO is full or
+ * earlier packets are still spilled.
+ *
+ * @param drfifo - device of interest.
+ * @param data - packet data.
+ * @param bytes - number of bytes in the packet.
+ *
+ * @return STATUS_SUCCESS if the packet was put or spilled,
+ * STATUS_INSUFFICIENT_RESOURCES if it could never fit in the FIFO or the
+ * spill's memory limit has been reached.
+ */
+NTSTATUS drfifo_spill_put(drfifo_dev_t* drfifo, const void* data, size_t bytes)
+{
+    drfifo_spill_t*        spill = &drfifo->spill;
+    drfifo_spill_packet_t* packet;
+    KIRQL                  level;
+    NTSTATUS               status = STATUS_SUCCESS;
+
+    if (bytes > fifo_bytes_capacity(drfifo->fifo))
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Most of the time the packet goes straight into the FIFO, so try that
+    // before paying for a copy.
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+
+    if ((0 == spill->backlog) && (drfifo_event_put(drfifo, data, bytes) > 0))
+    {
+        drfifo_unlock(drfifo, level);
+        return STATUS_SUCCESS;
+    }
+
+    if (!spill->enabled && (0 == spill->backlog))
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;     // Disabled since the caller looked.
+    }
+
+    drfifo_unlock(drfifo, level);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    // Refused, or behind spilled packets. Allocate and fill outside the
+    // lock, then look again under it: a read may have made room meanwhile.
+    packet = (drfifo_spill_packet_t*) ExAllocatePoolWithTag(NonPagedPool,
+                                                           FIELD_OFFSET(drfifo_spill_packet_t, data) + bytes,
+                                                           DRFIFO_POOL_TAG);
+
+    if (NULL == packet)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    packet->bytes = (uint32_t) bytes;
+    RtlCopyMemory(packet->data, data, bytes);
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+
+    if ((0 == spill->backlog) && (drfifo_event_put(drfifo, data, bytes) > 0))
+    {
+        // Went straight into the FIFO; the copy is freed below.
+    }
+    else if (!spill->enabled && (0 == spill->backlog))
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;     // Disabled since the caller looked.
+    }
+    else if ((spill->pending_bytes + bytes) > spill->memory_bytes)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;     // Worker can't keep up.
+    }
+    else
+    {
+        InsertTailList(&spill->pending, &packet->link);
+        spill->pending_bytes += bytes;
+        spill->backlog++;
+        packet = NULL;
+    }
+
+    drfifo_unlock(drfifo, level);
+
+    if (NULL != packet)
+    {
+        ExFreePoolWithTag(packet, DRFIFO_POOL_TAG);
+    }
+    else
+    {
+        drfifo_spill_kick(drfifo);
+    }
+
+    return status;
+}   /* drfifo_spill_put() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Throws away everything spilled, as when the FIFO is flushed or reset. The
+ * segment files are deleted by the worker.
+ */
+void drfifo_spill_discard(drfifo_dev_t* drfifo)
+{
+    drfifo_spill_t*        spill = &drfifo->spill;
+    drfifo_spill_packet_t* packet;
+    LIST_ENTRY             batch;
+    KIRQL                  level;
+    int                    spilled;
+
+    InitializeListHead(&batch);
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    spilled = (spill->backlog > 0);
+
+    while (!IsListEmpty(&spill->pending))
+    {
+        InsertTailList(&batch, RemoveHeadList(&spill->pending));
+    }
+
+    spill->pending_bytes = 0;
+    spill->backlog = 0;
+
+    if (spilled)
+    {
+        spill->generation++;
+        spill->discard = 1;
+    }
+
+    drfifo_unlock(drfifo, level);
+
+    while (!IsListEmpty(&batch))
+    {
+        packet = CONTAINING_RECORD(RemoveHeadList(&batch), drfifo_spill_packet_t, link);
+        ExFreePoolWithTag(packet, DRFIFO_POOL_TAG);
+    }
+
+    drfifo_spill_kick(drfifo);
+}   /* drfifo_spill_discard() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Handles DRFIFO_IOCTL_SPILL. Disabling stops new spills, but packets
+ * already spilled still drain into the FIFO ahead of later writes. Must be
+ * called at PASSIVE_LEVEL.
+ *
+ * @param drfifo - device of interest.
+ * @param config - requested settings.
+ *
+ * @return STATUS_SUCCESS on success, something else otherwise.
+ */
+NTSTATUS drfifo_spill_config(drfifo_dev_t* drfifo, const drfifo_ioctl_spill_t* config)
+{
+    drfifo_spill_t* spill = &drfifo->spill;
+    size_t          size;
+    KIRQL           level;
+
+    if (NULL == drfifo->fifo)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (NULL == spill->work_item)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // The record buffer belongs to the worker, so it can only be replaced
+    // while the worker is idle: when nothing is spilled, not even on disk.
+    // It takes the FIFO's whole size, not today's capacity: turning off
+    // alignment, CRCs, records or deadlines later grows the capacity, and
+    // records spilled then must still fit.
+    size = drfifo->fifo->size;
+
+    if (config->enabled && (spill->buffer_size < size))
+    {
+        uint8_t* buffer;
+
+        if ((0 != spill->backlog) || (0 != spill->work_queued))
+        {
+            return STATUS_DEVICE_BUSY;
+        }
+
+        buffer = (uint8_t*) ExAllocatePoolWithTag(NonPagedPool, size, DRFIFO_POOL_TAG);
+
+        if (NULL == buffer)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if (NULL != spill->buffer)
+        {
+            ExFreePoolWithTag(spill->buffer, DRFIFO_POOL_TAG);
+        }
+
+        spill->buffer = buffer;
+        spill->buffer_size = size;
+    }
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    spill->segment_bytes = config->segment_bytes ? config->segment_bytes : DRFIFO_SPILL_SEGMENT_BYTES;
+    spill->memory_bytes  = config->memory_bytes  ? config->memory_bytes  : DRFIFO_SPILL_MEMORY_BYTES;
+    spill->enabled       = config->enabled ? 1 : 0;
+    drfifo_unlock(drfifo, level);
+    return STATUS_SUCCESS;
+}   /* drfifo_spill_config() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Initializes the spill state of @a drfifo, whose device object is @a dev.
+ * Spilling stays off until DRFIFO_IOCTL_SPILL turns it on.
+ */
+void drfifo_spill_init(drfifo_dev_t* drfifo, PDEVICE_OBJECT dev)
+{
+    drfifo_spill_t* spill = &drfifo->spill;
+
+    InitializeListHead(&spill->pending);
+    spill->segment_bytes = DRFIFO_SPILL_SEGMENT_BYTES;
+    spill->memory_bytes  = DRFIFO_SPILL_MEMORY_BYTES;
+    spill->work_item     = IoAllocateWorkItem(dev);
+
+    if (NULL == spill->work_item)
+    {
+        DbgPrint("%s: Could not allocate work item for spilling.\r\n", DRIVER_NAME);
+    }
+}   /* drfifo_spill_init() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Shuts down spilling when the driver unloads. Spilled data do not survive
+ * an unload; the segment files are deleted.
+ */
+void drfifo_spill_exit(drfifo_dev_t* drfifo)
+{
+    drfifo_spill_t* spill = &drfifo->spill;
+    LARGE_INTEGER   delay;
+    KIRQL           level;
+
+    drfifo_lock(drfifo, &level, DRFIFO_LOCK_OTHER);
+    spill->enabled = 0;
+    drfifo_unlock(drfifo, level);
+    delay.QuadPart = -10 * 1000 * 10;     // 10ms, relative.
+
+    // Take the worker over, as drfifo_sink_stop() does: a running worker
+    // clears work_queued before its last look for more work, so waiting for
+    // 0 alone could free what it still uses. Holding the flag at 1 keeps
+    // that look from queueing it again. Never released; we're unloading.
+    while (0 != InterlockedCompareExchange(&spill->work_queued, 1, 0))
+    {
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+    }
+
+    while (!IsListEmpty(&spill->pending))
+    {
+        ExFreePoolWithTag(CONTAINING_RECORD(RemoveHeadList(&spill->pending), drfifo_spill_packet_t, link),
+                          DRFIFO_POOL_TAG);
+    }
+
+    drfifo_spill_remove_segments(spill);
+
+    if (NULL != spill->buffer)
+    {
+        ExFreePoolWithTag(spill->buffer, DRFIFO_POOL_TAG);
+        spill->buffer = NULL;
+        spill->buffer_size = 0;
+    }
+
+    if (NULL != spill->work_item)
+    {
+        IoFreeWorkItem(spill->work_item);
+        spill->work_item = NULL;
+    }
+}   /* drfifo_spill_exit() */
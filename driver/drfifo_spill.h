@@ -0,0 +1,53 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#ifndef __drfifo_spill_h__
+#define __drfifo_spill_h__
+
+#include <ntddk.h>
+
+#include "drfifo_ioctl.h"
+#include "fifo.h"
+
+struct drfifo_dev_s;
+
+/**
+ * State for spilling writes to on-disk segment files when the FIFO is full.
+ *
+ * Spilled packets flow pending (memory) -> write segment (disk) -> read
+ * segment (disk) -> FIFO. Only the spill worker touches the files, so the
+ * file fields need no locking; the fields marked "FIFO lock" are shared
+ * with the dispatch routines.
+ */
+typedef struct drfifo_spill_s
+{
+    ulong_t      enabled;          /**< Non-zero to spill writes that don't fit. */
+    ulong_t      segment_bytes;    /**< Segment size at which the writer moves on. */
+    ulong_t      memory_bytes;     /**< Limit on pending_bytes. */
+    LIST_ENTRY   pending;          /**< Spilled packets not yet on disk. FIFO lock. */
+    size_t       pending_bytes;    /**< Payload bytes in pending. FIFO lock. */
+    size_t       backlog;          /**< Spilled packets not yet back in the FIFO. FIFO lock. */
+    ulong_t      generation;       /**< Bumped by discards so the worker drops stale data. FIFO lock. */
+    ulong_t      discard;          /**< Set when the worker must delete the segment files. FIFO lock. */
+    size_t       next_bytes;       /**< Size of the record in buffer, or 0 if none. */
+    HANDLE       write_file;       /**< Segment being appended to, or NULL. */
+    ulong_t      write_segment;    /**< Number of the segment being appended to. */
+    uint64_t     write_offset;     /**< Append position in write_file. */
+    HANDLE       read_file;        /**< Segment being drained, or NULL. */
+    ulong_t      read_segment;     /**< Number of the segment being drained. */
+    uint64_t     read_offset;      /**< Position of the next record in read_file. */
+    uint8_t*     buffer;           /**< Record read from disk waiting for room in the FIFO. */
+    size_t       buffer_size;      /**< Size of buffer, in bytes: the FIFO's size, so any record fits. */
+    PIO_WORKITEM work_item;        /**< Runs the spill worker at PASSIVE_LEVEL. */
+    LONG         work_queued;      /**< 1 while work_item is queued or running. */
+} drfifo_spill_t;
+
+void     drfifo_spill_init(struct drfifo_dev_s* drfifo, PDEVICE_OBJECT dev);
+void     drfifo_spill_exit(struct drfifo_dev_s* drfifo);
+NTSTATUS drfifo_spill_config(struct drfifo_dev_s* drfifo, const drfifo_ioctl_spill_t* config);
+int      drfifo_spill_active(const struct drfifo_dev_s* drfifo);
+NTSTATUS drfifo_spill_put(struct drfifo_dev_s* drfifo, const void* data, size_t bytes);
+void     drfifo_spill_kick(struct drfifo_dev_s* drfifo);
+void     drfifo_spill_discard(struct drfifo_dev_s* drfifo);
+
+#endif
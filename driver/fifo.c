@@ -4,19 +4,28 @@
 #include <ntddk.h>
 #include <wdm.h>
 //#include <wdmsec.h>
-#define fifo_mem_alloc(_size)               MmAllocateNonCachedMemory(_size)
-#define fifo_mem_copy_into(_dst,_src,_len)  RtlCopyMemory(_dst, _src, _len)
-#define fifo_mem_copy_from(_dst,_src,_len)  RtlCopyMemory(_dst, _src, _len)
-#define fifo_mem_free(_ptr,_size)           MmFreeNonCachedMemory(_ptr, _size)
+#define fifo_mem_alloc(_size)               ExAllocatePoolWithTag(NonPagedPool, _size, FIFO_POOL_TAG)
+#define fifo_mem_copy_into(_dst,_src,_len)  fifo_copy(_dst, _src, _len)
+#define fifo_mem_copy_from(_dst,_src,_len)  fifo_copy(_dst, _src, _len)
+#define fifo_mem_free(_ptr,_size)           ExFreePoolWithTag(_ptr, FIFO_POOL_TAG)
+#define fifo_ticks()                        ((uint64_t) KeQueryPerformanceCounter(NULL).QuadPart)
+#define FIFO_POOL_TAG                       'ofif'
 #else    // standard C in user land...
 #error Not DDK.
+#include <time.h>
 #define fifo_mem_alloc(_size)               malloc(_size)
-#define fifo_mem_copy_into(_dst,_src,_len)  memcpy(_dst, _src, _len)
-#define fifo_mem_copy_from(_dst,_src,_len)  memcpy(_dst, _src, _len)
+#define fifo_mem_copy_into(_dst,_src,_len)  fifo_copy(_dst, _src, _len)
+#define fifo_mem_copy_from(_dst,_src,_len)  fifo_copy(_dst, _src, _len)
 #define fifo_mem_free(_ptr,_size)           free(_ptr)
+#define fifo_ticks()                        ((uint64_t) clock())
 #endif
 
 #include "fifo.h"
+#include "fifo_copy.h"
+#include "fifo_lz.h"
+#include "fifo_pool.h"
+#include "fifo_crc32c.h"
+#include "fifo_trace.h"
 
 /**
  * Flag to enable all-or-nothing operations.
@@ -33,18 +42,130 @@
  */
 #define FIFO_FLAG_PACKETIZED       (1 << 1)
 
+/**
+ * Flag to give each packet header the packet's original length, so that
+ * packets may be stored compressed. Set while a codec is attached (see
+ * fifo_codec()), and kept in a FIFO image so that a restored FIFO can still
+ * be read once a codec is attached again.
+ */
+#define FIFO_FLAG_CODEC            (1 << 2)
+
+/**
+ * Flag to protect each packet with CRC32Cs of its header and its data. A
+ * packet whose data fail the check is dropped on its own; a header that
+ * fails makes the reader slide forward a byte at a time until it finds one
+ * that passes, rather than resetting the FIFO.
+ */
+#define FIFO_FLAG_CRC              (1 << 3)
+
+/**
+ * Flag for broadcast mode: each registered reader has its own position in
+ * the data, and space is reclaimed only once the slowest reader has passed
+ * it. get_count is then the slowest reader's position. See
+ * fifo_broadcast().
+ */
+#define FIFO_FLAG_BROADCAST        (1 << 4)
+
+/**
+ * Flag to evict the slowest broadcast readers when a put would not fit,
+ * rather than turning the put away.
+ */
+#define FIFO_FLAG_EVICT            (1 << 5)
+
+/**
+ * Flag to tag each packet with a topic in its header, so that readers can
+ * skip the topics they don't subscribe to without copying them. See
+ * fifo_topic_tagged().
+ */
+#define FIFO_FLAG_TOPIC            (1 << 6)
+
+/**
+ * Flag for retention mode: data stay in the ring after they are read, until
+ * puts need the room, so that a reader may seek back and read them again.
+ * See fifo_retain().
+ */
+#define FIFO_FLAG_RETAIN           (1 << 7)
+
+/**
+ * Flag to give each packet header a deadline, after which readers skip the
+ * packet unread. See fifo_ttl().
+ */
+#define FIFO_FLAG_DEADLINE         (1 << 8)
+
+/**
+ * Flag set while data read stay unavailable to puts, from hold_count to
+ * get_count, until they are released. See fifo_hold().
+ */
+#define FIFO_FLAG_HOLD             (1 << 9)
+
+/**
+ * Field of the flags holding log2 of the payload alignment, or 0 when
+ * packets aren't aligned. It lives among the flags so that images carry it.
+ * See fifo_align().
+ */
+#define FIFO_FLAG_ALIGN_SHIFT      16
+#define FIFO_FLAG_ALIGN_MASK       ((size_t) 0x3F << FIFO_FLAG_ALIGN_SHIFT)
+
+/**
+ * Per-packet flags. These live in the top bits of the packet's length word
+ * so that the plain packet header stays a single size_t; packets are never
+ * big enough to need those bits.
+ */
+#define FIFO_PACKET_FLAG(_n)       ((size_t) 1 << ((sizeof(size_t) * 8) - 1 - (_n)))
+#define FIFO_PACKET_COMPRESSED     FIFO_PACKET_FLAG(0)   /**< Payload is fifo_lz-compressed. */
+#define FIFO_PACKET_INDIRECT       FIFO_PACKET_FLAG(1)   /**< Payload is a fifo_slab_ref_t to the real one. */
+#define FIFO_PACKET_MORE           FIFO_PACKET_FLAG(2)   /**< Fragment of a message that the next packet continues. */
+#define FIFO_PACKET_PAD            FIFO_PACKET_FLAG(3)   /**< Filler to the end of the ring; see fifo_align(). */
+#define FIFO_PACKET_FLAGS          (FIFO_PACKET_FLAG(0) | FIFO_PACKET_FLAG(1) | FIFO_PACKET_FLAG(2) | FIFO_PACKET_FLAG(3))
+
+/**
+ * Largest packet header, in bytes; see fifo_header_bytes().
+ */
+#define FIFO_HEADER_MAX_BYTES      ((2 * sizeof(size_t)) + (3 * sizeof(uint32_t)) + sizeof(uint64_t))
+
+/**
+ * A packet header, decoded. Which fields are stored in the FIFO depends on
+ * the FIFO's flags; the rest are 0 when read back.
+ */
+typedef struct fifo_header_s
+{
+    size_t bytes;        /**< Payload bytes stored after the header. */
+    size_t flags;        /**< FIFO_PACKET_xxx. */
+    size_t raw_bytes;    /**< Payload bytes before compression (FIFO_FLAG_CODEC). */
+    uint32_t topic;      /**< Topic of the packet (FIFO_FLAG_TOPIC). */
+    uint64_t deadline;   /**< fifo_ticks() after which the packet is stale; 0 for never (FIFO_FLAG_DEADLINE). */
+    uint32_t data_crc;   /**< CRC32C of the stored payload (FIFO_FLAG_CRC). */
+} fifo_header_t;
+
+/**
+ * Packet codec state: the compression threshold, a scratch buffer for a
+ * compressed packet, the compressor's match table and the statistics. One
+ * codec serves one FIFO, under that FIFO's lock.
+ */
+struct fifo_codec_s
+{
+    size_t             threshold;      /**< Packets smaller than this are stored raw. */
+    size_t             scratch_bytes;  /**< Size of scratch. */
+    uint8_t*           scratch;        /**< Compressed packet buffer; follows this struct. */
+    fifo_codec_stats_t stats;          /**< Statistics since the codec was created. */
+    size_t             table[FIFO_LZ_TABLE_ENTRIES];   /**< Compressor match table. */
+};   /* struct fifo_codec_s */
+
+static void fifo_retain_trim(fifo_t* fifo, size_t bytes);
+
 /* ------------------------------------------------------------------------- */
 /**
  * Allocates a fifo struct and the associated data.
  */
 fifo_t* fifo_new(size_t bytes)
 {
-    fifo_t* fifo = fifo_mem_alloc(sizeof(fifo_t) + bytes);
+    fifo_t* fifo = fifo_mem_alloc(sizeof(fifo_t) + FIFO_DATA_ALIGN - 1 + bytes);
 
     if (NULL != fifo)
     {
         memset(fifo, 0, sizeof(fifo_t));
         fifo->size = bytes;
+        fifo->data = FIFO_DATA_AFTER(fifo);
     }
 
     return fifo;
@@ -52,7 +173,85 @@ fifo_t* fifo_new(size_t bytes)
 
 /* ------------------------------------------------------------------------- */
 /**
- * Deletes a fifo object, NULL-ing the pointer.
+ * Allocates a sparse fifo: one whose @a bytes of data are split into pages
+ * of @a page_bytes, each allocated only when a put first reaches it. A page
+ * that lies wholly behind the oldest data still kept - behind get_count, or
+ * retain_count when retaining - is freed once it has stayed so for
+ * @a idle_ticks ticks of fifo_ticks(); 0 frees it as soon as it is found.
+ * Gets look for such pages each time they finish a page, no more often than
+ * every quarter of @a idle_ticks; an owner with a timer may also call
+ * fifo_decommit(), so that pages go once traffic stops. Memory in use then
+ * follows the backlog rather than the capacity, for large rings that are
+ * mostly empty.
+ *
+ * A put that can't get a page puts nothing, as though the FIFO were full.
+ * Images of sparse FIFOs are written with fifo_image_data() and read back
+ * with fifo_image_load(), like any other.
+ *
+ * @return the new FIFO, or NULL if out of memory or @a page_bytes is 0.
+ */
+fifo_t* fifo_new_sparse(size_t bytes, size_t page_bytes, uint64_t idle_ticks)
+{
+    size_t  pages;
+    fifo_t* fifo;
+
+    if ((0 == page_bytes) || (0 == bytes))
+    {
+        return NULL;
+    }
+
+    pages = (bytes + page_bytes - 1) / page_bytes;
+    fifo = fifo_mem_alloc(sizeof(fifo_t) + (pages * (sizeof(uint64_t) + sizeof(uint8_t*))));
+
+    if (NULL != fifo)
+    {
+        memset(fifo, 0, sizeof(fifo_t) + (pages * (sizeof(uint64_t) + sizeof(uint8_t*))));
+        fifo->size       = bytes;
+        fifo->page_bytes = page_bytes;
+        fifo->idle_since = (uint64_t*) &fifo[1];
+        fifo->page       = (uint8_t**) &fifo->idle_since[pages];
+        fifo->idle_ticks = idle_ticks;
+    }
+
+    return fifo;
+}   /* fifo_new_sparse() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the count of the oldest byte that puts into @a fifo must not
+ * overwrite: hold_count while holding, else get_count. Retained data don't
+ * count; puts give them up.
+ */
+static FIFO_INLINE size_t fifo_room_tail(const fifo_t* fifo)
+{
+    return (fifo->flags & FIFO_FLAG_HOLD) ? fifo->hold_count : fifo->get_count;
+}   /* fifo_room_tail() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the number of pages of the sparse @a fifo.
+ */
+static FIFO_INLINE size_t fifo_pages(const fifo_t* fifo)
+{
+    return (fifo->size + fifo->page_bytes - 1) / fifo->page_bytes;
+}   /* fifo_pages() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the size of page @a n of the sparse @a fifo; the last may be
+ * short.
+ */
+static FIFO_INLINE size_t fifo_page_bytes(const fifo_t* fifo, size_t n)
+{
+    const size_t start = n * fifo->page_bytes;
+    return ((fifo->size - start) < fifo->page_bytes) ? (fifo->size - start) : fifo->page_bytes;
+}   /* fifo_page_bytes() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Deletes a fifo object and any codec attached to it, NULL-ing the pointer.
+ * A FIFO from a pool goes back to it instead of being freed; a sparse one's
+ * pages are freed with it.
  */
 void fifo_del(fifo_t** fifo_ptr)
 {
@@ -60,7 +259,32 @@ void fifo_del(fifo_t** fifo_ptr)
     {
         fifo_t* fifo = *fifo_ptr;
         *fifo_ptr = NULL;
-        fifo_mem_free(fifo, sizeof(fifo_t) + fifo->size);
+        fifo_codec_del(&fifo->codec);
+        fifo_slab_del(&fifo->slab);
+
+        if (NULL != fifo->pool)
+        {
+            fifo_pool_put(fifo->pool, fifo);
+        }
+        else if (fifo->page_bytes > 0)
+        {
+            const size_t pages = fifo_pages(fifo);
+            size_t       n;
+
+            for (n = 0; n < pages; n++)
+            {
+                if (NULL != fifo->page[n])
+                {
+                    fifo_mem_free(fifo->page[n], fifo_page_bytes(fifo, n));
+                }
+            }
+
+            fifo_mem_free(fifo, sizeof(fifo_t) + (pages * (sizeof(uint64_t) + sizeof(uint8_t*))));
+        }
+        else
+        {
+            fifo_mem_free(fifo, sizeof(fifo_t) + FIFO_DATA_ALIGN - 1 + fifo->size);
+        }
     }
 }   /* fifo_del() */
 
@@ -71,13 +295,49 @@ void fifo_del(fifo_t** fifo_ptr)
  */
 void fifo_reset(fifo_t* fifo)
 {
+    fifo_reader_t* reader;
+
     if (NULL != fifo)
     {
         fifo->get_count = 0;
         fifo->put_count = 0;
+        fifo->staged_count = 0;     // An open transaction stays open, but empty.
+        fifo->fragmenting = 0;      // A message part way put ends early.
+        fifo->retain_count = 0;     // Sequence numbers carry on from put_sequence.
+        fifo->hold_count = 0;       // Held data are thrown away with the rest.
+        fifo_slab_reclaim(fifo->slab);
+
+        for (reader = fifo->readers; NULL != reader; reader = reader->next)
+        {
+            reader->get_count = 0;
+        }
     }
 }   /* fifo_reset() */
 
+/* ------------------------------------------------------------------------- */
+/**
+ * Discards all data in the @a fifo, for every broadcast reader too, without
+ * modifying its modes of operation.
+ */
+void fifo_flush(fifo_t* fifo)
+{
+    fifo_reader_t* reader;
+
+    if (NULL != fifo)
+    {
+        fifo->get_count = fifo->put_count;
+        fifo->retain_count = fifo->put_count;
+        fifo->hold_count = fifo->put_count;
+        fifo->fragmenting = 0;
+        fifo_slab_reclaim(fifo->slab);
+
+        for (reader = fifo->readers; NULL != reader; reader = reader->next)
+        {
+            reader->get_count = fifo->put_count;
+        }
+    }
+}   /* fifo_flush() */
+
 /* ------------------------------------------------------------------------- */
 int8_t fifo_is_all_or_nothing(const fifo_t* fifo)
 {
@@ -140,205 +400,2869 @@ int8_t fifo_packetized(fifo_t* fifo, int8_t enabled)
 
 /* ------------------------------------------------------------------------- */
 /**
- * Copies @a bytes from @a data into the @a fifo; no checking is performed
- * but the put_count field is incremented.
+ * Allocates a packet codec. Packets of at least @a threshold bytes are
+ * compressed on put, and stored compressed if that saves space and the
+ * result fits in @a scratch_bytes; the FIFO's size is a good choice.
+ *
+ * @return the new codec, or NULL if out of memory.
  */
-static void prechecked_fifo_raw_put(fifo_t* fifo, const void* data, size_t bytes)
+fifo_codec_t* fifo_codec_new(size_t scratch_bytes, size_t threshold)
 {
-    const uint8_t* src = (const uint8_t*) data;
-    const size_t put_index = fifo->put_count % fifo->size;
-    const size_t bytes_to_end = fifo->size - put_index;
+    fifo_codec_t* codec = (fifo_codec_t*) fifo_mem_alloc(sizeof(fifo_codec_t) + scratch_bytes);
 
-    DbgPrint("prechecked_fifo_raw_put(%u) at [%u], bytes_to_end=%u.\r\n", bytes, put_index, bytes_to_end);
-
-    if (bytes <= bytes_to_end)
-    {
-        fifo_mem_copy_into(&fifo->data[put_index], src, bytes);
-    }
-    else
+    if (NULL != codec)
     {
-        fifo_mem_copy_into(&fifo->data[put_index], src, bytes_to_end);
-        fifo_mem_copy_into(&fifo->data[0], &src[bytes_to_end], bytes - bytes_to_end);
+        memset(codec, 0, sizeof(fifo_codec_t));
+        codec->threshold     = threshold;
+        codec->scratch_bytes = scratch_bytes;
+        codec->scratch       = (uint8_t*) &codec[1];
     }
 
-    fifo->put_count += bytes;
-}   /* prechecked_fifo_raw_put() */
+    return codec;
+}   /* fifo_codec_new() */
 
 /* ------------------------------------------------------------------------- */
 /**
- * Copies up to @a bytes bytes from @a data into the fifo.
+ * Deletes a codec, NULL-ing the pointer. The codec must not be attached to
+ * a FIFO.
  */
-ssize_t fifo_put(fifo_t* fifo, const void* data, size_t bytes)
+void fifo_codec_del(fifo_codec_t** codec_ptr)
 {
-    const size_t bytes_available_to_put = fifo_bytes_to_put(fifo);
-
-    if ((NULL == fifo) || (0 == bytes_available_to_put))
+    if ((NULL != codec_ptr) && (NULL != *codec_ptr))
     {
-        return 0;
+        fifo_codec_t* codec = *codec_ptr;
+        *codec_ptr = NULL;
+        fifo_mem_free(codec, sizeof(fifo_codec_t) + codec->scratch_bytes);
     }
+}   /* fifo_codec_del() */
+
+/* ------------------------------------------------------------------------- */
+int8_t fifo_is_compressed(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : ((fifo->flags & FIFO_FLAG_CODEC) != 0);
+}   /* fifo_is_compressed() */
+
+/* ------------------------------------------------------------------------- */
+int8_t fifo_is_crc_checked(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : ((fifo->flags & FIFO_FLAG_CRC) != 0);
+}   /* fifo_is_crc_checked() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Enables or disables CRC32C checking of each packet. Only applies in
+ * packetized mode.
+ *
+ * @note Since this changes the way that data are stored in the FIFO, this
+ * call will reset the FIFO via fifo_reset() if the setting changes.
+ */
+int8_t fifo_crc_checked(fifo_t* fifo, int8_t enabled)
+{
+    int8_t result = fifo_is_crc_checked(fifo);
 
-    if (bytes > bytes_available_to_put)
+    if ((NULL != fifo) && ((0 != enabled) != result))
     {
-        if (fifo_is_all_or_nothing(fifo))
+        if (enabled)
         {
-            return 0;
+            fifo->flags |=  FIFO_FLAG_CRC;
         }
         else
         {
-            bytes = bytes_available_to_put;
+            fifo->flags &= ~FIFO_FLAG_CRC;
         }
-    }
 
-    if (!fifo_is_packetized(fifo))
-    {
-        prechecked_fifo_raw_put(fifo, data, bytes);
-    }
-    else
-    {
-        const size_t size = bytes;
-        // There's a minor race condition here over the value of put_count,
-        // but this code is not guaranteed to be thread-safe.
-        prechecked_fifo_raw_put(fifo, &size, sizeof(size_t));
-        prechecked_fifo_raw_put(fifo, data, bytes);
+        fifo_reset(fifo);
     }
 
-    return bytes;
-}   /* fifo_put() */
+    return result;
+}   /* fifo_crc_checked() */
 
 /* ------------------------------------------------------------------------- */
 /**
- * Copies @a bytes from the @a fifo into @a data; no checking is performed,
- * but the get_count field is incremented.
+ * Attaches @a codec to @a fifo, or detaches the current codec if @a codec
+ * is NULL. The FIFO takes ownership of the codec and deletes it in
+ * fifo_del(). Compression only applies in packetized mode.
+ *
+ * @note Turning compression on or off changes the way that data are stored
+ * in the FIFO, so in that case this call will reset the FIFO via
+ * fifo_reset(). Swapping one codec for another, or attaching one to a FIFO
+ * restored from a compressed image, keeps the data.
+ *
+ * @return the previously attached codec, which now belongs to the caller.
  */
-static void prechecked_fifo_raw_get(fifo_t* fifo, void* data, size_t bytes)
+fifo_codec_t* fifo_codec(fifo_t* fifo, fifo_codec_t* codec)
 {
-    uint8_t* dst = (uint8_t*) data;
-    const size_t get_index = fifo->get_count % fifo->size;
-    const size_t bytes_to_end = fifo->size - get_index;
-
-    DbgPrint("prechecked_fifo_raw_get(%u) at [%u], bytes_to_end=%u.\r\n", bytes, get_index, bytes_to_end);
+    fifo_codec_t* result = NULL;
 
-    if (bytes <= bytes_to_end)
-    {
-        fifo_mem_copy_from(dst, &fifo->data[get_index], bytes);
-    }
-    else
+    if (NULL != fifo)
     {
-        fifo_mem_copy_from(dst, &fifo->data[get_index], bytes_to_end);
-        fifo_mem_copy_from(&dst[bytes_to_end], &fifo->data[0], bytes - bytes_to_end);
+        result = fifo->codec;
+        fifo->codec = codec;
+
+        if ((NULL != codec) != fifo_is_compressed(fifo))
+        {
+            if (NULL != codec)
+            {
+                fifo->flags |=  FIFO_FLAG_CODEC;
+            }
+            else
+            {
+                fifo->flags &= ~FIFO_FLAG_CODEC;
+            }
+
+            fifo_reset(fifo);
+        }
     }
 
-    fifo->get_count += bytes;
-}   /* prechecked_fifo_raw_get() */
+    return result;
+}   /* fifo_codec() */
 
 /* ------------------------------------------------------------------------- */
 /**
- * Reads @a bytes bytes from the fifo into the @a data buffer.
+ * Copies the statistics of the codec attached to @a fifo into @a stats, or
+ * zeroes @a stats if there is none.
  */
-ssize_t fifo_get(fifo_t* fifo, void* data, size_t bytes)
+void fifo_codec_stats(const fifo_t* fifo, fifo_codec_stats_t* stats)
 {
-    const size_t bytes_available_to_get = fifo_bytes_to_get(fifo);
-
-    if ((NULL == fifo) || (0 == bytes_available_to_get))
-    {
-        return 0;
-    }
-
-    if (bytes > bytes_available_to_get)
+    if (NULL != stats)
     {
-        if (fifo_is_all_or_nothing(fifo))
+        if ((NULL != fifo) && (NULL != fifo->codec))
         {
-            return 0;
+            *stats = fifo->codec->stats;
         }
         else
         {
-            bytes = bytes_available_to_get;
+            memset(stats, 0, sizeof(*stats));
         }
     }
+}   /* fifo_codec_stats() */
 
-    if (!fifo_is_packetized(fifo))
-    {
-        prechecked_fifo_raw_get(fifo, data, bytes);
-    }
-    else
+/* ------------------------------------------------------------------------- */
+/**
+ * Attaches @a slab to @a fifo for indirect packets, or detaches the current
+ * slab if @a slab is NULL. The FIFO takes ownership of the slab and deletes
+ * it in fifo_del().
+ *
+ * With a slab attached, a packet of at least the slab's threshold that fits
+ * in one of its buffers is copied into a free buffer, and only a small
+ * fifo_slab_ref_t descriptor goes through the ring. Large packets thus
+ * neither need room in the ring nor hold up the small ones behind them. A
+ * get copies the payload out of the buffer and frees it, or with
+ * fifo_get_indirect() hands the buffer itself to the caller, who frees it
+ * with fifo_slab_release(). When no buffer is free such a put fails, as it
+ * would for lack of room. Packets put while broadcasting, retaining or
+ * staging a transaction are stored in the ring as usual, since the buffers
+ * are read once and freed. Only applies in packetized mode.
+ *
+ * @note Descriptors refer to buffers of the attached slab, so this call
+ * resets the FIFO via fifo_reset() when the slab changes.
+ *
+ * @return the previously attached slab, which now belongs to the caller.
+ */
+fifo_slab_t* fifo_indirect(fifo_t* fifo, fifo_slab_t* slab)
+{
+    fifo_slab_t* result = NULL;
+
+    if (NULL != fifo)
     {
-        size_t packet_bytes = bytes;
-        prechecked_fifo_raw_get(fifo, &packet_bytes, sizeof(size_t));
+        result = fifo->slab;
 
-        if (packet_bytes > bytes_available_to_get)
+        if (slab != result)
         {
-            DbgPrint("fifo_get() Internal error! %u > %u.\r\n", packet_bytes, bytes_available_to_get);
-            // Internal error! This should never happen.
+            fifo_slab_reclaim(result);      // Its packets go with the reset.
+            fifo->slab = slab;
             fifo_reset(fifo);
-            return 0;   // -----------------------------------> return!
         }
+    }
 
-        if (packet_bytes < bytes)
-        {
-            bytes = packet_bytes;
-        }
+    return result;
+}   /* fifo_indirect() */
 
-        prechecked_fifo_raw_get(fifo, data, bytes);
-        fifo->get_count += packet_bytes - bytes;    // Skip forward to next packet.
+/* ------------------------------------------------------------------------- */
+int8_t fifo_is_indirect(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : (NULL != fifo->slab);
+}   /* fifo_is_indirect() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return non-zero if a packet of @a bytes should go in a slab buffer
+ * rather than in the ring of @a fifo; see fifo_indirect().
+ */
+static FIFO_INLINE int8_t fifo_indirect_wanted(const fifo_t* fifo, size_t bytes)
+{
+    return (NULL != fifo->slab) && (bytes > 0) &&
+           (bytes >= fifo_slab_threshold(fifo->slab)) && (bytes <= fifo_slab_buffer_bytes(fifo->slab)) &&
+           (0 == (fifo->flags & (FIFO_FLAG_BROADCAST | FIFO_FLAG_RETAIN))) && !fifo->staging;
+}   /* fifo_indirect_wanted() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the size of each record in @a fifo; 0 when not in record mode.
+ */
+size_t fifo_record_bytes(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : fifo->record_bytes;
+}   /* fifo_record_bytes() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Puts @a fifo into record mode, or takes it out when @a record_bytes is 0.
+ *
+ * In record mode every put and get moves whole records of @a record_bytes
+ * bytes with no header, so N records are stored in N * @a record_bytes bytes
+ * and move in a single copy. Packet framing, compression and CRC checking
+ * are not used while record mode is on, though their settings are kept. A
+ * put of a partial record stores only the whole records in it - or nothing,
+ * in all-or-nothing mode - and a get returns only whole records.
+ *
+ * @note Since this changes the way that data are stored in the FIFO, this
+ * call resets the FIFO via fifo_reset() when the record size changes.
+ *
+ * @return the previous record size; 0 if not in record mode.
+ */
+size_t fifo_record(fifo_t* fifo, size_t record_bytes)
+{
+    size_t result = fifo_record_bytes(fifo);
+
+    if ((NULL != fifo) && (record_bytes != result))
+    {
+        fifo->record_bytes = record_bytes;
+        fifo_reset(fifo);
     }
 
-    return bytes;
-}   /* fifo_get() */
+    return result;
+}   /* fifo_record() */
 
 /* ------------------------------------------------------------------------- */
 /**
- * @return the number of bytes available to be put into @a fifo.
+ * @return @a bytes rounded down to a whole number of records; @a bytes when
+ * not in record mode.
  */
-size_t fifo_bytes_to_put(const fifo_t* fifo)
+static FIFO_INLINE size_t fifo_record_floor(const fifo_t* fifo, size_t bytes)
 {
-    size_t bytes = 0;
+    const size_t record_bytes = fifo->record_bytes;
 
-    if (NULL != fifo)
+    if (0 == record_bytes)
     {
-        bytes = fifo->size - (fifo->put_count - fifo->get_count);
+        return bytes;
+    }
 
-        if (fifo_is_packetized(fifo))
-        {
-            if (bytes <= sizeof(size_t))
-            {
-                bytes = 0;
-            }
-            else
-            {
-                bytes -= sizeof(size_t);
-            }
-        }
+    if (0 == (record_bytes & (record_bytes - 1)))
+    {
+        return bytes & ~(record_bytes - 1);     // The usual sizes need no division.
     }
 
-    return bytes;
-}   /* fifo_bytes_to_put() */
+    return bytes - (bytes % record_bytes);
+}   /* fifo_record_floor() */
 
 /* ------------------------------------------------------------------------- */
 /**
- * @return the number of bytes available to be gotten from @a fifo. When in
- * packet mode this may reflect more than are available on the next read.
+ * @return the boundary to which @a fifo aligns packet payloads; 0 when
+ * packets aren't aligned.
  */
-size_t fifo_bytes_to_get(const fifo_t* fifo)
+size_t fifo_align_bytes(const fifo_t* fifo)
 {
-    size_t bytes = 0;
+    size_t shift;
 
-    if (NULL != fifo)
+    if (NULL == fifo)
     {
-        bytes = fifo->put_count - fifo->get_count;
-
-        if (fifo_is_packetized(fifo))
-        {
-            if (bytes <= sizeof(size_t))
-            {
-                bytes = 0;
-            }
-            else
-            {
-                bytes -= sizeof(size_t);
-            }
-        }
+        return 0;
     }
 
-    return bytes;
-}   /* fifo_bytes_to_get() */
+    shift = (fifo->flags & FIFO_FLAG_ALIGN_MASK) >> FIFO_FLAG_ALIGN_SHIFT;
+    return (0 == shift) ? 0 : ((size_t) 1 << shift);
+}   /* fifo_align_bytes() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Has @a fifo store each packet contiguously, with its payload at an
+ * address that is a multiple of @a align_bytes, or stops doing so when
+ * @a align_bytes is 0.
+ *
+ * A packet that would run past the end of the ring is put at the start
+ * instead, after a padding packet that readers skip, and the bytes up to
+ * the next aligned payload are skipped silently; the reader works them out
+ * the same way. That costs up to @a align_bytes plus a header per packet,
+ * and the end of the ring for one that wraps. While the FIFO is empty and
+ * nothing else depends on its position, the next put starts at the start
+ * of the ring, so a packet of up to fifo_bytes_capacity() always fits
+ * then. fifo_get_ptr() reads the packets in place.
+ *
+ * Alignment applies only in packetized mode; it's kept, unused, in stream
+ * and record mode.
+ *
+ * @note Since this changes the way that data are stored in the FIFO, this
+ * call resets the FIFO via fifo_reset() when the alignment changes.
+ *
+ * @return the previous alignment; 0 if not aligned. The FIFO is left alone
+ * if @a align_bytes isn't a power of two that divides its size, if it is
+ * sparse, or if its data buffer isn't aligned that well - as it is up to
+ * FIFO_DATA_ALIGN for FIFOs from fifo_new() and pools.
+ */
+size_t fifo_align(fifo_t* fifo, size_t align_bytes)
+{
+    size_t result = fifo_align_bytes(fifo);
+    size_t shift = 0;
+
+    align_bytes = (1 == align_bytes) ? 0 : align_bytes;     // Every byte is aligned to 1.
+
+    if ((NULL == fifo) || (align_bytes == result))
+    {
+        return result;
+    }
+
+    if (0 != align_bytes)
+    {
+        if ((0 != (align_bytes & (align_bytes - 1))) || (0 != (fifo->size & (align_bytes - 1))) ||
+            (fifo->page_bytes > 0) || (0 != (((size_t) fifo->data) & (align_bytes - 1))))
+        {
+            return result;
+        }
+
+        while (((size_t) 1 << shift) < align_bytes)
+        {
+            shift++;
+        }
+    }
+
+    fifo->flags = (fifo->flags & ~FIFO_FLAG_ALIGN_MASK) | (shift << FIFO_FLAG_ALIGN_SHIFT);
+    fifo_reset(fifo);
+    return result;
+}   /* fifo_align() */
+
+/* ------------------------------------------------------------------------- */
+int8_t fifo_is_broadcast(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : ((fifo->flags & FIFO_FLAG_BROADCAST) != 0);
+}   /* fifo_is_broadcast() */
+
+/* ------------------------------------------------------------------------- */
+int8_t fifo_is_topic_tagged(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : ((fifo->flags & FIFO_FLAG_TOPIC) != 0);
+}   /* fifo_is_topic_tagged() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Enables or disables topic tags in the packet headers of @a fifo. Tagged
+ * packets are put with fifo_put_topic(), and each fifo_reader_t reads only
+ * the topics in its @c topics mask, skipping the rest in place - no copy,
+ * and no CRC check. Only applies in packetized mode.
+ *
+ * @note Since this changes the way that data are stored in the FIFO, this
+ * call resets the FIFO via fifo_reset() when the setting changes.
+ *
+ * @return the previous setting.
+ */
+int8_t fifo_topic_tagged(fifo_t* fifo, int8_t enabled)
+{
+    int8_t result = fifo_is_topic_tagged(fifo);
+
+    if ((NULL != fifo) && ((0 != enabled) != result))
+    {
+        if (enabled)
+        {
+            fifo->flags |=  FIFO_FLAG_TOPIC;
+        }
+        else
+        {
+            fifo->flags &= ~FIFO_FLAG_TOPIC;
+        }
+
+        fifo_reset(fifo);
+    }
+
+    return result;
+}   /* fifo_topic_tagged() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the time to live given to packets put into @a fifo, in
+ * fifo_ticks(); 0 if they don't expire.
+ */
+uint64_t fifo_ttl_ticks(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : fifo->ttl_ticks;
+}   /* fifo_ttl_ticks() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Gives each packet put into @a fifo from now on a deadline @a ttl_ticks
+ * after it is put, in the units of fifo_ticks(); 0 turns deadlines off.
+ * Readers skip packets past their deadlines without copying them, counting
+ * them in fifo_stats_t's expired, so that a reader that falls behind a
+ * real-time feed catches up with live data rather than working through
+ * stale data. Fragments of a message never expire, so that a message is
+ * never torn. Only applies in packetized mode.
+ *
+ * An image keeps the time to live, and restoring it keeps what each packet
+ * had left; see fifo_image_load().
+ *
+ * @note Since turning deadlines on or off changes the way that data are
+ * stored in the FIFO, this call resets the FIFO via fifo_reset() when it
+ * does; changing only the time to live leaves the data alone.
+ *
+ * @return the previous time to live.
+ */
+uint64_t fifo_ttl(fifo_t* fifo, uint64_t ttl_ticks)
+{
+    uint64_t result = fifo_ttl_ticks(fifo);
+
+    if (NULL != fifo)
+    {
+        fifo->ttl_ticks = ttl_ticks;
+
+        if ((0 != ttl_ticks) != (0 != (fifo->flags & FIFO_FLAG_DEADLINE)))
+        {
+            fifo->flags ^= FIFO_FLAG_DEADLINE;
+            fifo_reset(fifo);
+        }
+    }
+
+    return result;
+}   /* fifo_ttl() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the deadline for a packet put into @a fifo now; 0 for none.
+ */
+static FIFO_INLINE uint64_t fifo_deadline(const fifo_t* fifo)
+{
+    return (0 == fifo->ttl_ticks) ? 0 : (fifo_ticks() + fifo->ttl_ticks);
+}   /* fifo_deadline() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Turns broadcast mode on or off for @a fifo.
+ *
+ * In broadcast mode one put serves any number of readers: each reads
+ * through its own fifo_reader_t with fifo_reader_get() and sees every byte
+ * put after it joined, and space is reclaimed only when the slowest reader
+ * has passed it. Data put while there are no readers are kept for the first
+ * one. With @a evict set, a put that would not fit evicts the slowest
+ * readers until it does; an evicted reader rejoins at the oldest data kept
+ * on its next get, having missed whatever it was evicted from. The data
+ * themselves are stored as usual, so no reset is needed; turning broadcast
+ * off drops all readers.
+ *
+ * @return the previous broadcast setting.
+ */
+int8_t fifo_broadcast(fifo_t* fifo, int8_t enabled, int8_t evict)
+{
+    int8_t result = fifo_is_broadcast(fifo);
+
+    if (NULL != fifo)
+    {
+        fifo->flags &= ~(FIFO_FLAG_BROADCAST | FIFO_FLAG_EVICT);
+
+        if (enabled)
+        {
+            fifo->flags |= FIFO_FLAG_BROADCAST | (evict ? FIFO_FLAG_EVICT : 0);
+        }
+        else
+        {
+            while (NULL != fifo->readers)
+            {
+                fifo_reader_t* reader = fifo->readers;
+                fifo->readers = reader->next;
+                reader->next = NULL;
+                reader->active = 0;
+            }
+        }
+    }
+
+    return result;
+}   /* fifo_broadcast() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the active reader of @a fifo that is furthest behind, or NULL if
+ * there are none.
+ */
+static fifo_reader_t* fifo_readers_slowest(const fifo_t* fifo)
+{
+    fifo_reader_t* slowest = fifo->readers;
+    fifo_reader_t* reader;
+
+    for (reader = fifo->readers; NULL != reader; reader = reader->next)
+    {
+        if ((fifo->put_count - reader->get_count) > (fifo->put_count - slowest->get_count))
+        {
+            slowest = reader;
+        }
+    }
+
+    return slowest;
+}   /* fifo_readers_slowest() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Reclaims the space that every active reader of @a fifo has passed. Data
+ * are kept if there are no readers.
+ */
+static void fifo_readers_reclaim(fifo_t* fifo)
+{
+    const fifo_reader_t* slowest = fifo_readers_slowest(fifo);
+
+    if (NULL != slowest)
+    {
+        fifo->get_count = slowest->get_count;
+    }
+}   /* fifo_readers_reclaim() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Unlinks @a reader from the active readers of @a fifo, if it's there.
+ */
+static void fifo_readers_unlink(fifo_t* fifo, fifo_reader_t* reader)
+{
+    fifo_reader_t** link;
+
+    for (link = &fifo->readers; NULL != *link; link = &(*link)->next)
+    {
+        if (*link == reader)
+        {
+            *link = reader->next;
+            break;
+        }
+    }
+
+    reader->next = NULL;
+    reader->active = 0;
+}   /* fifo_readers_unlink() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Evicts the slowest readers of @a fifo until a put of @a bytes would fit.
+ * With a codec attached @a bytes is the uncompressed size, so this may
+ * evict a reader more than strictly necessary.
+ */
+static void fifo_readers_evict(fifo_t* fifo, size_t bytes)
+{
+    const size_t capacity = fifo_bytes_capacity(fifo);
+    const size_t wanted = (bytes < capacity) ? bytes : capacity;
+
+    while ((NULL != fifo->readers) && (fifo_bytes_to_put(fifo) < wanted))
+    {
+        fifo_reader_t* slowest = fifo_readers_slowest(fifo);
+
+        fifo_readers_unlink(fifo, slowest);
+        slowest->evictions++;
+        fifo->stats.evictions++;
+
+        if (NULL == fifo->readers)
+        {
+            fifo->get_count = fifo->put_count;      // Nobody is left to read it.
+        }
+        else
+        {
+            fifo_readers_reclaim(fifo);
+        }
+    }
+}   /* fifo_readers_evict() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Adds @a reader to the active readers of broadcast @a fifo, starting at the
+ * oldest data kept. Does nothing if it's already active.
+ */
+void fifo_reader_add(fifo_t* fifo, fifo_reader_t* reader)
+{
+    if ((NULL != fifo) && (NULL != reader) && !reader->active)
+    {
+        reader->get_count = fifo->get_count;
+        reader->next = fifo->readers;
+        reader->active = 1;
+        fifo->readers = reader;
+    }
+}   /* fifo_reader_add() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Removes @a reader from the active readers of @a fifo, reclaiming any
+ * space that only it was holding.
+ */
+void fifo_reader_remove(fifo_t* fifo, fifo_reader_t* reader)
+{
+    if ((NULL != fifo) && (NULL != reader) && reader->active)
+    {
+        fifo_readers_unlink(fifo, reader);
+        fifo_readers_reclaim(fifo);
+    }
+}   /* fifo_reader_remove() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the number of active broadcast readers of @a fifo.
+ */
+size_t fifo_readers(const fifo_t* fifo)
+{
+    const fifo_reader_t* reader;
+    size_t               count = 0;
+
+    if (NULL != fifo)
+    {
+        for (reader = fifo->readers; NULL != reader; reader = reader->next)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}   /* fifo_readers() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the number of bytes in each packet header of @a fifo; 0 when not
+ * packetized, or in record mode.
+ */
+static size_t fifo_header_bytes(const fifo_t* fifo)
+{
+    size_t bytes = 0;
+
+    if (fifo_is_packetized(fifo) && (0 == fifo->record_bytes))
+    {
+        bytes = sizeof(size_t);
+
+        if (fifo->flags & FIFO_FLAG_CODEC)
+        {
+            bytes += sizeof(size_t);
+        }
+
+        if (fifo->flags & FIFO_FLAG_TOPIC)
+        {
+            bytes += sizeof(uint32_t);
+        }
+
+        if (fifo->flags & FIFO_FLAG_DEADLINE)
+        {
+            bytes += sizeof(uint64_t);
+        }
+
+        if (fifo->flags & FIFO_FLAG_CRC)
+        {
+            bytes += 2 * sizeof(uint32_t);      // Data CRC, then header CRC.
+        }
+    }
+
+    return bytes;
+}   /* fifo_header_bytes() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Packets are placed by ring index; since fifo_align() insists that the data
+ * buffer be aligned too, their addresses follow.
+ *
+ * @return the payload alignment of @a fifo when it is in use: when
+ * aligned, and packets have headers; else 0.
+ */
+static FIFO_INLINE size_t fifo_packet_align(const fifo_t* fifo)
+{
+    return (0 == fifo_header_bytes(fifo)) ? 0 : fifo_align_bytes(fifo);
+}   /* fifo_packet_align() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the bytes that the aligned @a fifo skips, unmarked, before a
+ * header of @a header_bytes bytes at count @a count: up to where the
+ * payload is aligned, and past the end of the ring too when there's no
+ * room for the header before it. Readers skip the same.
+ */
+static size_t fifo_align_skip(const fifo_t* fifo, size_t count, size_t header_bytes)
+{
+    const size_t align = fifo_align_bytes(fifo);
+    size_t       skip = (align - ((count + header_bytes) & (align - 1))) & (align - 1);
+    const size_t left = fifo->size - ((count + skip) % fifo->size);
+
+    if (left < header_bytes)
+    {
+        skip += left + ((align - (header_bytes & (align - 1))) & (align - 1));
+    }
+
+    return skip;
+}   /* fifo_align_skip() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return 1 if the aligned @a fifo is empty and nothing depends on where
+ * its data sit - no reader positions, retained or held data, or staged
+ * puts - so that the next put may move to the start of the ring.
+ */
+static int8_t fifo_align_idle(const fifo_t* fifo)
+{
+    return (fifo->staged_count == fifo->get_count) && (fifo_room_tail(fifo) == fifo->get_count) &&
+           (0 == (fifo->flags & (FIFO_FLAG_BROADCAST | FIFO_FLAG_RETAIN)));
+}   /* fifo_align_idle() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the bytes that a put of a packet of @a bytes stored bytes into
+ * the aligned @a fifo now takes before its header: the skip, then a
+ * padding packet and the skip at the start of the ring if it won't fit
+ * before the end.
+ */
+static size_t fifo_align_lead(const fifo_t* fifo, size_t bytes)
+{
+    const size_t header_bytes = fifo_header_bytes(fifo);
+    const size_t count = fifo_align_idle(fifo) ? 0 : fifo->staged_count;
+    const size_t skip = fifo_align_skip(fifo, count, header_bytes);
+    const size_t left = fifo->size - ((count + skip) % fifo->size);
+
+    if (left >= (header_bytes + bytes))
+    {
+        return skip;
+    }
+
+    return skip + left + fifo_align_skip(fifo, 0, header_bytes);
+}   /* fifo_align_lead() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the most stored bytes that one packet put into the aligned
+ * @a fifo now can have: the larger of what fits before the end of the ring
+ * and what fits after padding out to it.
+ */
+static size_t fifo_align_room(const fifo_t* fifo)
+{
+    const size_t header_bytes = fifo_header_bytes(fifo);
+    const size_t count = fifo_align_idle(fifo) ? 0 : fifo->staged_count;
+    const size_t room = fifo->size - (fifo->staged_count - fifo_room_tail(fifo));
+    const size_t skip = fifo_align_skip(fifo, count, header_bytes);
+    const size_t left = fifo->size - ((count + skip) % fifo->size);
+    const size_t wrap = skip + left + fifo_align_skip(fifo, 0, header_bytes);
+    size_t       bytes = 0;
+
+    if (room >= (skip + header_bytes))
+    {
+        bytes = ((left < (room - skip)) ? left : (room - skip)) - header_bytes;
+    }
+
+    if ((room >= (wrap + header_bytes)) && ((room - wrap - header_bytes) > bytes))
+    {
+        bytes = room - wrap - header_bytes;
+    }
+
+    return bytes;
+}   /* fifo_align_room() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the address of the byte at ring index @a index of the @a fifo,
+ * with the number of bytes from there that are contiguous - up to the end
+ * of the ring, or of the page in a sparse FIFO - in @a span. The page must
+ * be committed.
+ */
+static FIFO_INLINE uint8_t* fifo_data_at(const fifo_t* fifo, size_t index, size_t* span)
+{
+    size_t n;
+
+    if (0 == fifo->page_bytes)
+    {
+        *span = fifo->size - index;
+        return (uint8_t*) &fifo->data[index];
+    }
+
+    n = index / fifo->page_bytes;
+    *span = fifo_page_bytes(fifo, n) - (index - (n * fifo->page_bytes));
+    return &fifo->page[n][index - (n * fifo->page_bytes)];
+}   /* fifo_data_at() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Commits the pages of the sparse @a fifo that hold the @a bytes bytes from
+ * ring index @a index, and marks them in use.
+ *
+ * @return 1 if they are all committed (always, for a FIFO that isn't
+ * sparse), 0 if out of memory.
+ */
+static int8_t fifo_pages_commit_at(fifo_t* fifo, size_t index, size_t bytes)
+{
+    if (0 == fifo->page_bytes)
+    {
+        return 1;
+    }
+
+    bytes = (bytes > fifo->size) ? fifo->size : bytes;
+
+    while (bytes > 0)
+    {
+        const size_t n = index / fifo->page_bytes;
+        const size_t page_bytes = fifo_page_bytes(fifo, n);
+        const size_t span = page_bytes - (index - (n * fifo->page_bytes));
+
+        if (NULL == fifo->page[n])
+        {
+            fifo->page[n] = (uint8_t*) fifo_mem_alloc(page_bytes);
+
+            if (NULL == fifo->page[n])
+            {
+                return 0;
+            }
+
+            fifo->stats.commits++;
+        }
+
+        fifo->idle_since[n] = 0;
+        bytes = (bytes > span) ? (bytes - span) : 0;
+        index = (index + span) % fifo->size;
+    }
+
+    return 1;
+}   /* fifo_pages_commit_at() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Commits the pages of the sparse @a fifo that the next @a bytes bytes put
+ * will land in, and marks them in use.
+ *
+ * @return 1 if they are all committed (always, for a FIFO that isn't
+ * sparse), 0 if out of memory.
+ */
+static FIFO_INLINE int8_t fifo_pages_commit(fifo_t* fifo, size_t bytes)
+{
+    return fifo_pages_commit_at(fifo, fifo->staged_count % fifo->size, bytes);
+}   /* fifo_pages_commit() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Frees the pages of a sparse @a fifo that have lain drained - wholly
+ * outside the data still kept, staged data included - for its idle_ticks,
+ * and starts the clock on any newly drained. Does nothing for a FIFO that
+ * isn't sparse.
+ *
+ * @return the number of pages freed.
+ */
+size_t fifo_decommit(fifo_t* fifo)
+{
+    size_t   freed = 0;
+    size_t   pages;
+    size_t   tail;
+    size_t   live;
+    size_t   n;
+    uint64_t now;
+
+    if ((NULL == fifo) || (0 == fifo->page_bytes))
+    {
+        return 0;
+    }
+
+    tail  = (fifo->flags & FIFO_FLAG_RETAIN) ? fifo->retain_count : fifo_room_tail(fifo);
+    live  = fifo->staged_count - tail;
+    tail %= fifo->size;
+    pages = fifo_pages(fifo);
+    now   = fifo_ticks();
+    fifo->sweep_ticks = now + (fifo->idle_ticks / 4);
+
+    for (n = 0; n < pages; n++)
+    {
+        const size_t start = n * fifo->page_bytes;
+
+        if ((NULL == fifo->page[n]) ||
+            ((live > 0) && ((((start + fifo->size - tail) % fifo->size) < live) ||
+                            ((tail >= start) && (tail < (start + fifo_page_bytes(fifo, n)))))))
+        {
+            continue;       // Not committed, or still holds data kept.
+        }
+
+        if ((0 == fifo->idle_since[n]) && (fifo->idle_ticks > 0))
+        {
+            fifo->idle_since[n] = now;
+        }
+        else if ((now - fifo->idle_since[n]) >= fifo->idle_ticks)
+        {
+            fifo_mem_free(fifo->page[n], fifo_page_bytes(fifo, n));
+            fifo->page[n] = NULL;
+            fifo->idle_since[n] = 0;
+            fifo->stats.decommits++;
+            freed++;
+        }
+    }
+
+    return freed;
+}   /* fifo_decommit() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Calls fifo_decommit() on a sparse @a fifo if a get has just finished a
+ * page - get_count was @a before it - and the last look was long enough
+ * ago.
+ */
+static FIFO_INLINE void fifo_pages_drained(fifo_t* fifo, size_t before)
+{
+    if ((NULL != fifo) && (fifo->page_bytes > 0) &&
+        (((before % fifo->size) / fifo->page_bytes) != ((fifo->get_count % fifo->size) / fifo->page_bytes)) &&
+        (fifo_ticks() >= fifo->sweep_ticks))
+    {
+        fifo_decommit(fifo);
+    }
+}   /* fifo_pages_drained() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the bytes of data buffer that @a fifo has allocated: its size,
+ * unless it is sparse.
+ */
+size_t fifo_bytes_committed(const fifo_t* fifo)
+{
+    size_t bytes = 0;
+    size_t pages;
+    size_t n;
+
+    if (NULL != fifo)
+    {
+        if (0 == fifo->page_bytes)
+        {
+            return fifo->size;
+        }
+
+        pages = fifo_pages(fifo);
+
+        for (n = 0; n < pages; n++)
+        {
+            bytes += (NULL == fifo->page[n]) ? 0 : fifo_page_bytes(fifo, n);
+        }
+    }
+
+    return bytes;
+}   /* fifo_bytes_committed() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies @a bytes from @a data into the @a fifo; no checking is performed
+ * but the put_count field is incremented - or, during a transaction, only
+ * the staged_count field. In retention mode, retained data in the way are
+ * given up first.
+ */
+static void prechecked_fifo_raw_put(fifo_t* fifo, const void* data, size_t bytes)
+{
+    const uint8_t* src = (const uint8_t*) data;
+    size_t         put_index = fifo->staged_count % fifo->size;
+    size_t         done = 0;
+    size_t         span;
+    uint8_t*       dst;
+
+    FIFO_TRACE(FIFO_TRACE_DATA, FIFO_TRACE_RAW_PUT, bytes, put_index);
+
+    if (fifo->flags & FIFO_FLAG_RETAIN)
+    {
+        fifo_retain_trim(fifo, bytes);
+    }
+
+    // At most two pieces - to the end and from the start - unless sparse.
+    while (done < bytes)
+    {
+        dst = fifo_data_at(fifo, put_index, &span);
+        span = ((bytes - done) < span) ? (bytes - done) : span;
+        fifo_mem_copy_into(dst, &src[done], span);
+        done += span;
+        put_index = (put_index + span) % fifo->size;
+    }
+
+    fifo->staged_count += bytes;
+
+    if (!fifo->staging)
+    {
+        fifo->put_count = fifo->staged_count;
+        fifo->put_sequence += bytes;
+    }
+}   /* prechecked_fifo_raw_put() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Moves the @a fifo's put position on @a bytes bytes without writing them,
+ * as prechecked_fifo_raw_put() would; no checking is performed.
+ */
+static void prechecked_fifo_skip(fifo_t* fifo, size_t bytes)
+{
+    if (fifo->flags & FIFO_FLAG_RETAIN)
+    {
+        fifo_retain_trim(fifo, bytes);
+    }
+
+    fifo->staged_count += bytes;
+
+    if (!fifo->staging)
+    {
+        fifo->put_count = fifo->staged_count;
+        fifo->put_sequence += bytes;
+    }
+}   /* prechecked_fifo_skip() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Encodes @a header into @a buf, fifo_header_bytes() long.
+ */
+static void fifo_header_encode(const fifo_t* fifo, const fifo_header_t* header, uint8_t* buf)
+{
+    const size_t word = header->bytes | header->flags;
+    size_t       used = sizeof(size_t);
+
+    memcpy(buf, &word, sizeof(size_t));
+
+    if (fifo->flags & FIFO_FLAG_CODEC)
+    {
+        memcpy(&buf[used], &header->raw_bytes, sizeof(size_t));
+        used += sizeof(size_t);
+    }
+
+    if (fifo->flags & FIFO_FLAG_TOPIC)
+    {
+        memcpy(&buf[used], &header->topic, sizeof(uint32_t));
+        used += sizeof(uint32_t);
+    }
+
+    if (fifo->flags & FIFO_FLAG_DEADLINE)
+    {
+        memcpy(&buf[used], &header->deadline, sizeof(uint64_t));
+        used += sizeof(uint64_t);
+    }
+
+    if (fifo->flags & FIFO_FLAG_CRC)
+    {
+        uint32_t header_crc;
+        memcpy(&buf[used], &header->data_crc, sizeof(uint32_t));
+        used += sizeof(uint32_t);
+        header_crc = fifo_crc32c(0, buf, used);
+        memcpy(&buf[used], &header_crc, sizeof(uint32_t));
+    }
+}   /* fifo_header_encode() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Encodes @a header into the @a fifo; no checking is performed.
+ */
+static void prechecked_fifo_header_put(fifo_t* fifo, const fifo_header_t* header)
+{
+    uint8_t buf[FIFO_HEADER_MAX_BYTES];
+
+    fifo_header_encode(fifo, header, buf);
+    prechecked_fifo_raw_put(fifo, buf, fifo_header_bytes(fifo));
+}   /* prechecked_fifo_header_put() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Moves the put position of the aligned @a fifo to where the header of a
+ * packet of @a bytes stored bytes goes, as fifo_align_lead() works out,
+ * putting a padding packet if it has to wrap; no checking is performed.
+ */
+static void prechecked_fifo_place(fifo_t* fifo, size_t bytes)
+{
+    const size_t  header_bytes = fifo_header_bytes(fifo);
+    size_t        skip;
+    size_t        left;
+    fifo_header_t pad;
+
+    if (fifo_align_idle(fifo))
+    {
+        // Empty, so move every count to the start of the ring.
+        skip = (fifo->size - (fifo->staged_count % fifo->size)) % fifo->size;
+        fifo->staged_count += skip;
+        fifo->put_count    += skip;
+        fifo->get_count    += skip;
+        fifo->hold_count   += skip;
+        fifo->put_sequence += skip;
+    }
+
+    skip = fifo_align_skip(fifo, fifo->staged_count, header_bytes);
+    left = fifo->size - ((fifo->staged_count + skip) % fifo->size);
+    prechecked_fifo_skip(fifo, skip);
+
+    if (left < (header_bytes + bytes))
+    {
+        memset(&pad, 0, sizeof(pad));
+        pad.bytes     = left - header_bytes;
+        pad.raw_bytes = pad.bytes;
+        pad.flags     = FIFO_PACKET_PAD;
+        prechecked_fifo_header_put(fifo, &pad);
+        prechecked_fifo_skip(fifo, pad.bytes + fifo_align_skip(fifo, 0, header_bytes));
+    }
+}   /* prechecked_fifo_place() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Puts a packet - @a header, then the header->bytes bytes at @a stored -
+ * into the @a fifo, filling in the data CRC if the FIFO has them; no
+ * checking is performed.
+ */
+static void prechecked_fifo_packet_put(fifo_t* fifo, fifo_header_t* header, const void* stored)
+{
+    if (fifo->flags & FIFO_FLAG_CRC)
+    {
+        header->data_crc = fifo_crc32c(0, stored, header->bytes);
+    }
+
+    if (0 != fifo_packet_align(fifo))
+    {
+        prechecked_fifo_place(fifo, header->bytes);
+    }
+
+    prechecked_fifo_header_put(fifo, header);
+    prechecked_fifo_raw_put(fifo, stored, header->bytes);
+}   /* prechecked_fifo_packet_put() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Compresses @a bytes from @a data into the codec's scratch buffer.
+ *
+ * @return the compressed size, or 0 if compressing saves nothing.
+ */
+static size_t fifo_codec_compress(fifo_codec_t* codec, const void* data, size_t bytes)
+{
+    const uint64_t start = fifo_ticks();
+    const size_t   limit = (bytes - 1 < codec->scratch_bytes) ? (bytes - 1) : codec->scratch_bytes;
+    const size_t   result = fifo_lz_compress(data, bytes, codec->scratch, limit, codec->table);
+
+    codec->stats.compress_ticks += fifo_ticks() - start;
+    return result;
+}   /* fifo_codec_compress() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Opens a transaction on @a fifo. Until fifo_commit() or fifo_abort(),
+ * every put - fifo_put(), fifo_put_packet() or fifo_put_topic() - is staged
+ * in the ring after the data already there, taking up room as usual but
+ * unseen by readers. A put that doesn't fit fails as it would otherwise, so
+ * the caller can abort rather than publish part of a batch.
+ *
+ * @return 1 if the transaction was opened, 0 if one was already open or a
+ * message is part way put (see fifo_put_fragments()).
+ */
+int8_t fifo_begin(fifo_t* fifo)
+{
+    if ((NULL == fifo) || fifo->staging || fifo->fragmenting)
+    {
+        return 0;
+    }
+
+    fifo->staged_count = fifo->put_count;
+    fifo->staging = 1;
+    return 1;
+}   /* fifo_begin() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Closes the transaction on @a fifo, publishing everything staged to the
+ * readers with a single update of put_count.
+ *
+ * @return the number of bytes published, headers included.
+ */
+size_t fifo_commit(fifo_t* fifo)
+{
+    const size_t bytes = fifo_staged_bytes(fifo);
+
+    if (NULL != fifo)
+    {
+        fifo->put_sequence += bytes;
+        fifo->put_count = fifo->staged_count;
+        fifo->staging = 0;
+    }
+
+    return bytes;
+}   /* fifo_commit() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Closes the transaction on @a fifo, giving back the room taken by
+ * everything staged.
+ *
+ * @return the number of bytes thrown away, headers included.
+ */
+size_t fifo_abort(fifo_t* fifo)
+{
+    const size_t bytes = fifo_staged_bytes(fifo);
+
+    if (NULL != fifo)
+    {
+        fifo->staged_count = fifo->put_count;
+        fifo->staging = 0;
+    }
+
+    return bytes;
+}   /* fifo_abort() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the number of bytes staged by the open transaction on @a fifo,
+ * headers included; 0 if none is open.
+ */
+size_t fifo_staged_bytes(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : (fifo->staged_count - fifo->put_count);
+}   /* fifo_staged_bytes() */
+
+/* ------------------------------------------------------------------------- */
+int8_t fifo_is_staging(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : fifo->staging;
+}   /* fifo_is_staging() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies up to @a bytes bytes from @a data into the fifo. A packet that
+ * does not fit is truncated unless @a whole is set, in which case nothing is
+ * put. In a topic-tagged FIFO the packet is tagged with @a topic. Nothing
+ * is put while a message is part way put; see fifo_put_fragments().
+ */
+static ssize_t fifo_put_common(fifo_t* fifo, const void* data, size_t bytes, int8_t whole, uint32_t topic)
+{
+    size_t          bytes_available_to_put;
+    size_t          stored_bytes;
+    const void*     stored = data;
+    fifo_header_t   header;
+    fifo_slab_ref_t ref;
+
+    if ((NULL != fifo) && fifo->fragmenting)
+    {
+        return 0;
+    }
+
+    if ((NULL != fifo) && (fifo->flags & FIFO_FLAG_EVICT))
+    {
+        fifo_readers_evict(fifo, bytes);
+    }
+
+    bytes_available_to_put = fifo_bytes_to_put(fifo);
+
+    if ((NULL == fifo) || (0 == bytes_available_to_put))
+    {
+        return 0;
+    }
+
+    // A sparse FIFO needs pages for the most this can store: the header,
+    // then the payload or a descriptor for it.
+    stored_bytes = (bytes > sizeof(ref)) ? bytes : sizeof(ref);
+
+    if (!fifo_pages_commit(fifo, fifo_header_bytes(fifo) +
+                                 ((stored_bytes < bytes_available_to_put) ? stored_bytes : bytes_available_to_put)))
+    {
+        return 0;
+    }
+
+    if (fifo->record_bytes > 0)
+    {
+        if (whole && ((bytes > bytes_available_to_put) || (fifo_record_floor(fifo, bytes) != bytes)))
+        {
+            return 0;
+        }
+
+        bytes = fifo_record_floor(fifo, (bytes > bytes_available_to_put) ? bytes_available_to_put : bytes);
+        prechecked_fifo_raw_put(fifo, data, bytes);
+        return bytes;
+    }
+
+    if (!fifo_is_packetized(fifo))
+    {
+        if (bytes > bytes_available_to_put)
+        {
+            if (whole)
+            {
+                return 0;
+            }
+
+            bytes = bytes_available_to_put;
+        }
+
+        prechecked_fifo_raw_put(fifo, data, bytes);
+        return bytes;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.bytes     = bytes;
+    header.raw_bytes = bytes;
+    header.topic     = topic;
+    header.deadline  = fifo_deadline(fifo);
+
+    if (fifo_indirect_wanted(fifo, bytes))
+    {
+        // Check for the descriptor's room first, so as not to copy in vain.
+        if ((sizeof(ref) > bytes_available_to_put) || !fifo_slab_alloc(fifo->slab, &ref))
+        {
+            return 0;
+        }
+
+        fifo_mem_copy_into(fifo_slab_data(fifo->slab, &ref), data, bytes);
+        ref.bytes    = (uint32_t) bytes;
+        header.bytes = sizeof(ref);
+        header.flags = FIFO_PACKET_INDIRECT;
+        stored = &ref;
+    }
+    else if ((NULL != fifo->codec) && (bytes >= fifo->codec->threshold) && (bytes > 1))
+    {
+        const size_t compressed = fifo_codec_compress(fifo->codec, data, bytes);
+
+        if (compressed > 0)
+        {
+            header.bytes = compressed;
+            header.flags = FIFO_PACKET_COMPRESSED;
+            stored = fifo->codec->scratch;
+        }
+    }
+
+    if (header.bytes > bytes_available_to_put)
+    {
+        if (whole)
+        {
+            return 0;
+        }
+
+        bytes = bytes_available_to_put;     // Truncated packets are stored raw.
+        header.bytes     = bytes;
+        header.raw_bytes = bytes;
+        header.flags     = 0;
+        stored = data;
+    }
+
+    // There's a minor race condition here over the value of put_count,
+    // but this code is not guaranteed to be thread-safe.
+    prechecked_fifo_packet_put(fifo, &header, stored);
+
+    if (header.flags & FIFO_PACKET_INDIRECT)
+    {
+        fifo_slab_queue(fifo->slab, &ref);
+    }
+
+    if (NULL != fifo->codec)
+    {
+        fifo->codec->stats.packets++;
+        fifo->codec->stats.compressed  += (0 != (header.flags & FIFO_PACKET_COMPRESSED));
+        fifo->codec->stats.raw_bytes    += header.raw_bytes;
+        fifo->codec->stats.stored_bytes += header.bytes;
+    }
+
+    return bytes;
+}   /* fifo_put_common() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies up to @a bytes bytes from @a data into the fifo.
+ */
+ssize_t fifo_put(fifo_t* fifo, const void* data, size_t bytes)
+{
+    return fifo_put_common(fifo, data, bytes, fifo_is_all_or_nothing(fifo), 0);
+}   /* fifo_put() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies all @a bytes bytes from @a data into the fifo, or nothing if they
+ * don't fit, regardless of all-or-nothing mode. In packetized mode with a
+ * codec attached, "fit" is judged on the compressed size, so this may accept
+ * a packet bigger than fifo_bytes_to_put().
+ */
+ssize_t fifo_put_packet(fifo_t* fifo, const void* data, size_t bytes)
+{
+    return fifo_put_common(fifo, data, bytes, 1, 0);
+}   /* fifo_put_packet() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Puts a whole packet, as fifo_put_packet(), tagged with @a topic, which
+ * must be less than FIFO_TOPICS. Packets put by the other calls are topic 0.
+ *
+ * @return @a bytes, or 0 if they didn't fit or @a topic is out of range.
+ */
+ssize_t fifo_put_topic(fifo_t* fifo, uint32_t topic, const void* data, size_t bytes)
+{
+    if (topic >= FIFO_TOPICS)
+    {
+        return 0;
+    }
+
+    return fifo_put_common(fifo, data, bytes, 1, topic);
+}   /* fifo_put_topic() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Puts @a bytes bytes from @a data as a message of fragments: packets of at
+ * most @a fragment_bytes bytes - 0 for the most that fit in the ring -
+ * each flagged if the next continues it, so that a message may be bigger
+ * than the ring. As many whole fragments are put as fit now. Until the
+ * last of the message is put, with @a more clear, the message stays open
+ * and nothing else may be put; call again with the rest as room appears,
+ * or with @a bytes 0 to end the message early. Every fragment but the last
+ * leaves room for the header of an empty one, so the message can always
+ * be ended.
+ *
+ * Fragments are tagged with @a topic and are never compressed or stored
+ * indirect. A reader reassembles them; see fifo_reader_get().
+ *
+ * @return the number of bytes put, which may be fewer than @a bytes; 0 if
+ * none fit, or in stream or record mode, or during a transaction. Ending a
+ * message early puts no bytes; check fifo_is_fragmenting() after.
+ */
+size_t fifo_put_fragments(fifo_t* fifo, uint32_t topic, const void* data, size_t bytes,
+                          size_t fragment_bytes, int8_t more)
+{
+    const uint8_t* src = (const uint8_t*) data;
+    size_t         header_bytes;
+    size_t         closing;
+    size_t         capacity;
+    size_t         done = 0;
+    fifo_header_t  header;
+
+    if ((NULL == fifo) || !fifo_is_packetized(fifo) || (fifo->record_bytes > 0) || fifo->staging ||
+        (topic >= FIFO_TOPICS) || ((0 == bytes) && (more || !fifo->fragmenting)))
+    {
+        return 0;
+    }
+
+    // Room kept for the empty fragment that ends the message, which when
+    // aligned may need a padding packet and two skips before it.
+    header_bytes = fifo_header_bytes(fifo);
+    closing = header_bytes + ((0 == fifo_packet_align(fifo)) ? 0 : (header_bytes + (2 * fifo_align_bytes(fifo))));
+    capacity = fifo_bytes_capacity(fifo);
+    capacity = (capacity > closing) ? (capacity - closing) : 0;
+
+    if ((0 == fragment_bytes) || (fragment_bytes > capacity))
+    {
+        fragment_bytes = capacity;
+    }
+
+    do
+    {
+        const size_t left = bytes - done;
+        const size_t n = (left < fragment_bytes) ? left : fragment_bytes;
+        const int8_t last = (n == left) && !more;
+        const size_t wanted = n + (last ? 0 : closing);
+        size_t       lead = 0;
+
+        if ((0 == n) && (0 != left))
+        {
+            break;      // Not even a header fits in the ring.
+        }
+
+        if (fifo->flags & FIFO_FLAG_EVICT)
+        {
+            fifo_readers_evict(fifo, wanted);
+        }
+
+        if (0 != fifo_packet_align(fifo))
+        {
+            lead = fifo_align_lead(fifo, n);
+        }
+
+        if (((lead + wanted + header_bytes) > (fifo->size - (fifo->staged_count - fifo_room_tail(fifo)))) ||
+            !fifo_pages_commit(fifo, header_bytes + n))
+        {
+            break;
+        }
+
+        memset(&header, 0, sizeof(header));
+        header.bytes     = n;
+        header.raw_bytes = n;
+        header.topic     = topic;
+        header.flags     = last ? 0 : FIFO_PACKET_MORE;
+        prechecked_fifo_packet_put(fifo, &header, &src[done]);
+        fifo->fragmenting = !last;
+        done += n;
+    } while (done < bytes);
+
+    return done;
+}   /* fifo_put_fragments() */
+
+/* ------------------------------------------------------------------------- */
+int8_t fifo_is_fragmenting(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : fifo->fragmenting;
+}   /* fifo_is_fragmenting() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Puts an indirect packet referring to the slab buffer @a ref, which the
+ * caller took with fifo_slab_alloc() from the slab attached to @a fifo and
+ * filled with ref->bytes bytes. On success the ring owns the buffer, so a
+ * producer can hand over a large payload without it being copied at all.
+ * This ignores the slab's threshold, but not the conditions of
+ * fifo_indirect(). Packets put this way are topic 0.
+ *
+ * @return ref->bytes, or 0 if there's no room for the descriptor or the
+ * caller doesn't own the buffer - which then stays the caller's.
+ */
+ssize_t fifo_put_ref(fifo_t* fifo, const fifo_slab_ref_t* ref)
+{
+    fifo_header_t header;
+
+    if ((NULL == fifo) || (NULL == ref) || !fifo_is_packetized(fifo) || (fifo->record_bytes > 0) ||
+        !fifo_indirect_wanted(fifo, fifo_slab_buffer_bytes(fifo->slab)) ||
+        (NULL == fifo_slab_data(fifo->slab, ref)) || (fifo_bytes_to_put(fifo) < sizeof(*ref)) ||
+        !fifo_pages_commit(fifo, fifo_header_bytes(fifo) + sizeof(*ref)))
+    {
+        return 0;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.bytes     = sizeof(*ref);
+    header.raw_bytes = sizeof(*ref);
+    header.flags     = FIFO_PACKET_INDIRECT;
+    header.deadline  = fifo_deadline(fifo);
+    prechecked_fifo_packet_put(fifo, &header, ref);
+    fifo_slab_queue(fifo->slab, ref);
+    return ref->bytes;
+}   /* fifo_put_ref() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies @a bytes from the @a fifo, starting at count @a at, into @a data;
+ * no checking is performed.
+ */
+static void prechecked_fifo_raw_peek_at(const fifo_t* fifo, size_t at, void* data, size_t bytes)
+{
+    uint8_t*       dst = (uint8_t*) data;
+    size_t         get_index = at % fifo->size;
+    size_t         done = 0;
+    size_t         span;
+    const uint8_t* src;
+
+    FIFO_TRACE(FIFO_TRACE_DATA, FIFO_TRACE_RAW_GET, bytes, get_index);
+
+    while (done < bytes)
+    {
+        src = fifo_data_at(fifo, get_index, &span);
+        span = ((bytes - done) < span) ? (bytes - done) : span;
+        fifo_mem_copy_from(&dst[done], src, span);
+        done += span;
+        get_index = (get_index + span) % fifo->size;
+    }
+}   /* prechecked_fifo_raw_peek_at() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies @a bytes from the @a fifo into @a data without consuming them; no
+ * checking is performed.
+ */
+static void prechecked_fifo_raw_peek(const fifo_t* fifo, void* data, size_t bytes)
+{
+    prechecked_fifo_raw_peek_at(fifo, fifo->get_count, data, bytes);
+}   /* prechecked_fifo_raw_peek() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies @a bytes from the @a fifo into @a data; no checking is performed,
+ * but the get_count field is incremented.
+ */
+static void prechecked_fifo_raw_get(fifo_t* fifo, void* data, size_t bytes)
+{
+    prechecked_fifo_raw_peek(fifo, data, bytes);
+    fifo->get_count += bytes;
+}   /* prechecked_fifo_raw_get() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the CRC32C of the @a bytes bytes at the @a fifo's get position,
+ * computed in place; no checking is performed.
+ */
+static uint32_t prechecked_fifo_crc(const fifo_t* fifo, size_t bytes)
+{
+    size_t         get_index = fifo->get_count % fifo->size;
+    size_t         span;
+    uint32_t       crc = 0;
+    const uint8_t* src;
+
+    while (bytes > 0)
+    {
+        src = fifo_data_at(fifo, get_index, &span);
+        span = (bytes < span) ? bytes : span;
+        crc = fifo_crc32c(crc, src, span);
+        bytes -= span;
+        get_index = (get_index + span) % fifo->size;
+    }
+
+    return crc;
+}   /* prechecked_fifo_crc() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Decodes the packet header in @a buf into @a header.
+ *
+ * @return 1 if the header passed its CRC check (or has none), 0 otherwise.
+ */
+static int8_t fifo_header_decode(const fifo_t* fifo, const uint8_t* buf, fifo_header_t* header)
+{
+    size_t word;
+    size_t used = sizeof(size_t);
+
+    memcpy(&word, buf, sizeof(size_t));
+    header->bytes     = word & ~FIFO_PACKET_FLAGS;
+    header->flags     = word &  FIFO_PACKET_FLAGS;
+    header->raw_bytes = header->bytes;
+    header->topic     = 0;
+    header->deadline  = 0;
+    header->data_crc  = 0;
+
+    if (fifo->flags & FIFO_FLAG_CODEC)
+    {
+        memcpy(&header->raw_bytes, &buf[used], sizeof(size_t));
+        used += sizeof(size_t);
+    }
+
+    if (fifo->flags & FIFO_FLAG_TOPIC)
+    {
+        memcpy(&header->topic, &buf[used], sizeof(uint32_t));
+        used += sizeof(uint32_t);
+    }
+
+    if (fifo->flags & FIFO_FLAG_DEADLINE)
+    {
+        memcpy(&header->deadline, &buf[used], sizeof(uint64_t));
+        used += sizeof(uint64_t);
+    }
+
+    if (fifo->flags & FIFO_FLAG_CRC)
+    {
+        uint32_t header_crc;
+        memcpy(&header->data_crc, &buf[used], sizeof(uint32_t));
+        used += sizeof(uint32_t);
+        memcpy(&header_crc, &buf[used], sizeof(uint32_t));
+        return (header_crc == fifo_crc32c(0, buf, used));
+    }
+
+    return 1;
+}   /* fifo_header_decode() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Takes the slab buffer that descriptor @a ref in the @a fifo refers to
+ * from the ring - unless fifo_get_ptr() already has, leaving the packet in
+ * place.
+ *
+ * @return 1 if the caller now holds the buffer, 0 if @a ref is stale.
+ */
+static int8_t fifo_indirect_claim(fifo_t* fifo, const fifo_slab_ref_t* ref)
+{
+    return (NULL != fifo_slab_data(fifo->slab, ref)) || fifo_slab_claim(fifo->slab, ref);
+}   /* fifo_indirect_claim() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Frees the slab buffer of the indirect packet whose payload is at the
+ * @a fifo's get position, when the packet is skipped unread; no checking is
+ * performed, and the get position is left alone.
+ */
+static void prechecked_fifo_indirect_drop(fifo_t* fifo, const fifo_header_t* header)
+{
+    fifo_slab_ref_t ref;
+
+    if (sizeof(ref) == header->bytes)
+    {
+        prechecked_fifo_raw_peek(fifo, &ref, sizeof(ref));
+
+        if (fifo_indirect_claim(fifo, &ref))
+        {
+            fifo_slab_release(fifo->slab, &ref);
+        }
+    }
+}   /* prechecked_fifo_indirect_drop() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Consumes the header of the next intact packet in the @a fifo, leaving the
+ * get position at its payload.
+ *
+ * With FIFO_FLAG_CRC, damaged packets are skipped: one whose data fail the
+ * check is dropped whole, and a damaged header is searched past a byte at a
+ * time. Without it, an impossible length resets the FIFO.
+ *
+ * With FIFO_FLAG_TOPIC, packets whose topics are not in @a topics are
+ * skipped too, before their data are checked or touched; and with
+ * FIFO_FLAG_DEADLINE so are packets past their deadlines. The clock is read
+ * once per call, so a run of stale packets costs a header peek apiece.
+ * When aligned, the skips before headers and the padding packets are
+ * passed over too.
+ *
+ * @param topics - topics wanted, one bit each; 0 for all.
+ *
+ * @return 1 if a header was consumed into @a header, 0 if no intact packet
+ * remains.
+ */
+static int8_t fifo_header_next(fifo_t* fifo, fifo_header_t* header, uint32_t topics)
+{
+    const size_t header_bytes = fifo_header_bytes(fifo);
+    const int8_t checked = fifo_is_crc_checked(fifo);
+    const int8_t aligned = (0 != fifo_packet_align(fifo));
+    int8_t       lost = 0;
+    uint64_t     now = 0;
+    uint8_t      buf[FIFO_HEADER_MAX_BYTES];
+
+    while ((fifo->put_count - fifo->get_count) >= header_bytes)
+    {
+        const size_t skip = aligned ? fifo_align_skip(fifo, fifo->get_count, header_bytes) : 0;
+        size_t       bytes_available_to_get;
+
+        if ((fifo->put_count - fifo->get_count) < (skip + header_bytes))
+        {
+            break;
+        }
+
+        fifo->get_count += skip;
+        bytes_available_to_get = fifo->put_count - fifo->get_count - header_bytes;
+        prechecked_fifo_raw_peek(fifo, buf, header_bytes);
+
+        if (!fifo_header_decode(fifo, buf, header) || (header->bytes > bytes_available_to_get))
+        {
+            if (!checked)
+            {
+                DbgPrint("fifo_get() Internal error! %u > %u.\r\n", header->bytes, bytes_available_to_get);
+                FIFO_TRACE(FIFO_TRACE_ERRORS, FIFO_TRACE_CORRUPT, header->bytes, fifo->get_count % fifo->size);
+                // Internal error! This should never happen.
+                fifo_reset(fifo);
+                return 0;   // -----------------------------------> return!
+            }
+
+            fifo->stats.resyncs += !lost;
+            fifo->stats.resync_bytes++;
+            fifo->get_count++;
+            lost = 1;
+            continue;
+        }
+
+        fifo->get_count += header_bytes;
+
+        if (header->flags & FIFO_PACKET_PAD)
+        {
+            fifo->get_count += header->bytes;   // Not a packet; the next is at the start of the ring.
+            lost = 0;
+            continue;
+        }
+
+        if (0 != header->deadline)
+        {
+            if (0 == now)
+            {
+                now = fifo_ticks();
+            }
+
+            if (now > header->deadline)
+            {
+                fifo->stats.expired++;
+
+                if ((header->flags & FIFO_PACKET_INDIRECT) && !fifo_is_broadcast(fifo))
+                {
+                    prechecked_fifo_indirect_drop(fifo, header);
+                }
+
+                fifo->get_count += header->bytes;
+                lost = 0;
+                continue;
+            }
+        }
+
+        if ((0 != topics) && (0 == (topics & ((uint32_t) 1 << header->topic))))
+        {
+            fifo->stats.filtered++;
+
+            if ((header->flags & FIFO_PACKET_INDIRECT) && !fifo_is_broadcast(fifo))
+            {
+                prechecked_fifo_indirect_drop(fifo, header);    // Gone for every reader.
+            }
+
+            fifo->get_count += header->bytes;
+            lost = 0;
+            continue;
+        }
+
+        if (checked && (prechecked_fifo_crc(fifo, header->bytes) != header->data_crc))
+        {
+            fifo->stats.bad_packets++;
+            fifo->get_count += header->bytes;
+            lost = 0;
+            continue;
+        }
+
+        return 1;
+    }
+
+    if (lost)
+    {
+        // Too little left to hold a header; it's part of the damage.
+        fifo->stats.resync_bytes += fifo->put_count - fifo->get_count;
+        fifo->get_count = fifo->put_count;
+    }
+
+    return 0;
+}   /* fifo_header_next() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Expands the compressed payload of the packet at the @a fifo's get
+ * position into @a data, consuming the payload.
+ *
+ * @return the number of bytes written to @a data.
+ */
+static size_t prechecked_fifo_expand(fifo_t* fifo, const fifo_header_t* header, void* data, size_t bytes)
+{
+    fifo_codec_t*  codec = fifo->codec;
+    size_t         span;
+    const uint8_t* src = fifo_data_at(fifo, fifo->get_count % fifo->size, &span);
+    uint64_t       start;
+    size_t         result;
+
+    if ((NULL == codec) || (header->bytes > codec->scratch_bytes))
+    {
+        fifo->get_count += header->bytes;   // Can't expand without the codec; drop it.
+        return 0;
+    }
+
+    if (bytes > header->raw_bytes)
+    {
+        bytes = header->raw_bytes;
+    }
+
+    // Expand straight out of the FIFO unless the payload wraps, or crosses
+    // a page.
+    if (header->bytes <= span)
+    {
+        fifo->get_count += header->bytes;
+    }
+    else
+    {
+        prechecked_fifo_raw_get(fifo, codec->scratch, header->bytes);
+        src = codec->scratch;
+    }
+
+    start = fifo_ticks();
+    result = fifo_lz_expand(src, header->bytes, data, bytes);
+    codec->stats.expand_ticks += fifo_ticks() - start;
+    return result;
+}   /* prechecked_fifo_expand() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Gets the indirect packet whose descriptor is at the @a fifo's get
+ * position, consuming the descriptor. With @a ref NULL the payload is
+ * copied into @a data, truncated to @a bytes as usual, and its buffer
+ * freed; otherwise the buffer passes to the caller through @a ref. A
+ * descriptor whose buffer is gone - freed by a reset since, say - is
+ * dropped.
+ *
+ * @return the number of bytes written to @a data, or the payload size when
+ * passed through @a ref.
+ */
+static size_t prechecked_fifo_indirect_get(fifo_t* fifo, const fifo_header_t* header, void* data, size_t bytes,
+                                           fifo_slab_ref_t* ref)
+{
+    fifo_slab_ref_t desc;
+
+    if (sizeof(desc) != header->bytes)
+    {
+        fifo->get_count += header->bytes;   // Not a descriptor; drop it.
+        return 0;
+    }
+
+    prechecked_fifo_raw_get(fifo, &desc, sizeof(desc));
+
+    if (!fifo_indirect_claim(fifo, &desc))
+    {
+        return 0;
+    }
+
+    if (NULL != ref)
+    {
+        *ref = desc;
+        return desc.bytes;
+    }
+
+    if (bytes > desc.bytes)
+    {
+        bytes = desc.bytes;
+    }
+
+    fifo_mem_copy_from(data, fifo_slab_data(fifo->slab, &desc), bytes);
+    fifo_slab_release(fifo->slab, &desc);
+    return bytes;
+}   /* prechecked_fifo_indirect_get() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies the fragments continuing the message whose packet was just read
+ * from the @a fifo - described by @a header - into @a data, after the
+ * @a done bytes already there, for as long as they are in the ring and fit
+ * whole in the @a bytes of @a data. One that doesn't fit is left for the
+ * next get.
+ *
+ * @return the number of bytes in @a data; @a header is left describing the
+ * last fragment copied, so that its MORE flag tells whether the message
+ * goes on.
+ */
+static size_t fifo_fragments_get(fifo_t* fifo, fifo_header_t* header, uint8_t* data, size_t done, size_t bytes,
+                                 uint32_t topics)
+{
+    fifo_header_t next;
+
+    while ((header->flags & FIFO_PACKET_MORE) && (done < bytes) && fifo_header_next(fifo, &next, topics))
+    {
+        if ((next.flags & (FIFO_PACKET_COMPRESSED | FIFO_PACKET_INDIRECT)) || (next.bytes > (bytes - done)))
+        {
+            fifo->get_count -= fifo_header_bytes(fifo);     // Unread; it starts the next get.
+            break;
+        }
+
+        prechecked_fifo_raw_get(fifo, &data[done], next.bytes);
+        done += next.bytes;
+        *header = next;
+    }
+
+    return done;
+}   /* fifo_fragments_get() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Reads @a bytes bytes from the fifo into the @a data buffer; see
+ * fifo_get(). With a @a reader, packets whose topics are not in its topics
+ * are skipped, and the topic of the packet read and whether its message
+ * goes on are left in it. An indirect packet is passed through @a ref
+ * rather than copied, if not NULL; see fifo_get_indirect().
+ */
+static ssize_t fifo_get_common(fifo_t* fifo, fifo_reader_t* reader, void* data, size_t bytes, fifo_slab_ref_t* ref)
+{
+    const size_t   bytes_available_to_get = fifo_bytes_to_get(fifo);
+    const uint32_t topics = (NULL == reader) ? 0 : reader->topics;
+
+    if (NULL != reader)
+    {
+        reader->more = 0;
+    }
+
+    // In packet mode an empty packet - one ending a message early - is
+    // still something to get.
+    if ((NULL == fifo) || (fifo->put_count == fifo->get_count) ||
+        ((0 == bytes_available_to_get) && !fifo_is_packetized(fifo)))
+    {
+        return 0;
+    }
+
+    if (bytes > bytes_available_to_get)
+    {
+        if (fifo_is_all_or_nothing(fifo))
+        {
+            return 0;
+        }
+        else if ((!fifo_is_compressed(fifo) && (NULL == fifo->slab)) || (fifo->record_bytes > 0))
+        {
+            bytes = bytes_available_to_get;
+        }
+    }
+
+    if (fifo->record_bytes > 0)
+    {
+        bytes = fifo_record_floor(fifo, bytes);
+        prechecked_fifo_raw_get(fifo, data, bytes);
+    }
+    else if (!fifo_is_packetized(fifo))
+    {
+        prechecked_fifo_raw_get(fifo, data, bytes);
+    }
+    else
+    {
+        const size_t  room = bytes;
+        fifo_header_t header;
+
+        if (!fifo_header_next(fifo, &header, topics))
+        {
+            return 0;
+        }
+
+        if (NULL != reader)
+        {
+            reader->topic = header.topic;
+        }
+
+        if (header.flags & FIFO_PACKET_INDIRECT)
+        {
+            bytes = prechecked_fifo_indirect_get(fifo, &header, data, bytes, ref);
+        }
+        else if (header.flags & FIFO_PACKET_COMPRESSED)
+        {
+            bytes = prechecked_fifo_expand(fifo, &header, data, bytes);
+        }
+        else
+        {
+            if (header.bytes < bytes)
+            {
+                bytes = header.bytes;
+            }
+
+            prechecked_fifo_raw_get(fifo, data, bytes);
+            fifo->get_count += header.bytes - bytes;    // Skip forward to next packet.
+            bytes = fifo_fragments_get(fifo, &header, (uint8_t*) data, bytes, room, topics);
+        }
+
+        if (NULL != reader)
+        {
+            reader->more = (0 != (header.flags & FIFO_PACKET_MORE));
+        }
+
+        if (fifo->get_count != fifo->put_count)
+        {
+            size_t span;
+            fifo_prefetch(fifo_data_at(fifo, fifo->get_count % fifo->size, &span));   // Next packet's header.
+        }
+    }
+
+    return bytes;
+}   /* fifo_get_common() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Reads @a bytes bytes from the fifo into the @a data buffer. A compressed
+ * packet is expanded into @a data, truncated to @a bytes as usual.
+ */
+ssize_t fifo_get(fifo_t* fifo, void* data, size_t bytes)
+{
+    const size_t  before = (NULL == fifo) ? 0 : fifo->get_count;
+    const ssize_t result = fifo_get_common(fifo, NULL, data, bytes, NULL);
+
+    fifo_pages_drained(fifo, before);
+    return result;
+}   /* fifo_get() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Gets the next packet as fifo_get() does, except that a packet stored in a
+ * slab buffer (see fifo_indirect()) is not copied: the buffer itself passes
+ * to the caller through @a ref, whole whatever @a bytes is, and the caller
+ * reads it with fifo_slab_data() and gives it back with fifo_slab_release()
+ * - under the FIFO's lock, like any other call here. For a packet copied
+ * into @a data, ref->bytes is 0.
+ *
+ * @return the bytes copied into @a data, or the payload size of the buffer
+ * passed through @a ref.
+ */
+ssize_t fifo_get_indirect(fifo_t* fifo, void* data, size_t bytes, fifo_slab_ref_t* ref)
+{
+    size_t  before;
+    ssize_t result;
+
+    if (NULL == ref)
+    {
+        return fifo_get(fifo, data, bytes);
+    }
+
+    memset(ref, 0, sizeof(*ref));
+    before = (NULL == fifo) ? 0 : fifo->get_count;
+    result = fifo_get_common(fifo, NULL, data, bytes, ref);
+    fifo_pages_drained(fifo, before);
+    return result;
+}   /* fifo_get_indirect() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Gets the next packet of the aligned @a fifo in place, without copying
+ * it: the payload stays in the ring, and its room stays taken, until
+ * fifo_get_done() consumes it. Until then the next get - fifo_get_ptr()
+ * again included - returns the same packet. An indirect packet's payload
+ * is its slab buffer, which fifo_get_done() frees.
+ *
+ * A packet that can't be read in place - compressed, or a fragment of a
+ * longer message - is left for fifo_get() and the like.
+ *
+ * @return the packet's payload, aligned as fifo_align() says - or as a
+ * slab buffer is, if indirect - with its size in @a bytes; NULL, with 0 in
+ * @a bytes, if there is no packet, the next can't be read in place, or
+ * @a fifo isn't aligned or is broadcasting.
+ */
+const void* fifo_get_ptr(fifo_t* fifo, size_t* bytes)
+{
+    const size_t    header_bytes = fifo_header_bytes(fifo);
+    fifo_header_t   header;
+    fifo_slab_ref_t ref;
+    size_t          span;
+
+    if (NULL != bytes)
+    {
+        *bytes = 0;
+    }
+
+    if ((NULL == fifo) || (NULL == bytes) || (0 == fifo_packet_align(fifo)) || fifo_is_broadcast(fifo))
+    {
+        return NULL;
+    }
+
+    while (fifo_header_next(fifo, &header, 0))
+    {
+        if (header.flags & (FIFO_PACKET_COMPRESSED | FIFO_PACKET_MORE))
+        {
+            fifo->get_count -= header_bytes;    // Unread; it's for fifo_get().
+            return NULL;
+        }
+
+        if (0 == (header.flags & FIFO_PACKET_INDIRECT))
+        {
+            fifo->get_count -= header_bytes;    // Unread until fifo_get_done().
+            *bytes = header.bytes;
+            return fifo_data_at(fifo, (fifo->get_count + header_bytes) % fifo->size, &span);
+        }
+
+        if (sizeof(ref) == header.bytes)
+        {
+            prechecked_fifo_raw_peek(fifo, &ref, sizeof(ref));
+
+            if (fifo_indirect_claim(fifo, &ref))
+            {
+                fifo->get_count -= header_bytes;    // Held until fifo_get_done().
+                *bytes = ref.bytes;
+                return fifo_slab_data(fifo->slab, &ref);
+            }
+        }
+
+        fifo->get_count += header.bytes;    // Stale or no descriptor; drop it, as fifo_get() does.
+    }
+
+    return NULL;
+}   /* fifo_get_ptr() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Consumes the packet last returned by fifo_get_ptr(), giving its room -
+ * and its slab buffer, if indirect - back to puts. Don't use the pointer
+ * after this.
+ *
+ * @return the payload size of the packet consumed; 0 if there was none.
+ */
+size_t fifo_get_done(fifo_t* fifo)
+{
+    const size_t    header_bytes = fifo_header_bytes(fifo);
+    fifo_header_t   header;
+    fifo_slab_ref_t ref;
+    size_t          bytes;
+    uint8_t         buf[FIFO_HEADER_MAX_BYTES];
+
+    if ((NULL == fifo) || (0 == fifo_packet_align(fifo)) || fifo_is_broadcast(fifo) ||
+        ((fifo->put_count - fifo->get_count) < header_bytes) ||
+        (0 != fifo_align_skip(fifo, fifo->get_count, header_bytes)))
+    {
+        return 0;       // Not at a packet that fifo_get_ptr() returned.
+    }
+
+    prechecked_fifo_raw_peek(fifo, buf, header_bytes);
+
+    if (!fifo_header_decode(fifo, buf, &header) || (header.flags & FIFO_PACKET_PAD) ||
+        (header.bytes > (fifo->put_count - fifo->get_count - header_bytes)))
+    {
+        return 0;
+    }
+
+    fifo->get_count += header_bytes;
+    bytes = header.bytes;
+
+    if ((header.flags & FIFO_PACKET_INDIRECT) && (sizeof(ref) == header.bytes))
+    {
+        prechecked_fifo_raw_peek(fifo, &ref, sizeof(ref));
+        bytes = ref.bytes;
+        fifo_slab_release(fifo->slab, &ref);
+    }
+
+    fifo->get_count += header.bytes;
+    return bytes;
+}   /* fifo_get_done() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Reads up to @a bytes bytes into @a data as @a reader of broadcast
+ * @a fifo, as fifo_get() does for the only reader, then reclaims whatever
+ * space every reader has now passed. A reader that is not active - new, or
+ * evicted - joins at the oldest data kept. When @a fifo is not in broadcast
+ * mode this reads from the FIFO's single position, as fifo_get().
+ *
+ * In a topic-tagged FIFO only packets of the reader's topics are read, and
+ * the packet's topic is left in reader->topic. The others are skipped
+ * without being copied; with a single position they are gone for every
+ * reader.
+ *
+ * The fragments of a message (see fifo_put_fragments()) are reassembled
+ * into @a data, as many as are in the ring and fit whole; if the message
+ * goes on past them, reader->more is set and the next get carries on with
+ * the rest. @a bytes should be at least the fragment size, since a fragment
+ * bigger than all of @a data is truncated like any packet. fifo_get() does
+ * the same, but can't say whether the message goes on.
+ */
+ssize_t fifo_reader_get(fifo_t* fifo, fifo_reader_t* reader, void* data, size_t bytes)
+{
+    size_t  before;
+    ssize_t result;
+
+    if (NULL == reader)
+    {
+        return fifo_get(fifo, data, bytes);
+    }
+
+    before = (NULL == fifo) ? 0 : fifo->get_count;
+
+    if (!fifo_is_broadcast(fifo))
+    {
+        result = fifo_get_common(fifo, reader, data, bytes, NULL);
+        fifo_pages_drained(fifo, before);
+        return result;
+    }
+
+    fifo_reader_add(fifo, reader);
+    fifo->get_count = reader->get_count;    // Read from this reader's position...
+    result = fifo_get_common(fifo, reader, data, bytes, NULL);
+    reader->get_count = fifo->get_count;
+    fifo_readers_reclaim(fifo);             // ...then put back the slowest one's.
+    fifo_pages_drained(fifo, before);
+    return result;
+}   /* fifo_reader_get() */
+
+/* ------------------------------------------------------------------------- */
+int8_t fifo_is_retaining(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : ((fifo->flags & FIFO_FLAG_RETAIN) != 0);
+}   /* fifo_is_retaining() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Turns retention mode on or off for @a fifo.
+ *
+ * In retention mode the data read stay in the ring until puts need their
+ * room, so a reader that lost what it read - a consumer that crashed before
+ * processing it - can seek back with fifo_reader_seek() and read it again.
+ * Retained data never turn a put away; the oldest packets are given up
+ * first. Every byte put has a 64-bit sequence number that keeps counting
+ * across fifo_reset(), so a consumer can checkpoint fifo_reader_sequence()
+ * after each packet it finishes and seek back to the checkpoint when it
+ * restarts. Retention starts with the data not yet read; no reset is
+ * needed.
+ *
+ * @return the previous setting.
+ */
+int8_t fifo_retain(fifo_t* fifo, int8_t enabled)
+{
+    int8_t result = fifo_is_retaining(fifo);
+
+    if ((NULL != fifo) && ((0 != enabled) != result))
+    {
+        if (enabled)
+        {
+            fifo->flags |=  FIFO_FLAG_RETAIN;
+        }
+        else
+        {
+            fifo->flags &= ~FIFO_FLAG_RETAIN;
+        }
+
+        fifo->retain_count = fifo->get_count;
+    }
+
+    return result;
+}   /* fifo_retain() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the sequence number of the byte at count @a count, which must not
+ * be past put_count.
+ */
+static FIFO_INLINE uint64_t fifo_count_sequence(const fifo_t* fifo, size_t count)
+{
+    return fifo->put_sequence - (size_t) (fifo->put_count - count);
+}   /* fifo_count_sequence() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the sequence number that the next byte put into @a fifo will
+ * have; that is, the number of bytes ever published.
+ */
+uint64_t fifo_put_sequence(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : fifo->put_sequence;
+}   /* fifo_put_sequence() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the sequence number of the oldest byte in @a fifo that a reader
+ * may seek back to: the oldest retained in retention mode, and otherwise
+ * the oldest not yet read.
+ */
+uint64_t fifo_retained_sequence(const fifo_t* fifo)
+{
+    if (NULL == fifo)
+    {
+        return 0;
+    }
+
+    return fifo_count_sequence(fifo, fifo_is_retaining(fifo) ? fifo->retain_count : fifo->get_count);
+}   /* fifo_retained_sequence() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the sequence number of the next byte that @a reader will read
+ * from @a fifo, as fifo_reader_get() would; @a reader may be NULL.
+ */
+uint64_t fifo_reader_sequence(const fifo_t* fifo, const fifo_reader_t* reader)
+{
+    if (NULL == fifo)
+    {
+        return 0;
+    }
+
+    if ((NULL != reader) && reader->active && fifo_is_broadcast(fifo))
+    {
+        return fifo_count_sequence(fifo, reader->get_count);
+    }
+
+    return fifo_count_sequence(fifo, fifo->get_count);
+}   /* fifo_reader_sequence() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the size, header included, of the packet whose header is at count
+ * @a at in @a fifo - or, if aligned, after the skip from there, which is
+ * included too - or 0 if there's no intact packet there that ends by count
+ * @a end. A padding packet counts as one.
+ */
+static size_t fifo_packet_bytes(const fifo_t* fifo, size_t at, size_t end)
+{
+    const size_t  header_bytes = fifo_header_bytes(fifo);
+    const size_t  skip = (0 == fifo_packet_align(fifo)) ? 0 : fifo_align_skip(fifo, at, header_bytes);
+    fifo_header_t header;
+    uint8_t       buf[FIFO_HEADER_MAX_BYTES];
+
+    if ((end - at) < (skip + header_bytes))
+    {
+        return 0;
+    }
+
+    prechecked_fifo_raw_peek_at(fifo, at + skip, buf, header_bytes);
+
+    if (!fifo_header_decode(fifo, buf, &header) || (header.bytes > (end - at - skip - header_bytes)))
+    {
+        return 0;
+    }
+
+    return skip + header_bytes + header.bytes;
+}   /* fifo_packet_bytes() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Gives up the oldest retained data in @a fifo - whole packets or records -
+ * until @a bytes more can be put at staged_count without overwriting any
+ * that are kept.
+ */
+static void fifo_retain_trim(fifo_t* fifo, size_t bytes)
+{
+    const size_t retained = fifo->get_count - fifo->retain_count;
+    size_t       excess = fifo->staged_count + bytes - fifo->retain_count;
+    size_t       dropped = 0;
+
+    if (excess <= fifo->size)
+    {
+        return;
+    }
+
+    excess -= fifo->size;
+
+    if (fifo->record_bytes > 0)
+    {
+        dropped = ((excess + fifo->record_bytes - 1) / fifo->record_bytes) * fifo->record_bytes;
+    }
+    else if (0 == fifo_header_bytes(fifo))
+    {
+        dropped = excess;
+    }
+    else
+    {
+        while (dropped < excess)
+        {
+            const size_t packet = fifo_packet_bytes(fifo, fifo->retain_count + dropped, fifo->get_count);
+
+            if (0 == packet)
+            {
+                dropped = retained;     // Damaged; none of it can be replayed.
+                break;
+            }
+
+            dropped += packet;
+        }
+    }
+
+    fifo->retain_count += (dropped < retained) ? dropped : retained;
+}   /* fifo_retain_trim() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Moves @a reader of @a fifo to @a sequence, back into the retained data or
+ * forward over unread data, so that its next fifo_reader_get() starts
+ * there. @a reader may be NULL, or not broadcasting, to move the FIFO's
+ * single position. The sequence must be a packet (or record) boundary - one
+ * returned by fifo_reader_sequence() is - between fifo_retained_sequence()
+ * and fifo_put_sequence(); it is checked by walking the packet headers from
+ * the oldest one kept.
+ *
+ * @return 1 if the reader was moved, 0 if @a sequence is not available.
+ */
+int8_t fifo_reader_seek(fifo_t* fifo, fifo_reader_t* reader, uint64_t sequence)
+{
+    size_t oldest;
+    size_t count;
+    size_t at;
+
+    if ((NULL == fifo) || (sequence > fifo->put_sequence))
+    {
+        return 0;
+    }
+
+    oldest = fifo_is_retaining(fifo) ? fifo->retain_count : fifo->get_count;
+
+    if ((fifo->put_sequence - sequence) > (uint64_t) (fifo->put_count - oldest))
+    {
+        return 0;   // Overwritten, or never retained.
+    }
+
+    count = fifo->put_count - (size_t) (fifo->put_sequence - sequence);
+
+    if (fifo->record_bytes > 0)
+    {
+        if (0 != ((count - oldest) % fifo->record_bytes))
+        {
+            return 0;
+        }
+    }
+    else if (0 != fifo_header_bytes(fifo))
+    {
+        for (at = oldest; at != count; )
+        {
+            const size_t packet = fifo_packet_bytes(fifo, at, fifo->put_count);
+
+            if ((0 == packet) || (packet > (count - at)))
+            {
+                return 0;   // Not a packet boundary.
+            }
+
+            at += packet;
+        }
+    }
+
+    if ((NULL != reader) && fifo_is_broadcast(fifo))
+    {
+        fifo_reader_add(fifo, reader);
+        reader->get_count = count;
+        fifo_readers_reclaim(fifo);
+    }
+    else
+    {
+        fifo->get_count = count;
+    }
+
+    return 1;
+}   /* fifo_reader_seek() */
+
+/* ------------------------------------------------------------------------- */
+int8_t fifo_is_holding(const fifo_t* fifo)
+{
+    return (NULL == fifo) ? 0 : ((fifo->flags & FIFO_FLAG_HOLD) != 0);
+}   /* fifo_is_holding() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Starts holding the data that @a fifo's reader gets from now on: they are
+ * gone from fifo_bytes_to_get() as usual, but their room stays unavailable
+ * to puts until fifo_release(). A consumer that hands the data on to
+ * something slow - a disk - holds them until it's done, so that a failed
+ * hand-off loses nothing and the producer is held back meanwhile, just as
+ * by data not yet read. A persisted image counts held data as unread.
+ *
+ * Holding is refused in broadcast and retention modes, which keep their own
+ * tails; neither may be turned on while holding.
+ *
+ * @return 1 if holding, 0 if refused.
+ */
+int8_t fifo_hold(fifo_t* fifo)
+{
+    if ((NULL == fifo) || (fifo->flags & (FIFO_FLAG_BROADCAST | FIFO_FLAG_RETAIN)))
+    {
+        return 0;
+    }
+
+    if (0 == (fifo->flags & FIFO_FLAG_HOLD))
+    {
+        fifo->flags |= FIFO_FLAG_HOLD;
+        fifo->hold_count = fifo->get_count;
+    }
+
+    return 1;
+}   /* fifo_hold() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Ends the hold begun by fifo_hold(), giving puts the room of everything
+ * read since.
+ *
+ * @return the number of bytes - headers included - released.
+ */
+size_t fifo_release(fifo_t* fifo)
+{
+    size_t bytes = 0;
+
+    if ((NULL != fifo) && (fifo->flags & FIFO_FLAG_HOLD))
+    {
+        bytes = fifo->get_count - fifo->hold_count;
+        fifo->flags &= ~FIFO_FLAG_HOLD;
+        fifo->hold_count = fifo->get_count;
+    }
+
+    return bytes;
+}   /* fifo_release() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the number of bytes available to be put into @a fifo; whole
+ * records only, in record mode.
+ */
+size_t fifo_bytes_to_put(const fifo_t* fifo)
+{
+    size_t bytes = 0;
+
+    if ((NULL != fifo) && (0 != fifo_packet_align(fifo)))
+    {
+        bytes = fifo_align_room(fifo);
+    }
+    else if (NULL != fifo)
+    {
+        bytes = fifo->size - (fifo->staged_count - fifo_room_tail(fifo));   // Staged and held bytes take room too.
+
+        if (bytes <= fifo_header_bytes(fifo))
+        {
+            bytes = 0;
+        }
+        else
+        {
+            bytes -= fifo_header_bytes(fifo);
+        }
+
+        bytes = fifo_record_floor(fifo, bytes);
+    }
+
+    return bytes;
+}   /* fifo_bytes_to_put() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the number of bytes available to be gotten from @a fifo. When in
+ * packet mode this may reflect more than are available on the next read;
+ * with compression, it counts the stored (compressed) bytes.
+ */
+size_t fifo_bytes_to_get(const fifo_t* fifo)
+{
+    size_t bytes = 0;
+
+    if (NULL != fifo)
+    {
+        bytes = fifo->put_count - fifo->get_count;
+
+        if (bytes <= fifo_header_bytes(fifo))
+        {
+            bytes = 0;
+        }
+        else
+        {
+            bytes -= fifo_header_bytes(fifo);
+        }
+    }
+
+    return bytes;
+}   /* fifo_bytes_to_get() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the number of bytes available to be gotten by @a reader of
+ * broadcast @a fifo, counted as fifo_bytes_to_get() counts them; those at
+ * the FIFO's single position when not broadcasting, or when @a reader is
+ * NULL or not active.
+ */
+size_t fifo_reader_bytes_to_get(const fifo_t* fifo, const fifo_reader_t* reader)
+{
+    size_t bytes;
+
+    if ((NULL == fifo) || (NULL == reader) || !reader->active || !fifo_is_broadcast(fifo))
+    {
+        return fifo_bytes_to_get(fifo);
+    }
+
+    bytes = fifo->put_count - reader->get_count;
+    return (bytes <= fifo_header_bytes(fifo)) ? 0 : (bytes - fifo_header_bytes(fifo));
+}   /* fifo_reader_bytes_to_get() */
+
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the largest number of bytes that a single put into an empty
+ * @a fifo would accept. Anything larger can never be put whole.
+ */
+size_t fifo_bytes_capacity(const fifo_t* fifo)
+{
+    size_t bytes = 0;
+
+    if (NULL != fifo)
+    {
+        bytes = fifo->size;
+
+        if (0 != fifo_packet_align(fifo))
+        {
+            const size_t skip = fifo_align_skip(fifo, 0, fifo_header_bytes(fifo));
+            bytes = (skip < bytes) ? (bytes - skip) : 0;    // Packets start aligned.
+        }
+
+        bytes = (bytes <= fifo_header_bytes(fifo)) ? 0 : (bytes - fifo_header_bytes(fifo));
+        bytes = fifo_record_floor(fifo, bytes);
+    }
+
+    return bytes;
+}   /* fifo_bytes_capacity() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the number of records that may be put into @a fifo; 0 when not in
+ * record mode.
+ */
+size_t fifo_records_to_put(const fifo_t* fifo)
+{
+    return (0 == fifo_record_bytes(fifo)) ? 0 : (fifo_bytes_to_put(fifo) / fifo->record_bytes);
+}   /* fifo_records_to_put() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the number of records held in @a fifo; 0 when not in record mode.
+ */
+size_t fifo_records_to_get(const fifo_t* fifo)
+{
+    return (0 == fifo_record_bytes(fifo)) ? 0 : (fifo_bytes_to_get(fifo) / fifo->record_bytes);
+}   /* fifo_records_to_get() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the number of records that an empty @a fifo holds; 0 when not in
+ * record mode.
+ */
+size_t fifo_records_capacity(const fifo_t* fifo)
+{
+    return (0 == fifo_record_bytes(fifo)) ? 0 : (fifo_bytes_capacity(fifo) / fifo->record_bytes);
+}   /* fifo_records_capacity() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies the counters of @a fifo into @a stats.
+ */
+void fifo_stats(const fifo_t* fifo, fifo_stats_t* stats)
+{
+    if (NULL != stats)
+    {
+        if (NULL != fifo)
+        {
+            *stats = fifo->stats;
+        }
+        else
+        {
+            memset(stats, 0, sizeof(*stats));
+        }
+    }
+}   /* fifo_stats() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Fills in @a image with a header describing the current state of @a fifo.
+ * The caller is responsible for writing the header and the data buffer -
+ * fifo->size bytes, copied out with fifo_image_data() - to the backing
+ * store, and for filling in the owner-defined fields.
+ */
+void fifo_image_header(const fifo_t* fifo, fifo_image_t* image)
+{
+    if ((NULL != fifo) && (NULL != image))
+    {
+        memset(image, 0, sizeof(*image));
+        image->magic        = FIFO_IMAGE_MAGIC;
+        image->version      = FIFO_IMAGE_VERSION;
+        image->header_bytes = sizeof(fifo_image_t);
+        image->size         = fifo->size;
+        image->flags        = fifo->flags & ~FIFO_FLAG_HOLD;
+        image->record_bytes = (uint32_t) fifo->record_bytes;
+        image->put_count    = fifo->put_count;
+        image->get_count    = fifo_room_tail(fifo);    // Held data count as unread.
+        image->ttl_ticks    = fifo->ttl_ticks;
+        image->ticks        = fifo_ticks();
+    }
+}   /* fifo_image_header() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies @a bytes of the data buffer of @a fifo, from ring index @a index
+ * and wrapping at its end, into @a data, for an image. Bytes in pages that
+ * a sparse FIFO hasn't committed hold no data kept, and read as 0.
+ */
+void fifo_image_data(const fifo_t* fifo, size_t index, void* data, size_t bytes)
+{
+    uint8_t* dst = (uint8_t*) data;
+    size_t   span;
+    size_t   n;
+
+    while (bytes > 0)
+    {
+        n = (0 == fifo->page_bytes) ? 0 : (index / fifo->page_bytes);
+
+        if ((fifo->page_bytes > 0) && (NULL == fifo->page[n]))
+        {
+            span = fifo_page_bytes(fifo, n) - (index - (n * fifo->page_bytes));
+            span = (bytes < span) ? bytes : span;
+            memset(dst, 0, span);
+        }
+        else
+        {
+            const uint8_t* src = fifo_data_at(fifo, index, &span);
+            span = (bytes < span) ? bytes : span;
+            memcpy(dst, src, span);
+        }
+
+        dst   += span;
+        bytes -= span;
+        index  = (index + span) % fifo->size;
+    }
+}   /* fifo_image_data() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Restores the modes and counters of @a fifo from @a image. The caller then
+ * loads the data buffer with fifo_image_load().
+ *
+ * Images from before version 3 hold no time to live, so those in deadline
+ * mode are refused rather than restored with a mode that can't be honoured.
+ *
+ * @return 1 if @a image is valid for @a fifo and was applied, 0 otherwise
+ * (in which case @a fifo is left untouched). Aligned images are refused for
+ * sparse FIFOs, whose pages can't hold aligned packets.
+ */
+int8_t fifo_image_restore(fifo_t* fifo, const fifo_image_t* image)
+{
+    const int8_t old = (NULL != image) && ((1 == image->version) || (2 == image->version));   // Version 1 has no records.
+
+    if ((NULL == fifo) || (NULL == image) ||
+        ((fifo->page_bytes > 0) && (0 != (image->flags & FIFO_FLAG_ALIGN_MASK))) ||
+        (FIFO_IMAGE_MAGIC != image->magic) ||
+        ((FIFO_IMAGE_VERSION != image->version) && !old) ||
+        ((old ? FIFO_IMAGE_V2_BYTES : sizeof(fifo_image_t)) != image->header_bytes) ||
+        ((0 != (image->flags & FIFO_FLAG_DEADLINE)) != (!old && (0 != image->ttl_ticks))) ||
+        (fifo->size != image->size) ||
+        (image->record_bytes > fifo->size) ||
+        (0 != ((fifo->size | (size_t) fifo->data) &
+               (((size_t) 1 << ((image->flags & FIFO_FLAG_ALIGN_MASK) >> FIFO_FLAG_ALIGN_SHIFT)) - 1))) ||
+        ((size_t) (image->put_count - image->get_count) > fifo->size))
+    {
+        return 0;
+    }
+
+    fifo->flags        = (size_t) image->flags;
+    fifo->record_bytes = (size_t) image->record_bytes;
+    fifo->put_count    = (size_t) image->put_count;
+    fifo->get_count    = (size_t) image->get_count;
+    fifo->staged_count = fifo->put_count;
+    fifo->staging      = 0;
+    fifo->retain_count = fifo->get_count;       // Only unread data are in the image.
+    fifo->put_sequence = image->put_count;
+    fifo->ttl_ticks    = old ? 0 : image->ttl_ticks;
+    return 1;
+}   /* fifo_image_restore() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies @a bytes from @a data into the @a fifo, starting at count @a at,
+ * over data already there; no checking is performed.
+ */
+static void prechecked_fifo_raw_poke_at(fifo_t* fifo, size_t at, const void* data, size_t bytes)
+{
+    const uint8_t* src = (const uint8_t*) data;
+    size_t         index = at % fifo->size;
+    size_t         done = 0;
+    size_t         span;
+    uint8_t*       dst;
+
+    while (done < bytes)
+    {
+        dst = fifo_data_at(fifo, index, &span);
+        span = ((bytes - done) < span) ? (bytes - done) : span;
+        memcpy(dst, &src[done], span);
+        done += span;
+        index = (index + span) % fifo->size;
+    }
+}   /* prechecked_fifo_raw_poke_at() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Moves the deadlines of the unread packets of @a fifo, just loaded from an
+ * image made at fifo_ticks() @a then, onto the clock of this run, so each
+ * keeps the time it had left when the image was made; time spent unloaded
+ * doesn't count. Packets already stale stay so. Stops at a damaged header,
+ * which gets then resync past as usual.
+ */
+static void fifo_deadlines_rebase(fifo_t* fifo, uint64_t then)
+{
+    const size_t   header_bytes = fifo_header_bytes(fifo);
+    const int8_t   aligned = (0 != fifo_packet_align(fifo));
+    const uint64_t now = fifo_ticks();
+    size_t         at = fifo->get_count;
+    fifo_header_t  header;
+    uint8_t        buf[FIFO_HEADER_MAX_BYTES];
+
+    while ((fifo->put_count - at) >= header_bytes)
+    {
+        const size_t skip = aligned ? fifo_align_skip(fifo, at, header_bytes) : 0;
+
+        if ((fifo->put_count - at) < (skip + header_bytes))
+        {
+            break;
+        }
+
+        at += skip;
+        prechecked_fifo_raw_peek_at(fifo, at, buf, header_bytes);
+
+        if (!fifo_header_decode(fifo, buf, &header) || (header.bytes > (fifo->put_count - at - header_bytes)))
+        {
+            break;
+        }
+
+        if (0 != header.deadline)
+        {
+            header.deadline = (header.deadline > then) ? (now + (header.deadline - then)) : 1;   // 1 is long past.
+            fifo_header_encode(fifo, &header, buf);
+            prechecked_fifo_raw_poke_at(fifo, at, buf, header_bytes);
+        }
+
+        at += header_bytes + header.bytes;
+    }
+}   /* fifo_deadlines_rebase() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Loads the unread data of @a fifo, just restored from @a image by
+ * fifo_image_restore(), from @a data: its whole data buffer as read from
+ * the image. Only pages of a sparse FIFO that hold unread data are
+ * committed. In deadline mode the packets' deadlines are re-based onto
+ * this run's clock; see fifo_deadlines_rebase().
+ *
+ * @return 1 on success, 0 if out of memory.
+ */
+int8_t fifo_image_load(fifo_t* fifo, const fifo_image_t* image, const void* data)
+{
+    const uint8_t* src = (const uint8_t*) data;
+    size_t         index = fifo->get_count % fifo->size;
+    size_t         bytes = fifo->put_count - fifo->get_count;
+    size_t         span;
+    uint8_t*       dst;
+
+    if (!fifo_pages_commit_at(fifo, index, bytes))
+    {
+        return 0;
+    }
+
+    while (bytes > 0)
+    {
+        dst  = fifo_data_at(fifo, index, &span);
+        span = (bytes < span) ? bytes : span;
+        memcpy(dst, &src[index], span);
+        bytes -= span;
+        index  = (index + span) % fifo->size;
+    }
+
+    if ((fifo_header_bytes(fifo) > 0) && (fifo->flags & FIFO_FLAG_DEADLINE))
+    {
+        fifo_deadlines_rebase(fifo, image->ticks);
+    }
 
+    return 1;
+}   /* fifo_image_load() */
@@ -2,14 +2,54 @@
 #define __fifo_h__
 
 #include "drfifo_stdint.h"
+#include "fifo_slab.h"
 
 typedef struct fifo_s fifo_t;
+typedef struct fifo_codec_s fifo_codec_t;
 
 typedef int          ssize_t;
 //typedef unsigned int size_t;
 
 typedef uint_t fifo_flags_t;
 
+/**
+ * Number of packet topics; see fifo_topic_tagged(). Topics are 0 through
+ * FIFO_TOPICS - 1, so that a set of them fits in a uint32_t.
+ */
+#define FIFO_TOPICS   32
+
+/**
+ * Counters kept by a FIFO, as returned by fifo_stats(). They survive
+ * fifo_reset().
+ */
+typedef struct fifo_stats_s
+{
+    uint64_t bad_packets;    /**< Packets dropped because their data failed the CRC check. */
+    uint64_t resyncs;        /**< Times the reader lost the packet framing and searched for it. */
+    uint64_t resync_bytes;   /**< Bytes skipped while searching. */
+    uint64_t evictions;      /**< Broadcast readers evicted for falling behind. */
+    uint64_t filtered;       /**< Packets skipped by readers not subscribed to their topics. */
+    uint64_t expired;        /**< Packets skipped unread because they were past their deadlines. */
+    uint64_t commits;        /**< Pages of a sparse FIFO allocated as puts first reached them. */
+    uint64_t decommits;      /**< Pages of a sparse FIFO freed after lying drained and idle. */
+} fifo_stats_t;
+
+/**
+ * A reader of a broadcast FIFO, with its own position in the data; see
+ * fifo_broadcast(). Readers are owned by the caller and linked into the FIFO
+ * while active. Zero one before its first use.
+ */
+typedef struct fifo_reader_s
+{
+    struct fifo_reader_s* next;   /**< Next active reader of the FIFO. */
+    size_t   get_count;           /**< Number of bytes this reader has read from the FIFO. */
+    uint64_t evictions;           /**< Times this reader was evicted for falling behind. */
+    uint32_t topics;              /**< Topics read, one bit per topic; 0 for all. See fifo_topic_tagged(). */
+    uint32_t topic;               /**< Topic of the last packet read. */
+    int8_t   more;                /**< Set if the message last read goes on in the next get; see fifo_put_fragments(). */
+    int8_t   active;              /**< Set while linked into the FIFO. */
+} fifo_reader_t;
+
 /**
  * Main FIFO structure. This should be considered private but is provided for
  * static allocation and status introspection.
@@ -19,10 +59,41 @@ struct fifo_s
     size_t   size;       /**< Number of data bytes in the buffer. */
     size_t   flags;      /**< Flags for this FIFO; used internally. */
     size_t   put_count;  /**< Number of bytes written to the FIFO. */
-    size_t   get_count;  /**< Number of bytes read from the FIFO. */
-    uint8_t  data[0];    /**< FIFO data. */
+    size_t   get_count;  /**< Number of bytes read from the FIFO; the slowest reader's when broadcasting. */
+    size_t   staged_count;  /**< put_count plus any bytes staged by an open transaction; see fifo_begin(). */
+    int8_t   staging;    /**< Set while a transaction is open. */
+    int8_t   fragmenting;   /**< Set while a message is part way put; see fifo_put_fragments(). */
+    size_t   retain_count;  /**< Oldest byte kept for replay in retention mode; see fifo_retain(). */
+    size_t   hold_count;    /**< Oldest byte read but still held from puts; see fifo_hold(). */
+    uint64_t put_sequence;  /**< Sequence number of put_count: bytes ever published, never reset. */
+    fifo_codec_t* codec; /**< Packet codec, or NULL; see fifo_codec(). */
+    fifo_slab_t*  slab;  /**< Payload buffers for indirect packets, or NULL; see fifo_indirect(). */
+    struct fifo_pool_s* pool;   /**< Pool the FIFO came from and goes back to, or NULL; see fifo_pool_get(). */
+    size_t   record_bytes;  /**< Record size in record mode, else 0; see fifo_record(). */
+    uint64_t ttl_ticks;     /**< Time to live given to each packet put, else 0; see fifo_ttl(). */
+    size_t    page_bytes;   /**< Page size of a sparse FIFO, else 0; see fifo_new_sparse(). */
+    uint8_t** page;         /**< Sparse FIFO's page table, after the struct; NULL for pages not committed. */
+    uint64_t* idle_since;   /**< Per page, fifo_ticks() when it was first seen drained, else 0. */
+    uint64_t  idle_ticks;   /**< How long a drained page stays committed. */
+    uint64_t  sweep_ticks;  /**< fifo_ticks() before which gets don't look for idle pages. */
+    fifo_reader_t* readers; /**< Active broadcast readers; see fifo_broadcast(). */
+    fifo_stats_t  stats; /**< Counters of damage found by the reader, and of evictions. */
+    uint8_t* data;       /**< FIFO data, after the struct on a FIFO_DATA_ALIGN boundary; NULL if sparse. */
 };   /* struct fifo_s */
 
+/**
+ * Boundary of the data buffer of a FIFO from fifo_new() or a pool: a cache
+ * line, so that aligned packets (see fifo_align()) are aligned in memory.
+ */
+#define FIFO_DATA_ALIGN     64
+
+/**
+ * Address of the data buffer of the FIFO at @a _fifo, when it's allocated
+ * in one block with the struct: the first FIFO_DATA_ALIGN boundary after
+ * the struct. Allow FIFO_DATA_ALIGN - 1 bytes for getting there.
+ */
+#define FIFO_DATA_AFTER(_fifo)  ((uint8_t*) ((((size_t) &(_fifo)[1]) + FIFO_DATA_ALIGN - 1) & ~(size_t) (FIFO_DATA_ALIGN - 1)))
+
 /**
  * Structure used with fifo_scatter_get() to get a list of buffers from the
  * fifo.
@@ -43,12 +114,73 @@ typedef struct fifo_put_data_s
     size_t      size;
 } fifo_put_data_t;
 
+/**
+ * Packet codec statistics, as returned by fifo_codec_stats(). The
+ * compression ratio is raw_bytes / stored_bytes; times are in ticks of the
+ * platform's performance counter (KeQueryPerformanceCounter() in the
+ * kernel).
+ */
+typedef struct fifo_codec_stats_s
+{
+    uint64_t packets;          /**< Packets put while the codec was attached. */
+    uint64_t compressed;       /**< Packets stored compressed. */
+    uint64_t raw_bytes;        /**< Payload bytes offered to put. */
+    uint64_t stored_bytes;     /**< Payload bytes actually stored in the FIFO. */
+    uint64_t compress_ticks;   /**< Time spent compressing. */
+    uint64_t expand_ticks;     /**< Time spent expanding. */
+} fifo_codec_stats_t;
+
+/**
+ * Magic number at the start of a FIFO image: "DRFI" when read as bytes on a
+ * little-endian machine.
+ */
+#define FIFO_IMAGE_MAGIC     0x49465244
+
+/**
+ * Version of the FIFO image format. Bump whenever the layout of
+ * fifo_image_t or of the data that follows it changes.
+ */
+#define FIFO_IMAGE_VERSION   3
+
+/**
+ * Size of the fifo_image_t of versions 1 and 2, which end at get_count.
+ */
+#define FIFO_IMAGE_V2_BYTES  56
+
+/**
+ * Header of a FIFO image, as stored at the start of a backing file. The
+ * header is followed by a byte-for-byte copy of the FIFO's data buffer, so
+ * the byte at ring index @c i lives at offset @c header_bytes + @c i.
+ *
+ * Fixed-width fields keep the image identical for 32- and 64-bit builds.
+ * Only data between get_count and put_count are meaningful; anything beyond
+ * put_count was never committed and is ignored on restore.
+ */
+typedef struct fifo_image_s
+{
+    uint32_t magic;           /**< FIFO_IMAGE_MAGIC. */
+    uint32_t version;         /**< FIFO_IMAGE_VERSION. */
+    uint32_t header_bytes;    /**< Offset of the data buffer within the image. */
+    uint32_t durability;      /**< Owner-defined durability level; not interpreted by fifo.c. */
+    uint32_t period_ms;       /**< Owner-defined sync period; not interpreted by fifo.c. */
+    uint32_t record_bytes;    /**< Record size in record mode, else 0. Was reserved (0) in version 1. */
+    uint64_t size;            /**< Number of data bytes in the buffer. */
+    uint64_t flags;           /**< FIFO flags (modes of operation). */
+    uint64_t put_count;       /**< Committed put count. */
+    uint64_t get_count;       /**< Committed get count. */
+    uint64_t ttl_ticks;       /**< Time to live in deadline mode, else 0. Not in versions 1 and 2. */
+    uint64_t ticks;           /**< fifo_ticks() when the header was made, to re-base deadlines. Ditto. */
+} fifo_image_t;
+
 
 //fifo_t* fifo_init(fifo_t* fifo, void* data, size_t size);
 //void    fifo_exit(fifo_t** fifo_ptr);
 
 fifo_t* fifo_new(size_t bytes);
+fifo_t* fifo_new_sparse(size_t bytes, size_t page_bytes, uint64_t idle_ticks);   // Pages committed as used.
 void fifo_del(fifo_t** fifo_ptr);
+size_t fifo_decommit(fifo_t* fifo);             // Frees a sparse FIFO's pages drained for idle_ticks.
+size_t fifo_bytes_committed(const fifo_t* fifo);
 
 void   fifo_reset(fifo_t* fifo);
 
@@ -57,11 +189,79 @@ int8_t fifo_all_or_nothing(fifo_t* fifo, int8_t enabled);
 int8_t fifo_is_packetized_get(const fifo_t* fifo);            // Each transaction is a packet; resets FIFO.
 int8_t fifo_packetized(fifo_t* fifo, int8_t enabled);
 
+fifo_codec_t* fifo_codec_new(size_t scratch_bytes, size_t threshold);
+void          fifo_codec_del(fifo_codec_t** codec_ptr);
+fifo_codec_t* fifo_codec(fifo_t* fifo, fifo_codec_t* codec);  // Attaches a codec; resets FIFO if compression turns on/off.
+int8_t        fifo_is_compressed(const fifo_t* fifo);
+int8_t        fifo_is_crc_checked(const fifo_t* fifo);
+int8_t        fifo_crc_checked(fifo_t* fifo, int8_t enabled);  // CRC32C per packet; resets FIFO if changed.
+void          fifo_codec_stats(const fifo_t* fifo, fifo_codec_stats_t* stats);
+
+fifo_slab_t*  fifo_indirect(fifo_t* fifo, fifo_slab_t* slab); // Big packets go in slab buffers; resets FIFO if changed.
+int8_t        fifo_is_indirect(const fifo_t* fifo);
+
+int8_t fifo_is_topic_tagged(const fifo_t* fifo);
+int8_t fifo_topic_tagged(fifo_t* fifo, int8_t enabled);        // Topic in each packet header; resets FIFO if changed.
+
+uint64_t fifo_ttl_ticks(const fifo_t* fifo);
+uint64_t fifo_ttl(fifo_t* fifo, uint64_t ttl_ticks);   // Stale packets skipped unread; 0 turns off. Resets FIFO if on/off changes.
+
+size_t fifo_record_bytes(const fifo_t* fifo);
+size_t fifo_record(fifo_t* fifo, size_t record_bytes);  // Fixed-size records, no headers; 0 turns off. Resets FIFO if changed.
+size_t fifo_records_to_put(const fifo_t* fifo);
+size_t fifo_records_to_get(const fifo_t* fifo);
+size_t fifo_records_capacity(const fifo_t* fifo);
+
+size_t fifo_align_bytes(const fifo_t* fifo);
+size_t fifo_align(fifo_t* fifo, size_t align_bytes);    // Packets contiguous, payloads aligned; 0 turns off. Resets FIFO if changed.
+
+int8_t fifo_is_broadcast(const fifo_t* fifo);
+int8_t fifo_broadcast(fifo_t* fifo, int8_t enabled, int8_t evict);   // Per-reader positions; evict readers that fall behind.
+void   fifo_reader_add(fifo_t* fifo, fifo_reader_t* reader);        // Starts at the oldest data kept.
+void   fifo_reader_remove(fifo_t* fifo, fifo_reader_t* reader);
+size_t fifo_readers(const fifo_t* fifo);
+void   fifo_flush(fifo_t* fifo);                                    // Discards all data, for every reader.
+
+int8_t   fifo_is_retaining(const fifo_t* fifo);
+int8_t   fifo_retain(fifo_t* fifo, int8_t enabled);     // Data read stay until overwritten, for replay.
+uint64_t fifo_put_sequence(const fifo_t* fifo);         // Sequence number of the next byte put.
+uint64_t fifo_retained_sequence(const fifo_t* fifo);    // ...of the oldest byte that may be read again.
+uint64_t fifo_reader_sequence(const fifo_t* fifo, const fifo_reader_t* reader);    // ...of the reader's next byte.
+int8_t   fifo_reader_seek(fifo_t* fifo, fifo_reader_t* reader, uint64_t sequence); // Must be a packet boundary.
+
+int8_t fifo_is_holding(const fifo_t* fifo);
+int8_t fifo_hold(fifo_t* fifo);                 // Room of data gotten stays taken until...
+size_t fifo_release(fifo_t* fifo);              // ...it is released.
+
+int8_t fifo_begin(fifo_t* fifo);                // Puts are staged, unseen by readers, until...
+size_t fifo_commit(fifo_t* fifo);               // ...they are all published at once, or...
+size_t fifo_abort(fifo_t* fifo);                // ...thrown away.
+size_t fifo_staged_bytes(const fifo_t* fifo);
+int8_t fifo_is_staging(const fifo_t* fifo);
+
 ssize_t fifo_put(fifo_t* fifo, const void* data, size_t bytes);
+ssize_t fifo_put_packet(fifo_t* fifo, const void* data, size_t bytes);  // Whole packet or nothing.
+ssize_t fifo_put_topic(fifo_t* fifo, uint32_t topic, const void* data, size_t bytes);  // Whole, tagged with topic.
+ssize_t fifo_put_ref(fifo_t* fifo, const fifo_slab_ref_t* ref);     // Queues a filled slab buffer; the ring owns it.
+size_t  fifo_put_fragments(fifo_t* fifo, uint32_t topic, const void* data, size_t bytes,
+                           size_t fragment_bytes, int8_t more);     // As much of a message as fits; see reader->more.
+int8_t  fifo_is_fragmenting(const fifo_t* fifo);                    // Set while a message is part way put.
 ssize_t fifo_get(fifo_t* fifo,       void* data, size_t bytes);
+ssize_t fifo_get_indirect(fifo_t* fifo, void* data, size_t bytes, fifo_slab_ref_t* ref);  // Indirect packets not copied.
+ssize_t fifo_reader_get(fifo_t* fifo, fifo_reader_t* reader, void* data, size_t bytes);   // Own position if broadcasting; own topics.
+const void* fifo_get_ptr(fifo_t* fifo, size_t* bytes);   // Aligned FIFOs: next packet in place, until...
+size_t  fifo_get_done(fifo_t* fifo);                      // ...it is consumed. Compressed or fragments: fifo_get().
 //ssize_t fifo_scatter_put(fifo_t* fifo, const fifo_put_data_t list[], size_t count);
 //ssize_t fifo_scatter_get(fifo_t* fifo, const fifo_get_data_t list[], size_t count);
-size_t  fifo_bytes_to_put(const fifo_t* fifo);   // Removes sizeof(size_t) for packetized transactions.
+size_t  fifo_bytes_to_put(const fifo_t* fifo);   // Removes the packet header for packetized transactions.
 size_t  fifo_bytes_to_get(const fifo_t* fifo);
+size_t  fifo_reader_bytes_to_get(const fifo_t* fifo, const fifo_reader_t* reader);   // From the reader's own position.
+size_t  fifo_bytes_capacity(const fifo_t* fifo); // Largest single put that an empty FIFO would accept.
+void    fifo_stats(const fifo_t* fifo, fifo_stats_t* stats);
+
+void   fifo_image_header(const fifo_t* fifo, fifo_image_t* image);
+void   fifo_image_data(const fifo_t* fifo, size_t index, void* data, size_t bytes);   // Ring bytes, page-aware.
+int8_t fifo_image_restore(fifo_t* fifo, const fifo_image_t* image);
+int8_t fifo_image_load(fifo_t* fifo, const fifo_image_t* image, const void* data);    // After fifo_image_restore().
 
 #endif
@@ -0,0 +1,394 @@
+#include <stdlib.h>
+
+#if !defined(WINDDK) && !defined(NT_INST)
+#define FIFO_COPY_USER       1     // AVX state is only free to use outside the kernel.
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64) || defined(_M_AMD64))
+#include <intrin.h>
+#include <emmintrin.h>
+#if defined(FIFO_COPY_USER) && (_MSC_VER >= 1911)
+#include <immintrin.h>
+#define FIFO_COPY_AVX        1
+#endif
+#define FIFO_COPY_X86        1
+#define FIFO_COPY_TARGET(_isa)
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#include <immintrin.h>
+#if defined(FIFO_COPY_USER)
+#define FIFO_COPY_AVX        1
+#endif
+#define FIFO_COPY_X86        1
+#define FIFO_COPY_TARGET(_isa)   __attribute__((target(_isa)))
+#endif
+
+/*
+ * XMM registers may be used freely by 64-bit kernel code, but 32-bit kernel
+ * code would have to save the FPU state first, which costs more than the
+ * streaming stores save.
+ */
+#if defined(FIFO_COPY_X86) && (defined(FIFO_COPY_USER) || defined(_M_X64) || defined(_M_AMD64) || defined(__x86_64__))
+#define FIFO_COPY_SSE2       1
+#endif
+
+#include "fifo_copy.h"
+
+/*
+ * Copy kernels for the FIFO. Small copies are inlined by fifo_copy(); this
+ * file handles the rest, picking kernels once for the CPU at hand:
+ *
+ * - medium copies use AVX-512 or AVX2 loads and stores in user builds, and
+ *   the compiler's memcpy (RtlCopyMemory) in the kernel, where it is already
+ *   a tuned "rep movsb";
+ * - copies of at least fifo_copy_stream_bytes() use non-temporal stores
+ *   (AVX-512, AVX2 or SSE2), bypassing the cache.
+ */
+
+typedef void (*fifo_copy_fn_t)(uint8_t* d, const uint8_t* s, size_t bytes);
+
+static void fifo_copy_memcpy(uint8_t* d, const uint8_t* s, size_t bytes);
+
+/**
+ * The kernels in use; fifo_copy_select() replaces them on first use.
+ */
+static fifo_copy_fn_t fifo_copy_medium = NULL;
+static fifo_copy_fn_t fifo_copy_stream = NULL;
+static const char*    fifo_copy_names = "memcpy";
+
+/**
+ * Smallest streaming threshold; below this the aligned head and the fence
+ * cost more than the cache pollution they save.
+ */
+#define FIFO_COPY_STREAM_MIN_BYTES   4096
+
+/**
+ * Size at and above which fifo_copy_stream is used.
+ */
+static size_t fifo_copy_stream_at = FIFO_COPY_STREAM_BYTES;
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Plain memcpy, for when nothing better is available.
+ */
+static void fifo_copy_memcpy(uint8_t* d, const uint8_t* s, size_t bytes)
+{
+    memcpy(d, s, bytes);
+}   /* fifo_copy_memcpy() */
+
+#if defined(FIFO_COPY_SSE2)
+/* ------------------------------------------------------------------------- */
+/**
+ * Non-temporal copy with SSE2 streaming stores.
+ */
+static FIFO_COPY_TARGET("sse2") void fifo_copy_stream_sse2(uint8_t* d, const uint8_t* s, size_t bytes)
+{
+    const size_t head = (16 - ((size_t) d & 15)) & 15;
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    bytes -= head;
+
+    while (bytes >= 64)
+    {
+        const __m128i a = _mm_loadu_si128((const __m128i*) s);
+        const __m128i b = _mm_loadu_si128((const __m128i*) (s + 16));
+        const __m128i c = _mm_loadu_si128((const __m128i*) (s + 32));
+        const __m128i e = _mm_loadu_si128((const __m128i*) (s + 48));
+
+        _mm_prefetch((const char*) (s + 512), _MM_HINT_NTA);
+        _mm_stream_si128((__m128i*) d, a);
+        _mm_stream_si128((__m128i*) (d + 16), b);
+        _mm_stream_si128((__m128i*) (d + 32), c);
+        _mm_stream_si128((__m128i*) (d + 48), e);
+        s += 64;
+        d += 64;
+        bytes -= 64;
+    }
+
+    _mm_sfence();       // Streaming stores are weakly ordered.
+    memcpy(d, s, bytes);
+}   /* fifo_copy_stream_sse2() */
+#endif
+
+#if defined(FIFO_COPY_AVX)
+/* ------------------------------------------------------------------------- */
+/**
+ * Cached copy with AVX2 loads and stores, 128 bytes at a time.
+ */
+static FIFO_COPY_TARGET("avx2") void fifo_copy_medium_avx2(uint8_t* d, const uint8_t* s, size_t bytes)
+{
+    while (bytes >= 128)
+    {
+        const __m256i a = _mm256_loadu_si256((const __m256i*) s);
+        const __m256i b = _mm256_loadu_si256((const __m256i*) (s + 32));
+        const __m256i c = _mm256_loadu_si256((const __m256i*) (s + 64));
+        const __m256i e = _mm256_loadu_si256((const __m256i*) (s + 96));
+
+        _mm256_storeu_si256((__m256i*) d, a);
+        _mm256_storeu_si256((__m256i*) (d + 32), b);
+        _mm256_storeu_si256((__m256i*) (d + 64), c);
+        _mm256_storeu_si256((__m256i*) (d + 96), e);
+        s += 128;
+        d += 128;
+        bytes -= 128;
+    }
+
+    while (bytes >= 32)
+    {
+        _mm256_storeu_si256((__m256i*) d, _mm256_loadu_si256((const __m256i*) s));
+        s += 32;
+        d += 32;
+        bytes -= 32;
+    }
+
+    fifo_copy_small(d, s, bytes);
+}   /* fifo_copy_medium_avx2() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Non-temporal copy with AVX2 streaming stores.
+ */
+static FIFO_COPY_TARGET("avx2") void fifo_copy_stream_avx2(uint8_t* d, const uint8_t* s, size_t bytes)
+{
+    const size_t head = (32 - ((size_t) d & 31)) & 31;
+
+    fifo_copy_small(d, s, head);
+    d += head;
+    s += head;
+    bytes -= head;
+
+    while (bytes >= 128)
+    {
+        const __m256i a = _mm256_loadu_si256((const __m256i*) s);
+        const __m256i b = _mm256_loadu_si256((const __m256i*) (s + 32));
+        const __m256i c = _mm256_loadu_si256((const __m256i*) (s + 64));
+        const __m256i e = _mm256_loadu_si256((const __m256i*) (s + 96));
+
+        _mm_prefetch((const char*) (s + 1024), _MM_HINT_NTA);
+        _mm256_stream_si256((__m256i*) d, a);
+        _mm256_stream_si256((__m256i*) (d + 32), b);
+        _mm256_stream_si256((__m256i*) (d + 64), c);
+        _mm256_stream_si256((__m256i*) (d + 96), e);
+        s += 128;
+        d += 128;
+        bytes -= 128;
+    }
+
+    _mm_sfence();
+    fifo_copy_medium_avx2(d, s, bytes);
+}   /* fifo_copy_stream_avx2() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Cached copy with AVX-512 loads and stores, 256 bytes at a time.
+ */
+static FIFO_COPY_TARGET("avx512f") void fifo_copy_medium_avx512(uint8_t* d, const uint8_t* s, size_t bytes)
+{
+    while (bytes >= 256)
+    {
+        const __m512i a = _mm512_loadu_si512((const void*) s);
+        const __m512i b = _mm512_loadu_si512((const void*) (s + 64));
+        const __m512i c = _mm512_loadu_si512((const void*) (s + 128));
+        const __m512i e = _mm512_loadu_si512((const void*) (s + 192));
+
+        _mm512_storeu_si512((void*) d, a);
+        _mm512_storeu_si512((void*) (d + 64), b);
+        _mm512_storeu_si512((void*) (d + 128), c);
+        _mm512_storeu_si512((void*) (d + 192), e);
+        s += 256;
+        d += 256;
+        bytes -= 256;
+    }
+
+    while (bytes >= 64)
+    {
+        _mm512_storeu_si512((void*) d, _mm512_loadu_si512((const void*) s));
+        s += 64;
+        d += 64;
+        bytes -= 64;
+    }
+
+    memcpy(d, s, bytes);
+}   /* fifo_copy_medium_avx512() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Non-temporal copy with AVX-512 streaming stores.
+ */
+static FIFO_COPY_TARGET("avx512f") void fifo_copy_stream_avx512(uint8_t* d, const uint8_t* s, size_t bytes)
+{
+    const size_t head = (64 - ((size_t) d & 63)) & 63;
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    bytes -= head;
+
+    while (bytes >= 256)
+    {
+        const __m512i a = _mm512_loadu_si512((const void*) s);
+        const __m512i b = _mm512_loadu_si512((const void*) (s + 64));
+        const __m512i c = _mm512_loadu_si512((const void*) (s + 128));
+        const __m512i e = _mm512_loadu_si512((const void*) (s + 192));
+
+        _mm_prefetch((const char*) (s + 2048), _MM_HINT_NTA);
+        _mm512_stream_si512((void*) d, a);
+        _mm512_stream_si512((void*) (d + 64), b);
+        _mm512_stream_si512((void*) (d + 128), c);
+        _mm512_stream_si512((void*) (d + 192), e);
+        s += 256;
+        d += 256;
+        bytes -= 256;
+    }
+
+    _mm_sfence();
+    memcpy(d, s, bytes);
+}   /* fifo_copy_stream_avx512() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return a bit mask of what the CPU and OS support: 1 for AVX2, 2 for
+ * AVX-512F.
+ */
+static int fifo_copy_cpu_features(void)
+{
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    unsigned int xcr0 = 0;
+    int          result = 0;
+
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    ecx = (unsigned int) info[2];
+#else
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+#endif
+
+    if (0 == (ecx & (1u << 27)))        // OSXSAVE: the OS manages extended state.
+    {
+        return 0;
+    }
+
+#if defined(_MSC_VER)
+    xcr0 = (unsigned int) _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    ebx = (unsigned int) info[1];
+#else
+    __asm__ __volatile__ ("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+#endif
+
+    if (((xcr0 & 0x06) == 0x06) && (ebx & (1u << 5)))        // YMM state; AVX2.
+    {
+        result |= 1;
+    }
+
+    if (((xcr0 & 0xE6) == 0xE6) && (ebx & (1u << 16)))       // ZMM state; AVX-512F.
+    {
+        result |= 2;
+    }
+
+    return result;
+}   /* fifo_copy_cpu_features() */
+#endif
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Picks the kernels for this CPU. Racing callers pick the same ones.
+ */
+static void fifo_copy_select(void)
+{
+    fifo_copy_fn_t medium = fifo_copy_memcpy;
+    fifo_copy_fn_t stream = fifo_copy_memcpy;
+    const char*    names = "memcpy";
+
+#if defined(FIFO_COPY_SSE2)
+    stream = fifo_copy_stream_sse2;
+    names = "memcpy, sse2 stream";
+#endif
+
+#if defined(FIFO_COPY_AVX)
+    {
+        const int features = fifo_copy_cpu_features();
+
+        if (features & 2)
+        {
+            medium = fifo_copy_medium_avx512;
+            stream = fifo_copy_stream_avx512;
+            names = "avx512, avx512 stream";
+        }
+        else if (features & 1)
+        {
+            medium = fifo_copy_medium_avx2;
+            stream = fifo_copy_stream_avx2;
+            names = "avx2, avx2 stream";
+        }
+    }
+#endif
+
+    fifo_copy_names  = names;
+    fifo_copy_stream = stream;
+    fifo_copy_medium = medium;      // Last: it's what callers check.
+}   /* fifo_copy_select() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies @a bytes bytes from @a src to @a dst, which must not overlap.
+ * Called by fifo_copy() for anything bigger than FIFO_COPY_SMALL_BYTES.
+ */
+void fifo_copy_large(void* dst, const void* src, size_t bytes)
+{
+    if (NULL == fifo_copy_medium)
+    {
+        fifo_copy_select();
+    }
+
+    if (bytes >= fifo_copy_stream_at)
+    {
+        fifo_copy_stream((uint8_t*) dst, (const uint8_t*) src, bytes);
+    }
+    else
+    {
+        fifo_copy_medium((uint8_t*) dst, (const uint8_t*) src, bytes);
+    }
+}   /* fifo_copy_large() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Sets the size at and above which copies use non-temporal stores. Lower it
+ * when the other side won't touch the data again soon; raise it when it will
+ * read the data while still in cache.
+ *
+ * @param bytes - new threshold; 0 leaves it unchanged. Anything under
+ * FIFO_COPY_STREAM_MIN_BYTES is raised to that.
+ *
+ * @return the previous threshold.
+ */
+size_t fifo_copy_stream_bytes(size_t bytes)
+{
+    const size_t result = fifo_copy_stream_at;
+
+    if (bytes > 0)
+    {
+        fifo_copy_stream_at = (bytes < FIFO_COPY_STREAM_MIN_BYTES) ? FIFO_COPY_STREAM_MIN_BYTES : bytes;
+    }
+
+    return result;
+}   /* fifo_copy_stream_bytes() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the names of the medium and streaming kernels picked for this
+ * CPU, for benchmarks and diagnostics.
+ */
+const char* fifo_copy_kernels(void)
+{
+    if (NULL == fifo_copy_medium)
+    {
+        fifo_copy_select();
+    }
+
+    return fifo_copy_names;
+}   /* fifo_copy_kernels() */
@@ -0,0 +1,85 @@
+#ifndef __fifo_copy_h__
+#define __fifo_copy_h__
+
+#include <string.h>
+
+#include "drfifo_stdint.h"
+
+#if defined(_MSC_VER)
+#define FIFO_INLINE   __inline
+#else
+#define FIFO_INLINE   __inline__
+#endif
+
+/**
+ * Copies of at most this many bytes - packet headers and small packets -
+ * are done inline with a few fixed-size moves rather than a call.
+ */
+#define FIFO_COPY_SMALL_BYTES    32
+
+/**
+ * Default size at and above which copies use non-temporal (streaming)
+ * stores, so that a bulk transfer doesn't push the other side's working set
+ * out of the cache. See fifo_copy_stream_bytes().
+ */
+#define FIFO_COPY_STREAM_BYTES   (256 * 1024)
+
+/**
+ * Hints that the cache line at @a _p will be read soon.
+ */
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64) || defined(_M_AMD64))
+#include <xmmintrin.h>
+#define fifo_prefetch(_p)   _mm_prefetch((const char*) (_p), _MM_HINT_T0)
+#elif defined(__GNUC__) || defined(__clang__)
+#define fifo_prefetch(_p)   __builtin_prefetch(_p)
+#else
+#define fifo_prefetch(_p)
+#endif
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies up to FIFO_COPY_SMALL_BYTES bytes with overlapping fixed-size
+ * moves, which compilers turn into plain loads and stores.
+ */
+static FIFO_INLINE void fifo_copy_small(void* dst, const void* src, size_t bytes)
+{
+    uint8_t*       d = (uint8_t*) dst;
+    const uint8_t* s = (const uint8_t*) src;
+
+    if (bytes >= 16)
+    {
+        memcpy(d, s, 8);
+        memcpy(d + 8, s + 8, 8);
+        memcpy(d + bytes - 16, s + bytes - 16, 8);
+        memcpy(d + bytes - 8, s + bytes - 8, 8);
+    }
+    else if (bytes >= 8)
+    {
+        memcpy(d, s, 8);
+        memcpy(d + bytes - 8, s + bytes - 8, 8);
+    }
+    else if (bytes >= 4)
+    {
+        memcpy(d, s, 4);
+        memcpy(d + bytes - 4, s + bytes - 4, 4);
+    }
+    else if (bytes > 0)
+    {
+        d[0] = s[0];
+        d[bytes >> 1] = s[bytes >> 1];
+        d[bytes - 1] = s[bytes - 1];
+    }
+}   /* fifo_copy_small() */
+
+void        fifo_copy_large(void* dst, const void* src, size_t bytes);
+size_t      fifo_copy_stream_bytes(size_t bytes);   // Sets the streaming threshold; 0 keeps it. Returns the old one.
+const char* fifo_copy_kernels(void);                // Names the kernels picked for this CPU.
+
+/**
+ * Copies @a _len bytes from @a _src to @a _dst, which must not overlap,
+ * picking the fastest way for the size.
+ */
+#define fifo_copy(_dst,_src,_len)                                       \
+    (((_len) <= FIFO_COPY_SMALL_BYTES) ? fifo_copy_small(_dst, _src, _len) : fifo_copy_large(_dst, _src, _len))
+
+#endif
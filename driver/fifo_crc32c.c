@@ -0,0 +1,413 @@
+#include <stdlib.h>
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64) || defined(_M_AMD64))
+#include <intrin.h>
+#include <nmmintrin.h>
+#define FIFO_CRC32C_X86      1
+#define FIFO_CRC32C_TARGET
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define FIFO_CRC32C_X86      1
+#define FIFO_CRC32C_TARGET   __attribute__((target("sse4.2")))
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define FIFO_CRC32C_ARM      1
+#endif
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__x86_64__)
+#define FIFO_CRC32C_64       1
+#endif
+
+#if defined(FIFO_CRC32C_X86) && defined(FIFO_CRC32C_64)
+#define fifo_crc32c_word(_crc,_p)   ((uint32_t) _mm_crc32_u64(_crc, *(const uint64_t*) (_p)))
+#define FIFO_CRC32C_WORD_BYTES      8
+#elif defined(FIFO_CRC32C_X86)
+#define fifo_crc32c_word(_crc,_p)   ((uint32_t) _mm_crc32_u32(_crc, *(const uint32_t*) (_p)))
+#define FIFO_CRC32C_WORD_BYTES      4
+#endif
+
+#include "fifo_crc32c.h"
+
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI, ext4 and SSE4.2's CRC32
+ * instruction. The hardware path is picked at run time on x86 and at
+ * compile time on ARMv8; otherwise a slicing-by-8 table does the work.
+ *
+ * The CRC32 instruction has a latency of three cycles but a throughput of
+ * one, so the x86 path runs three streams over adjacent blocks and then
+ * combines them. The technique is Mark Adler's (crc32c.c, zlib licence).
+ * Even so a pass costs several times a memcpy() of the same packet; see
+ * drfifoutil/drfifo_crcbench.c.
+ */
+
+/**
+ * The CRC-32C polynomial, bit-reflected.
+ */
+#define FIFO_CRC32C_POLY   0x82F63B78UL
+
+/**
+ * Slicing-by-8 tables, built on first use by the table-driven fallback.
+ * Racing builders all write the same values, so no lock is needed.
+ */
+static uint32_t fifo_crc32c_table[8][256];
+static volatile int fifo_crc32c_table_ready = 0;
+
+/**
+ * Whether a CRC instruction is available: -1 until checked.
+ */
+static volatile int fifo_crc32c_has_hw = -1;
+
+#if defined(FIFO_CRC32C_X86)
+/**
+ * Sizes of the three blocks checked in parallel, in bytes; multiples of the
+ * word size. Three long blocks cover a 4KB packet but for 16 bytes, so the
+ * common case needs a single combine; short blocks take what remains of
+ * other sizes, so that little is left for the one-stream tail.
+ */
+#define FIFO_CRC32C_LONG    1360
+#define FIFO_CRC32C_SHORT   80
+
+/**
+ * Tables that shift a CRC past FIFO_CRC32C_LONG and FIFO_CRC32C_SHORT zero
+ * bytes; built before fifo_crc32c_has_hw is set.
+ */
+static uint32_t fifo_crc32c_long[4][256];
+static uint32_t fifo_crc32c_short[4][256];
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the product of the GF(2) 32x32 matrix @a mat and vector @a vec.
+ */
+static uint32_t fifo_gf2_times(const uint32_t* mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    while (vec)
+    {
+        if (vec & 1)
+        {
+            sum ^= *mat;
+        }
+
+        vec >>= 1;
+        mat++;
+    }
+
+    return sum;
+}   /* fifo_gf2_times() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Sets @a product to the GF(2) matrix product of @a a and @a b, which may
+ * not be @a product.
+ */
+static void fifo_gf2_multiply(uint32_t* product, const uint32_t* a, const uint32_t* b)
+{
+    int n;
+
+    for (n = 0; n < 32; n++)
+    {
+        product[n] = fifo_gf2_times(a, b[n]);
+    }
+}   /* fifo_gf2_multiply() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Builds @a table from the operator that feeds @a len zero bytes through
+ * the CRC, found by squaring the one-byte operator and multiplying in the
+ * powers that make up @a len.
+ */
+static void fifo_crc32c_zeros_init(uint32_t table[4][256], size_t len)
+{
+    uint32_t base[32];
+    uint32_t op[32];
+    uint32_t tmp[32];
+    uint32_t row = 1;
+    int      have = 0;
+    int      n;
+
+    tmp[0] = FIFO_CRC32C_POLY;      // One zero bit.
+
+    for (n = 1; n < 32; n++)
+    {
+        tmp[n] = row;
+        row <<= 1;
+    }
+
+    fifo_gf2_multiply(base, tmp, tmp);      // Two zero bits.
+    fifo_gf2_multiply(tmp, base, base);     // Four.
+    fifo_gf2_multiply(base, tmp, tmp);      // One zero byte.
+
+    for (; len > 0; len >>= 1)
+    {
+        if (len & 1)
+        {
+            if (have)
+            {
+                fifo_gf2_multiply(tmp, base, op);
+            }
+
+            for (n = 0; n < 32; n++)
+            {
+                op[n] = have ? tmp[n] : base[n];
+            }
+
+            have = 1;
+        }
+
+        fifo_gf2_multiply(tmp, base, base);
+
+        for (n = 0; n < 32; n++)
+        {
+            base[n] = tmp[n];
+        }
+    }
+
+    for (n = 0; n < 256; n++)
+    {
+        table[0][n] = fifo_gf2_times(op, (uint32_t) n);
+        table[1][n] = fifo_gf2_times(op, (uint32_t) n << 8);
+        table[2][n] = fifo_gf2_times(op, (uint32_t) n << 16);
+        table[3][n] = fifo_gf2_times(op, (uint32_t) n << 24);
+    }
+}   /* fifo_crc32c_zeros_init() */
+
+/**
+ * Shifts the running CRC @a _crc past the zero bytes of @a _table.
+ */
+#define fifo_crc32c_shift(_table,_crc)                                        \
+    ((_table)[0][(_crc) & 0xFF]         ^ (_table)[1][((_crc) >> 8) & 0xFF] ^ \
+     (_table)[2][((_crc) >> 16) & 0xFF] ^ (_table)[3][((_crc) >> 24) & 0xFF])
+#endif
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Builds the slicing-by-8 tables.
+ */
+static void fifo_crc32c_table_init(void)
+{
+    uint32_t n;
+    uint32_t k;
+    uint32_t crc;
+
+    for (n = 0; n < 256; n++)
+    {
+        crc = n;
+
+        for (k = 0; k < 8; k++)
+        {
+            crc = (crc >> 1) ^ (FIFO_CRC32C_POLY & (0 - (crc & 1)));
+        }
+
+        fifo_crc32c_table[0][n] = crc;
+    }
+
+    for (n = 0; n < 256; n++)
+    {
+        crc = fifo_crc32c_table[0][n];
+
+        for (k = 1; k < 8; k++)
+        {
+            crc = fifo_crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+            fifo_crc32c_table[k][n] = crc;
+        }
+    }
+
+    fifo_crc32c_table_ready = 1;
+}   /* fifo_crc32c_table_init() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Table-driven CRC-32C of @a bytes at @a p, eight bytes at a time. @a crc
+ * is the running (inverted) value.
+ */
+static uint32_t fifo_crc32c_sw(uint32_t crc, const uint8_t* p, size_t bytes)
+{
+    if (!fifo_crc32c_table_ready)
+    {
+        fifo_crc32c_table_init();
+    }
+
+    while ((bytes > 0) && (0 != ((size_t) p & 7)))
+    {
+        crc = fifo_crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        bytes--;
+    }
+
+    while (bytes >= 8)
+    {
+        const uint32_t lo = crc ^ ((uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24));
+        const uint32_t hi =        (uint32_t) p[4] | ((uint32_t) p[5] << 8) | ((uint32_t) p[6] << 16) | ((uint32_t) p[7] << 24);
+
+        crc = fifo_crc32c_table[7][lo & 0xFF]         ^ fifo_crc32c_table[6][(lo >> 8) & 0xFF] ^
+              fifo_crc32c_table[5][(lo >> 16) & 0xFF] ^ fifo_crc32c_table[4][(lo >> 24) & 0xFF] ^
+              fifo_crc32c_table[3][hi & 0xFF]         ^ fifo_crc32c_table[2][(hi >> 8) & 0xFF] ^
+              fifo_crc32c_table[1][(hi >> 16) & 0xFF] ^ fifo_crc32c_table[0][(hi >> 24) & 0xFF];
+        p += 8;
+        bytes -= 8;
+    }
+
+    while (bytes-- > 0)
+    {
+        crc = fifo_crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}   /* fifo_crc32c_sw() */
+
+#if defined(FIFO_CRC32C_X86)
+/* ------------------------------------------------------------------------- */
+/**
+ * CRC-32C using the SSE4.2 CRC32 instruction. Only general-purpose
+ * registers are involved, so no floating-point state needs saving in the
+ * kernel.
+ */
+static FIFO_CRC32C_TARGET uint32_t fifo_crc32c_hw_x86(uint32_t crc, const uint8_t* p, size_t bytes)
+{
+    while ((bytes > 0) && (0 != ((size_t) p & 7)))
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+        bytes--;
+    }
+
+    while (bytes >= (3 * FIFO_CRC32C_LONG))
+    {
+        const uint8_t* end = p + FIFO_CRC32C_LONG;
+        uint32_t       crc1 = 0;
+        uint32_t       crc2 = 0;
+
+        do
+        {
+            crc  = fifo_crc32c_word(crc,  p);
+            crc1 = fifo_crc32c_word(crc1, p + FIFO_CRC32C_LONG);
+            crc2 = fifo_crc32c_word(crc2, p + (2 * FIFO_CRC32C_LONG));
+            p += FIFO_CRC32C_WORD_BYTES;
+        } while (p < end);
+
+        crc = fifo_crc32c_shift(fifo_crc32c_long, crc) ^ crc1;
+        crc = fifo_crc32c_shift(fifo_crc32c_long, crc) ^ crc2;
+        p += 2 * FIFO_CRC32C_LONG;
+        bytes -= 3 * FIFO_CRC32C_LONG;
+    }
+
+    while (bytes >= (3 * FIFO_CRC32C_SHORT))
+    {
+        const uint8_t* end = p + FIFO_CRC32C_SHORT;
+        uint32_t       crc1 = 0;
+        uint32_t       crc2 = 0;
+
+        do
+        {
+            crc  = fifo_crc32c_word(crc,  p);
+            crc1 = fifo_crc32c_word(crc1, p + FIFO_CRC32C_SHORT);
+            crc2 = fifo_crc32c_word(crc2, p + (2 * FIFO_CRC32C_SHORT));
+            p += FIFO_CRC32C_WORD_BYTES;
+        } while (p < end);
+
+        crc = fifo_crc32c_shift(fifo_crc32c_short, crc) ^ crc1;
+        crc = fifo_crc32c_shift(fifo_crc32c_short, crc) ^ crc2;
+        p += 2 * FIFO_CRC32C_SHORT;
+        bytes -= 3 * FIFO_CRC32C_SHORT;
+    }
+
+    while (bytes >= FIFO_CRC32C_WORD_BYTES)
+    {
+        crc = fifo_crc32c_word(crc, p);
+        p += FIFO_CRC32C_WORD_BYTES;
+        bytes -= FIFO_CRC32C_WORD_BYTES;
+    }
+
+    while (bytes-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+
+    return crc;
+}   /* fifo_crc32c_hw_x86() */
+#endif
+
+#if defined(FIFO_CRC32C_ARM)
+/* ------------------------------------------------------------------------- */
+/**
+ * CRC-32C using the ARMv8 CRC32C instructions.
+ */
+static uint32_t fifo_crc32c_hw_arm(uint32_t crc, const uint8_t* p, size_t bytes)
+{
+    while ((bytes > 0) && (0 != ((size_t) p & 7)))
+    {
+        crc = __crc32cb(crc, *p++);
+        bytes--;
+    }
+
+    while (bytes >= 8)
+    {
+        crc = __crc32cd(crc, *(const uint64_t*) p);
+        p += 8;
+        bytes -= 8;
+    }
+
+    while (bytes-- > 0)
+    {
+        crc = __crc32cb(crc, *p++);
+    }
+
+    return crc;
+}   /* fifo_crc32c_hw_arm() */
+#endif
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return non-zero if fifo_crc32c() uses a CRC instruction rather than the
+ * table-driven fallback.
+ */
+int8_t fifo_crc32c_hw(void)
+{
+    if (fifo_crc32c_has_hw < 0)
+    {
+#if defined(FIFO_CRC32C_X86) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        fifo_crc32c_zeros_init(fifo_crc32c_long, FIFO_CRC32C_LONG);
+        fifo_crc32c_zeros_init(fifo_crc32c_short, FIFO_CRC32C_SHORT);
+        fifo_crc32c_has_hw = (info[2] >> 20) & 1;       // ECX.SSE4_2
+#elif defined(FIFO_CRC32C_X86)
+        unsigned int eax, ebx, ecx, edx;
+        fifo_crc32c_zeros_init(fifo_crc32c_long, FIFO_CRC32C_LONG);
+        fifo_crc32c_zeros_init(fifo_crc32c_short, FIFO_CRC32C_SHORT);
+        fifo_crc32c_has_hw = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#elif defined(FIFO_CRC32C_ARM)
+        fifo_crc32c_has_hw = 1;
+#else
+        fifo_crc32c_has_hw = 0;
+#endif
+    }
+
+    return (int8_t) fifo_crc32c_has_hw;
+}   /* fifo_crc32c_hw() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Updates the CRC-32C @a crc with @a bytes bytes at @a data. Start with a
+ * @a crc of 0; a CRC over several buffers is the same as one over their
+ * concatenation.
+ *
+ * @return the updated CRC.
+ */
+uint32_t fifo_crc32c(uint32_t crc, const void* data, size_t bytes)
+{
+    const uint8_t* p = (const uint8_t*) data;
+
+    crc = ~crc;
+
+#if defined(FIFO_CRC32C_X86)
+    if (fifo_crc32c_hw())
+    {
+        return ~fifo_crc32c_hw_x86(crc, p, bytes);
+    }
+#elif defined(FIFO_CRC32C_ARM)
+    return ~fifo_crc32c_hw_arm(crc, p, bytes);
+#endif
+
+    return ~fifo_crc32c_sw(crc, p, bytes);
+}   /* fifo_crc32c() */
@@ -0,0 +1,9 @@
+#ifndef __fifo_crc32c_h__
+#define __fifo_crc32c_h__
+
+#include "drfifo_stdint.h"
+
+uint32_t fifo_crc32c(uint32_t crc, const void* data, size_t bytes);
+int8_t   fifo_crc32c_hw(void);    // Non-zero if a CRC instruction is used.
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "fifo_lz.h"
+
+/*
+ * A small LZ77 codec in the LZF format, which favours speed over ratio and
+ * needs no memory beyond a caller-provided match table.
+ *
+ * The compressed stream is a series of runs, each starting with a control
+ * byte:
+ *
+ *   000LLLLL                      L+1 literal bytes follow (1..32).
+ *   LLLOOOOO OOOOOOOO             back-reference of L+2 bytes (L = 1..6).
+ *   111OOOOO LLLLLLLL OOOOOOOO    back-reference of L+9 bytes.
+ *
+ * where the 13-bit O is the distance back from the current output position,
+ * less one.
+ */
+
+/**
+ * Longest literal run that a single control byte can describe.
+ */
+#define FIFO_LZ_MAX_LITERALS   32
+
+/**
+ * Hashes the three bytes at @a p into an index into the match table.
+ */
+#define FIFO_LZ_HASH(_p)                                                \
+    ((size_t) (((((uint32_t) (_p)[0]) | ((uint32_t) (_p)[1] << 8) |     \
+                 ((uint32_t) (_p)[2] << 16)) * 2654435761UL) >> 20) &   \
+     (FIFO_LZ_TABLE_ENTRIES - 1))
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Compresses @a in_bytes bytes from @a in into @a out.
+ *
+ * @a table must hold FIFO_LZ_TABLE_ENTRIES entries. It need not be cleared
+ * between calls - every candidate match is verified against the input - but
+ * it must not be shared between concurrent callers.
+ *
+ * @return the number of bytes written to @a out, or 0 if the result would
+ * not fit in @a out_bytes (which includes the case where the data don't
+ * compress).
+ */
+size_t fifo_lz_compress(const void* in, size_t in_bytes, void* out, size_t out_bytes, size_t* table)
+{
+    const uint8_t* src = (const uint8_t*) in;
+    uint8_t*       dst = (uint8_t*) out;
+    size_t         ip = 0;
+    size_t         op = 1;      // dst[0] is the control byte of the first literal run.
+    size_t         lit = 0;     // Bytes in the current literal run.
+
+    if ((0 == in_bytes) || (out_bytes < 2))
+    {
+        return 0;
+    }
+
+    while (ip < in_bytes)
+    {
+        if ((ip + 2) < in_bytes)
+        {
+            const size_t h = FIFO_LZ_HASH(&src[ip]);
+            const size_t ref = table[h];
+
+            table[h] = ip;
+
+            if ((ref < ip) && ((ip - ref) <= FIFO_LZ_MAX_OFFSET) &&
+                (src[ref] == src[ip]) && (src[ref + 1] == src[ip + 1]) && (src[ref + 2] == src[ip + 2]))
+            {
+                const size_t off = ip - ref - 1;
+                size_t       max = in_bytes - ip;
+                size_t       len = 3;
+
+                if (max > FIFO_LZ_MAX_MATCH)
+                {
+                    max = FIFO_LZ_MAX_MATCH;
+                }
+
+                while ((len < max) && (src[ref + len] == src[ip + len]))
+                {
+                    len++;
+                }
+
+                // Close the literal run, or take back its unused control byte.
+                if (0 == lit)
+                {
+                    op--;
+                }
+                else
+                {
+                    dst[op - lit - 1] = (uint8_t) (lit - 1);
+                }
+
+                if ((op + 3 + 1) > out_bytes)
+                {
+                    return 0;
+                }
+
+                if ((len - 2) < 7)
+                {
+                    dst[op++] = (uint8_t) (((len - 2) << 5) | (off >> 8));
+                }
+                else
+                {
+                    dst[op++] = (uint8_t) ((7 << 5) | (off >> 8));
+                    dst[op++] = (uint8_t) (len - 2 - 7);
+                }
+
+                dst[op++] = (uint8_t) off;
+                op++;   // Control byte for the next literal run.
+                lit = 0;
+                ip += len;
+                continue;
+            }
+        }
+
+        if (op >= out_bytes)
+        {
+            return 0;
+        }
+
+        dst[op++] = src[ip++];
+        lit++;
+
+        if (FIFO_LZ_MAX_LITERALS == lit)
+        {
+            dst[op - lit - 1] = (uint8_t) (lit - 1);
+            op++;
+            lit = 0;
+        }
+    }
+
+    if (0 == lit)
+    {
+        op--;
+    }
+    else
+    {
+        dst[op - lit - 1] = (uint8_t) (lit - 1);
+    }
+
+    return op;
+}   /* fifo_lz_compress() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Expands the compressed @a in_bytes bytes at @a in into @a out, stopping
+ * once @a out_bytes bytes have been produced. Corrupt input stops the
+ * expansion early rather than reading or writing out of bounds.
+ *
+ * @return the number of bytes written to @a out.
+ */
+size_t fifo_lz_expand(const void* in, size_t in_bytes, void* out, size_t out_bytes)
+{
+    const uint8_t* src = (const uint8_t*) in;
+    uint8_t*       dst = (uint8_t*) out;
+    size_t         ip = 0;
+    size_t         op = 0;
+
+    while ((ip < in_bytes) && (op < out_bytes))
+    {
+        const size_t ctrl = src[ip++];
+
+        if (ctrl < FIFO_LZ_MAX_LITERALS)
+        {
+            size_t len = ctrl + 1;
+
+            if ((ip + len) > in_bytes)
+            {
+                break;      // Corrupt: run past the end of the input.
+            }
+
+            if (len > (out_bytes - op))
+            {
+                len = out_bytes - op;
+            }
+
+            memcpy(&dst[op], &src[ip], len);
+            ip += ctrl + 1;
+            op += len;
+        }
+        else
+        {
+            size_t len = ctrl >> 5;
+            size_t off;
+
+            if (7 == len)
+            {
+                if (ip >= in_bytes)
+                {
+                    break;
+                }
+
+                len += src[ip++];
+            }
+
+            if (ip >= in_bytes)
+            {
+                break;
+            }
+
+            off = ((ctrl & 0x1F) << 8) + src[ip++] + 1;
+            len += 2;
+
+            if (off > op)
+            {
+                break;      // Corrupt: reference before the start of the output.
+            }
+
+            if (len > (out_bytes - op))
+            {
+                len = out_bytes - op;
+            }
+
+            // Byte by byte, since the source may overlap what's being written.
+            while (len-- > 0)
+            {
+                dst[op] = dst[op - off];
+                op++;
+            }
+        }
+    }
+
+    return op;
+}   /* fifo_lz_expand() */
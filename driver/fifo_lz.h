@@ -0,0 +1,24 @@
+#ifndef __fifo_lz_h__
+#define __fifo_lz_h__
+
+#include "drfifo_stdint.h"
+
+/**
+ * Number of entries in the match table passed to fifo_lz_compress().
+ */
+#define FIFO_LZ_TABLE_ENTRIES   (1 << 12)
+
+/**
+ * Largest back-reference distance, in bytes.
+ */
+#define FIFO_LZ_MAX_OFFSET      (1 << 13)
+
+/**
+ * Longest match that a single back-reference can encode, in bytes.
+ */
+#define FIFO_LZ_MAX_MATCH       (2 + 7 + 0xFF)
+
+size_t fifo_lz_compress(const void* in, size_t in_bytes, void* out, size_t out_bytes, size_t* table);
+size_t fifo_lz_expand(const void* in, size_t in_bytes, void* out, size_t out_bytes);
+
+#endif
@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WINDDK) || defined(NT_INST)
+#include <ntddk.h>
+#define fifo_pool_mem_alloc(_size)          ExAllocatePoolWithTag(NonPagedPool, _size, FIFO_POOL_POOL_TAG)
+#define fifo_pool_mem_free(_ptr,_size)      ExFreePoolWithTag(_ptr, FIFO_POOL_POOL_TAG)
+#define fifo_pool_cpu_count()               KeQueryActiveProcessorCount(NULL)
+#define fifo_pool_cpu_number()              KeGetCurrentProcessorNumber()
+#define fifo_pool_depth(_list)              ExQueryDepthSList(_list)
+#define FIFO_POOL_POOL_TAG                  'lpof'
+#else    // Win32 user land...
+#include <windows.h>
+#define fifo_pool_mem_alloc(_size)          _aligned_malloc(_size, 64)
+#define fifo_pool_mem_free(_ptr,_size)      _aligned_free(_ptr)
+#define fifo_pool_cpu_count()               GetActiveProcessorCount(ALL_PROCESSOR_GROUPS)
+#define fifo_pool_cpu_number()              GetCurrentProcessorNumber()
+#define fifo_pool_depth(_list)              QueryDepthSList(_list)
+#endif
+
+#include "fifo.h"
+#include "fifo_pool.h"
+
+/**
+ * Bytes before each FIFO in the pool: its free-list link and its class,
+ * padded to a cache line so that the FIFO starts on one.
+ */
+#define FIFO_POOL_ENTRY_BYTES   64
+
+/**
+ * Bookkeeping ahead of each FIFO in the pool.
+ */
+typedef struct fifo_pool_entry_s
+{
+    SLIST_ENTRY link;        /**< Free-list link; first, for its alignment. */
+    size_t      klass;       /**< Size class of the FIFO. */
+} fifo_pool_entry_t;
+
+/**
+ * The free lists and counters of one processor. Each processor gets and
+ * puts on its own lists, so the interlocked operations rarely contend or
+ * move a cache line between processors; a get only looks at the other
+ * processors' lists when its own is empty.
+ */
+typedef struct fifo_pool_cpu_s
+{
+    SLIST_HEADER       free[FIFO_POOL_CLASSES];  /**< Free FIFOs, by class. */
+    volatile LONGLONG  gets;
+    volatile LONGLONG  steals;
+    volatile LONGLONG  misses;
+    volatile LONGLONG  puts;
+} fifo_pool_cpu_t;
+
+/**
+ * A pool of FIFOs in a few size classes, allocated in one block when the
+ * pool is created so that getting one is a list pop, and memory use is
+ * fixed.
+ */
+struct fifo_pool_s
+{
+    size_t   classes;                           /**< Size classes in use, smallest first. */
+    size_t   class_bytes[FIFO_POOL_CLASSES];    /**< Data bytes of each FIFO, by class. */
+    size_t   class_count[FIFO_POOL_CLASSES];    /**< FIFOs, by class. */
+    size_t   cpus;                              /**< Processors, each with its own free lists. */
+    size_t   cpu_stride;                        /**< Bytes per processor, a whole number of cache lines. */
+    uint8_t* cpu;                               /**< The processors' free lists and counters. */
+    uint8_t* entries;                           /**< First FIFO's bookkeeping... */
+    uint8_t* entries_end;                       /**< ... and the end of the last FIFO. */
+    size_t   alloc_bytes;                       /**< Size of the whole block. */
+};   /* struct fifo_pool_s */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the free lists and counters of processor @a n of @a pool.
+ */
+static fifo_pool_cpu_t* fifo_pool_cpu(const fifo_pool_t* pool, size_t n)
+{
+    return (fifo_pool_cpu_t*) &pool->cpu[n * pool->cpu_stride];
+}   /* fifo_pool_cpu() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the bytes taken in the pool by each FIFO of @a bytes data bytes,
+ * bookkeeping included, a whole number of cache lines.
+ */
+static size_t fifo_pool_stride(size_t bytes)
+{
+    return (FIFO_POOL_ENTRY_BYTES + sizeof(fifo_t) + FIFO_DATA_ALIGN - 1 + bytes + 63) & ~(size_t) 63;
+}   /* fifo_pool_stride() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Allocates a pool with @a count size classes from @a classes, in any
+ * order; each FIFO is ready to be handed out, with a zeroed fifo_t as
+ * fifo_new() returns.
+ *
+ * @return the new pool, or NULL if out of memory, or if there are no
+ * classes, too many, or two of the same size.
+ */
+fifo_pool_t* fifo_pool_new(const fifo_pool_class_t* classes, size_t count)
+{
+    fifo_pool_t* pool;
+    size_t       order[FIFO_POOL_CLASSES];
+    size_t       cpus = fifo_pool_cpu_count();
+    size_t       cpu_stride = (sizeof(fifo_pool_cpu_t) + 63) & ~(size_t) 63;
+    size_t       header_bytes = (sizeof(fifo_pool_t) + 63) & ~(size_t) 63;
+    size_t       entry_bytes = 0;
+    size_t       i;
+    size_t       j;
+    size_t       k;
+    uint8_t*     entry;
+
+    if ((NULL == classes) || (0 == count) || (count > FIFO_POOL_CLASSES))
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++)         // Insertion sort by size.
+    {
+        for (j = i; (j > 0) && (classes[order[j - 1]].bytes > classes[i].bytes); j--)
+        {
+            order[j] = order[j - 1];
+        }
+
+        if ((j > 0) && (classes[order[j - 1]].bytes == classes[i].bytes))
+        {
+            return NULL;
+        }
+
+        order[j] = i;
+        entry_bytes += classes[i].count * fifo_pool_stride(classes[i].bytes);
+    }
+
+    cpus = (0 == cpus) ? 1 : cpus;
+    pool = (fifo_pool_t*) fifo_pool_mem_alloc(header_bytes + (cpus * cpu_stride) + entry_bytes + 63);
+
+    if (NULL == pool)
+    {
+        return NULL;
+    }
+
+    memset(pool, 0, sizeof(fifo_pool_t));
+    pool->classes     = count;
+    pool->cpus        = cpus;
+    pool->cpu_stride  = cpu_stride;
+    pool->cpu         = (uint8_t*) ((((size_t) pool) + header_bytes + 63) & ~(size_t) 63);
+    pool->entries     = &pool->cpu[cpus * cpu_stride];
+    pool->entries_end = &pool->entries[entry_bytes];
+    pool->alloc_bytes = header_bytes + (cpus * cpu_stride) + entry_bytes + 63;
+    memset(pool->cpu, 0, cpus * cpu_stride);
+
+    for (i = 0; i < cpus; i++)
+    {
+        for (k = 0; k < FIFO_POOL_CLASSES; k++)
+        {
+            InitializeSListHead(&fifo_pool_cpu(pool, i)->free[k]);
+        }
+    }
+
+    entry = pool->entries;
+
+    for (k = 0; k < count; k++)
+    {
+        const size_t stride = fifo_pool_stride(classes[order[k]].bytes);
+        pool->class_bytes[k] = classes[order[k]].bytes;
+        pool->class_count[k] = classes[order[k]].count;
+
+        for (i = 0; i < pool->class_count[k]; i++)     // Dealt round the processors.
+        {
+            fifo_pool_entry_t* bookkeeping = (fifo_pool_entry_t*) entry;
+            fifo_t*            fifo = (fifo_t*) &entry[FIFO_POOL_ENTRY_BYTES];
+            bookkeeping->klass = k;
+            memset(fifo, 0, sizeof(fifo_t));
+            fifo->size = pool->class_bytes[k];
+            fifo->data = FIFO_DATA_AFTER(fifo);
+            fifo->pool = pool;
+            InterlockedPushEntrySList(&fifo_pool_cpu(pool, i % cpus)->free[k], &bookkeeping->link);
+            entry += stride;
+        }
+    }
+
+    return pool;
+}   /* fifo_pool_new() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Deletes a pool, NULL-ing the pointer. Every FIFO got from it must have
+ * been given back.
+ */
+void fifo_pool_del(fifo_pool_t** pool_ptr)
+{
+    if ((NULL != pool_ptr) && (NULL != *pool_ptr))
+    {
+        fifo_pool_t* pool = *pool_ptr;
+        *pool_ptr = NULL;
+        fifo_pool_mem_free(pool, pool->alloc_bytes);
+    }
+}   /* fifo_pool_del() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Takes a FIFO of at least @a bytes data bytes from @a pool: one of the
+ * smallest class that is big enough, so its size may be more than asked
+ * for. It is zeroed as by fifo_new(), so all its modes are off; it goes
+ * back to the pool when fifo_del() is called on it. Takes no lock, so may
+ * be called at any IRQL up to DISPATCH_LEVEL.
+ *
+ * @return the FIFO, or NULL if no class is big enough or the class that is
+ * has none free - when the caller may fall back to fifo_new().
+ */
+fifo_t* fifo_pool_get(fifo_pool_t* pool, size_t bytes)
+{
+    fifo_pool_cpu_t* cpu;
+    PSLIST_ENTRY     link;
+    size_t           k;
+    size_t           n;
+    size_t           i;
+
+    if (NULL == pool)
+    {
+        return NULL;
+    }
+
+    n = fifo_pool_cpu_number() % pool->cpus;
+    cpu = fifo_pool_cpu(pool, n);
+
+    k = 0;
+
+    while ((k < pool->classes) && (pool->class_bytes[k] < bytes))
+    {
+        k++;
+    }
+
+    if (k == pool->classes)
+    {
+        InterlockedIncrement64(&cpu->misses);
+        return NULL;
+    }
+
+    link = InterlockedPopEntrySList(&cpu->free[k]);
+
+    for (i = 1; (NULL == link) && (i < pool->cpus); i++)
+    {
+        link = InterlockedPopEntrySList(&fifo_pool_cpu(pool, (n + i) % pool->cpus)->free[k]);
+
+        if (NULL != link)
+        {
+            InterlockedIncrement64(&cpu->steals);
+        }
+    }
+
+    if (NULL == link)
+    {
+        InterlockedIncrement64(&cpu->misses);
+        return NULL;
+    }
+
+    InterlockedIncrement64(&cpu->gets);
+    return (fifo_t*) &((uint8_t*) link)[FIFO_POOL_ENTRY_BYTES];
+}   /* fifo_pool_get() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Gives @a fifo back to @a pool, which it came from, zeroing it for its
+ * next user. fifo_del() calls this once it has freed any codec or slab;
+ * nothing else should.
+ */
+void fifo_pool_put(fifo_pool_t* pool, fifo_t* fifo)
+{
+    fifo_pool_entry_t* bookkeeping;
+    fifo_pool_cpu_t*   cpu;
+    size_t             k;
+
+    if ((NULL == pool) || (NULL == fifo) || ((uint8_t*) fifo < &pool->entries[FIFO_POOL_ENTRY_BYTES]) ||
+        ((uint8_t*) fifo >= pool->entries_end))
+    {
+        return;
+    }
+
+    bookkeeping = (fifo_pool_entry_t*) &((uint8_t*) fifo)[-FIFO_POOL_ENTRY_BYTES];
+    k = bookkeeping->klass;
+    memset(fifo, 0, sizeof(fifo_t));
+    fifo->size = pool->class_bytes[k];
+    fifo->data = FIFO_DATA_AFTER(fifo);
+    fifo->pool = pool;
+    cpu = fifo_pool_cpu(pool, fifo_pool_cpu_number() % pool->cpus);
+    InterlockedPushEntrySList(&cpu->free[k], &bookkeeping->link);
+    InterlockedIncrement64(&cpu->puts);
+}   /* fifo_pool_put() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies the statistics of @a pool, summed over the processors, into
+ * @a stats, or zeroes @a stats if @a pool is NULL. Counts taken while the
+ * pool is in use may be a little out of step with each other.
+ */
+void fifo_pool_stats(const fifo_pool_t* pool, fifo_pool_stats_t* stats)
+{
+    size_t i;
+    size_t k;
+
+    if (NULL == stats)
+    {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (NULL != pool)
+    {
+        for (k = 0; k < pool->classes; k++)
+        {
+            stats->fifos += pool->class_count[k];
+        }
+
+        for (i = 0; i < pool->cpus; i++)
+        {
+            fifo_pool_cpu_t* cpu = fifo_pool_cpu(pool, i);
+
+            for (k = 0; k < pool->classes; k++)
+            {
+                stats->free += fifo_pool_depth(&cpu->free[k]);
+            }
+
+            stats->gets   += (uint64_t) cpu->gets;
+            stats->steals += (uint64_t) cpu->steals;
+            stats->misses += (uint64_t) cpu->misses;
+            stats->puts   += (uint64_t) cpu->puts;
+        }
+    }
+}   /* fifo_pool_stats() */
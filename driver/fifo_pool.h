@@ -0,0 +1,43 @@
+#ifndef __fifo_pool_h__
+#define __fifo_pool_h__
+
+#include "drfifo_stdint.h"
+#include "fifo.h"
+
+/**
+ * Most size classes in a pool.
+ */
+#define FIFO_POOL_CLASSES   8
+
+typedef struct fifo_pool_s fifo_pool_t;
+
+/**
+ * A size class of a pool, as given to fifo_pool_new().
+ */
+typedef struct fifo_pool_class_s
+{
+    size_t bytes;     /**< Data bytes of each FIFO in the class. */
+    size_t count;     /**< FIFOs in the class. */
+} fifo_pool_class_t;
+
+/**
+ * Pool statistics, as returned by fifo_pool_stats().
+ */
+typedef struct fifo_pool_stats_s
+{
+    uint64_t fifos;      /**< FIFOs in the pool, all classes. */
+    uint64_t free;       /**< ... of which are free now. */
+    uint64_t gets;       /**< FIFOs handed out. */
+    uint64_t steals;     /**< ... of which came from another processor's free list. */
+    uint64_t misses;     /**< Gets refused because the class was empty, or no class was big enough. */
+    uint64_t puts;       /**< FIFOs given back. */
+} fifo_pool_stats_t;
+
+fifo_pool_t* fifo_pool_new(const fifo_pool_class_t* classes, size_t count);
+void         fifo_pool_del(fifo_pool_t** pool_ptr);        // Every FIFO must be back.
+fifo_t*      fifo_pool_get(fifo_pool_t* pool, size_t bytes); // Smallest class that fits; fifo_del() gives it back.
+void         fifo_pool_stats(const fifo_pool_t* pool, fifo_pool_stats_t* stats);
+
+void         fifo_pool_put(fifo_pool_t* pool, fifo_t* fifo);  // For fifo_del().
+
+#endif
@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WINDDK) || defined(NT_INST)
+#include <ntddk.h>
+#define fifo_slab_mem_alloc(_size)          ExAllocatePoolWithTag(NonPagedPool, _size, FIFO_SLAB_POOL_TAG)
+#define fifo_slab_mem_free(_ptr,_size)      ExFreePoolWithTag(_ptr, FIFO_SLAB_POOL_TAG)
+#define FIFO_SLAB_POOL_TAG                  'bslf'
+#else    // standard C in user land...
+#define fifo_slab_mem_alloc(_size)          malloc(_size)
+#define fifo_slab_mem_free(_ptr,_size)      free(_ptr)
+#endif
+
+#include "fifo_slab.h"
+
+/**
+ * States of a slab buffer.
+ */
+#define FIFO_SLAB_FREE     0   /**< On the free list. */
+#define FIFO_SLAB_HELD     1   /**< Owned by a producer filling it or a consumer reading it. */
+#define FIFO_SLAB_QUEUED   2   /**< Owned by the ring: an indirect packet refers to it. */
+
+/**
+ * Bookkeeping for one slab buffer.
+ */
+typedef struct fifo_slab_buffer_s
+{
+    uint32_t sequence;   /**< Incremented on each allocation. */
+    uint32_t state;      /**< FIFO_SLAB_xxx. */
+} fifo_slab_buffer_t;
+
+/**
+ * A slab of equal-sized payload buffers for indirect packets; see
+ * fifo_indirect(). The buffers, their bookkeeping and a stack of free
+ * buffer numbers are allocated with the slab in one block. Like a codec, a
+ * slab serves one FIFO, under that FIFO's lock.
+ */
+struct fifo_slab_s
+{
+    size_t              buffers;        /**< Number of buffers. */
+    size_t              buffer_bytes;   /**< Size of each buffer. */
+    size_t              threshold;      /**< Packets at least this big go in a buffer. */
+    size_t              free_count;     /**< Entries on the free stack. */
+    uint32_t*           free;           /**< Stack of free buffer numbers. */
+    fifo_slab_buffer_t* buffer;         /**< Bookkeeping, one per buffer. */
+    uint8_t*            data;           /**< The buffers themselves, cache-line aligned. */
+    size_t              alloc_bytes;    /**< Size of the whole block. */
+    fifo_slab_stats_t   stats;          /**< Statistics since the slab was created. */
+};   /* struct fifo_slab_s */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Allocates a slab of @a buffers buffers of @a buffer_bytes bytes each, for
+ * packets of at least @a threshold bytes.
+ *
+ * @return the new slab, or NULL if out of memory or either size is 0.
+ */
+fifo_slab_t* fifo_slab_new(size_t buffers, size_t buffer_bytes, size_t threshold)
+{
+    const size_t header_bytes = (sizeof(fifo_slab_t) + (buffers * (sizeof(uint32_t) + sizeof(fifo_slab_buffer_t))) + 63) & ~63;
+    fifo_slab_t* slab;
+    size_t       i;
+
+    if ((0 == buffers) || (0 == buffer_bytes) || (buffers > 0xFFFFFFFF) || (buffer_bytes > 0xFFFFFFFF))
+    {
+        return NULL;
+    }
+
+    slab = (fifo_slab_t*) fifo_slab_mem_alloc(header_bytes + (buffers * buffer_bytes) + 63);
+
+    if (NULL != slab)
+    {
+        memset(slab, 0, sizeof(fifo_slab_t));
+        slab->buffers      = buffers;
+        slab->buffer_bytes = buffer_bytes;
+        slab->threshold    = threshold;
+        slab->free_count   = buffers;
+        slab->free         = (uint32_t*) &slab[1];
+        slab->buffer       = (fifo_slab_buffer_t*) &slab->free[buffers];
+        slab->data         = (uint8_t*) ((((size_t) slab) + header_bytes + 63) & ~(size_t) 63);
+        slab->alloc_bytes  = header_bytes + (buffers * buffer_bytes) + 63;
+        slab->stats.buffers      = buffers;
+        slab->stats.buffer_bytes = buffer_bytes;
+
+        for (i = 0; i < buffers; i++)
+        {
+            slab->free[i] = (uint32_t) (buffers - 1 - i);      // Buffer 0 comes off first.
+            slab->buffer[i].sequence = 0;
+            slab->buffer[i].state = FIFO_SLAB_FREE;
+        }
+    }
+
+    return slab;
+}   /* fifo_slab_new() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Deletes a slab, NULL-ing the pointer. The slab must not be attached to a
+ * FIFO, and nobody may still hold its buffers.
+ */
+void fifo_slab_del(fifo_slab_t** slab_ptr)
+{
+    if ((NULL != slab_ptr) && (NULL != *slab_ptr))
+    {
+        fifo_slab_t* slab = *slab_ptr;
+        *slab_ptr = NULL;
+        fifo_slab_mem_free(slab, slab->alloc_bytes);
+    }
+}   /* fifo_slab_del() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the size of each buffer in @a slab; 0 if NULL.
+ */
+size_t fifo_slab_buffer_bytes(const fifo_slab_t* slab)
+{
+    return (NULL == slab) ? 0 : slab->buffer_bytes;
+}   /* fifo_slab_buffer_bytes() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the size at and above which packets are put in a buffer of
+ * @a slab rather than in the ring.
+ */
+size_t fifo_slab_threshold(const fifo_slab_t* slab)
+{
+    return (NULL == slab) ? 0 : slab->threshold;
+}   /* fifo_slab_threshold() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies the statistics of @a slab into @a stats, or zeroes @a stats if
+ * @a slab is NULL.
+ */
+void fifo_slab_stats(const fifo_slab_t* slab, fifo_slab_stats_t* stats)
+{
+    if (NULL != stats)
+    {
+        if (NULL != slab)
+        {
+            *stats = slab->stats;
+            stats->free = slab->free_count;
+        }
+        else
+        {
+            memset(stats, 0, sizeof(*stats));
+        }
+    }
+}   /* fifo_slab_stats() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the bookkeeping for the buffer that @a ref refers to, if it is
+ * current and in state @a state; NULL otherwise.
+ */
+static fifo_slab_buffer_t* fifo_slab_lookup(const fifo_slab_t* slab, const fifo_slab_ref_t* ref, uint32_t state)
+{
+    size_t index;
+
+    if ((NULL == slab) || (NULL == ref) || (0 != (ref->offset % slab->buffer_bytes)) || (ref->bytes > slab->buffer_bytes))
+    {
+        return NULL;
+    }
+
+    index = (size_t) (ref->offset / slab->buffer_bytes);
+
+    if ((index >= slab->buffers) || (slab->buffer[index].sequence != ref->sequence) ||
+        (slab->buffer[index].state != state))
+    {
+        return NULL;
+    }
+
+    return &slab->buffer[index];
+}   /* fifo_slab_lookup() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Takes a free buffer from @a slab. The caller owns it until it is queued
+ * in a FIFO with fifo_put_ref() or given back with fifo_slab_release().
+ *
+ * @return 1 with @a ref filled in (bytes 0), or 0 if no buffer is free.
+ */
+int8_t fifo_slab_alloc(fifo_slab_t* slab, fifo_slab_ref_t* ref)
+{
+    fifo_slab_buffer_t* buffer;
+    uint32_t            index;
+
+    if ((NULL == slab) || (NULL == ref))
+    {
+        return 0;
+    }
+
+    if (0 == slab->free_count)
+    {
+        slab->stats.exhausted++;
+        return 0;
+    }
+
+    index = slab->free[--slab->free_count];
+    buffer = &slab->buffer[index];
+    buffer->sequence++;
+    buffer->state = FIFO_SLAB_HELD;
+    slab->stats.allocs++;
+
+    ref->offset   = (uint64_t) index * slab->buffer_bytes;
+    ref->bytes    = 0;
+    ref->sequence = buffer->sequence;
+    return 1;
+}   /* fifo_slab_alloc() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * @return the payload of the buffer that @a ref refers to, which the caller
+ * must own; NULL if it doesn't.
+ */
+void* fifo_slab_data(const fifo_slab_t* slab, const fifo_slab_ref_t* ref)
+{
+    if (NULL == fifo_slab_lookup(slab, ref, FIFO_SLAB_HELD))
+    {
+        return NULL;
+    }
+
+    return &slab->data[(size_t) ref->offset];
+}   /* fifo_slab_data() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Gives the buffer that @a ref refers to back to @a slab. The caller must
+ * own it.
+ *
+ * @return 1 if it was freed, 0 if @a ref is stale.
+ */
+int8_t fifo_slab_release(fifo_slab_t* slab, const fifo_slab_ref_t* ref)
+{
+    fifo_slab_buffer_t* buffer = fifo_slab_lookup(slab, ref, FIFO_SLAB_HELD);
+
+    if (NULL == buffer)
+    {
+        if (NULL != slab)
+        {
+            slab->stats.stale++;
+        }
+
+        return 0;
+    }
+
+    buffer->state = FIFO_SLAB_FREE;
+    slab->free[slab->free_count++] = (uint32_t) (buffer - slab->buffer);
+    return 1;
+}   /* fifo_slab_release() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Passes ownership of the buffer that @a ref refers to from its holder to
+ * the ring, when an indirect packet referring to it is put.
+ *
+ * @return 1 on success, 0 if the caller doesn't own it.
+ */
+int8_t fifo_slab_queue(fifo_slab_t* slab, const fifo_slab_ref_t* ref)
+{
+    fifo_slab_buffer_t* buffer = fifo_slab_lookup(slab, ref, FIFO_SLAB_HELD);
+
+    if (NULL == buffer)
+    {
+        return 0;
+    }
+
+    buffer->state = FIFO_SLAB_QUEUED;
+    return 1;
+}   /* fifo_slab_queue() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Passes ownership of the buffer that @a ref refers to from the ring to
+ * the consumer that got the indirect packet referring to it.
+ *
+ * @return 1 on success, 0 if @a ref is stale - the packet outlived a reset,
+ * say, or was read already.
+ */
+int8_t fifo_slab_claim(fifo_slab_t* slab, const fifo_slab_ref_t* ref)
+{
+    fifo_slab_buffer_t* buffer = fifo_slab_lookup(slab, ref, FIFO_SLAB_QUEUED);
+
+    if (NULL == buffer)
+    {
+        if (NULL != slab)
+        {
+            slab->stats.stale++;
+        }
+
+        return 0;
+    }
+
+    buffer->state = FIFO_SLAB_HELD;
+    return 1;
+}   /* fifo_slab_claim() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Frees every buffer owned by the ring, when the packets referring to them
+ * are discarded unread. Buffers held by producers and consumers are left
+ * alone.
+ */
+void fifo_slab_reclaim(fifo_slab_t* slab)
+{
+    size_t i;
+
+    if (NULL != slab)
+    {
+        for (i = 0; i < slab->buffers; i++)
+        {
+            if (FIFO_SLAB_QUEUED == slab->buffer[i].state)
+            {
+                slab->buffer[i].state = FIFO_SLAB_FREE;
+                slab->free[slab->free_count++] = (uint32_t) i;
+            }
+        }
+    }
+}   /* fifo_slab_reclaim() */
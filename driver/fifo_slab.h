@@ -0,0 +1,47 @@
+#ifndef __fifo_slab_h__
+#define __fifo_slab_h__
+
+#include "drfifo_stdint.h"
+
+typedef struct fifo_slab_s fifo_slab_t;
+
+/**
+ * Reference to a buffer in a slab: what an indirect packet stores in the
+ * ring in place of its payload, and what a consumer holds while it owns the
+ * buffer. Fixed-width so that it is the same in 32- and 64-bit builds.
+ */
+typedef struct fifo_slab_ref_s
+{
+    uint64_t offset;     /**< Offset of the buffer within the slab. */
+    uint32_t bytes;      /**< Payload bytes in the buffer. */
+    uint32_t sequence;   /**< Allocation number of the buffer, so that a stale reference is refused. */
+} fifo_slab_ref_t;
+
+/**
+ * Slab statistics, as returned by fifo_slab_stats().
+ */
+typedef struct fifo_slab_stats_s
+{
+    uint64_t buffers;        /**< Buffers in the slab. */
+    uint64_t buffer_bytes;   /**< Size of each. */
+    uint64_t free;           /**< Buffers free now. */
+    uint64_t allocs;         /**< Buffers handed out. */
+    uint64_t exhausted;      /**< Allocations refused because none were free. */
+    uint64_t stale;          /**< References refused because their buffer had been reused or freed. */
+} fifo_slab_stats_t;
+
+fifo_slab_t* fifo_slab_new(size_t buffers, size_t buffer_bytes, size_t threshold);
+void         fifo_slab_del(fifo_slab_t** slab_ptr);
+size_t       fifo_slab_buffer_bytes(const fifo_slab_t* slab);
+size_t       fifo_slab_threshold(const fifo_slab_t* slab);
+void         fifo_slab_stats(const fifo_slab_t* slab, fifo_slab_stats_t* stats);
+
+int8_t       fifo_slab_alloc(fifo_slab_t* slab, fifo_slab_ref_t* ref);          // Caller owns the buffer...
+void*        fifo_slab_data(const fifo_slab_t* slab, const fifo_slab_ref_t* ref);
+int8_t       fifo_slab_release(fifo_slab_t* slab, const fifo_slab_ref_t* ref);  // ...until it gives it back.
+
+int8_t       fifo_slab_queue(fifo_slab_t* slab, const fifo_slab_ref_t* ref);    // Owned by the ring; for fifo.c.
+int8_t       fifo_slab_claim(fifo_slab_t* slab, const fifo_slab_ref_t* ref);    // Back to an owner; for fifo.c.
+void         fifo_slab_reclaim(fifo_slab_t* slab);                              // Frees all the ring's; for fifo.c.
+
+#endif
@@ -0,0 +1,147 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#include <ntddk.h>
+
+#include "drfifo_stdint.h"
+#include "fifo_trace.h"
+
+#define FIFO_TRACE_POOL_TAG   'crtf'
+
+#if FIFO_TRACE_LEVEL > FIFO_TRACE_OFF
+
+/**
+ * The trace ring of one processor. Each processor records into its own, so
+ * tracing doesn't bounce a shared cache line between processors; the
+ * interlocked increment only guards against a thread preempted, or moved to
+ * another processor, part way through recording.
+ */
+typedef struct fifo_trace_cpu_s
+{
+    volatile LONG      recorded;    /**< Events ever recorded; the next goes at recorded % FIFO_TRACE_EVENTS. */
+    uint8_t            pad[64 - sizeof(LONG)];          /**< Keeps recorded off its neighbour's cache line. */
+    fifo_trace_event_t events[FIFO_TRACE_EVENTS];
+} fifo_trace_cpu_t;
+
+static fifo_trace_cpu_t* g_trace = NULL;        /**< One ring per processor. */
+static ULONG             g_trace_cpus = 0;      /**< Number of rings in g_trace. */
+
+#endif
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Allocates a trace ring for each processor. Does nothing when tracing is
+ * compiled out.
+ *
+ * @return 1 on success, 0 if out of memory.
+ */
+int8_t fifo_trace_init(void)
+{
+#if FIFO_TRACE_LEVEL > FIFO_TRACE_OFF
+    const ULONG cpus = KeQueryActiveProcessorCount(NULL);
+
+    g_trace = (fifo_trace_cpu_t*) ExAllocatePoolWithTag(NonPagedPool, cpus * sizeof(fifo_trace_cpu_t),
+                                                        FIFO_TRACE_POOL_TAG);
+
+    if (NULL == g_trace)
+    {
+        return 0;
+    }
+
+    RtlZeroMemory(g_trace, cpus * sizeof(fifo_trace_cpu_t));
+    g_trace_cpus = cpus;
+#endif
+    return 1;
+}   /* fifo_trace_init() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Frees the trace rings. Nothing may be recording.
+ */
+void fifo_trace_exit(void)
+{
+#if FIFO_TRACE_LEVEL > FIFO_TRACE_OFF
+    if (NULL != g_trace)
+    {
+        ExFreePoolWithTag(g_trace, FIFO_TRACE_POOL_TAG);
+        g_trace = NULL;
+        g_trace_cpus = 0;
+    }
+#endif
+}   /* fifo_trace_exit() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Records an event in the current processor's trace ring, overwriting its
+ * oldest. Callable at any IRQL up to DISPATCH_LEVEL; use FIFO_TRACE() rather
+ * than calling this directly, so that the call compiles out.
+ */
+void fifo_trace_record(uint32_t op, size_t bytes, size_t index)
+{
+#if FIFO_TRACE_LEVEL > FIFO_TRACE_OFF
+    const ULONG         cpu = KeGetCurrentProcessorNumber();
+    fifo_trace_cpu_t*   ring;
+    fifo_trace_event_t* event;
+    LONG                sequence;
+
+    if (NULL == g_trace)
+    {
+        return;
+    }
+
+    ring = &g_trace[cpu % g_trace_cpus];
+    sequence = InterlockedIncrement(&ring->recorded) - 1;
+    event = &ring->events[sequence & (FIFO_TRACE_EVENTS - 1)];
+    event->ticks    = (uint64_t) KeQueryPerformanceCounter(NULL).QuadPart;
+    event->op       = (uint16_t) op;
+    event->cpu      = (uint16_t) cpu;
+    event->sequence = (uint32_t) sequence;
+    event->bytes    = (uint32_t) bytes;
+    event->index    = (uint32_t) index;
+#endif
+}   /* fifo_trace_record() */
+
+/* ------------------------------------------------------------------------- */
+/**
+ * Copies the newest events into @a events, up to @a count of them shared
+ * evenly among the processors; each processor's come oldest first, and the
+ * caller merges them by ticks. Events recorded meanwhile may be torn. With
+ * @a clear set the rings are emptied afterwards.
+ *
+ * @return the number of events copied; 0 when tracing is compiled out.
+ */
+size_t fifo_trace_read(fifo_trace_event_t* events, size_t count, int8_t clear)
+{
+    size_t result = 0;
+#if FIFO_TRACE_LEVEL > FIFO_TRACE_OFF
+    size_t share;
+    ULONG  cpu;
+
+    if ((NULL == g_trace) || (NULL == events))
+    {
+        return 0;
+    }
+
+    share = count / g_trace_cpus;
+    share = (share < FIFO_TRACE_EVENTS) ? share : FIFO_TRACE_EVENTS;
+
+    for (cpu = 0; cpu < g_trace_cpus; cpu++)
+    {
+        fifo_trace_cpu_t* ring = &g_trace[cpu];
+        const uint32_t    recorded = (uint32_t) ring->recorded;
+        const size_t      available = (recorded < share) ? recorded : share;
+        size_t            i;
+
+        for (i = 0; i < available; i++)
+        {
+            events[result++] = ring->events[(recorded - available + i) & (FIFO_TRACE_EVENTS - 1)];
+        }
+
+        if (clear)
+        {
+            InterlockedExchange(&ring->recorded, 0);
+        }
+    }
+#endif
+    return result;
+}   /* fifo_trace_read() */
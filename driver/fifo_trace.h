@@ -0,0 +1,77 @@
+/* Copyright (c) 2013-2019 Doug Rogers under the Zero Clause BSD License. */
+/* You are free to do whatever you want with this software. See LICENSE.txt. */
+
+#ifndef __fifo_trace_h__
+#define __fifo_trace_h__
+
+#include "drfifo_stdint.h"
+
+/**
+ * Trace levels. FIFO_TRACE() calls above FIFO_TRACE_LEVEL compile to
+ * nothing, so a free (release) build pays nothing for them.
+ */
+#define FIFO_TRACE_OFF      0   /**< No tracing; the trace ring isn't even allocated. */
+#define FIFO_TRACE_ERRORS   1   /**< Internal errors. */
+#define FIFO_TRACE_IRPS     2   /**< Every IRP handled. */
+#define FIFO_TRACE_DATA     3   /**< Every copy into or out of the ring. */
+
+/**
+ * Level compiled in. Checked builds default to IRPs; define it in SOURCES'
+ * C_DEFINES for anything else.
+ */
+#ifndef FIFO_TRACE_LEVEL
+#if DBG
+#define FIFO_TRACE_LEVEL    FIFO_TRACE_IRPS
+#else
+#define FIFO_TRACE_LEVEL    FIFO_TRACE_OFF
+#endif
+#endif
+
+/**
+ * Number of events kept per CPU; a power of two.
+ */
+#define FIFO_TRACE_EVENTS   1024
+
+/**
+ * Trace operations, with the meaning of their bytes and index fields.
+ */
+#define FIFO_TRACE_RAW_PUT      1   /**< Bytes copied into the ring, at ring index. */
+#define FIFO_TRACE_RAW_GET      2   /**< Bytes copied out of the ring, at ring index. */
+#define FIFO_TRACE_CORRUPT      3   /**< Impossible packet length, at ring index; the FIFO was reset. */
+#define FIFO_TRACE_IRP_CREATE   4   /**< Handle opened. */
+#define FIFO_TRACE_IRP_CLOSE    5   /**< Handle closed. */
+#define FIFO_TRACE_IRP_READ     6   /**< Bytes returned, of index bytes asked for. */
+#define FIFO_TRACE_IRP_WRITE    7   /**< Bytes put or spilled, of index bytes written. */
+#define FIFO_TRACE_IRP_IOCTL    8   /**< Bytes returned, for ioctl command index. */
+#define FIFO_TRACE_IRP_OTHER    9   /**< Unhandled IRP of major function index, completed as a no-op. */
+#define FIFO_TRACE_READ_FAILED  10  /**< Read failed with NTSTATUS bytes, of index bytes asked for. */
+#define FIFO_TRACE_WRITE_FAILED 11  /**< Write failed with NTSTATUS bytes, of index bytes written. */
+#define FIFO_TRACE_IOCTL_FAILED 12  /**< Ioctl failed with NTSTATUS bytes, for ioctl command index. */
+
+/**
+ * A trace event, as recorded and as returned by DRFIFO_IOCTL_TRACE. Binary,
+ * so that recording one costs a few stores rather than a format.
+ */
+typedef struct fifo_trace_event_s
+{
+    uint64_t ticks;      /**< Performance counter when recorded. */
+    uint16_t op;         /**< FIFO_TRACE_xxx; 0 for an empty slot. */
+    uint16_t cpu;        /**< Processor that recorded it. */
+    uint32_t sequence;   /**< Events recorded on that processor before this one. */
+    uint32_t bytes;      /**< See the operation. */
+    uint32_t index;      /**< See the operation. */
+} fifo_trace_event_t;
+
+#if FIFO_TRACE_LEVEL > FIFO_TRACE_OFF
+#define FIFO_TRACE(_level,_op,_bytes,_index)                                    \
+    do { if ((_level) <= FIFO_TRACE_LEVEL) { fifo_trace_record(_op, _bytes, _index); } } while (0)
+#else
+#define FIFO_TRACE(_level,_op,_bytes,_index)   ((void) 0)
+#endif
+
+int8_t fifo_trace_init(void);
+void   fifo_trace_exit(void);
+void   fifo_trace_record(uint32_t op, size_t bytes, size_t index);
+size_t fifo_trace_read(fifo_trace_event_t* events, size_t count, int8_t clear);    // Newest count events, by CPU.
+
+#endif
@@ -2,6 +2,11 @@
 @rem \src\vs2008\drvinstall\Debug\drvinstall c:\src\vs2008\drfifo\driver\objfre_win7_amd64\amd64\drfifo.sys
 
 sc create drfifo binpath= c:\tmp\drfifo.sys type= kernel
+@rem Optional settings, read when the driver loads; see drfifo.h. A sparse FIFO
+@rem (PageBytes set) allocates its pages only as writes reach them:
+@rem reg add HKLM\SYSTEM\CurrentControlSet\Services\drfifo\Parameters /v Size /t REG_DWORD /d 0x4000000
+@rem reg add HKLM\SYSTEM\CurrentControlSet\Services\drfifo\Parameters /v PageBytes /t REG_DWORD /d 0x10000
+@rem reg add HKLM\SYSTEM\CurrentControlSet\Services\drfifo\Parameters /v IdleMs /t REG_DWORD /d 1000
 @rem Sleep:
 @ping 1.1.1.1 -n 1 -w 1000 > nul
 sc start drfifo